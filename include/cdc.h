@@ -0,0 +1,25 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content-defined chunking. Cut points are chosen by a rolling hash of the
+// last few dozen bytes rather than by offset, so an insertion or deletion
+// only changes the chunks around it and the rest of a file still matches
+// what the server stored the last time.
+
+#define CDC_MIN_SIZE (16 * 1024)   // No cut before this many bytes
+#define CDC_AVG_SIZE (64 * 1024)   // Size chunks are normalized towards
+#define CDC_MAX_SIZE (256 * 1024)  // Forced cut
+
+/**
+ * Find the end of the chunk starting at data
+ *
+ * @param data Bytes from the start of the chunk to the end of the file
+ * @param len Number of bytes
+ * @return Length of the chunk, len if the rest of the file is one chunk
+ */
+size_t cdc_next_chunk(const uint8_t *data, size_t len);
+
+#endif /* CDC_H */
@@ -0,0 +1,75 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// End-to-end CRC32C of GET bodies and PUT payloads. When both sides agree on
+// it with HELLO, the last CHECKSUM_SIZE bytes of the data are the CRC32C of
+// the file bytes before them, in network byte order. It is computed as the
+// bytes stream through, with the SSE4.2 crc32 instruction where the CPU has it.
+
+#define CHECKSUM_SIZE 4
+
+/**
+ * Extend a CRC32C (Castagnoli) over more data
+ *
+ * @param crc CRC32C of the data before, 0 to start
+ * @param data Data to add
+ * @param len Number of bytes
+ * @return CRC32C of all the data
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * State of one checksummed transfer, in either direction
+ */
+typedef struct checksum_stream {
+    uint32_t crc;                   // CRC32C of the file bytes so far
+    uint8_t tail[CHECKSUM_SIZE];    // Receiving: last bytes seen, held back as they may be the trailer
+    size_t tail_len;
+} checksum_stream_t;
+
+/**
+ * Start a checksummed transfer
+ *
+ * @return New stream state, NULL if out of memory
+ */
+checksum_stream_t *checksum_open(void);
+
+/**
+ * Release a checksummed transfer's state
+ *
+ * @param cs Stream state, may be NULL
+ */
+void checksum_close(checksum_stream_t *cs);
+
+/**
+ * Store received payload bytes. The last CHECKSUM_SIZE bytes seen so far
+ * are held back, the payload may end with any of them.
+ *
+ * @param cs Stream state
+ * @param fd File to write the file bytes to, at its current position
+ * @param data Received bytes
+ * @param len Number of received bytes
+ * @return 0 on success, an errno value if writing failed
+ */
+int checksum_store(checksum_stream_t *cs, int fd, const char *data, size_t len);
+
+/**
+ * Check the trailer at the end of a received payload
+ *
+ * @param cs Stream state
+ * @return 0 if the payload ended with the CRC32C of the bytes before, -1 otherwise
+ */
+int checksum_verify(const checksum_stream_t *cs);
+
+/**
+ * Encode the trailer for the bytes sent so far
+ *
+ * @param crc CRC32C of the file bytes
+ * @param trailer Receives CHECKSUM_SIZE bytes
+ */
+void checksum_trailer(uint32_t crc, uint8_t trailer[CHECKSUM_SIZE]);
+
+#endif /* CHECKSUM_H */
@@ -0,0 +1,60 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+// The chunk store keeps file chunks named by their SHA-256 in the configured
+// chunk_dir, one file per chunk. Deduplicating uploads ask which chunks of a
+// file are already there, send only the others and have the file assembled
+// from the store. Chunks are never removed by the server; every chunk that is
+// found again has its modification time renewed, so old ones can be pruned
+// by age.
+
+#define CHUNK_HASH_SIZE SHA256_DIGEST_SIZE
+#define CHUNK_ENTRY_SIZE (CHUNK_HASH_SIZE + 4)  // A chunk of a file: hash, then length in network byte order
+
+/**
+ * Create the chunk store directory if needed
+ *
+ * @return 0 on success, non-zero on failure
+ */
+int chunk_store_init(void);
+
+/**
+ * Check whether a chunk is in the store
+ *
+ * @param hash SHA-256 of the chunk
+ * @return 1 if it is, 0 otherwise
+ */
+int chunk_store_has(const uint8_t hash[CHUNK_HASH_SIZE]);
+
+/**
+ * Add a chunk to the store
+ *
+ * @param hash SHA-256 the client claims for the chunk
+ * @param data Chunk data
+ * @param len Length of the chunk
+ * @return 0 on success, EBADMSG if the data doesn't match the hash,
+ *         another errno value on failure
+ */
+int chunk_store_put(const uint8_t hash[CHUNK_HASH_SIZE], const void *data, size_t len);
+
+/**
+ * Build a file from stored chunks and put it in place of path in one step.
+ * Chunks are cloned where the filesystem shares blocks between files and
+ * copied otherwise. A stored chunk whose length isn't the one given is
+ * hashed again; one that no longer matches its hash is removed from the store.
+ *
+ * @param path Relative path of the file to create or replace
+ * @param entries The file's chunks in order, CHUNK_ENTRY_SIZE bytes each
+ * @param count Number of chunks
+ * @param size Receives the size of the file
+ * @return 0 on success, EAGAIN if a chunk is not in the store or was
+ *         removed, EINVAL if a length given is wrong, another errno value
+ *         on failure
+ */
+int chunk_store_assemble(const char *path, const uint8_t *entries, size_t count, uint64_t *size);
+
+#endif /* CHUNK_STORE_H */
@@ -0,0 +1,102 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-the-wire compression of GET bodies and PUT payloads. A compressed
+// payload is sent in chunks like a PUT of unknown size, and the chunks
+// carry a sequence of blocks, each holding up to COMPRESS_BLOCK_SIZE file
+// bytes compressed on its own. Blocks whose sampled byte entropy shows
+// they won't shrink are stored as they are, which costs no CPU time.
+// The codecs are only available when the build found their libraries
+// (HAVE_LZ4, HAVE_ZSTD).
+
+#define COMPRESS_NONE 0   // Block stored uncompressed
+#define COMPRESS_LZ4  1   // Fast, for links that are barely too slow
+#define COMPRESS_ZSTD 2   // Better ratio, for slow links
+
+#define COMPRESS_BLOCK_SIZE (128 * 1024)  // File bytes per block
+#define COMPRESS_BLOCK_HEADER 9           // Codec, file length and stored length of a block
+#define COMPRESS_BLOCK_MAX (COMPRESS_BLOCK_HEADER + COMPRESS_BLOCK_SIZE)
+#define COMPRESS_ENTROPY_LIMIT 7.5        // Bits per sampled byte above which a block is stored as is
+#define COMPRESS_ZSTD_LEVEL 3
+
+/**
+ * State of one compressed transfer, in either direction
+ */
+typedef struct compress_stream {
+    int codec;            // Codec new blocks are compressed with
+    void *zstd_cctx;      // zstd contexts, created on first use
+    void *zstd_dctx;
+    char *block;          // Block being assembled, or encoded to be sent
+    size_t block_len;     // Decoding: bytes of the block received so far
+    char *raw;            // File bytes of the current block
+    uint64_t raw_bytes;   // File bytes passed through
+    uint64_t wire_bytes;  // Block bytes sent or received, headers included
+    int finished;         // Encoding: the end of the payload has been queued
+} compress_stream_t;
+
+/**
+ * Get the codecs this build supports
+ *
+ * @return Bit mask with bit (1 << codec) set for every available codec
+ */
+uint32_t compress_codecs(void);
+
+/**
+ * Look up a codec by name
+ *
+ * @param name "lz4" or "zstd"
+ * @return Codec, or -1 if the name is unknown
+ */
+int compress_codec_by_name(const char *name);
+
+/**
+ * Start a compressed transfer
+ *
+ * @param codec Codec to compress blocks with, COMPRESS_NONE when only decoding
+ * @return New stream state, NULL if out of memory
+ */
+compress_stream_t *compress_open(int codec);
+
+/**
+ * Release a compressed transfer's state
+ *
+ * @param cs Stream state, may be NULL
+ */
+void compress_close(compress_stream_t *cs);
+
+/**
+ * Encode file bytes as one block
+ *
+ * @param cs Stream state
+ * @param data File bytes
+ * @param len Number of file bytes, at most COMPRESS_BLOCK_SIZE
+ * @param block Receives the block, room for COMPRESS_BLOCK_HEADER + len bytes
+ * @return Size of the block
+ */
+size_t compress_block(compress_stream_t *cs, const char *data, size_t len, char *block);
+
+/**
+ * Decode received blocks and write their file bytes. Blocks may be split
+ * anywhere, a partial one is kept until the rest arrives.
+ *
+ * @param cs Stream state
+ * @param fd File to write to, at its current position
+ * @param data Received bytes
+ * @param len Number of received bytes
+ * @return 0 on success, EBADMSG for a malformed block or one of an unknown
+ *         codec, another errno value if writing failed
+ */
+int compress_store(compress_stream_t *cs, int fd, const char *data, size_t len);
+
+/**
+ * Check that a decoded payload did not end in the middle of a block
+ *
+ * @param cs Stream state
+ * @return 0 if the payload was complete, EBADMSG otherwise
+ */
+int compress_finish(const compress_stream_t *cs);
+
+#endif /* COMPRESS_H */
@@ -7,10 +7,20 @@
 typedef struct {
     char root_directory[MAX_PATH_LENGTH];
     int max_connections;
+    int worker_threads;
+    int queue_depth;
+    char io_engine[16];
+    int reactor_threads;
+    int cpu_affinity;
+    int stats_interval;
     int port;
     int log_level;
     int enable_auth;
     char auth_file[MAX_PATH_LENGTH];
+    char upload_dir[MAX_PATH_LENGTH];
+    char chunk_dir[MAX_PATH_LENGTH];
+    int hash_threads;
+    int meta_cache_entries;
 } server_config_t;
 
 /**
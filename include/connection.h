@@ -0,0 +1,276 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "auth.h"
+
+#define CONN_BUFFER_SIZE 4096   // Largest request (header + path + payload) buffered in memory
+#define CONN_RING_SIZE 8192     // Input ring, a power of two no smaller than CONN_BUFFER_SIZE
+#define CONN_OUTPUT_SEGMENTS 16 // Pieces of pending output, each one iovec of a vectored send
+#define CONN_LENGTH_CHUNKED UINT64_MAX // Stream length of a payload sent as length-prefixed chunks
+
+/**
+ * Per-connection state machine states
+ */
+typedef enum {
+    CONN_READ_HEADER,   // Waiting for the next complete request in the input ring
+    CONN_READ_BODY,     // Reading a payload too large for in_buf into its own buffer
+    CONN_RECV_FILE,     // Streaming a request payload into a file
+    CONN_SEND_FILE      // Streaming a file body to the client
+} conn_state_t;
+
+struct connection;
+struct mux_state;
+struct compress_stream;
+struct delta_apply;
+struct checksum_stream;
+
+/**
+ * Called once a streamed request payload has been fully received
+ *
+ * @param conn Connection the payload arrived on
+ * @param status 0 if the whole payload was stored, -1 if the connection failed
+ *               or the stream was cancelled, or an errno value if storing failed and the rest of the payload was discarded
+ * @return 0 on success, non-zero to close the connection
+ */
+typedef int (*conn_stream_done_t)(struct connection *conn, int status);
+
+/**
+ * A piece of pending output: a range of out_buf, or a payload buffer
+ * queued by reference that is freed once it has been sent
+ */
+typedef struct {
+    char *data;            // Owned buffer, NULL for a range of out_buf
+    size_t offset;         // Next unsent byte, in out_buf or data
+    size_t len;            // Unsent bytes
+} conn_output_seg_t;
+
+/**
+ * Client connection state
+ */
+typedef struct connection {
+    int fd;
+    conn_state_t state;
+    user_role_t role;
+
+    // Raw input, read as far as the socket allows and cut into requests in order.
+    // The offsets run freely and are masked on access.
+    char in_ring[CONN_RING_SIZE];
+    size_t ring_head;      // Next byte to consume
+    size_t ring_tail;      // Next byte to fill
+
+    // Request being processed, copied out of the ring in one piece
+    char in_buf[CONN_BUFFER_SIZE];
+    size_t in_len;
+    char *body;            // Payload of a large buffered request (CMD_BATCH), NULL otherwise
+    size_t body_len;       // Payload bytes received so far
+    uint8_t command;
+    uint16_t path_length;
+    uint64_t data_length;
+    int protocol_version;  // Request/response framing, negotiated with CMD_HELLO
+    struct mux_state *mux; // Stream state of a version 3 connection, NULL before that
+    int checksums;         // GET bodies and PUT payloads end with a CRC32C, agreed with CMD_HELLO
+    int compact_lists;     // LIST and INFO answers are compact records, agreed with CMD_HELLO
+    uint32_t mux_stream;   // Stream the request being handled belongs to, 0 if responses aren't framed
+
+    // Pending response bytes. Headers and small payloads are copied side by
+    // side into out_buf, large payloads are queued as their own segment.
+    char *out_buf;
+    size_t out_len;        // Bytes used in out_buf, reset once everything is sent
+    size_t out_cap;
+    size_t out_pending;    // Unsent bytes across all segments
+    conn_output_seg_t out_segs[CONN_OUTPUT_SEGMENTS];
+    int out_nsegs;
+
+    // Active file stream (GET body or PUT payload)
+    int file_fd;
+    uint64_t file_offset;
+    uint64_t file_remaining;
+    conn_stream_done_t stream_done;
+    int file_chunked;      // Payload arrives in chunks, file_remaining covers the current one
+    int file_copy;         // sendfile()/splice() unsupported for this file, copy through a buffer
+    int file_error;        // errno of a failed write, the rest of the payload is discarded
+    int pipe_rd;           // Pipe used to splice PUT payloads from the socket into the file
+    int pipe_wr;
+    size_t pipe_len;       // Bytes currently held in the pipe
+    uint64_t upload_id;    // Upload session and chunk offset of a streamed upload chunk
+    uint64_t upload_offset;
+    struct compress_stream *codec; // Blocks of a compressed GET body or PUT payload, NULL for plain streams
+    struct delta_apply *delta;     // Instructions of a DELTA payload, NULL for plain streams
+    struct checksum_stream *checksum; // CRC32C of a GET body or PUT payload, NULL for streams without trailer
+
+    // Connection table bookkeeping
+    uint32_t shard;        // Reactor shard that owns the connection
+    uint32_t slot;
+    uint32_t generation;   // Bumped every time the slot is reused
+    int busy;              // A worker thread currently owns the connection
+    int request_status;    // Result of the last request run by a worker
+    int request_count;     // Requests the worker ran before handing the connection back
+} connection_t;
+
+/**
+ * Initialize a connection table slot for an accepted socket
+ *
+ * @param conn Unused connection slot
+ * @param fd Client socket file descriptor
+ */
+void conn_open(connection_t *conn, int fd);
+
+/**
+ * Close a connection's socket and any active stream. A request payload still
+ * being received is handed to its handler with status -1 first. The slot
+ * keeps a small output buffer around for the next connection that uses it.
+ *
+ * @param conn Connection to close
+ */
+void conn_close(connection_t *conn);
+
+/**
+ * Reset the request framing state so the next request can be read.
+ * Input already buffered for later requests is kept.
+ *
+ * @param conn Connection to reset
+ */
+void conn_reset_request(connection_t *conn);
+
+/**
+ * Get the number of unconsumed bytes in the input ring
+ *
+ * @param conn Connection to query
+ * @return Number of buffered input bytes
+ */
+size_t conn_input_len(const connection_t *conn);
+
+/**
+ * Copy buffered input without consuming it
+ *
+ * @param conn Connection to read from
+ * @param offset Offset from the oldest unconsumed byte
+ * @param dest Destination buffer
+ * @param len Number of bytes to copy, offset + len must not exceed conn_input_len()
+ */
+void conn_input_peek(const connection_t *conn, size_t offset, void *dest, size_t len);
+
+/**
+ * Drop bytes from the front of the input ring
+ *
+ * @param conn Connection to update
+ * @param len Number of bytes to drop
+ */
+void conn_input_consume(connection_t *conn, size_t len);
+
+/**
+ * Describe the free space of the input ring, so a single readv() can fill it
+ *
+ * @param conn Connection to query
+ * @param iov Receives up to two buffers
+ * @return Number of buffers filled in, 0 if the ring is full
+ */
+int conn_input_space(connection_t *conn, struct iovec iov[2]);
+
+/**
+ * Account for bytes read into the space returned by conn_input_space()
+ *
+ * @param conn Connection to update
+ * @param len Number of bytes read
+ */
+void conn_input_commit(connection_t *conn, size_t len);
+
+/**
+ * Append bytes to the connection's pending output
+ *
+ * @param conn Connection to send on
+ * @param data Bytes to queue
+ * @param size Number of bytes to queue
+ * @return 0 on success, non-zero on failure
+ */
+int conn_queue_output(connection_t *conn, const void *data, size_t size);
+
+/**
+ * Append a heap buffer to the connection's pending output without copying it.
+ * The connection takes ownership and frees the buffer once it has been sent,
+ * or right away if it is small enough to be copied instead.
+ *
+ * @param conn Connection to send on
+ * @param data Buffer from malloc()
+ * @param size Number of bytes to queue
+ * @return 0 on success, non-zero on failure (the buffer is freed either way)
+ */
+int conn_queue_output_buffer(connection_t *conn, void *data, size_t size);
+
+/**
+ * Overwrite bytes queued with conn_queue_output() that have not been sent,
+ * e.g. to fill in a length known only after the rest was queued
+ *
+ * @param conn Connection to update
+ * @param offset Value of out_len just before the bytes were queued, plus an offset into them
+ * @param data Replacement bytes
+ * @param size Number of bytes to replace
+ */
+void conn_patch_output(connection_t *conn, size_t offset, const void *data, size_t size);
+
+/**
+ * Check whether the connection has queued output that has not been sent yet
+ *
+ * @param conn Connection to check
+ * @return 1 if output is pending, 0 otherwise
+ */
+int conn_has_output(const connection_t *conn);
+
+/**
+ * Describe the pending output for writev()/sendmsg()
+ *
+ * @param conn Connection to query
+ * @param iov Receives up to CONN_OUTPUT_SEGMENTS buffers, oldest first
+ * @return Number of buffers filled in
+ */
+int conn_output_iov(const connection_t *conn, struct iovec *iov);
+
+/**
+ * Drop sent bytes from the front of the pending output
+ *
+ * @param conn Connection to update
+ * @param len Number of bytes the socket accepted
+ */
+void conn_output_sent(connection_t *conn, size_t len);
+
+/**
+ * Stream a file to the client once all queued output has been sent. On a
+ * multiplexed connection the file becomes a stream of the current request
+ * and later requests are served while it is sent. Setting conn->codec
+ * afterwards sends the range as chunks of compressed blocks instead,
+ * setting conn->checksum follows it with a CRC32C trailer.
+ *
+ * @param conn Connection to send on
+ * @param file_fd Open file descriptor, owned by the connection from now on
+ * @param offset File offset of the first byte to send
+ * @param length Number of bytes to send
+ */
+void conn_start_send_file(connection_t *conn, int file_fd, uint64_t offset, uint64_t length);
+
+/**
+ * Stream the remainder of the current request payload into a file. On a
+ * multiplexed connection the payload arrives as DATA frames of the current
+ * request's stream, in between other requests. Setting conn->codec
+ * afterwards decodes the payload as compressed blocks before it is stored,
+ * setting conn->delta applies it as delta instructions, setting
+ * conn->checksum holds back its CRC32C trailer and checks it.
+ *
+ * @param conn Connection to receive on
+ * @param file_fd Open file descriptor owned by the connection from now on, or -1 to discard the payload
+ * @param length Number of payload bytes still to be received, or CONN_LENGTH_CHUNKED
+ *               for a payload of length-prefixed chunks ending with an empty one
+ * @param done Callback invoked when the payload has been received, may be NULL
+ */
+void conn_start_recv_file(connection_t *conn, int file_fd, uint64_t length, conn_stream_done_t done);
+
+/**
+ * Close the active file stream, if any, and return to request framing
+ *
+ * @param conn Connection whose stream ends
+ */
+void conn_end_stream(connection_t *conn);
+
+#endif /* CONNECTION_H */
@@ -0,0 +1,135 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// rsync-style delta transfers. The server describes the file it has as a
+// list of block signatures, a weak rolling checksum and a strong hash per
+// block. The client slides a block-sized window over its own version of the
+// file, and wherever the window matches a block the server already has, it
+// sends a reference to that block instead of the data. The server builds the
+// new file from the references and the literal data in between.
+
+#define DELTA_MIN_BLOCK 2048            // Block sizes grow with the square root of the file size
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_STRONG_SIZE 16            // Leading bytes of the SHA-256 of a block
+#define DELTA_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)  // Weak checksum and strong hash of one block
+
+#define DELTA_COPY    0x01  // Instruction: copy a range of the old file, 8-byte offset and length
+#define DELTA_LITERAL 0x02  // Instruction: 4-byte length, then that many bytes of new data
+#define DELTA_COPY_SIZE 17
+#define DELTA_LITERAL_HEADER 5
+
+/**
+ * Pick the block size for a file
+ *
+ * @param size Size of the file
+ * @return Block size in bytes
+ */
+uint32_t delta_block_size(uint64_t size);
+
+/**
+ * Compute the weak checksum of a block
+ *
+ * @param data Block data
+ * @param len Block length
+ * @return Checksum
+ */
+uint32_t delta_weak_sum(const uint8_t *data, size_t len);
+
+/**
+ * Move a weak checksum one byte forward
+ *
+ * @param sum Checksum of the len bytes starting with out
+ * @param out Byte leaving the window
+ * @param in Byte entering the window
+ * @param len Window length
+ * @return Checksum of the len bytes ending with in
+ */
+uint32_t delta_weak_roll(uint32_t sum, uint8_t out, uint8_t in, size_t len);
+
+/**
+ * Compute the strong hash of a block
+ *
+ * @param data Block data
+ * @param len Block length
+ * @param out Receives DELTA_STRONG_SIZE bytes
+ */
+void delta_strong_sum(const uint8_t *data, size_t len, uint8_t out[DELTA_STRONG_SIZE]);
+
+/**
+ * Compute the signatures of a file, DELTA_SIGNATURE_SIZE bytes per block with
+ * the weak checksum in network byte order. The last block may be shorter.
+ *
+ * @param fd File to read, from offset 0
+ * @param size Size of the file
+ * @param block_size Block size
+ * @param out Receives the signatures, room for one per block
+ * @return 0 on success, an errno value if reading failed
+ */
+int delta_signatures(int fd, uint64_t size, uint32_t block_size, uint8_t *out);
+
+/**
+ * State of a delta being applied
+ */
+typedef struct delta_apply {
+    int base_fd;              // Old version of the file
+    uint64_t base_size;
+    uint64_t size;            // Size the new file must end up with
+    uint64_t written;         // Bytes of the new file written so far
+    uint8_t header[DELTA_COPY_SIZE];  // Instruction being collected
+    size_t header_len;
+    uint32_t literal_left;    // Literal bytes still to come
+    char *buffer;             // Copies from the old file pass through here
+    int dir_fd;               // Directory holding both files
+    char *temp;               // File the new version is written to, removed unless committed
+    char *target;
+    int committed;
+} delta_apply_t;
+
+/**
+ * Start applying a delta
+ *
+ * @param base_fd Old version of the file, owned by the delta afterwards
+ * @param base_size Size of the old version
+ * @param size Size of the new version
+ * @param dir_fd Directory holding the old and new version, owned by the delta afterwards
+ * @param temp Name of the file the new version is written to
+ * @param target Name the new version replaces once complete
+ * @return New delta state, NULL if out of memory
+ */
+delta_apply_t *delta_open(int base_fd, uint64_t base_size, uint64_t size, int dir_fd, const char *temp,
+                          const char *target);
+
+/**
+ * Apply received delta instructions. Instructions may be split anywhere,
+ * a partial one is kept until the rest arrives.
+ *
+ * @param d Delta state
+ * @param fd New version of the file, written at its current position
+ * @param data Received bytes
+ * @param len Number of received bytes
+ * @return 0 on success, EBADMSG for a malformed instruction or one reaching
+ *         outside either file, another errno value if writing failed
+ */
+int delta_store(delta_apply_t *d, int fd, const char *data, size_t len);
+
+/**
+ * Check that a delta is complete and put the new file in place of the old one
+ *
+ * @param d Delta state
+ * @return 0 on success, EBADMSG if the delta ended early, another errno
+ *         value if the file could not be renamed
+ */
+int delta_commit(delta_apply_t *d);
+
+/**
+ * Release a delta's state, removing the new file unless it was committed
+ *
+ * @param d Delta state, may be NULL
+ */
+void delta_close(delta_apply_t *d);
+
+#endif /* DELTA_H */
@@ -0,0 +1,41 @@
+#ifndef FILE_HASH_H
+#define FILE_HASH_H
+
+#include <stdint.h>
+#include "sha256.h"
+
+// Digest of a whole file, built as a tree so the leaves can be hashed in
+// parallel: the SHA-256 of each 4MB leaf, prefixed with a 0 byte, and over
+// those the SHA-256 of a 1 byte, the file size (8 bytes, big endian) and
+// the leaf digests in order. The result doesn't depend on how many threads
+// computed it.
+
+#define FILE_HASH_LEAF_SIZE (4 * 1024 * 1024)
+#define FILE_HASH_XATTR "user.cile.tree-sha256"  // Cached digest, see file_hash_cached()
+
+/**
+ * Compute the digest of a file
+ *
+ * @param fd File to hash, read with pread()
+ * @param size Size of the file
+ * @param threads Threads to hash leaves with, at least 1
+ * @param digest Receives the digest
+ * @return 0 on success, an errno value if reading failed
+ */
+int file_hash(int fd, uint64_t size, int threads, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Get the digest of a file, from the extended attribute where it was cached
+ * if the file still has the same size, modification time and inode, or else
+ * by computing it and caching it for next time. Files that can't take the
+ * attribute are hashed every time.
+ *
+ * @param fd Regular file to hash
+ * @param threads Threads to hash leaves with, at least 1
+ * @param size Receives the size of the file
+ * @param digest Receives the digest
+ * @return 0 on success, an errno value if reading failed
+ */
+int file_hash_cached(int fd, int threads, uint64_t *size, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* FILE_HASH_H */
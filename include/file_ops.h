@@ -2,7 +2,13 @@
 #define FILE_OPS_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MAX_PATH_SIZE 2048  // Paths below the root directory
 
 typedef struct {
     char name[256];
@@ -11,22 +17,145 @@ typedef struct {
     time_t modified_time;
 } file_info_t;
 
+// Reads a directory a batch of entries at a time. One entry is read ahead,
+// so done is exact as soon as the last entry has been returned.
+typedef struct {
+    DIR *dir;
+    struct dirent *pending;  // Next entry to return, NULL at the end
+    uint64_t cursor;         // Where pending starts, 0 once done
+    int done;                // No entries are left
+    int linked;              // A symlink was met on the way or among the entries
+    char path[MAX_PATH_SIZE];  // Normalized path of the directory
+} dir_reader_t;
+
+#define DIR_FILTER_ANY 0
+#define DIR_FILTER_FILES 1
+#define DIR_FILTER_DIRECTORIES 2
+
+// Which entries a directory reader returns, and what it must know of them.
+// An entry is only stat'ed if need_stat is set, or if need_type is and
+// readdir() doesn't give its type; symlinks are always followed, so one that
+// leads outside the root directory is never listed.
+typedef struct {
+    const char *pattern;   // fnmatch() pattern names must match, NULL for any
+    int type;              // DIR_FILTER_ANY, DIR_FILTER_FILES or DIR_FILTER_DIRECTORIES
+    uint64_t min_size;     // Inclusive size range
+    uint64_t max_size;
+    int64_t min_mtime;     // Inclusive mtime range, in seconds
+    int64_t max_mtime;
+    int need_stat;         // Size and mtime are wanted or filtered on
+    int need_type;         // Whether an entry is a directory is wanted or filtered on
+} dir_filter_t;
+
 /**
- * Initialize the file operations module
+ * Initialize the file operations module, opening the root directory that
+ * every path is resolved against
  * 
  * @return 0 on success, non-zero on failure
  */
 int init_file_ops(void);
 
 /**
- * Gets a securely resolved absolute path corresponding to a relative path
+ * Bring a relative path into the form the metadata cache is keyed by: no
+ * leading, doubled or trailing slashes and no "." components. The root
+ * directory itself becomes the empty string.
  * 
- * @param relative_path Relative path
- * @param out_path Output buffer for the resolved path
+ * @param path Relative path
+ * @param out Output buffer for the normalized path
  * @param out_size Size of the output buffer
- * @return 0 on success, non-zero on failure
+ * @return 0 on success, -1 with errno set if the path has a ".." component
+ *         or doesn't fit
  */
-int get_full_path(const char *relative_path, char *out_path, size_t out_size);
+int normalize_path(const char *path, char *out, size_t out_size);
+
+/**
+ * Open a path below the root directory. Symlinks are followed as long as
+ * they stay below it; the kernel resolves the path relative to the root
+ * directory's descriptor, so nothing reaches outside, not even through a
+ * rename racing with the lookup.
+ * 
+ * @param path Relative path
+ * @param flags Flags as for open(), O_CLOEXEC is always added
+ * @param mode Permissions of a file created with O_CREAT
+ * @return File descriptor on success, -1 with errno set on failure
+ */
+int open_beneath(const char *path, int flags, mode_t mode);
+
+/**
+ * Open a path below the root directory like open_beneath(), but fail with
+ * ELOOP if any component of it is a symlink
+ * 
+ * @param path Relative path
+ * @param flags Flags as for open(), O_CLOEXEC is always added
+ * @return File descriptor on success, -1 with errno set on failure
+ */
+int open_beneath_strict(const char *path, int flags);
+
+/**
+ * Open the directory holding a path, for the *at() calls that create,
+ * remove or rename the entry itself
+ * 
+ * @param path Relative path, not the root directory
+ * @param name Output buffer for the last component of the path
+ * @param name_size Size of the name buffer
+ * @return O_PATH descriptor of the directory on success, -1 with errno set on failure
+ */
+int open_parent_beneath(const char *path, char *name, size_t name_size);
+
+/**
+ * Stat a path below the root directory. A path that goes through a symlink
+ * depends on wherever the link leads, which callers caching the result need
+ * to know.
+ * 
+ * @param path Relative path
+ * @param st Receives the result
+ * @param linked Set to 1 if a symlink was followed, left alone otherwise
+ * @return 0 on success, an errno value on failure
+ */
+int stat_beneath(const char *path, struct stat *st, int *linked);
+
+/**
+ * Open a directory for reading with dir_reader_read()
+ * 
+ * @param reader Reader to set up
+ * @param path Relative path to the directory
+ * @param cursor 0 to start at the first entry, or a cursor an earlier reader
+ *        of the same directory left off at
+ * @return 0 on success, -1 with errno set on failure
+ */
+int dir_reader_open(dir_reader_t *reader, const char *path, uint64_t cursor);
+
+/**
+ * Read the next entries of a directory and their metadata. Entries that
+ * can't be examined are skipped, "." and ".." are never returned.
+ * 
+ * @param reader Open reader; cursor and done describe where it stopped
+ * @param filter Entries to return and what to find out about them, NULL for
+ *        all entries with all their metadata. Size and mtime are 0 unless
+ *        need_stat is set, is_directory may be 0 unless need_type is.
+ * @param entries Array to store file information
+ * @param max_entries Maximum number of entries to retrieve
+ * @param num_entries Pointer to store the number of entries retrieved
+ * @return 0 on success, -1 with errno set if the directory can't be read
+ */
+int dir_reader_read(dir_reader_t *reader, const dir_filter_t *filter, file_info_t *entries,
+                    int max_entries, int *num_entries);
+
+/**
+ * Check an entry whose metadata is known against a filter
+ * 
+ * @param filter Filter to apply
+ * @param info Entry to check
+ * @return 1 if the entry passes, 0 otherwise
+ */
+int dir_filter_match(const dir_filter_t *filter, const file_info_t *info);
+
+/**
+ * Close a reader opened with dir_reader_open()
+ * 
+ * @param reader Reader to close
+ */
+void dir_reader_close(dir_reader_t *reader);
 
 /**
  * Clean up file operations resources
@@ -93,11 +222,30 @@ int create_directory(const char *path);
 int get_file_info(const char *path, file_info_t *info);
 
 /**
- * Check if a path is valid and within the server's root directory
+ * Check if a path is valid: not empty and without ".." components
  * 
  * @param path Relative path to check
  * @return 1 if valid, 0 if invalid
  */
 int is_path_valid(const char *path);
 
+/**
+ * Check that one of the server's own directories lies apart from the root
+ * directory, neither inside it nor containing it, so clients can't reach
+ * the files kept there
+ *
+ * @param dir Directory, which may not exist yet
+ * @return 1 if it does, 0 if the two overlap, -1 if either can't be resolved
+ */
+int is_outside_root(const char *dir);
+
+/**
+ * Create one of the server's own directories with any missing parents,
+ * readable by the server only, once is_outside_root() has accepted it
+ *
+ * @param dir Directory to create, may exist already
+ * @return 0 on success, EXDEV if it overlaps the root directory, or an errno value
+ */
+int create_state_directory(const char *dir);
+
 #endif /* FILE_OPS_H */ 
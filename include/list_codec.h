@@ -0,0 +1,89 @@
+#ifndef LIST_CODEC_H
+#define LIST_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "file_ops.h"
+
+// Compact encoding of LIST and INFO answers, used when both sides agree on it
+// with HELLO. Each entry is a record of a type byte, the number of bytes its
+// name shares with the previous entry's, the length and bytes of the rest of
+// the name, the size, and the difference between its mtime and the previous
+// entry's, zigzag-encoded. A LIST query can leave the size and mtime out, and
+// leave the type byte 0 for directories. Numbers are varints: 7 bits per byte, least
+// significant first, the high bit set on every byte but the last. A paged LIST
+// ends with a trailer record: the type byte, then the entry count and the
+// next cursor as 8 bytes each in network byte order.
+
+#define LIST_RECORD_FILE 0x00
+#define LIST_RECORD_DIRECTORY 0x01
+#define LIST_RECORD_TRAILER 0xFF
+#define LIST_VARINT_MAX 10                                    // Bytes of a 64-bit varint
+#define LIST_RECORD_MAX (1 + 2 + 2 + 255 + 2 * LIST_VARINT_MAX)  // Type, name lengths, name, size, mtime
+#define LIST_TRAILER_RECORD_SIZE 17
+
+#define LIST_FIELD_SIZE 0x1   // Records carry the size
+#define LIST_FIELD_MTIME 0x2  // Records carry the mtime
+#define LIST_FIELD_TYPE 0x4   // The type byte tells directories apart
+#define LIST_FIELDS_ALL (LIST_FIELD_SIZE | LIST_FIELD_MTIME | LIST_FIELD_TYPE)
+
+/**
+ * Names and mtimes already encoded, which the next record is relative to.
+ * Both sides start from a zeroed state at the beginning of every answer.
+ */
+typedef struct {
+    char name[256];
+    size_t name_len;
+    int64_t mtime;
+    int fields;      // LIST_FIELD_* bits the records carry
+    int keep_order;  // Entries are in the order wanted, not to be sorted by name
+} list_codec_t;
+
+/**
+ * Start a new answer
+ *
+ * @param codec State to reset
+ * @param fields LIST_FIELD_* bits the records carry
+ * @param keep_order Whether entries are encoded in the order given
+ */
+void list_codec_reset(list_codec_t *codec, int fields, int keep_order);
+
+/**
+ * Encode entries, sorted by name first unless the codec keeps their order:
+ * neighbours then share long prefixes
+ *
+ * @param codec State, carried over from the entries encoded before
+ * @param entries Entries to encode, may be reordered in place
+ * @param num_entries Number of entries
+ * @param out Receives the records, room for num_entries * LIST_RECORD_MAX bytes
+ * @return Number of bytes written
+ */
+size_t list_encode_entries(list_codec_t *codec, file_info_t *entries, int num_entries, uint8_t *out);
+
+/**
+ * Encode the trailer record of a paged LIST
+ *
+ * @param count Number of entries in the page
+ * @param cursor Cursor of the next page, 0 after the last
+ * @param out Receives LIST_TRAILER_RECORD_SIZE bytes
+ * @return Number of bytes written
+ */
+size_t list_encode_trailer(uint64_t count, uint64_t cursor, uint8_t *out);
+
+/**
+ * Decode one record
+ *
+ * @param codec State, updated past an entry record
+ * @param data Encoded bytes
+ * @param len Number of bytes available
+ * @param info Receives an entry record
+ * @param trailer Receives the count and cursor of a trailer record
+ * @param used Receives the size of the record
+ * @return LIST_RECORD_FILE or LIST_RECORD_DIRECTORY for an entry,
+ *         LIST_RECORD_TRAILER for a trailer, -1 if the record is malformed
+ *         or doesn't end within len bytes
+ */
+int list_decode_record(list_codec_t *codec, const uint8_t *data, size_t len, file_info_t *info,
+                       uint64_t trailer[2], size_t *used);
+
+#endif /* LIST_CODEC_H */
@@ -0,0 +1,110 @@
+#ifndef LIST_QUERY_H
+#define LIST_QUERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "file_ops.h"
+#include "list_codec.h"
+
+// A LIST query, sent after the cursor and page size when both sides agree on
+// it with HELLO: which entries to list, in what order and which of their
+// fields. In network byte order:
+//   fields (1B)          LIST_FIELD_* bits wanted besides the name
+//   type (1B)            DIR_FILTER_ANY, DIR_FILTER_FILES or DIR_FILTER_DIRECTORIES
+//   sort (1B)            LIST_SORT_* key, ORed with LIST_SORT_DESCENDING
+//   pattern length (1B)
+//   min size, max size   8B each, inclusive
+//   min mtime, max mtime 8B each, signed seconds, inclusive
+//   pattern              fnmatch() pattern the name must match, empty for any
+// A sorted answer holds the first page size entries of the whole directory
+// in that order.
+
+#define LIST_QUERY_SIZE 36  // Fixed part of a query, the pattern follows
+#define LIST_PATTERN_MAX 255
+
+#define LIST_SORT_NONE 0    // Directory order, a page at a time
+#define LIST_SORT_NAME 1
+#define LIST_SORT_SIZE 2
+#define LIST_SORT_MTIME 3
+#define LIST_SORT_DESCENDING 0x80
+
+typedef struct {
+    dir_filter_t filter;
+    int fields;                           // LIST_FIELD_* bits
+    int sort;                             // LIST_SORT_* key
+    int descending;
+    char pattern[LIST_PATTERN_MAX + 1];   // filter.pattern points here when set
+} list_query_t;
+
+/**
+ * Set up a query for every entry with all fields, in directory order
+ *
+ * @param query Query to set up
+ */
+void list_query_init(list_query_t *query);
+
+/**
+ * Decode a query
+ *
+ * @param query Receives the query
+ * @param data Encoded query
+ * @param size Size of the encoded query
+ * @return 0 on success, -1 if the query is malformed
+ */
+int list_query_parse(list_query_t *query, const char *data, size_t size);
+
+/**
+ * Encode a query
+ *
+ * @param query Query to encode
+ * @param out Receives up to LIST_QUERY_SIZE + LIST_PATTERN_MAX bytes
+ * @return Number of bytes written
+ */
+size_t list_query_encode(const list_query_t *query, char *out);
+
+/**
+ * Sort entries into the order a query asks for
+ *
+ * @param query Query with a sort key
+ * @param entries Entries to sort
+ * @param num_entries Number of entries
+ */
+void list_query_sort(const list_query_t *query, file_info_t *entries, int num_entries);
+
+/**
+ * The first entries in a query's order among all those pushed, kept in a
+ * heap whose root is the one that would come last
+ */
+typedef struct {
+    const list_query_t *query;
+    file_info_t *entries;   // Room for a paged answer's trailer after them, the caller frees them
+    int count;
+    int capacity;
+} list_top_t;
+
+/**
+ * Start collecting the first entries
+ *
+ * @param top Collection to set up
+ * @param query Query with a sort key
+ * @param capacity Number of entries to keep
+ * @return 0 on success, -1 if out of memory
+ */
+int list_top_init(list_top_t *top, const list_query_t *query, int capacity);
+
+/**
+ * Offer an entry, kept if it comes before the last one kept so far
+ *
+ * @param top Collection
+ * @param entry Entry to offer
+ */
+void list_top_push(list_top_t *top, const file_info_t *entry);
+
+/**
+ * Sort the entries kept into the query's order
+ *
+ * @param top Collection
+ */
+void list_top_finish(list_top_t *top);
+
+#endif /* LIST_QUERY_H */
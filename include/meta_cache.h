@@ -0,0 +1,51 @@
+#ifndef META_CACHE_H
+#define META_CACHE_H
+
+#include "file_ops.h"
+
+// Cache of the metadata INFO and LIST answer from. Entries are keyed by
+// normalized path and hold a stat result, the error of a path that doesn't
+// exist, or a directory listing as LIST sends it. Paths through a symlink,
+// and listings holding one, aren't kept: no watch sees where a link leads.
+// Every directory an entry depends on, and each of its ancestors up to the
+// root directory, has an inotify watch. Pending events are read before every lookup, so a change
+// that finished before a request started is never missed, whether this
+// server made it or something else did. At most meta_cache_entries entries
+// are kept, the least recently used go first.
+
+#define META_CACHE_MAX_LIST 1024  // Larger listings are read from the directory every time
+
+/**
+ * Set up the cache and its inotify instance. Without inotify the cache
+ * stays off and every lookup goes to the filesystem.
+ *
+ * @return 0 on success, non-zero on failure
+ */
+int meta_cache_init(void);
+
+/**
+ * Drop all entries and watches
+ */
+void meta_cache_cleanup(void);
+
+/**
+ * Get the size, type and modification time of a path. The name is left alone.
+ *
+ * @param path Path below the root directory, as normalize_path() gives it
+ * @param info Receives the metadata
+ * @return 0 on success, -1 with errno set if the path can't be examined
+ */
+int meta_cache_stat(const char *path, file_info_t *info);
+
+/**
+ * List a directory, in the order the filesystem returns the entries
+ *
+ * @param path Directory below the root directory, as normalize_path() gives it
+ * @param entries Receives the entries
+ * @param max_entries Maximum number of entries to return
+ * @param num_entries Receives the number of entries returned
+ * @return 0 on success, -1 with errno set if the directory can't be read
+ */
+int meta_cache_list(const char *path, file_info_t *entries, int max_entries, int *num_entries);
+
+#endif /* META_CACHE_H */
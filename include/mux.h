@@ -0,0 +1,101 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdint.h>
+#include "connection.h"
+#include "protocol.h"
+
+// Stream multiplexing, protocol version 3. Every request opens a stream with
+// an id the client picks, and GET bodies and PUT payloads travel as DATA
+// frames within per-stream flow control windows. Requests keep being served
+// while transfers run, so a LIST no longer waits behind a large GET on the
+// same connection.
+
+#define MUX_MAX_STREAMS STREAM_LIMIT
+#define MUX_ROUND_FRAMES 4    // DATA frames queued per round before the socket is serviced again
+
+typedef enum {
+    MUX_STREAM_FREE,
+    MUX_STREAM_SEND,      // GET body going out
+    MUX_STREAM_RECV       // PUT payload coming in
+} mux_stream_kind_t;
+
+typedef struct {
+    uint32_t id;
+    mux_stream_kind_t kind;
+    int file_fd;          // -1 while a PUT payload is being discarded
+    uint64_t offset;      // File offset of the next byte to send
+    uint64_t remaining;   // Body bytes still to send or receive
+    int chunked;          // Payload of unknown size, ends with an empty DATA frame
+    int error;            // errno of a failed write, the rest of the payload is discarded
+    uint64_t window;      // DATA bytes the client has room for, or may still send
+    conn_stream_done_t done;
+    uint64_t upload_id;   // Upload chunk the payload belongs to, restored into the connection for done
+    uint64_t upload_offset;
+} mux_stream_t;
+
+typedef struct mux_state {
+    mux_stream_t streams[MUX_MAX_STREAMS];
+    int num_streams;
+    int next_send;        // Slot the next round of DATA frames starts at, so streams take turns
+    uint32_t in_stream;   // DATA frame whose payload is being read
+    uint32_t in_length;
+    uint32_t in_left;     // Payload bytes of that frame still to come
+} mux_state_t;
+
+/**
+ * Switch a connection to multiplexed streams
+ *
+ * @param conn Connection that agreed on version 3
+ * @return 0 on success, non-zero on failure
+ */
+int mux_enable(connection_t *conn);
+
+/**
+ * Drop all streams of a connection. Receiving streams see their done callback
+ * with status -1, as if the connection had failed.
+ *
+ * @param conn Connection being closed
+ */
+void mux_disable(connection_t *conn);
+
+/**
+ * Handle the frames in the input ring up to the next request. DATA, WINDOW
+ * and CANCEL frames are dealt with on the spot.
+ *
+ * @param conn Multiplexed connection
+ * @param request_length Receives the payload length of a request frame
+ * @return 1 when a request frame is next in the input ring, its header consumed
+ *         and at least CONN_BUFFER_SIZE of its payload (all of a smaller one) buffered,
+ *         0 if more input is needed, -1 on a malformed frame or a failed stream
+ */
+int mux_read_frames(connection_t *conn, uint32_t *request_length);
+
+/**
+ * Queue the next round of DATA frames of the GET streams with room in their windows
+ *
+ * @param conn Multiplexed connection
+ * @return 1 if frames were queued, 0 if no stream can send, -1 on failure
+ */
+int mux_fill_output(connection_t *conn);
+
+/**
+ * Check whether every stream slot is taken, in which case requests that
+ * would open a transfer are refused
+ *
+ * @param conn Multiplexed connection
+ * @return 1 if no more streams fit, 0 otherwise
+ */
+int mux_streams_full(const connection_t *conn);
+
+/**
+ * Send a file range as DATA frames of the current stream, see conn_start_send_file()
+ */
+void mux_start_send(connection_t *conn, int file_fd, uint64_t offset, uint64_t length);
+
+/**
+ * Store the DATA frames of the current stream in a file, see conn_start_recv_file()
+ */
+void mux_start_recv(connection_t *conn, int file_fd, uint64_t length, conn_stream_done_t done);
+
+#endif /* MUX_H */
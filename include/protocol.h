@@ -2,7 +2,9 @@
 #define PROTOCOL_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "auth.h"
+#include "connection.h"
 
 // Command codes
 #define CMD_LIST    0x01
@@ -13,114 +15,408 @@
 #define CMD_INFO    0x06
 #define CMD_AUTH    0x07  // New authentication command
 #define CMD_LOGOUT  0x08  // New logout command
+#define CMD_BATCH   0x09  // Several sub-requests in one frame
+#define CMD_HELLO   0x0A  // Negotiate the protocol version
+#define CMD_UPLOAD_BEGIN  0x0B  // Start an upload session
+#define CMD_UPLOAD_WRITE  0x0C  // Store one chunk of an upload session
+#define CMD_UPLOAD_COMMIT 0x0D  // Publish a complete upload
+#define CMD_UPLOAD_ABORT  0x0E  // Discard an upload
+#define CMD_UPLOAD_STATUS 0x0F  // Report the chunks an upload still needs
+#define CMD_GET_COMPRESSED 0x10 // GET whose body may come back compressed
+#define CMD_PUT_COMPRESSED 0x11 // PUT of a compressed payload
+#define CMD_CHUNK_QUERY    0x12 // Ask which chunks the chunk store holds
+#define CMD_CHUNK_STORE    0x13 // Add a chunk to the chunk store
+#define CMD_CHUNK_ASSEMBLE 0x14 // Build a file from stored chunks
+#define CMD_SIGNATURES     0x15 // Get the block signatures of a file
+#define CMD_DELTA          0x16 // Update a file with a delta against its signatures
+#define CMD_HASH           0x17 // Get the digest of a file
+
+#define MAX_BATCH_SIZE (1024 * 1024)  // Largest CMD_BATCH payload
+#define MAX_CHUNK_LIST (16 * 1024 * 1024)  // Largest CHUNK_QUERY and CHUNK_ASSEMBLE payload
+#define MAX_CHUNK_DATA (256 * 1024)        // Largest chunk CHUNK_STORE takes
+
+// Protocol versions. Every connection starts at version 1, CMD_HELLO moves it
+// to the highest version both sides speak.
+#define PROTOCOL_V1 1     // 32-bit lengths: 7-byte request, 5-byte response headers
+#define PROTOCOL_V2 2     // 64-bit lengths: 11-byte request, 9-byte response headers
+#define PROTOCOL_V3 3     // Version 2 requests and responses carried by frames of multiplexed streams
+#define PROTOCOL_VERSION PROTOCOL_V3  // Highest version this build speaks
+
+#define REQUEST_HEADER_MAX 11
+#define RESPONSE_HEADER_MAX 9
+#define CHUNK_HEADER_SIZE 4  // Length prefix of each chunk of a chunked payload
+#define GET_RANGE_SIZE 16    // Optional GET payload: 64-bit offset and length
+#define RANGE_TO_END UINT64_MAX  // Range length that reads to the end of the file
+#define UPLOAD_BEGIN_SIZE 16     // UPLOAD_BEGIN payload: 64-bit file size and chunk size
+#define UPLOAD_ID_SIZE 8         // Session id answering UPLOAD_BEGIN, payload of COMMIT and ABORT
+#define UPLOAD_WRITE_PREFIX 16   // UPLOAD_WRITE payload starts with the session id and chunk offset
+#define UPLOAD_STATUS_SIZE 24    // UPLOAD_STATUS answer starts with the session id, file size and chunk size
+#define GET_CODEC_SIZE 1         // GET_COMPRESSED payload starts with the codec asked for, a range may follow
+#define HELLO_CODECS_SIZE 4      // Optional HELLO payload after the version: mask of codecs the client speaks
+#define HELLO_FEATURES_SIZE 4    // Optional HELLO payload after the codecs: mask of HELLO_FEATURE_* bits
+#define HELLO_FEATURE_CRC32C 0x1 // GET bodies and PUT payloads end with a CRC32C trailer
+#define HELLO_FEATURE_LIST_PAGES 0x2 // LIST takes a cursor and page size, see LIST_PAGE_SIZE
+#define HELLO_FEATURE_COMPACT_LIST 0x4 // LIST and INFO answer with compact records, see list_codec.h
+#define HELLO_FEATURE_LIST_QUERY 0x8 // LIST takes a query after the cursor and page size, see list_query.h
+#define SIGNATURES_PREFIX 20     // SIGNATURES answer starts with the file size, mtime in ns and block size
+#define DELTA_PREFIX 24          // DELTA payload starts with the old file's size and mtime, and the new size
+#define HASH_ANSWER_SIZE 40      // HASH answer: file size and tree SHA-256 digest
+#define LIST_PAGE_SIZE 12        // Optional LIST payload: 64-bit cursor and 32-bit page size
+#define LIST_PAGE_MAX 1024       // Most entries one LIST answer carries
+#define LIST_TRAILER_SIZE 16     // Paged LIST answer ends with the entry count and the next cursor, 0 when done
+#define LIST_CHUNK_ENTRIES 64    // Entries per chunk of a chunked LIST answer
+
+// Version 3 frames: a type, the stream id and the payload length, then the payload
+#define FRAME_HEADER_SIZE 9
+#define FRAME_REQUEST  0x01  // Client opens a stream with a version 2 request
+#define FRAME_RESPONSE 0x02  // Server answers a stream with a version 2 response
+#define FRAME_DATA     0x03  // Part of a stream's GET body or PUT payload
+#define FRAME_WINDOW   0x04  // Lets the other side send more DATA on a stream
+#define FRAME_CANCEL   0x05  // Abandons a stream
+#define FRAME_MAX_DATA 65536                // Largest DATA frame payload
+#define STREAM_INITIAL_WINDOW (256 * 1024)  // DATA bytes either side may send on a new stream unasked
+#define STREAM_LIMIT 32                     // GET and PUT transfers a server runs at once per connection
+#define WINDOW_UPDATE_SIZE 4                // WINDOW payload: 32-bit increment
+
+// Version 2 data length of a payload sent as chunks, each a 32-bit length in
+// network byte order followed by that many bytes, ending with an empty chunk
+#define LENGTH_CHUNKED CONN_LENGTH_CHUNKED
 
 // Response codes
 #define RESP_OK     0x00
 #define RESP_ERROR  0x01
 #define RESP_AUTH_REQUIRED 0x02  // New response code for authentication required
 
+/**
+ * Get the size of a request header
+ * 
+ * @param version Protocol version
+ * @return Header size in bytes
+ */
+size_t request_header_size(int version);
+
+/**
+ * Get the size of a response header
+ * 
+ * @param version Protocol version
+ * @return Header size in bytes
+ */
+size_t response_header_size(int version);
+
+/**
+ * Write a request header
+ * 
+ * @param version Protocol version
+ * @param buf Output buffer of at least REQUEST_HEADER_MAX bytes
+ * @param command Command code
+ * @param path_length Length of the path that follows
+ * @param data_length Length of the payload that follows, or LENGTH_CHUNKED
+ * @return Header size in bytes, 0 if the length can't be expressed in this version
+ */
+size_t encode_request_header(int version, char *buf, uint8_t command, uint16_t path_length, uint64_t data_length);
+
+/**
+ * Read a request header
+ * 
+ * @param version Protocol version
+ * @param buf Header bytes, request_header_size() of them
+ * @param command Receives the command code
+ * @param path_length Receives the path length
+ * @param data_length Receives the payload length
+ */
+void decode_request_header(int version, const char *buf, uint8_t *command, uint16_t *path_length, uint64_t *data_length);
+
+/**
+ * Write a response header
+ * 
+ * @param version Protocol version
+ * @param buf Output buffer of at least RESPONSE_HEADER_MAX bytes
+ * @param status Response status code
+ * @param data_length Length of the data that follows
+ * @return Header size in bytes, 0 if the length can't be expressed in this version
+ */
+size_t encode_response_header(int version, char *buf, uint8_t status, uint64_t data_length);
+
+/**
+ * Read a response header
+ * 
+ * @param version Protocol version
+ * @param buf Header bytes, response_header_size() of them
+ * @param status Receives the status code
+ * @param data_length Receives the data length
+ */
+void decode_response_header(int version, const char *buf, uint8_t *status, uint64_t *data_length);
+
+/**
+ * Write a version 3 frame header
+ * 
+ * @param buf Output buffer of at least FRAME_HEADER_SIZE bytes
+ * @param type Frame type
+ * @param stream Stream id
+ * @param length Length of the frame payload
+ * @return Header size in bytes
+ */
+size_t encode_frame_header(char *buf, uint8_t type, uint32_t stream, uint32_t length);
+
+/**
+ * Read a version 3 frame header
+ * 
+ * @param buf Header bytes, FRAME_HEADER_SIZE of them
+ * @param type Receives the frame type
+ * @param stream Receives the stream id
+ * @param length Receives the payload length
+ */
+void decode_frame_header(const char *buf, uint8_t *type, uint32_t *stream, uint32_t *length);
+
 /**
  * Process a client request
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection, its role is used for permission checking
  * @param buffer Request buffer
  * @param size Size of the request
- * @param user_role User role for permission checking
  * @return 0 on success, non-zero on failure
  */
-int process_request(int client_fd, const char *buffer, size_t size, user_role_t *user_role);
+int process_request(connection_t *conn, const char *buffer, size_t size);
+
+/**
+ * Check whether a command's payload is streamed to its handler rather than
+ * buffered together with the request
+ * 
+ * @param command Command code
+ * @return 1 if the payload is streamed, 0 if it is buffered
+ */
+int command_streams_payload(int command);
+
+/**
+ * Get the largest payload a command may have buffered in memory. Payloads
+ * that don't fit the regular request buffer get a buffer of their own.
+ * 
+ * @param command Command code
+ * @return Payload limit in bytes, 0 if only the regular request buffer is allowed
+ */
+size_t command_payload_limit(int command);
 
 /**
- * Send a response to the client
+ * Get the number of bytes at the start of a streamed payload that must have
+ * arrived before the request is handled
  * 
- * @param client_fd Client socket file descriptor
+ * @param command Command code
+ * @return Prefix size in bytes, 0 if the handler needs none of the payload
+ */
+size_t command_payload_prefix(int command);
+
+/**
+ * Queue a response to the client
+ * 
+ * @param conn Client connection
  * @param status Response status code
  * @param data Response data
  * @param data_size Size of the response data
  * @return 0 on success, non-zero on failure
  */
-int send_response(int client_fd, int status, const void *data, size_t data_size);
+int send_response(connection_t *conn, int status, const void *data, size_t data_size);
+
+/**
+ * Queue a response whose payload is a heap buffer, sent without copying
+ * 
+ * @param conn Client connection
+ * @param status Response status code
+ * @param data Response data from malloc(), owned by the connection afterwards
+ * @param data_size Size of the response data
+ * @return 0 on success, non-zero on failure
+ */
+int send_response_buffer(connection_t *conn, int status, void *data, size_t data_size);
 
 /**
  * Handle an AUTH command
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param username Username
  * @param password Password
  * @param user_role Pointer to store the user's role if authentication succeeds
  * @return 0 on success, non-zero on failure
  */
-int handle_auth_command(int client_fd, const char *username, const char *password, user_role_t *user_role);
+int handle_auth_command(connection_t *conn, const char *username, const char *password, user_role_t *user_role);
 
 /**
- * Handle a LIST command
+ * Handle a LIST command. Without a payload the answer is an array of up to
+ * LIST_PAGE_MAX entries. With a LIST_PAGE_SIZE payload it is one page of
+ * entries starting at the cursor, followed by the LIST_TRAILER_SIZE trailer.
+ * A query after the page size filters, sorts and trims the entries.
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param path Directory path to list
+ * @param data Payload of the request
+ * @param size Payload size
+ * @param chunked Whether a page may be sent as chunks while the directory is read
  * @param user_role User role for permission checking
  * @return 0 on success, non-zero on failure
  */
-int handle_list_command(int client_fd, const char *path, user_role_t user_role);
+int handle_list_command(connection_t *conn, const char *path, const char *data, size_t size,
+                        int chunked, user_role_t user_role);
 
 /**
  * Handle a GET command
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param path File path to get
  * @param user_role User role for permission checking
  * @return 0 on success, non-zero on failure
  */
-int handle_get_command(int client_fd, const char *path, user_role_t user_role);
+int handle_get_command(connection_t *conn, const char *path, user_role_t user_role);
 
 /**
  * Handle a PUT command
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param path File path to put
  * @param data File data
  * @param data_size Size of the file data
  * @param user_role User role for permission checking
  * @return 0 on success, non-zero on failure
  */
-int handle_put_command(int client_fd, const char *path, const void *data, size_t data_size, user_role_t user_role);
+int handle_put_command(connection_t *conn, const char *path, const void *data, size_t data_size, user_role_t user_role);
 
 /**
  * Handle a DELETE command
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param path Path to delete
  * @param user_role User role for permission checking
  * @return 0 on success, non-zero on failure
  */
-int handle_delete_command(int client_fd, const char *path, user_role_t user_role);
+int handle_delete_command(connection_t *conn, const char *path, user_role_t user_role);
 
 /**
  * Handle a MKDIR command
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param path Directory path to create
  * @param user_role User role for permission checking
  * @return 0 on success, non-zero on failure
  */
-int handle_mkdir_command(int client_fd, const char *path, user_role_t user_role);
+int handle_mkdir_command(connection_t *conn, const char *path, user_role_t user_role);
 
 /**
  * Handle an INFO command
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param path Path to get info for
  * @param user_role User role for permission checking
  * @return 0 on success, non-zero on failure
  */
-int handle_info_command(int client_fd, const char *path, user_role_t user_role);
+int handle_info_command(connection_t *conn, const char *path, user_role_t user_role);
+
+/**
+ * Handle a BATCH command: run each sub-request in order and answer with a
+ * single response holding a count followed by one response frame per entry
+ * 
+ * @param conn Client connection
+ * @param data Batch payload, a sequence of regular request frames
+ * @param size Size of the batch payload
+ * @param user_role User role for permission checking
+ * @return 0 on success, non-zero on failure
+ */
+int handle_batch_command(connection_t *conn, const char *data, size_t size, user_role_t user_role);
+
+/**
+ * Handle a HELLO command. The response is framed with the version in use
+ * so far, later requests and responses with the agreed one.
+ * 
+ * @param conn Client connection
+ * @param data Payload, the highest version the client speaks (32-bit, network byte order),
+ *             optionally followed by the codecs and features it wants
+ * @param size Size of the payload
+ * @return 0 on success, non-zero on failure
+ */
+int handle_hello_command(connection_t *conn, const char *data, size_t size);
+
+/**
+ * Handle an UPLOAD_WRITE command. The chunk is streamed from the socket into
+ * the session's file at the chunk's offset.
+ * 
+ * @param conn Client connection
+ * @param initial_data Part of the payload that arrived with the request, at least the prefix
+ * @param initial_len Size of initial_data
+ * @param total_len Size of the whole payload
+ * @param user_role User role for permission checking
+ * @return 0 on success, non-zero on failure
+ */
+int handle_upload_write(connection_t *conn, const char *initial_data, size_t initial_len,
+                        uint64_t total_len, user_role_t user_role);
+
+/**
+ * Handle UPLOAD_BEGIN, UPLOAD_COMMIT, UPLOAD_ABORT and UPLOAD_STATUS
+ * 
+ * @param conn Client connection
+ * @param command Command code
+ * @param path Target path, used by UPLOAD_BEGIN and by UPLOAD_STATUS without a session id
+ * @param data Payload
+ * @param size Size of the payload
+ * @param user_role User role for permission checking
+ * @return 0 on success, non-zero on failure
+ */
+int handle_upload_command(connection_t *conn, uint8_t command, const char *path,
+                          const char *data, size_t size, user_role_t user_role);
+
+/**
+ * Handle a SIGNATURES command: answer with the file's size, modification
+ * time and block size, then a weak checksum and strong hash per block
+ * 
+ * @param conn Client connection
+ * @param path File path
+ * @param user_role User role for permission checking
+ * @return 0 on success, non-zero on failure
+ */
+int handle_signatures_command(connection_t *conn, const char *path, user_role_t user_role);
+
+/**
+ * Handle a HASH command: answer with the file's size and digest, cached in
+ * an extended attribute of the file
+ * 
+ * @param conn Client connection
+ * @param path File path
+ * @param user_role User role for permission checking
+ * @return 0 on success, non-zero on failure
+ */
+int handle_hash_command(connection_t *conn, const char *path, user_role_t user_role);
+
+/**
+ * Handle a DELTA command. The instructions are streamed from the socket and
+ * applied to a new file, which replaces the old one once complete.
+ * 
+ * @param conn Client connection
+ * @param path File path
+ * @param initial_data Part of the payload that arrived with the request, at least the prefix
+ * @param initial_len Size of initial_data
+ * @param total_len Size of the whole payload
+ * @param user_role User role for permission checking
+ * @return 0 on success, non-zero on failure
+ */
+int handle_delta_streaming(connection_t *conn, const char *path, const char *initial_data, size_t initial_len,
+                           uint64_t total_len, user_role_t user_role);
+
+/**
+ * Handle CHUNK_QUERY, CHUNK_STORE and CHUNK_ASSEMBLE
+ * 
+ * @param conn Client connection
+ * @param command Command code
+ * @param path Target path, used by CHUNK_ASSEMBLE
+ * @param data Payload: a list of chunk hashes, for CHUNK_STORE a hash and the chunk
+ * @param size Size of the payload
+ * @param user_role User role for permission checking
+ * @return 0 on success, non-zero on failure
+ */
+int handle_chunk_command(connection_t *conn, uint8_t command, const char *path,
+                         const char *data, size_t size, user_role_t user_role);
 
 /**
  * Handle a LOGOUT command
  * 
- * @param client_fd Client socket file descriptor
+ * @param conn Client connection
  * @param user_role Pointer to the user's role (will be reset to ROLE_GUEST)
  * @return 0 on success, non-zero on failure
  */
-int handle_logout_command(int client_fd, user_role_t *user_role);
+int handle_logout_command(connection_t *conn, user_role_t *user_role);
 
 #endif /* PROTOCOL_H */ 
@@ -11,7 +11,9 @@
 int init_server(int port, int backlog);
 
 /**
- * Process incoming connections and handle client requests
+ * Run one pass of the event loop: accept incoming connections and advance
+ * every client connection that is ready. Blocks for at most a short timeout
+ * when nothing is ready.
  * 
  * @return 0 on success, non-zero on failure
  */
@@ -24,13 +26,4 @@ int server_process(void);
  */
 int shutdown_server(void);
 
-/**
- * Handle a client connection
- * 
- * @param client_fd Client socket file descriptor
- * @param client_index Index of the client in the client array
- * @return 0 on success, non-zero on failure
- */
-int handle_client(int client_fd, int client_index);
-
 #endif /* SERVER_H */ 
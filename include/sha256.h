@@ -0,0 +1,53 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+/**
+ * State of a digest computed piecewise
+ */
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                    // Bytes hashed so far
+    uint8_t buffer[SHA256_BLOCK_SIZE];  // Partial block waiting for more input
+    size_t buffer_len;
+} sha256_ctx_t;
+
+/**
+ * Start a digest
+ *
+ * @param ctx Digest state
+ */
+void sha256_init(sha256_ctx_t *ctx);
+
+/**
+ * Add data to a digest
+ *
+ * @param ctx Digest state
+ * @param data Data to hash
+ * @param len Number of bytes
+ */
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+
+/**
+ * Finish a digest
+ *
+ * @param ctx Digest state, must be started again before reuse
+ * @param digest Receives the digest
+ */
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Hash a buffer in one call
+ *
+ * @param data Data to hash
+ * @param len Number of bytes
+ * @param digest Receives the digest
+ */
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* SHA256_H */
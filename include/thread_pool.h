@@ -0,0 +1,42 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/**
+ * Work item executed by a pool worker
+ *
+ * @param arg Argument given to thread_pool_submit()
+ */
+typedef void (*thread_pool_task_t)(void *arg);
+
+/**
+ * Start the worker threads
+ *
+ * @param num_workers Number of worker threads
+ * @param queue_depth Maximum number of queued tasks, rounded up to a power of two
+ * @return 0 on success, non-zero on failure
+ */
+int thread_pool_init(int num_workers, int queue_depth);
+
+/**
+ * Queue a task for execution on a worker thread. Never blocks.
+ *
+ * @param task Function to run
+ * @param arg Argument passed to the function
+ * @return 0 on success, non-zero if the queue is full or the pool is stopped
+ */
+int thread_pool_submit(thread_pool_task_t task, void *arg);
+
+/**
+ * Get the number of worker threads
+ *
+ * @return Number of running worker threads
+ */
+int thread_pool_size(void);
+
+/**
+ * Stop the worker threads. Tasks still queued are discarded, running tasks
+ * are allowed to finish.
+ */
+void thread_pool_shutdown(void);
+
+#endif /* THREAD_POOL_H */
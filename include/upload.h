@@ -0,0 +1,99 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdint.h>
+
+// Upload sessions let a client send one file as fixed-size chunks, in any
+// order and over any number of connections. The chunks are written in place
+// into a preallocated temporary file next to the target, which replaces the
+// target only when the session is committed with every chunk present.
+// Each session's chunk map is kept in a state file in the configured
+// upload_dir, so an interrupted upload can be resumed, even after a restart.
+
+#define MAX_UPLOAD_SESSIONS 64
+#define MAX_UPLOAD_CHUNKS (1024 * 1024)   // Limits the per-session chunk map to 128KB
+#define UPLOAD_IDLE_TIMEOUT 86400         // Seconds before an untouched session may be discarded
+
+/**
+ * Load the sessions left unfinished by an earlier run from upload_dir,
+ * creating the directory if needed
+ *
+ * @return 0 on success, non-zero on failure
+ */
+int upload_init(void);
+
+/**
+ * Start an upload session. The temporary file is created and the full size
+ * reserved before this returns, so a full disk is reported right away.
+ *
+ * @param path Relative path of the file to create or replace
+ * @param size Size of the complete file
+ * @param chunk_size Size of every chunk but the last
+ * @param id Receives the session id
+ * @return 0 on success, an errno value on failure
+ */
+int upload_begin(const char *path, uint64_t size, uint64_t chunk_size, uint64_t *id);
+
+/**
+ * Open a session's file for writing one chunk. The chunk must start on a
+ * chunk boundary and have that chunk's exact length. Every successful call
+ * must be followed by upload_chunk_done().
+ *
+ * @param id Session id
+ * @param offset Offset of the chunk
+ * @param length Length of the chunk
+ * @param fd Receives a descriptor positioned at offset, owned by the caller
+ * @return 0 on success, ENOENT for an unknown session, EINVAL for a chunk
+ *         that doesn't fit the session, another errno value on failure
+ */
+int upload_open_chunk(uint64_t id, uint64_t offset, uint64_t length, int *fd);
+
+/**
+ * Finish writing a chunk opened with upload_open_chunk(). A complete chunk
+ * is flushed to disk before the session records it.
+ *
+ * @param id Session id
+ * @param offset Offset of the chunk
+ * @param complete 1 if the whole chunk was stored, 0 if it has to be sent again
+ * @return 0 on success, an errno value if a complete chunk couldn't be
+ *         flushed and has to be sent again
+ */
+int upload_chunk_done(uint64_t id, uint64_t offset, int complete);
+
+/**
+ * Publish a session's file under its target path and end the session
+ *
+ * @param id Session id
+ * @return 0 on success, ENOENT for an unknown session, EAGAIN while chunks
+ *         are missing, EBUSY while chunks are being written, another errno
+ *         value if the file could not be renamed
+ */
+int upload_commit(uint64_t id);
+
+/**
+ * Discard a session and its temporary file
+ *
+ * @param id Session id
+ * @return 0 on success, ENOENT for an unknown session
+ */
+int upload_abort(uint64_t id);
+
+/**
+ * Describe a session and list the parts of its file that have not been stored
+ *
+ * @param id Session id, or 0 to find the session by its target path
+ * @param path Relative target path, used when id is 0
+ * @param info Receives the session id, file size and chunk size, in that order
+ * @param extents Receives a malloc()ed array of offset and length pairs,
+ *                one pair per run of missing chunks, NULL if there are none
+ * @param num_extents Receives the number of pairs
+ * @return 0 on success, ENOENT if there is no such session, ENOMEM on failure
+ */
+int upload_status(uint64_t id, const char *path, uint64_t info[3], uint64_t **extents, size_t *num_extents);
+
+/**
+ * Release the session table. Unfinished sessions stay on disk for the next run.
+ */
+void upload_cleanup(void);
+
+#endif /* UPLOAD_H */
@@ -0,0 +1,93 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring ring, driven through the raw system calls
+typedef struct {
+    int fd;
+    unsigned features;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;    // Entries handed out but not yet published to the kernel
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * Set up a ring. Fails if the kernel lacks io_uring or the features
+ * the server relies on.
+ *
+ * @param ring Ring to initialize
+ * @param entries Number of submission queue entries
+ * @return 0 on success, non-zero on failure
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/**
+ * Release the ring
+ *
+ * @param ring Ring to release
+ */
+void uring_exit(uring_t *ring);
+
+/**
+ * Get a cleared submission queue entry. Queued entries are flushed to the
+ * kernel first if the queue is full.
+ *
+ * @param ring Ring to use
+ * @return Entry to fill in, or NULL if the queue could not be flushed
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * Submit queued entries and wait for at least one completion
+ *
+ * @param ring Ring to use
+ * @param timeout_ms Maximum time to wait, 0 to only submit
+ * @return 0 on success (including timeout and interruption), non-zero on failure
+ */
+int uring_submit_and_wait(uring_t *ring, int timeout_ms);
+
+/**
+ * Get the next completion without consuming it
+ *
+ * @param ring Ring to use
+ * @return Completion entry, or NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/**
+ * Mark the completion returned by uring_peek_cqe() as consumed
+ *
+ * @param ring Ring to use
+ */
+void uring_cqe_seen(uring_t *ring);
+
+/**
+ * Register fixed buffers for IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED
+ *
+ * @param ring Ring to use
+ * @param iovs Buffers to register
+ * @param count Number of buffers
+ * @return 0 on success, non-zero on failure
+ */
+int uring_register_buffers(uring_t *ring, const struct iovec *iovs, unsigned count);
+
+#endif /* URING_H */
@@ -0,0 +1,50 @@
+#include <pthread.h>
+#include "../include/cdc.h"
+
+// FastCDC's normalized chunking: before the average size a cut needs more
+// hash bits to be zero than after it, which narrows the spread of chunk
+// sizes. Gear hashing shifts the hash left once per byte, so its top bits
+// depend on the last 64 bytes only.
+#define MASK_BEFORE_AVG 0xFFFFC00000000000ULL  // Top 18 bits
+#define MASK_AFTER_AVG  0xFFFC000000000000ULL  // Top 14 bits
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// The table only has to be random-looking and the same everywhere, since the
+// server keeps chunks cut by every client. splitmix64 of the byte value fits.
+static void init_gear(void) {
+    uint64_t seed = 0;
+    for (int i = 0; i < 256; i++) {
+        seed += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cdc_next_chunk(const uint8_t *data, size_t len) {
+    pthread_once(&gear_once, init_gear);
+    if (len <= CDC_MIN_SIZE) {
+        return len;
+    }
+
+    size_t end = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+    size_t normal = end < CDC_AVG_SIZE ? end : CDC_AVG_SIZE;
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & MASK_BEFORE_AVG) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & MASK_AFTER_AVG) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
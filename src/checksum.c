@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../include/checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // Castagnoli polynomial, bit-reversed
+
+// The functions below work on the CRC register, the caller inverts it before and after
+static uint32_t crc_tables[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_impl)(uint32_t crc, const uint8_t *p, size_t len);
+
+// Slicing-by-8: eight table lookups per 8 bytes instead of one per byte
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_tables[7][lo & 0xff] ^ crc_tables[6][(lo >> 8) & 0xff] ^
+              crc_tables[5][(lo >> 16) & 0xff] ^ crc_tables[4][lo >> 24] ^
+              crc_tables[3][hi & 0xff] ^ crc_tables[2][(hi >> 8) & 0xff] ^
+              crc_tables[1][(hi >> 16) & 0xff] ^ crc_tables[0][hi >> 24];
+    }
+    for (; len > 0; p++, len--) {
+        crc = crc_tables[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; len >= 4; p += 4, len -= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+static void init_crc(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_tables[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_tables[t][i] = (crc_tables[t - 1][i] >> 8) ^ crc_tables[0][crc_tables[t - 1][i] & 0xff];
+        }
+    }
+    
+    crc_impl = crc32c_generic;
+#ifdef HAVE_SSE42_CRC
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+        crc_impl = crc32c_sse42;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc_once, init_crc);
+    return ~crc_impl(~crc, data, len);
+}
+
+checksum_stream_t *checksum_open(void) {
+    return calloc(1, sizeof(checksum_stream_t));
+}
+
+void checksum_close(checksum_stream_t *cs) {
+    free(cs);
+}
+
+static int write_bytes(checksum_stream_t *cs, int fd, const void *data, size_t len) {
+    const char *p = data;
+    cs->crc = crc32c(cs->crc, data, len);
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int checksum_store(checksum_stream_t *cs, int fd, const char *data, size_t len) {
+    if (cs->tail_len + len <= CHECKSUM_SIZE) {
+        memcpy(cs->tail + cs->tail_len, data, len);
+        cs->tail_len += len;
+        return 0;
+    }
+    
+    // Bytes that are now known to come before the last CHECKSUM_SIZE are file
+    // bytes: first from the held back ones, then from the new data
+    size_t release = cs->tail_len + len - CHECKSUM_SIZE;
+    size_t from_tail = release < cs->tail_len ? release : cs->tail_len;
+    int err = write_bytes(cs, fd, cs->tail, from_tail);
+    memmove(cs->tail, cs->tail + from_tail, cs->tail_len - from_tail);
+    cs->tail_len -= from_tail;
+    
+    size_t from_data = release - from_tail;
+    if (err == 0) {
+        err = write_bytes(cs, fd, data, from_data);
+    }
+    memcpy(cs->tail + cs->tail_len, data + from_data, len - from_data);
+    cs->tail_len = CHECKSUM_SIZE;
+    return err;
+}
+
+int checksum_verify(const checksum_stream_t *cs) {
+    uint8_t expected[CHECKSUM_SIZE];
+    checksum_trailer(cs->crc, expected);
+    return cs->tail_len == CHECKSUM_SIZE && memcmp(cs->tail, expected, CHECKSUM_SIZE) == 0 ? 0 : -1;
+}
+
+void checksum_trailer(uint32_t crc, uint8_t trailer[CHECKSUM_SIZE]) {
+    trailer[0] = (uint8_t)(crc >> 24);
+    trailer[1] = (uint8_t)(crc >> 16);
+    trailer[2] = (uint8_t)(crc >> 8);
+    trailer[3] = (uint8_t)crc;
+}
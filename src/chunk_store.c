@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+#include <linux/fs.h>
+#include "../include/chunk_store.h"
+#include "../include/file_ops.h"
+#include "../include/config.h"
+#include "../include/logger.h"
+
+#define CHUNK_PATH_SIZE 2048
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+static void hash_hex(const uint8_t hash[CHUNK_HASH_SIZE], char out[2 * CHUNK_HASH_SIZE + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < CHUNK_HASH_SIZE; i++) {
+        out[2 * i] = digits[hash[i] >> 4];
+        out[2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    out[2 * CHUNK_HASH_SIZE] = '\0';
+}
+
+// Chunks are spread over 256 subdirectories by the first byte of their hash,
+// which keeps directories small enough to look up quickly
+static int chunk_path(const uint8_t hash[CHUNK_HASH_SIZE], char *out, size_t out_size) {
+    char hex[2 * CHUNK_HASH_SIZE + 1];
+    hash_hex(hash, hex);
+    int len = snprintf(out, out_size, "%s/%.2s/%s", get_config()->chunk_dir, hex, hex);
+    return len < 0 || (size_t)len >= out_size ? -1 : 0;
+}
+
+int chunk_store_init(void) {
+    const char *dir = get_config()->chunk_dir;
+
+    // Clients that could write there could swap the chunks other uploads are built from
+    int err = create_state_directory(dir);
+    if (err == EXDEV) {
+        log_error("Chunk store %s must lie outside root_directory and not contain it", dir);
+        return -1;
+    }
+    if (err != 0) {
+        log_error("Failed to create chunk store %s: %s", dir, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int chunk_store_has(const uint8_t hash[CHUNK_HASH_SIZE]) {
+    char path[CHUNK_PATH_SIZE];
+
+    // Renewing the modification time marks the chunk as still in use
+    return chunk_path(hash, path, sizeof(path)) == 0 && utimensat(AT_FDCWD, path, NULL, 0) == 0;
+}
+
+int chunk_store_put(const uint8_t hash[CHUNK_HASH_SIZE], const void *data, size_t len) {
+    char path[CHUNK_PATH_SIZE];
+    char temp[CHUNK_PATH_SIZE];
+    uint8_t actual[CHUNK_HASH_SIZE];
+
+    // The store is shared by every client, so a chunk must be what its name says
+    sha256(data, len, actual);
+    if (memcmp(actual, hash, CHUNK_HASH_SIZE) != 0) {
+        return EBADMSG;
+    }
+    if (chunk_path(hash, path, sizeof(path)) != 0) {
+        return ENAMETOOLONG;
+    }
+    if (chunk_store_has(hash)) {
+        return 0;
+    }
+
+    char *name = strrchr(path, '/');
+    *name = '\0';
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        int err = errno;
+        log_error("Failed to create chunk directory %s: %s", path, strerror(err));
+        return err;
+    }
+    *name = '/';
+
+    // Written under a temporary name first, so a chunk in the store is always complete
+    uint64_t nonce;
+    if (getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+        return errno;
+    }
+    int len_temp = snprintf(temp, sizeof(temp), "%s.%016llx", path, (unsigned long long)nonce);
+    if (len_temp < 0 || (size_t)len_temp >= sizeof(temp)) {
+        return ENAMETOOLONG;
+    }
+    // Read-only once stored, nothing but the store itself changes a chunk
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0400);
+    if (fd < 0) {
+        int err = errno;
+        log_error("Failed to create chunk %s: %s", temp, strerror(err));
+        return err;
+    }
+    const char *p = data;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t w = write(fd, p, left);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            log_error("Failed to write chunk %s: %s", temp, strerror(err));
+            close(fd);
+            unlink(temp);
+            return err;
+        }
+        p += w;
+        left -= w;
+    }
+    close(fd);
+
+    // A chunk stored by someone else in the meantime is simply replaced by an identical one
+    if (rename(temp, path) != 0) {
+        int err = errno;
+        log_error("Failed to store chunk %s: %s", path, strerror(err));
+        unlink(temp);
+        return err;
+    }
+    return 0;
+}
+
+// Append one chunk at offset. Returns 0 on success, an errno value on failure.
+static int append_chunk(int out, int in, uint64_t offset, uint64_t len, blksize_t block_size, int *can_clone) {
+    // A chunk starting on a block boundary can share the stored chunk's blocks.
+    // Filesystems without shared blocks say so on the first try.
+    if (*can_clone && offset % block_size == 0) {
+        struct file_clone_range range = { .src_fd = in, .src_offset = 0, .src_length = len, .dest_offset = offset };
+        if (ioctl(out, FICLONERANGE, &range) == 0) {
+            return 0;
+        }
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV) {
+            *can_clone = 0;
+        }
+    }
+
+    // copy_file_range() copies within the kernel, or shares blocks where it can
+    loff_t in_off = 0;
+    loff_t out_off = (loff_t)offset;
+    while ((uint64_t)in_off < len) {
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, len - in_off, 0);
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            return EIO;  // Chunk shorter than it was a moment ago
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL) {
+            return errno;
+        }
+        break;
+    }
+
+    // Fall back to a plain copy for whatever is left
+    char *buffer = NULL;
+    while ((uint64_t)in_off < len) {
+        if (buffer == NULL && (buffer = malloc(COPY_BUFFER_SIZE)) == NULL) {
+            return ENOMEM;
+        }
+        size_t want = len - in_off < COPY_BUFFER_SIZE ? len - in_off : COPY_BUFFER_SIZE;
+        ssize_t r = pread(in, buffer, want, in_off);
+        if (r <= 0) {
+            int err = r < 0 ? errno : EIO;
+            if (err == EINTR) {
+                continue;
+            }
+            free(buffer);
+            return err;
+        }
+        for (ssize_t done = 0; done < r;) {
+            ssize_t w = pwrite(out, buffer + done, r - done, out_off + done);
+            if (w < 0 && errno != EINTR) {
+                int err = errno;
+                free(buffer);
+                return err;
+            }
+            done += w > 0 ? w : 0;
+        }
+        in_off += r;
+        out_off += r;
+    }
+    free(buffer);
+    return 0;
+}
+
+// A stored chunk isn't the length a client gave for it. Either the client is
+// wrong, or the chunk changed after it was stored: hash it again to tell, and
+// take a damaged chunk out of the store so the next upload sends it afresh.
+// Returns EINVAL or EAGAIN, or an errno value if the chunk can't be read.
+static int check_stored_chunk(int in, const uint8_t hash[CHUNK_HASH_SIZE], const char *chunk) {
+    uint8_t actual[CHUNK_HASH_SIZE];
+    sha256_ctx_t ctx;
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return ENOMEM;
+    }
+    sha256_init(&ctx);
+    for (off_t offset = 0;;) {
+        ssize_t r = pread(in, buffer, COPY_BUFFER_SIZE, offset);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0) {
+            int err = errno;
+            free(buffer);
+            return err;
+        }
+        if (r == 0) {
+            break;
+        }
+        sha256_update(&ctx, buffer, (size_t)r);
+        offset += r;
+    }
+    free(buffer);
+    sha256_final(&ctx, actual);
+    if (memcmp(actual, hash, CHUNK_HASH_SIZE) == 0) {
+        return EINVAL;
+    }
+    log_warning("Chunk %s doesn't match its hash, removing it from the store", chunk);
+    unlink(chunk);
+    return EAGAIN;
+}
+
+int chunk_store_assemble(const char *path, const uint8_t *entries, size_t count, uint64_t *size) {
+    char name[NAME_MAX + 1];
+    char temp[NAME_MAX + 1];
+    struct stat st;
+
+    int dir_fd = open_parent_beneath(path, name, sizeof(name));
+    if (dir_fd < 0) {
+        return EINVAL;
+    }
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+        close(dir_fd);
+        return EISDIR;
+    }
+
+    // Built next to the target, like an upload session's file
+    uint64_t nonce;
+    if (getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce)) {
+        int err = errno;
+        close(dir_fd);
+        return err;
+    }
+    int len = snprintf(temp, sizeof(temp), ".%s.dedup-%016llx", name, (unsigned long long)nonce);
+    if (len < 0 || (size_t)len >= sizeof(temp)) {
+        close(dir_fd);
+        return ENAMETOOLONG;
+    }
+    int out = openat(dir_fd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (out < 0) {
+        int err = errno;
+        log_error("Failed to create the file for %s: %s", path, strerror(err));
+        close(dir_fd);
+        return err;
+    }
+    blksize_t block_size = fstat(out, &st) == 0 && st.st_blksize > 0 ? st.st_blksize : 4096;
+
+    int err = 0;
+    int can_clone = 1;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count && err == 0; i++) {
+        const uint8_t *hash = entries + i * CHUNK_ENTRY_SIZE;
+        uint32_t length;
+        memcpy(&length, hash + CHUNK_HASH_SIZE, sizeof(length));
+        length = ntohl(length);
+        
+        char chunk[CHUNK_PATH_SIZE];
+        if (chunk_path(hash, chunk, sizeof(chunk)) != 0) {
+            err = ENAMETOOLONG;
+            break;
+        }
+        int in = open(chunk, O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            err = errno == ENOENT ? EAGAIN : errno;
+            break;
+        }
+        if (fstat(in, &st) != 0) {
+            err = errno;
+        } else if ((uint64_t)st.st_size != length) {
+            err = check_stored_chunk(in, hash, chunk);
+        } else {
+            err = append_chunk(out, in, offset, (uint64_t)st.st_size, block_size, &can_clone);
+            offset += (uint64_t)st.st_size;
+        }
+        close(in);
+    }
+    if (close(out) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err == 0 && renameat(dir_fd, temp, dir_fd, name) != 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        if (err != EAGAIN) {
+            log_error("Failed to assemble %s: %s", path, strerror(err));
+        }
+        unlinkat(dir_fd, temp, 0);
+        close(dir_fd);
+        return err;
+    }
+    close(dir_fd);
+
+    log_info("Assembled %s from %zu chunks (%llu bytes)", path, count, (unsigned long long)offset);
+    *size = offset;
+    return 0;
+}
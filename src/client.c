@@ -2,37 +2,85 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <time.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include "../include/protocol.h"
 #include "../include/file_ops.h"
 #include "../include/auth.h"
+#include "../include/compress.h"
+#include "../include/chunk_store.h"
+#include "../include/cdc.h"
+#include "../include/delta.h"
+#include "../include/file_hash.h"
+#include "../include/checksum.h"
+#include "../include/list_codec.h"
+#include "../include/list_query.h"
 
 #define BUFFER_SIZE 4096
 #define DEFAULT_PORT 9090
 #define DEFAULT_HOST "localhost"
+#define MAX_STREAMS 64
+#define STRIPE_SIZE (64ULL * 1024 * 1024)  // Range fetched per request in a parallel download
+#define STRIPE_BUFFER_SIZE (256 * 1024)
+#define MUX_INPUT_SIZE (256 * 1024)    // Received frames waiting to be handled
+#define MUX_OUTPUT_SIZE (512 * 1024)   // Frames waiting for room in the socket
+#define CHUNK_BUFFER_SIZE (64 * 1024)  // Pieces a compressed body is received in
+#define DEDUP_PIPELINE 16              // CHUNK_STORE requests sent ahead of their answers
+#define DELTA_LITERAL_MAX (1024 * 1024) // Longest literal instruction of a delta
 
 // Global variables for auth credentials
 static char g_username[64] = "";
 static char g_password[64] = "";
 static char g_host[256] = DEFAULT_HOST;
 static int g_port = DEFAULT_PORT;
+static int g_protocol = PROTOCOL_V1;  // Framing agreed with the server on connect
+static int g_continue = 0;            // Resume an interrupted transfer
+static int g_streams = 1;             // Connections used to transfer a file
+static int g_multiplex = 0;           // Carry parallel transfers as streams of one connection
+static uint32_t g_next_stream = 1;    // Stream id of the next version 3 request
+static int g_codec = COMPRESS_NONE;   // Codec single-connection transfers are compressed with
+static uint32_t g_server_codecs = 0;  // Codecs the server named in its HELLO answer
+static int g_checksums = 0;           // Plain GET bodies and PUT payloads end with a CRC32C
+static int g_list_pages = 0;          // LIST is walked a page at a time with a cursor
+static int g_compact_list = 0;        // LIST and INFO answer with compact records
+static int g_list_queries = 0;        // LIST takes a query after the page
+static list_query_t g_list_query;     // Entries, order and fields list asks for
+static int g_list_queried = 0;        // The query differs from listing everything
+static uint32_t g_list_top = 0;       // Entries list stops after, 0 for all
+static int g_dedup = 0;               // Upload only the chunks the server doesn't have
+static int g_sync = 0;                // Update the server's copy of a file with a delta
 
-// Protocol message header
+// A parallel transfer. Every connection takes the next unclaimed stripe
+// until all are claimed, so faster connections move more of the file.
 typedef struct {
-    uint8_t command;
-    uint16_t path_length;
-    uint32_t data_length;
-} __attribute__((packed)) message_header_t;
+    const char *path;
+    int file_fd;
+    uint64_t size;
+    uint64_t stripe_size;
+    const uint64_t *stripes;  // Offsets of the stripes to move, NULL for the whole file
+    uint64_t num_stripes;
+    uint64_t upload_id;       // Upload session the stripes belong to, uploads only
+    atomic_uint_fast64_t next_stripe;
+    atomic_int failed;
+} stripe_job_t;
 
-// Response header
 typedef struct {
-    uint8_t status;
-    uint32_t data_length;
-} __attribute__((packed)) response_header_t;
+    stripe_job_t *job;
+    int sock_fd;
+    pthread_t thread;
+} stripe_stream_t;
 
 // Auth message structure
 typedef struct {
@@ -41,11 +89,17 @@ typedef struct {
 } __attribute__((packed)) auth_message_t;
 
 int connect_to_server(const char *host, int port);
-int send_request(int sock_fd, uint8_t command, const char *path, const void *data, size_t data_size);
-int receive_response(int sock_fd, void *buffer, size_t buffer_size, size_t *data_size);
+int negotiate_protocol(int sock_fd);
+int send_request(int sock_fd, uint8_t command, const char *path, const void *data, uint64_t data_size);
+int receive_response(int sock_fd, void *buffer, size_t buffer_size, uint64_t *data_size);
 void client_list_directory(int sock_fd, const char *path);
-void client_get_file(int sock_fd, const char *path, const char *local_path);
+void client_get_file(int sock_fd, const char *path, const char *local_path, uint64_t offset, uint64_t length);
+void client_get_file_parallel(int sock_fd, const char *path, const char *local_path, int streams);
 void client_put_file(int sock_fd, const char *path, const char *local_path);
+void client_upload_file(int sock_fd, const char *path, const char *local_path, int streams);
+void client_dedup_file(int sock_fd, const char *path, const char *local_path);
+void client_sync_file(int sock_fd, const char *path, const char *local_path);
+void client_hash_file(int sock_fd, const char *path, const char *local_path);
 void client_delete_file(int sock_fd, const char *path);
 void client_create_directory(int sock_fd, const char *path);
 void client_authenticate(int sock_fd, const char *username, const char *password);
@@ -86,35 +140,141 @@ int connect_to_server(const char *host, int port) {
         return -1;
     }
     
+    negotiate_protocol(sock_fd);
     return sock_fd;
 }
 
-int send_request(int sock_fd, uint8_t command, const char *path, const void *data, size_t data_size) {
-    message_header_t header;
+// Read or write exactly size bytes, sockets may transfer less per call
+static int read_full(int fd, void *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = read(fd, (char *)buffer + done, size - done);
+        if (r <= 0) {
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t w = write(fd, (const char *)buffer + done, size - done);
+        if (w < 0) {
+            return -1;
+        }
+        done += w;
+    }
+    return 0;
+}
+
+// Ask the server for a protocol version and switch to the one it agrees on.
+// Servers that predate CMD_HELLO answer with an error, the version then stays.
+// With -z the codecs this build has are listed as well. Checksum trailers
+// are always asked for, the server grants them unless streams are multiplexed.
+// Paged listings and compact entries are asked for too, servers that grant
+// them list any size in a fraction of the bytes, and so are LIST queries.
+static int request_protocol(int sock_fd, uint32_t wanted) {
+    char buffer[BUFFER_SIZE];
+    char header[RESPONSE_HEADER_MAX];
+    uint8_t status;
+    uint64_t data_size;
+    uint32_t version = htonl(wanted);
+    uint32_t hello[3] = { version, htonl(g_codec != COMPRESS_NONE ? compress_codecs() : 0),
+                          htonl(HELLO_FEATURE_CRC32C | HELLO_FEATURE_LIST_PAGES |
+                                HELLO_FEATURE_COMPACT_LIST | HELLO_FEATURE_LIST_QUERY) };
+    
+    g_checksums = 0;
+    g_list_pages = 0;
+    g_compact_list = 0;
+    g_list_queries = 0;
+    if (send_request(sock_fd, CMD_HELLO, "", hello, sizeof(hello)) != 0 ||
+        read_full(sock_fd, header, response_header_size(g_protocol)) != 0) {
+        return -1;
+    }
+    decode_response_header(g_protocol, header, &status, &data_size);
+    if (data_size > sizeof(buffer) || read_full(sock_fd, buffer, data_size) != 0) {
+        return -1;
+    }
+    
+    if (status == RESP_OK && data_size >= sizeof(version)) {
+        memcpy(&version, buffer, sizeof(version));
+        version = ntohl(version);
+        if (version >= PROTOCOL_V1 && version <= wanted) {
+            g_protocol = (int)version;
+        }
+    }
+    if (status == RESP_OK && data_size >= sizeof(version) + HELLO_CODECS_SIZE) {
+        memcpy(&g_server_codecs, buffer + sizeof(version), sizeof(g_server_codecs));
+        g_server_codecs = ntohl(g_server_codecs);
+    }
+    if (status == RESP_OK && data_size >= sizeof(hello)) {
+        uint32_t features;
+        memcpy(&features, buffer + sizeof(version) + HELLO_CODECS_SIZE, sizeof(features));
+        g_checksums = (ntohl(features) & HELLO_FEATURE_CRC32C) != 0;
+        g_list_pages = (ntohl(features) & HELLO_FEATURE_LIST_PAGES) != 0;
+        g_compact_list = (ntohl(features) & HELLO_FEATURE_COMPACT_LIST) != 0;
+        g_list_queries = (ntohl(features) & HELLO_FEATURE_LIST_QUERY) != 0;
+    }
+    return 0;
+}
+
+// Every connection starts on version 1, whatever an earlier one agreed on.
+// Version 2 is asked for, multiplexing only when a transfer uses it.
+int negotiate_protocol(int sock_fd) {
+    g_protocol = PROTOCOL_V1;
+    return request_protocol(sock_fd, PROTOCOL_V2);
+}
+
+// Move the connection to multiplexed streams. Returns 0 on success, -1 if
+// the server doesn't multiplex, the connection then keeps working as before.
+static int enable_multiplexing(int sock_fd) {
+    if (request_protocol(sock_fd, PROTOCOL_V3) != 0 || g_protocol < PROTOCOL_V3) {
+        fprintf(stderr, "Server does not multiplex streams, using separate connections\n");
+        return -1;
+    }
+    g_next_stream = 1;
+    return 0;
+}
+
+int send_request(int sock_fd, uint8_t command, const char *path, const void *data, uint64_t data_size) {
+    char header[FRAME_HEADER_SIZE + REQUEST_HEADER_MAX];
     size_t path_len = strlen(path);
     
-    // Prepare header
-    header.command = command;
-    header.path_length = htons(path_len);
-    header.data_length = htonl(data_size);
+    // Prepare header. Version 3 sends each request, data included, as the
+    // frame that opens a stream of its own.
+    size_t frame_size = 0;
+    if (g_protocol >= PROTOCOL_V3) {
+        uint64_t frame_length = request_header_size(g_protocol) + path_len + data_size;
+        if (frame_length > UINT32_MAX) {
+            fprintf(stderr, "Request too large for a frame\n");
+            return -1;
+        }
+        frame_size = encode_frame_header(header, FRAME_REQUEST, g_next_stream++, (uint32_t)frame_length);
+    }
+    size_t header_size = encode_request_header(g_protocol, header + frame_size, command, path_len, data_size);
+    if (header_size == 0) {
+        fprintf(stderr, "Request too large for protocol version %d\n", g_protocol);
+        return -1;
+    }
+    header_size += frame_size;
     
     // Send header
-    if (write(sock_fd, &header, sizeof(header)) != sizeof(header)) {
+    if (write_full(sock_fd, header, header_size) != 0) {
         perror("Error sending request header");
         return -1;
     }
     
     // Send path
-    ssize_t bytes_written = write(sock_fd, path, path_len);
-    if (bytes_written < 0 || (size_t)bytes_written != path_len) {
+    if (write_full(sock_fd, path, path_len) != 0) {
         perror("Error sending path");
         return -1;
     }
     
     // Send data if present
     if (data != NULL && data_size > 0) {
-        bytes_written = write(sock_fd, data, data_size);
-        if (bytes_written < 0 || (size_t)bytes_written != data_size) {
+        if (write_full(sock_fd, data, data_size) != 0) {
             perror("Error sending data");
             return -1;
         }
@@ -123,21 +283,39 @@ int send_request(int sock_fd, uint8_t command, const char *path, const void *dat
     return 0;
 }
 
-int receive_response(int sock_fd, void *buffer, size_t buffer_size, size_t *data_size) {
-    response_header_t header;
+int receive_response(int sock_fd, void *buffer, size_t buffer_size, uint64_t *data_size) {
+    char header[RESPONSE_HEADER_MAX];
+    uint8_t status;
+    
+    // Version 3 responses come in a frame, requests are answered one at a time
+    // here so it belongs to the last one sent
+    if (g_protocol >= PROTOCOL_V3) {
+        char frame[FRAME_HEADER_SIZE];
+        uint8_t type;
+        uint32_t stream, length;
+        if (read_full(sock_fd, frame, sizeof(frame)) != 0) {
+            perror("Error receiving response header");
+            return -1;
+        }
+        decode_frame_header(frame, &type, &stream, &length);
+        if (type != FRAME_RESPONSE) {
+            fprintf(stderr, "Unexpected frame type %d\n", type);
+            return -1;
+        }
+    }
     
     // Receive header
-    if (read(sock_fd, &header, sizeof(header)) != sizeof(header)) {
+    if (read_full(sock_fd, header, response_header_size(g_protocol)) != 0) {
         perror("Error receiving response header");
         return -1;
     }
     
     // Get data length
-    *data_size = ntohl(header.data_length);
+    decode_response_header(g_protocol, header, &status, data_size);
     
     // Check if response is OK
-    if (header.status != RESP_OK) {
-        if (header.status == RESP_AUTH_REQUIRED) {
+    if (status != RESP_OK) {
+        if (status == RESP_AUTH_REQUIRED) {
             fprintf(stderr, "Authentication required\n");
             return -2;  // Special return code for auth required
         } else {
@@ -146,8 +324,7 @@ int receive_response(int sock_fd, void *buffer, size_t buffer_size, size_t *data
         
         // Read error message if available
         if (*data_size > 0 && *data_size < buffer_size) {
-            ssize_t bytes_read = read(sock_fd, buffer, *data_size);
-            if (bytes_read < 0 || (size_t)bytes_read != *data_size) {
+            if (read_full(sock_fd, buffer, *data_size) != 0) {
                 perror("Error receiving error message");
             } else {
                 ((char *)buffer)[*data_size] = '\0';
@@ -165,8 +342,7 @@ int receive_response(int sock_fd, void *buffer, size_t buffer_size, size_t *data
             return -1;
         }
         
-        ssize_t bytes_read = read(sock_fd, buffer, *data_size);
-        if (bytes_read < 0 || (size_t)bytes_read != *data_size) {
+        if (read_full(sock_fd, buffer, *data_size) != 0) {
             perror("Error receiving response data");
             return -1;
         }
@@ -177,7 +353,7 @@ int receive_response(int sock_fd, void *buffer, size_t buffer_size, size_t *data
 
 void client_authenticate(int sock_fd, const char *username, const char *password) {
     char buffer[BUFFER_SIZE];
-    size_t data_size;
+    uint64_t data_size;
     auth_message_t auth_data;
     
     printf("Authenticating as user: %s\n", username);
@@ -206,7 +382,7 @@ void client_authenticate(int sock_fd, const char *username, const char *password
 
 void client_logout(int sock_fd) {
     char buffer[BUFFER_SIZE];
-    size_t data_size;
+    uint64_t data_size;
     
     printf("Logging out\n");
     
@@ -225,9 +401,145 @@ void client_logout(int sock_fd) {
     printf("%s\n", buffer);
 }
 
+static void print_entry(const file_info_t *entry) {
+    char time_str[30];
+    if (g_list_query.fields == 0) {
+        printf("%s\n", entry->name);
+        return;
+    }
+    struct tm *tm_info = localtime(&entry->modified_time);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
+    
+    printf("%-30s %-10zu %-20s %s\n", 
+           entry->name, 
+           entry->size, 
+           entry->is_directory ? "Directory" : "File",
+           time_str);
+}
+
+// Read directory entries and print them, a bufferful at a time.
+// Returns 0 on success, -1 on failure.
+static int print_entries(int sock_fd, uint64_t size) {
+    file_info_t entries[BUFFER_SIZE / sizeof(file_info_t)];
+    
+    if (size % sizeof(file_info_t) != 0) {
+        fprintf(stderr, "Malformed directory listing\n");
+        return -1;
+    }
+    while (size > 0) {
+        size_t len = size < sizeof(entries) ? size : sizeof(entries);
+        if (read_full(sock_fd, entries, len) != 0) {
+            perror("Error receiving directory entries");
+            return -1;
+        }
+        for (size_t i = 0; i < len / sizeof(file_info_t); i++) {
+            print_entry(&entries[i]);
+        }
+        size -= len;
+    }
+    return 0;
+}
+
+// Read compact records and print their entries; a page's trailer record
+// fills trailer. The size is at most a page, so the records are read whole.
+// Returns the number of entries, -1 on failure.
+static int64_t print_records(int sock_fd, uint64_t size, list_codec_t *codec, uint64_t trailer[2], int *have_trailer) {
+    if (size > (uint64_t)LIST_PAGE_MAX * LIST_RECORD_MAX + LIST_TRAILER_RECORD_SIZE) {
+        fprintf(stderr, "Malformed directory listing\n");
+        return -1;
+    }
+    uint8_t *records = malloc(size > 0 ? size : 1);
+    if (records == NULL || read_full(sock_fd, records, size) != 0) {
+        perror("Error receiving directory entries");
+        free(records);
+        return -1;
+    }
+    
+    int64_t count = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        file_info_t entry;
+        size_t used;
+        int type = list_decode_record(codec, records + pos, size - pos, &entry, trailer, &used);
+        if (type < 0 || (type == LIST_RECORD_TRAILER && pos + used != size)) {
+            fprintf(stderr, "Malformed directory listing\n");
+            free(records);
+            return -1;
+        }
+        if (type == LIST_RECORD_TRAILER) {
+            *have_trailer = 1;
+        } else {
+            print_entry(&entry);
+            count++;
+        }
+        pos += used;
+    }
+    free(records);
+    return count;
+}
+
+// Read the entries of one page and its trailer, in one piece or as chunks with
+// the trailer in a chunk of its own. Returns 0 on success, -1 on failure.
+static int receive_list_page(int sock_fd, uint64_t data_size, uint64_t *count, uint64_t *cursor) {
+    uint64_t trailer[2];
+    int have_trailer = 0;
+    list_codec_t codec;
+    
+    list_codec_reset(&codec, g_list_query.fields, 0);
+    if (data_size == LENGTH_CHUNKED) {
+        uint32_t chunk_length;
+        for (;;) {
+            if (read_full(sock_fd, &chunk_length, sizeof(chunk_length)) != 0) {
+                perror("Error receiving directory entries");
+                return -1;
+            }
+            chunk_length = ntohl(chunk_length);
+            if (chunk_length == 0) {
+                break;
+            }
+            if (g_compact_list) {
+                if (print_records(sock_fd, chunk_length, &codec, trailer, &have_trailer) < 0) {
+                    return -1;
+                }
+            } else if (chunk_length == LIST_TRAILER_SIZE) {
+                if (read_full(sock_fd, trailer, sizeof(trailer)) != 0) {
+                    perror("Error receiving directory entries");
+                    return -1;
+                }
+                trailer[0] = be64toh(trailer[0]);
+                trailer[1] = be64toh(trailer[1]);
+                have_trailer = 1;
+            } else if (print_entries(sock_fd, chunk_length) != 0) {
+                return -1;
+            }
+        }
+    } else if (g_compact_list) {
+        if (print_records(sock_fd, data_size, &codec, trailer, &have_trailer) < 0) {
+            return -1;
+        }
+    } else {
+        if (data_size < LIST_TRAILER_SIZE || print_entries(sock_fd, data_size - LIST_TRAILER_SIZE) != 0 ||
+            read_full(sock_fd, trailer, sizeof(trailer)) != 0) {
+            fprintf(stderr, "Malformed directory listing\n");
+            return -1;
+        }
+        trailer[0] = be64toh(trailer[0]);
+        trailer[1] = be64toh(trailer[1]);
+        have_trailer = 1;
+    }
+    if (!have_trailer) {
+        fprintf(stderr, "Malformed directory listing\n");
+        return -1;
+    }
+    *count = trailer[0];
+    *cursor = trailer[1];
+    return 0;
+}
+
 void client_list_directory(int sock_fd, const char *path) {
-    char buffer[BUFFER_SIZE];
-    size_t data_size;
+    uint64_t data_size;
+    uint64_t cursor = 0;
+    uint64_t total = 0;
     
     printf("Listing directory: %s\n", path);
     
@@ -236,13 +548,27 @@ void client_list_directory(int sock_fd, const char *path) {
         client_authenticate(sock_fd, g_username, g_password);
     }
     
-    // Send LIST request
-    if (send_request(sock_fd, CMD_LIST, path, NULL, 0) != 0) {
+    // Send LIST request, asking for the first page if the server has them,
+    // with the query if there is one; --top entries make a page of their own
+    if (g_list_queried && !(g_list_pages && g_list_queries)) {
+        fprintf(stderr, "Server does not take list queries\n");
+        return;
+    }
+    char page[LIST_PAGE_SIZE + LIST_QUERY_SIZE + LIST_PATTERN_MAX];
+    size_t page_len = g_list_pages ? LIST_PAGE_SIZE : 0;
+    uint64_t start = 0;
+    uint32_t page_size = htonl(g_list_top != 0 ? g_list_top : LIST_PAGE_MAX);
+    memcpy(page, &start, sizeof(start));
+    memcpy(page + sizeof(start), &page_size, sizeof(page_size));
+    if (g_list_queried) {
+        page_len += list_query_encode(&g_list_query, page + LIST_PAGE_SIZE);
+    }
+    if (send_request(sock_fd, CMD_LIST, path, page, page_len) != 0) {
         return;
     }
     
     // Receive response
-    int result = receive_response(sock_fd, buffer, BUFFER_SIZE, &data_size);
+    int result = receive_response(sock_fd, NULL, 0, &data_size);
     if (result == -2) {
         // Authentication required, prompt for credentials if not already set
         if (g_username[0] == '\0') {
@@ -269,29 +595,138 @@ void client_list_directory(int sock_fd, const char *path) {
     }
     
     // Parse and display directory entries
-    int num_entries = data_size / sizeof(file_info_t);
-    file_info_t *entries = (file_info_t *)buffer;
+    if (!g_list_pages && g_compact_list) {
+        list_codec_t codec;
+        uint64_t trailer[2];
+        int have_trailer = 0;
+        list_codec_reset(&codec, LIST_FIELDS_ALL, 0);
+        printf("Directory contents:\n");
+        printf("%-30s %-10s %-20s\n", "Name", "Size", "Type");
+        printf("------------------------------------------------------------\n");
+        int64_t count = print_records(sock_fd, data_size, &codec, trailer, &have_trailer);
+        if (count >= 0) {
+            printf("(%lld entries)\n", (long long)count);
+        }
+        return;
+    }
+    if (!g_list_pages) {
+        printf("Directory contents (%d entries):\n", (int)(data_size / sizeof(file_info_t)));
+        printf("%-30s %-10s %-20s\n", "Name", "Size", "Type");
+        printf("------------------------------------------------------------\n");
+        print_entries(sock_fd, data_size);
+        return;
+    }
     
-    printf("Directory contents (%d entries):\n", num_entries);
+    // Each page ends with a cursor to ask for the next one from, 0 after the last
+    printf("Directory contents:\n");
     printf("%-30s %-10s %-20s\n", "Name", "Size", "Type");
     printf("------------------------------------------------------------\n");
-    
-    for (int i = 0; i < num_entries; i++) {
-        char time_str[30];
-        struct tm *tm_info = localtime(&entries[i].modified_time);
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
+    for (;;) {
+        uint64_t count;
+        uint64_t asked = cursor;
+        if (receive_list_page(sock_fd, data_size, &count, &cursor) != 0) {
+            return;
+        }
+        total += count;
+        if (cursor == 0 || g_list_top != 0) {
+            break;
+        }
+        if (cursor == asked) {
+            fprintf(stderr, "Directory listing stopped making progress\n");
+            return;
+        }
+        
+        uint64_t next = htobe64(cursor);
+        memcpy(page, &next, sizeof(next));
+        if (send_request(sock_fd, CMD_LIST, path, page, page_len) != 0 ||
+            receive_response(sock_fd, NULL, 0, &data_size) != 0) {
+            return;
+        }
+    }
+    printf("(%llu entries)\n", (unsigned long long)total);
+}
+
+// Check whether the server has the codec asked for with -z
+static int use_compression(void) {
+    if (g_codec == COMPRESS_NONE) {
+        return 0;
+    }
+    if (!(g_server_codecs & (1u << g_codec))) {
+        fprintf(stderr, "Server does not offer this compression, transferring uncompressed\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Receive a compressed body, chunks of blocks ending with an empty chunk,
+// and store the file bytes. Returns 0 on success, -1 on failure.
+static int receive_compressed(int sock_fd, int fd, compress_stream_t *cs) {
+    char buffer[CHUNK_BUFFER_SIZE];
+    uint32_t chunk_length;
+    
+    for (;;) {
+        if (read_full(sock_fd, &chunk_length, sizeof(chunk_length)) != 0) {
+            perror("Error receiving data chunk");
+            return -1;
+        }
+        chunk_length = ntohl(chunk_length);
+        if (chunk_length == 0) {
+            break;
+        }
         
-        printf("%-30s %-10zu %-20s %s\n", 
-               entries[i].name, 
-               entries[i].size, 
-               entries[i].is_directory ? "Directory" : "File",
-               time_str);
+        // Blocks may span chunks, the stream keeps any partial one
+        while (chunk_length > 0) {
+            size_t len = chunk_length < sizeof(buffer) ? chunk_length : sizeof(buffer);
+            if (read_full(sock_fd, buffer, len) != 0) {
+                perror("Error receiving data chunk");
+                return -1;
+            }
+            int err = compress_store(cs, fd, buffer, len);
+            if (err != 0) {
+                fprintf(stderr, "Error storing data: %s\n", strerror(err));
+                return -1;
+            }
+            chunk_length -= len;
+        }
+    }
+    
+    if (compress_finish(cs) != 0) {
+        fprintf(stderr, "Compressed data ended inside a block\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Read the CRC32C trailer of a body and compare it with the one computed.
+// Returns 0 if they match, -1 otherwise.
+static int receive_trailer(int sock_fd, uint32_t crc) {
+    uint8_t trailer[CHECKSUM_SIZE];
+    uint8_t expected[CHECKSUM_SIZE];
+    
+    if (read_full(sock_fd, trailer, sizeof(trailer)) != 0) {
+        perror("Error receiving checksum");
+        return -1;
+    }
+    checksum_trailer(crc, expected);
+    if (memcmp(trailer, expected, sizeof(trailer)) != 0) {
+        fprintf(stderr, "Checksum mismatch, the data was damaged in transit\n");
+        return -1;
     }
+    return 0;
 }
 
-void client_get_file(int sock_fd, const char *path, const char *local_path) {
+void client_get_file(int sock_fd, const char *path, const char *local_path, uint64_t offset, uint64_t length) {
     char buffer[BUFFER_SIZE];
-    size_t data_size;
+    uint64_t data_size;
+    const char *mode = "wb";
+    
+    // Resuming continues after whatever an earlier download left behind
+    if (g_continue) {
+        struct stat st;
+        offset = stat(local_path, &st) == 0 ? (uint64_t)st.st_size : 0;
+        length = RANGE_TO_END;
+        mode = "ab";
+    }
     
     printf("Getting file: %s -> %s\n", path, local_path);
     
@@ -300,8 +735,25 @@ void client_get_file(int sock_fd, const char *path, const char *local_path) {
         client_authenticate(sock_fd, g_username, g_password);
     }
     
-    // Send GET request
-    if (send_request(sock_fd, CMD_GET, path, NULL, 0) != 0) {
+    // Send GET request, with a range unless the whole file is wanted.
+    // Servers speaking version 1 ignore the range, so it is never sent to them.
+    int ranged = offset != 0 || length != RANGE_TO_END;
+    if (ranged && g_protocol < PROTOCOL_V2) {
+        fprintf(stderr, "Ranged downloads need protocol version 2, the server speaks %d\n", g_protocol);
+        return;
+    }
+    uint64_t range[2] = { htobe64(offset), htobe64(length) };
+    int compressed = use_compression();
+    if (compressed) {
+        // The codec goes first, the server may still decide to send the file plain
+        char request[GET_CODEC_SIZE + GET_RANGE_SIZE];
+        request[0] = (char)g_codec;
+        memcpy(request + GET_CODEC_SIZE, range, sizeof(range));
+        if (send_request(sock_fd, CMD_GET_COMPRESSED, path, request,
+                         GET_CODEC_SIZE + (ranged ? GET_RANGE_SIZE : 0)) != 0) {
+            return;
+        }
+    } else if (send_request(sock_fd, CMD_GET, path, ranged ? range : NULL, ranged ? GET_RANGE_SIZE : 0) != 0) {
         return;
     }
     
@@ -315,13 +767,36 @@ void client_get_file(int sock_fd, const char *path, const char *local_path) {
     }
     
     // Write to local file streaming
-    FILE *file = fopen(local_path, "wb");
+    FILE *file = fopen(local_path, mode);
     if (file == NULL) {
         perror("Error opening local file");
         return;
     }
     
-    size_t remaining = data_size;
+    // A compressed body is announced with the chunked length
+    if (compressed && data_size == LENGTH_CHUNKED) {
+        compress_stream_t *cs = compress_open(COMPRESS_NONE);
+        int res = cs != NULL ? receive_compressed(sock_fd, fileno(file), cs) : -1;
+        fclose(file);
+        if (res == 0) {
+            printf("File downloaded successfully (%llu bytes, %llu compressed)\n",
+                   (unsigned long long)cs->raw_bytes, (unsigned long long)cs->wire_bytes);
+        }
+        compress_close(cs);
+        return;
+    }
+    
+    // A plain body asked for plainly ends with the checksum trailer
+    int checked = g_checksums && !compressed;
+    if (checked && data_size < CHECKSUM_SIZE) {
+        fprintf(stderr, "Response too short for its checksum\n");
+        fclose(file);
+        return;
+    }
+    uint64_t file_size = checked ? data_size - CHECKSUM_SIZE : data_size;
+    uint32_t crc = 0;
+    
+    uint64_t remaining = file_size;
     while (remaining > 0) {
         size_t to_read = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
         ssize_t bytes_read = read(sock_fd, buffer, to_read);
@@ -335,122 +810,1437 @@ void client_get_file(int sock_fd, const char *path, const char *local_path) {
             fclose(file);
             return;
         }
+        if (checked) {
+            crc = crc32c(crc, buffer, bytes_read);
+        }
         remaining -= bytes_read;
     }
     
     fclose(file);
-    printf("File downloaded successfully (%zu bytes)\n", data_size);
+    if (checked && receive_trailer(sock_fd, crc) != 0) {
+        return;
+    }
+    printf("File downloaded successfully (%llu bytes)\n", (unsigned long long)file_size);
 }
 
-void client_put_file(int sock_fd, const char *path, const char *local_path) {
-    char buffer[BUFFER_SIZE];
-    size_t data_size;
-    
-    // Check if path ends with a slash (directory)
-    size_t path_len = strlen(path);
-    if (path_len > 0 && path[path_len - 1] == '/') {
-        fprintf(stderr, "Error: Cannot write to a directory path. Please specify a file path.\n");
-        return;
+static int pwrite_full(int fd, const void *buffer, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t w = pwrite(fd, (const char *)buffer + done, size - done, (off_t)(offset + done));
+        if (w < 0) {
+            return -1;
+        }
+        done += w;
     }
-    
-    printf("Putting file: %s -> %s\n", local_path, path);
-    
-        // Try to authenticate first if credentials are available
-    if (g_username[0] != '\0' && g_password[0] != '\0') {
-        client_authenticate(sock_fd, g_username, g_password);
+    return 0;
+}
+
+// Claim the next stripe. Returns 0 with its range, -1 when none are left.
+static int next_stripe(stripe_job_t *job, uint64_t *offset, uint64_t *length) {
+    uint64_t index = atomic_fetch_add(&job->next_stripe, 1);
+    if (index >= job->num_stripes) {
+        return -1;
     }
-    
-    // Read local file
-    FILE *file = fopen(local_path, "rb");
-    if (file == NULL) {
-        perror("Error opening local file");
-        return;
+    *offset = job->stripes != NULL ? job->stripes[index] : index * job->stripe_size;
+    *length = job->size - *offset < job->stripe_size ? job->size - *offset : job->stripe_size;
+    return 0;
+}
+
+static void *stripe_get_worker(void *arg) {
+    stripe_stream_t *stream = arg;
+    stripe_job_t *job = stream->job;
+    char *buffer = malloc(STRIPE_BUFFER_SIZE);
+    
+    if (buffer == NULL) {
+        atomic_store(&job->failed, 1);
+        return NULL;
     }
     
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    if (file_size < 0) {
-        fprintf(stderr, "Invalid file size\n");
-        fclose(file);
-        return;
+    uint64_t offset, length;
+    while (!atomic_load(&job->failed) && next_stripe(job, &offset, &length) == 0) {
+        uint64_t range[2] = { htobe64(offset), htobe64(length) };
+        uint64_t data_size;
+        
+        if (send_request(stream->sock_fd, CMD_GET, job->path, range, GET_RANGE_SIZE) != 0 ||
+            receive_response(stream->sock_fd, NULL, 0, &data_size) != 0) {
+            atomic_store(&job->failed, 1);
+            break;
+        }
+        if (data_size != length + (g_checksums ? CHECKSUM_SIZE : 0)) {
+            fprintf(stderr, "Remote file changed size during download\n");
+            atomic_store(&job->failed, 1);
+            break;
+        }
+        
+        // Each stripe lands at its own offset, so streams never wait on each other
+        uint32_t crc = 0;
+        while (length > 0 && !atomic_load(&job->failed)) {
+            size_t to_read = length < STRIPE_BUFFER_SIZE ? length : STRIPE_BUFFER_SIZE;
+            ssize_t bytes_read = read(stream->sock_fd, buffer, to_read);
+            if (bytes_read <= 0) {
+                perror("Error receiving data chunk");
+                atomic_store(&job->failed, 1);
+                break;
+            }
+            if (pwrite_full(job->file_fd, buffer, bytes_read, offset) != 0) {
+                perror("Error writing to local file");
+                atomic_store(&job->failed, 1);
+                break;
+            }
+            if (g_checksums) {
+                crc = crc32c(crc, buffer, bytes_read);
+            }
+            offset += bytes_read;
+            length -= bytes_read;
+        }
+        if (g_checksums && length == 0 && receive_trailer(stream->sock_fd, crc) != 0) {
+            atomic_store(&job->failed, 1);
+        }
     }
     
-    // Send PUT request header only
-    if (send_request(sock_fd, CMD_PUT, path, NULL, file_size) != 0) {
-        fclose(file);
-        return;
+    free(buffer);
+    return NULL;
+}
+
+// Split the job into stripes. Returns how many of 'streams' are worth
+// using, there's no point in having more than there are stripes.
+static int prepare_stripes(stripe_job_t *job, int streams) {
+    if (job->stripes == NULL) {
+        job->num_stripes = (job->size + job->stripe_size - 1) / job->stripe_size;
     }
-    
-    // Stream file content chunks
-    size_t remaining = file_size;
-    while (remaining > 0) {
-        size_t bytes_read = fread(buffer, 1, remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE, file);
-        if (bytes_read == 0) {
-            perror("Error reading local file chunk");
-            fclose(file);
-            return;
+    if ((uint64_t)streams > job->num_stripes) {
+        streams = job->num_stripes > 0 ? (int)job->num_stripes : 1;
+    }
+    atomic_init(&job->next_stripe, 0);
+    atomic_init(&job->failed, 0);
+    return streams;
+}
+
+// Move a file over up to 'streams' connections, sock_fd being the first.
+// Returns the number of connections used, 0 if the transfer failed.
+static int run_stripes(stripe_job_t *job, int sock_fd, int streams, void *(*worker)(void *), double *seconds) {
+    stripe_stream_t stream[MAX_STREAMS];
+    struct timespec start, end;
+    
+    streams = prepare_stripes(job, streams);
+    
+    // Connect and log in one by one, only the transfers run concurrently
+    int opened = 1;
+    stream[0].sock_fd = sock_fd;
+    for (; opened < streams; opened++) {
+        stream[opened].sock_fd = connect_to_server(g_host, g_port);
+        if (stream[opened].sock_fd < 0) {
+            break;
         }
-        size_t written = 0;
-        while (written < bytes_read) {
-            ssize_t sent = write(sock_fd, buffer + written, bytes_read - written);
-            if (sent < 0) {
-                perror("Error sending local file chunk");
-                fclose(file);
-                return;
-            }
-            written += sent;
+        if (g_username[0] != '\0' && g_password[0] != '\0') {
+            client_authenticate(stream[opened].sock_fd, g_username, g_password);
         }
-        remaining -= bytes_read;
     }
-    fclose(file);
     
-    // Receive response OK status
-    int result = receive_response(sock_fd, buffer, BUFFER_SIZE, &data_size);
-    if (result == -2) {
-        // ... Handled in other paths mostly natively or we prompt ...
-        return;
-    } else if (result != 0) {
-        return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (; started < opened; started++) {
+        stream[started].job = job;
+        if (pthread_create(&stream[started].thread, NULL, worker, &stream[started]) != 0) {
+            break;
+        }
     }
+    for (int i = 0; i < started; i++) {
+        pthread_join(stream[i].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
     
-    // Display success message
-    if (data_size > 0 && data_size < BUFFER_SIZE) {
-        buffer[data_size] = '\0';
-        printf("%s\n", buffer);
-    } else {
-        printf("Upload completed successfully.\n");
+    for (int i = 1; i < opened; i++) {
+        close(stream[i].sock_fd);
     }
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return atomic_load(&job->failed) ? 0 : started;
 }
 
-void client_delete_file(int sock_fd, const char *path) {
-    char buffer[BUFFER_SIZE];
-    size_t data_size;
-    
-    printf("Deleting: %s\n", path);
-    
-        // Try to authenticate first if credentials are available
-    if (g_username[0] != '\0' && g_password[0] != '\0') {
-        client_authenticate(sock_fd, g_username, g_password);
+// One stripe of a multiplexed transfer
+typedef struct {
+    uint32_t id;          // Stream carrying the stripe, 0 while the slot is idle
+    uint64_t offset;      // Next byte to receive or send
+    uint64_t remaining;   // Bytes still to move
+    uint64_t window;      // Uploads: DATA bytes the server has room for
+    int answered;         // Downloads: the response header has arrived
+} mux_stripe_t;
+
+// Frames on their way in and out of a multiplexed connection
+typedef struct {
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len;
+} mux_buffers_t;
+
+// Append a frame to the output. Returns where its payload goes, NULL if it doesn't fit yet.
+static char *queue_frame(mux_buffers_t *b, uint8_t type, uint32_t stream, uint32_t length) {
+    if (MUX_OUTPUT_SIZE - b->out_len < FRAME_HEADER_SIZE + (size_t)length) {
+        return NULL;
     }
-    
-    // Send DELETE request
-    if (send_request(sock_fd, CMD_DELETE, path, NULL, 0) != 0) {
+    char *frame = b->out + b->out_len;
+    encode_frame_header(frame, type, stream, length);
+    b->out_len += FRAME_HEADER_SIZE + length;
+    return frame + FRAME_HEADER_SIZE;
+}
+
+static int pread_full(int fd, void *buffer, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t r = pread(fd, (char *)buffer + done, size - done, (off_t)(offset + done));
+        if (r <= 0) {
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+// Start the next stripe on an idle slot: a ranged GET, or an UPLOAD_WRITE
+// whose chunk follows as DATA frames
+static void open_stripe(stripe_job_t *job, mux_buffers_t *b, mux_stripe_t *st, int upload) {
+    size_t path_len = upload ? 0 : strlen(job->path);
+    size_t request_size = request_header_size(g_protocol) + path_len + 16;
+    uint64_t offset, length;
+    
+    if (MUX_OUTPUT_SIZE - b->out_len < FRAME_HEADER_SIZE + request_size ||
+        next_stripe(job, &offset, &length) != 0) {
         return;
     }
     
-    // Receive response
-    int result = receive_response(sock_fd, buffer, BUFFER_SIZE, &data_size);
-    if (result == -2) {
-        // Authentication required, prompt for credentials if not already set
-        if (g_username[0] == '\0') {
-            printf("Username: ");
-            fgets(g_username, sizeof(g_username), stdin);
-            g_username[strcspn(g_username, "\n")] = 0; // Remove newline
-        } else {
-            printf("Using username: %s\n", g_username);
+    uint64_t payload[2];
+    st->id = g_next_stream++;
+    st->offset = offset;
+    st->remaining = length;
+    st->window = STREAM_INITIAL_WINDOW;
+    st->answered = 0;
+    char *request = queue_frame(b, FRAME_REQUEST, st->id, (uint32_t)request_size);
+    if (upload) {
+        payload[0] = htobe64(job->upload_id);
+        payload[1] = htobe64(offset);
+        request += encode_request_header(g_protocol, request, CMD_UPLOAD_WRITE, 0, UPLOAD_WRITE_PREFIX + length);
+    } else {
+        payload[0] = htobe64(offset);
+        payload[1] = htobe64(length);
+        request += encode_request_header(g_protocol, request, CMD_GET, path_len, GET_RANGE_SIZE);
+        memcpy(request, job->path, path_len);
+        request += path_len;
+    }
+    memcpy(request, payload, sizeof(payload));
+}
+
+// Queue one DATA frame for every upload stripe the server has room for
+static int queue_upload_data(stripe_job_t *job, mux_buffers_t *b, mux_stripe_t *stripes, int count) {
+    for (int i = 0; i < count; i++) {
+        mux_stripe_t *st = &stripes[i];
+        if (st->id == 0 || st->remaining == 0 || st->window == 0) {
+            continue;
+        }
+        uint64_t len = st->remaining < FRAME_MAX_DATA ? st->remaining : FRAME_MAX_DATA;
+        if (len > st->window) {
+            len = st->window;
+        }
+        char *data = queue_frame(b, FRAME_DATA, st->id, (uint32_t)len);
+        if (data == NULL) {
+            return 0;
+        }
+        if (pread_full(job->file_fd, data, len, st->offset) != 0) {
+            perror("Error reading local file");
+            return -1;
+        }
+        st->offset += len;
+        st->remaining -= len;
+        st->window -= len;
+    }
+    return 0;
+}
+
+// Apply one received frame to its stripe. Returns 0 on success, -1 if the transfer failed.
+static int handle_stripe_frame(stripe_job_t *job, mux_buffers_t *b, mux_stripe_t *stripes, int count,
+                               uint8_t type, uint32_t stream, const char *payload, uint32_t length) {
+    mux_stripe_t *st = NULL;
+    for (int i = 0; i < count && stream != 0; i++) {
+        if (stripes[i].id == stream) {
+            st = &stripes[i];
+        }
+    }
+    if (st == NULL) {
+        fprintf(stderr, "Frame for unknown stream %u\n", stream);
+        return -1;
+    }
+    
+    switch (type) {
+        case FRAME_RESPONSE: {
+            uint8_t status;
+            uint64_t data_size;
+            size_t header_size = response_header_size(g_protocol);
+            if (length < header_size) {
+                fprintf(stderr, "Malformed response\n");
+                return -1;
+            }
+            decode_response_header(g_protocol, payload, &status, &data_size);
+            if (status != RESP_OK) {
+                fprintf(stderr, "Server returned error\nError message: %.*s\n",
+                        (int)(length - header_size), payload + header_size);
+                return -1;
+            }
+            if (st->answered || st->remaining == 0) {
+                st->id = 0;  // Upload chunk stored
+                return 0;
+            }
+            if (data_size != st->remaining) {
+                fprintf(stderr, "Remote file changed size during download\n");
+                return -1;
+            }
+            st->answered = 1;
+            return 0;
+        }
+        
+        case FRAME_DATA: {
+            if (!st->answered || length > st->remaining) {
+                fprintf(stderr, "Unexpected data on stream %u\n", stream);
+                return -1;
+            }
+            if (pwrite_full(job->file_fd, payload, length, st->offset) != 0) {
+                perror("Error writing to local file");
+                return -1;
+            }
+            st->offset += length;
+            st->remaining -= length;
+            if (st->remaining == 0) {
+                st->id = 0;
+                return 0;
+            }
+            // Consumed data makes room for as much again
+            uint32_t increment = htonl(length);
+            char *window = queue_frame(b, FRAME_WINDOW, stream, sizeof(increment));
+            if (window == NULL) {
+                fprintf(stderr, "Too much output pending\n");
+                return -1;
+            }
+            memcpy(window, &increment, sizeof(increment));
+            return 0;
+        }
+        
+        case FRAME_WINDOW: {
+            uint32_t increment;
+            if (length != sizeof(increment)) {
+                fprintf(stderr, "Malformed window update\n");
+                return -1;
+            }
+            memcpy(&increment, payload, sizeof(increment));
+            st->window += ntohl(increment);
+            return 0;
+        }
+        
+        default:
+            fprintf(stderr, "Server cancelled stream %u\n", stream);
+            return -1;
+    }
+}
+
+// Move a file as up to 'streams' concurrent streams of one multiplexed
+// connection, each stripe a stream of its own. A single thread keeps reading
+// while it writes, so neither side ever waits on the other.
+// Returns the number of streams used, 0 if the transfer failed.
+static int run_mux_stripes(stripe_job_t *job, int sock_fd, int streams, int upload, double *seconds) {
+    mux_stripe_t stripes[MAX_STREAMS];
+    mux_buffers_t b;
+    struct timespec start, end;
+    int failed = 0;
+    
+    // The server runs a limited number of transfers per connection
+    streams = prepare_stripes(job, streams < STREAM_LIMIT ? streams : STREAM_LIMIT);
+    memset(stripes, 0, sizeof(stripes));
+    b.in = malloc(MUX_INPUT_SIZE);
+    b.out = malloc(MUX_OUTPUT_SIZE);
+    b.in_len = 0;
+    b.out_len = 0;
+    if (b.in == NULL || b.out == NULL) {
+        free(b.in);
+        free(b.out);
+        return 0;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!failed) {
+        int active = 0;
+        for (int i = 0; i < streams; i++) {
+            if (stripes[i].id == 0) {
+                open_stripe(job, &b, &stripes[i], upload);
+            }
+            active += stripes[i].id != 0;
+        }
+        if (active == 0) {
+            break;
+        }
+        if (upload && queue_upload_data(job, &b, stripes, streams) != 0) {
+            failed = 1;
+            break;
+        }
+        
+        struct pollfd pfd = { sock_fd, POLLIN | (b.out_len > 0 ? POLLOUT : 0), 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for the server");
+            failed = 1;
+            break;
+        }
+        
+        if (pfd.revents & POLLOUT) {
+            ssize_t w = send(sock_fd, b.out, b.out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Error sending to the server");
+                failed = 1;
+                break;
+            }
+            if (w > 0) {
+                memmove(b.out, b.out + w, b.out_len - w);
+                b.out_len -= w;
+            }
+        }
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        
+        ssize_t r = recv(sock_fd, b.in + b.in_len, MUX_INPUT_SIZE - b.in_len, MSG_DONTWAIT);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            fprintf(stderr, "Connection to the server lost\n");
+            failed = 1;
+            break;
+        }
+        b.in_len += r > 0 ? r : 0;
+        
+        // Handle every complete frame, a partial one waits for the rest
+        size_t pos = 0;
+        while (!failed && b.in_len - pos >= FRAME_HEADER_SIZE) {
+            uint8_t type;
+            uint32_t stream, length;
+            decode_frame_header(b.in + pos, &type, &stream, &length);
+            if (FRAME_HEADER_SIZE + (size_t)length > MUX_INPUT_SIZE) {
+                fprintf(stderr, "Frame too large\n");
+                failed = 1;
+                break;
+            }
+            if (b.in_len - pos < FRAME_HEADER_SIZE + length) {
+                break;
+            }
+            failed = handle_stripe_frame(job, &b, stripes, streams, type, stream,
+                                         b.in + pos + FRAME_HEADER_SIZE, length) != 0;
+            pos += FRAME_HEADER_SIZE + length;
+        }
+        memmove(b.in, b.in + pos, b.in_len - pos);
+        b.in_len -= pos;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    free(b.in);
+    free(b.out);
+    *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return failed ? 0 : streams;
+}
+
+// Receive an INFO answer, a file_info_t or a compact record, whichever the
+// connection agreed on. Returns 0 on success, -1 on failure.
+static int receive_info(int sock_fd, file_info_t *info) {
+    uint8_t answer[sizeof(file_info_t) + LIST_RECORD_MAX];
+    uint64_t data_size;
+    
+    if (receive_response(sock_fd, answer, sizeof(answer), &data_size) != 0) {
+        return -1;
+    }
+    if (g_compact_list) {
+        list_codec_t codec;
+        uint64_t trailer[2];
+        size_t used;
+        list_codec_reset(&codec, LIST_FIELDS_ALL, 1);
+        int type = list_decode_record(&codec, answer, data_size, info, trailer, &used);
+        if ((type == LIST_RECORD_FILE || type == LIST_RECORD_DIRECTORY) && used == data_size) {
+            return 0;
+        }
+        fprintf(stderr, "Malformed file information\n");
+        return -1;
+    }
+    if (data_size != sizeof(*info)) {
+        fprintf(stderr, "Malformed file information\n");
+        return -1;
+    }
+    memcpy(info, answer, sizeof(*info));
+    return 0;
+}
+
+void client_get_file_parallel(int sock_fd, const char *path, const char *local_path, int streams) {
+    file_info_t info;
+    stripe_job_t job;
+    
+    // Stripes are ranged GETs, older servers get the whole file over one connection
+    if (g_protocol < PROTOCOL_V2) {
+        fprintf(stderr, "Parallel downloads need protocol version 2, using a single connection\n");
+        client_get_file(sock_fd, path, local_path, 0, RANGE_TO_END);
+        return;
+    }
+    
+    printf("Getting file: %s -> %s\n", path, local_path);
+    
+    if (g_username[0] != '\0' && g_password[0] != '\0') {
+        client_authenticate(sock_fd, g_username, g_password);
+    }
+    
+    if (send_request(sock_fd, CMD_INFO, path, NULL, 0) != 0 || receive_info(sock_fd, &info) != 0) {
+        return;
+    }
+    if (info.is_directory) {
+        fprintf(stderr, "Error: %s is not a file\n", path);
+        return;
+    }
+    
+    job.path = path;
+    job.size = info.size;
+    job.stripe_size = STRIPE_SIZE;
+    job.stripes = NULL;
+    job.upload_id = 0;
+    job.file_fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job.file_fd < 0) {
+        perror("Error opening local file");
+        return;
+    }
+    if (ftruncate(job.file_fd, (off_t)info.size) != 0) {
+        perror("Error sizing local file");
+        close(job.file_fd);
+        return;
+    }
+    
+    double seconds;
+    int multiplexed = g_multiplex && enable_multiplexing(sock_fd) == 0;
+    int used = multiplexed ? run_mux_stripes(&job, sock_fd, streams, 0, &seconds)
+                           : run_stripes(&job, sock_fd, streams, stripe_get_worker, &seconds);
+    if (close(job.file_fd) != 0) {
+        perror("Error writing to local file");
+        return;
+    }
+    if (used == 0) {
+        fprintf(stderr, "Error: download of %s failed\n", path);
+        return;
+    }
+    
+    printf("File downloaded successfully (%llu bytes over %d %s%s, %.1f MB/s)\n",
+           (unsigned long long)info.size, used, multiplexed ? "stream" : "connection", used == 1 ? "" : "s",
+           seconds > 0 ? info.size / seconds / (1024 * 1024) : 0.0);
+}
+
+// Send a file as a compressed PUT, one block per chunk.
+// Returns 0 once the payload is sent, -1 on failure.
+static int send_compressed(int sock_fd, const char *path, FILE *file, compress_stream_t *cs) {
+    if (send_request(sock_fd, CMD_PUT_COMPRESSED, path, NULL, LENGTH_CHUNKED) != 0) {
+        return -1;
+    }
+    
+    for (;;) {
+        size_t len = fread(cs->raw, 1, COMPRESS_BLOCK_SIZE, file);
+        if (len == 0 && ferror(file)) {
+            perror("Error reading local file chunk");
+            return -1;
+        }
+        
+        // End of input is sent as the empty chunk
+        size_t block_size = len > 0 ? compress_block(cs, cs->raw, len, cs->block) : 0;
+        uint32_t chunk_length = htonl((uint32_t)block_size);
+        if (write_full(sock_fd, &chunk_length, sizeof(chunk_length)) != 0 ||
+            write_full(sock_fd, cs->block, block_size) != 0) {
+            perror("Error sending local file chunk");
+            return -1;
+        }
+        if (len == 0) {
+            return 0;
+        }
+    }
+}
+
+void client_put_file(int sock_fd, const char *path, const char *local_path) {
+    char buffer[BUFFER_SIZE];
+    uint64_t data_size;
+    
+    // Check if path ends with a slash (directory)
+    size_t path_len = strlen(path);
+    if (path_len > 0 && path[path_len - 1] == '/') {
+        fprintf(stderr, "Error: Cannot write to a directory path. Please specify a file path.\n");
+        return;
+    }
+    
+    printf("Putting file: %s -> %s\n", local_path, path);
+    
+        // Try to authenticate first if credentials are available
+    if (g_username[0] != '\0' && g_password[0] != '\0') {
+        client_authenticate(sock_fd, g_username, g_password);
+    }
+    
+    // Read local file, "-" is standard input
+    FILE *file = strcmp(local_path, "-") == 0 ? stdin : fopen(local_path, "rb");
+    if (file == NULL) {
+        perror("Error opening local file");
+        return;
+    }
+    
+    // Get file size. Pipes and other streams have none, they are sent in
+    // chunks, which needs protocol version 2.
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        perror("Error reading local file size");
+        if (file != stdin) fclose(file);
+        return;
+    }
+    int chunked = !S_ISREG(st.st_mode);
+    uint64_t file_size = chunked ? LENGTH_CHUNKED : (uint64_t)st.st_size;
+    if (chunked && g_protocol < PROTOCOL_V2) {
+        fprintf(stderr, "Server does not support uploads of unknown size\n");
+        if (file != stdin) fclose(file);
+        return;
+    }
+    
+    if (use_compression()) {
+        compress_stream_t *cs = compress_open(g_codec);
+        int res = cs != NULL ? send_compressed(sock_fd, path, file, cs) : -1;
+        if (file != stdin) fclose(file);
+        if (res == 0 && receive_response(sock_fd, buffer, BUFFER_SIZE, &data_size) == 0) {
+            printf("File uploaded successfully (%llu bytes, %llu compressed)\n",
+                   (unsigned long long)cs->raw_bytes, (unsigned long long)cs->wire_bytes);
+        }
+        compress_close(cs);
+        return;
+    }
+    
+    // Send PUT request header only, the checksum trailer counts towards the length
+    uint64_t data_length = chunked || !g_checksums ? file_size : file_size + CHECKSUM_SIZE;
+    if (send_request(sock_fd, CMD_PUT, path, NULL, data_length) != 0) {
+        if (file != stdin) fclose(file);
+        return;
+    }
+    
+    // Stream file content chunks
+    uint32_t crc = 0;
+    uint64_t remaining = file_size;
+    while (remaining > 0) {
+        size_t bytes_read = fread(buffer, 1, remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE, file);
+        if (bytes_read == 0 && chunked && !ferror(file)) {
+            break;  // End of input, the empty chunk below ends the payload
+        }
+        if (bytes_read == 0) {
+            perror("Error reading local file chunk");
+            if (file != stdin) fclose(file);
+            return;
+        }
+        uint32_t chunk_length = htonl(bytes_read);
+        if ((chunked && write_full(sock_fd, &chunk_length, sizeof(chunk_length)) != 0) ||
+            write_full(sock_fd, buffer, bytes_read) != 0) {
+            perror("Error sending local file chunk");
+            if (file != stdin) fclose(file);
+            return;
+        }
+        if (g_checksums) {
+            crc = crc32c(crc, buffer, bytes_read);
+        }
+        if (!chunked) {
+            remaining -= bytes_read;
+        }
+    }
+    if (file != stdin) fclose(file);
+    
+    // The trailer goes last, in a chunk of its own when the payload is chunked
+    uint32_t trailer_length = htonl(CHECKSUM_SIZE);
+    uint8_t trailer[CHECKSUM_SIZE];
+    checksum_trailer(crc, trailer);
+    if (g_checksums &&
+        ((chunked && write_full(sock_fd, &trailer_length, sizeof(trailer_length)) != 0) ||
+         write_full(sock_fd, trailer, sizeof(trailer)) != 0)) {
+        perror("Error sending checksum");
+        return;
+    }
+    
+    uint32_t end_of_chunks = 0;
+    if (chunked && write_full(sock_fd, &end_of_chunks, sizeof(end_of_chunks)) != 0) {
+        perror("Error sending local file chunk");
+        return;
+    }
+    
+    // Receive response OK status
+    int result = receive_response(sock_fd, buffer, BUFFER_SIZE, &data_size);
+    if (result == -2) {
+        // ... Handled in other paths mostly natively or we prompt ...
+        return;
+    } else if (result != 0) {
+        return;
+    }
+    
+    // Display success message
+    if (data_size > 0 && data_size < BUFFER_SIZE) {
+        buffer[data_size] = '\0';
+        printf("%s\n", buffer);
+    } else {
+        printf("Upload completed successfully.\n");
+    }
+}
+
+static void *stripe_put_worker(void *arg) {
+    stripe_stream_t *stream = arg;
+    stripe_job_t *job = stream->job;
+    char buffer[BUFFER_SIZE];
+    
+    uint64_t offset, length;
+    while (!atomic_load(&job->failed) && next_stripe(job, &offset, &length) == 0) {
+        // The chunk's payload is its session and offset, then the file data
+        char header[REQUEST_HEADER_MAX];
+        uint64_t prefix[2] = { htobe64(job->upload_id), htobe64(offset) };
+        size_t header_size = encode_request_header(g_protocol, header, CMD_UPLOAD_WRITE, 0,
+                                                   UPLOAD_WRITE_PREFIX + length);
+        if (write_full(stream->sock_fd, header, header_size) != 0 ||
+            write_full(stream->sock_fd, prefix, sizeof(prefix)) != 0) {
+            perror("Error sending request header");
+            atomic_store(&job->failed, 1);
+            break;
+        }
+        off_t file_offset = (off_t)offset;
+        while (length > 0) {
+            ssize_t w = sendfile(stream->sock_fd, job->file_fd, &file_offset, length);
+            if (w <= 0) {
+                perror("Error sending local file chunk");
+                atomic_store(&job->failed, 1);
+                break;
+            }
+            length -= w;
+        }
+        
+        uint64_t data_size;
+        if (length > 0 || receive_response(stream->sock_fd, buffer, sizeof(buffer), &data_size) != 0) {
+            atomic_store(&job->failed, 1);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Look for an unfinished upload to path. If it is for a file of the same
+// size, the job is set up to send only the stripes the server lacks.
+// Returns 1 if the upload can be resumed, 0 if it has to start over.
+static int resume_upload(int sock_fd, stripe_job_t *job) {
+    char buffer[BUFFER_SIZE];
+    char header[RESPONSE_HEADER_MAX];
+    uint8_t status;
+    uint64_t data_size;
+    
+    if (send_request(sock_fd, CMD_UPLOAD_STATUS, job->path, NULL, 0) != 0 ||
+        read_full(sock_fd, header, response_header_size(g_protocol)) != 0) {
+        return 0;
+    }
+    decode_response_header(g_protocol, header, &status, &data_size);
+    uint64_t *answer = malloc(data_size > 0 ? data_size : 1);
+    if (answer == NULL || read_full(sock_fd, answer, data_size) != 0) {
+        free(answer);
+        return 0;
+    }
+    if (status != RESP_OK || data_size < UPLOAD_STATUS_SIZE || (data_size - UPLOAD_STATUS_SIZE) % 16 != 0) {
+        free(answer);
+        return 0;  // Nothing to resume
+    }
+    
+    uint64_t id = answer[0];
+    uint64_t size = be64toh(answer[1]);
+    uint64_t chunk_size = be64toh(answer[2]);
+    if (size != job->size || chunk_size == 0) {
+        // Left over from a different file, it's of no use any more
+        printf("Discarding an earlier upload of %llu bytes\n", (unsigned long long)size);
+        if (send_request(sock_fd, CMD_UPLOAD_ABORT, "", &id, sizeof(id)) == 0) {
+            receive_response(sock_fd, buffer, sizeof(buffer), &data_size);
+        }
+        free(answer);
+        return 0;
+    }
+    
+    // Every missing extent is made of whole chunks
+    size_t num_extents = (data_size - UPLOAD_STATUS_SIZE) / 16;
+    uint64_t num_stripes = 0;
+    uint64_t missing = 0;
+    for (size_t i = 0; i < num_extents; i++) {
+        uint64_t length = be64toh(answer[4 + 2 * i]);
+        num_stripes += (length + chunk_size - 1) / chunk_size;
+        missing += length;
+    }
+    uint64_t *stripes = malloc((num_stripes > 0 ? num_stripes : 1) * sizeof(uint64_t));
+    if (stripes == NULL) {
+        free(answer);
+        return 0;
+    }
+    uint64_t n = 0;
+    for (size_t i = 0; i < num_extents; i++) {
+        uint64_t offset = be64toh(answer[3 + 2 * i]);
+        uint64_t end = offset + be64toh(answer[4 + 2 * i]);
+        for (; offset < end; offset += chunk_size) {
+            stripes[n++] = offset;
+        }
+    }
+    free(answer);
+    
+    printf("Resuming upload: %llu of %llu bytes still to send\n",
+           (unsigned long long)missing, (unsigned long long)size);
+    job->upload_id = be64toh(id);
+    job->stripe_size = chunk_size;
+    job->stripes = stripes;
+    job->num_stripes = num_stripes;
+    return 1;
+}
+
+// Upload through an upload session: the server writes every stripe in place
+// and only replaces the target once all of them have arrived. An upload that
+// is cut short stays on the server and is picked up again with -c.
+void client_upload_file(int sock_fd, const char *path, const char *local_path, int streams) {
+    char buffer[BUFFER_SIZE];
+    uint64_t data_size;
+    stripe_job_t job;
+    struct stat st;
+    
+    if (g_protocol < PROTOCOL_V2 || strcmp(local_path, "-") == 0) {
+        fprintf(stderr, "Parallel and resumable uploads need a local file and protocol version 2, "
+                        "using a single connection\n");
+        client_put_file(sock_fd, path, local_path);
+        return;
+    }
+    
+    printf("Putting file: %s -> %s\n", local_path, path);
+    
+    if (g_username[0] != '\0' && g_password[0] != '\0') {
+        client_authenticate(sock_fd, g_username, g_password);
+    }
+    
+    job.path = path;
+    job.file_fd = open(local_path, O_RDONLY);
+    if (job.file_fd < 0 || fstat(job.file_fd, &st) != 0) {
+        perror("Error opening local file");
+        if (job.file_fd >= 0) close(job.file_fd);
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: %s is not a regular file\n", local_path);
+        close(job.file_fd);
+        return;
+    }
+    job.size = (uint64_t)st.st_size;
+    job.stripe_size = STRIPE_SIZE;
+    job.stripes = NULL;
+    
+    if (!g_continue || !resume_upload(sock_fd, &job)) {
+        uint64_t params[2] = { htobe64(job.size), htobe64(STRIPE_SIZE) };
+        if (send_request(sock_fd, CMD_UPLOAD_BEGIN, path, params, sizeof(params)) != 0 ||
+            receive_response(sock_fd, buffer, sizeof(buffer), &data_size) != 0) {
+            close(job.file_fd);
+            return;
+        }
+        if (data_size != UPLOAD_ID_SIZE) {
+            fprintf(stderr, "Invalid response to upload request\n");
+            close(job.file_fd);
+            return;
+        }
+        memcpy(&job.upload_id, buffer, sizeof(job.upload_id));
+        job.upload_id = be64toh(job.upload_id);
+    }
+    
+    double seconds;
+    int multiplexed = g_multiplex && enable_multiplexing(sock_fd) == 0;
+    int used = multiplexed ? run_mux_stripes(&job, sock_fd, streams, 1, &seconds)
+                           : run_stripes(&job, sock_fd, streams, stripe_put_worker, &seconds);
+    close(job.file_fd);
+    free((void *)job.stripes);
+    if (used == 0) {
+        fprintf(stderr, "Error: upload of %s was interrupted, run again with -c to resume it\n", local_path);
+        return;
+    }
+    
+    uint64_t id = htobe64(job.upload_id);
+    if (send_request(sock_fd, CMD_UPLOAD_COMMIT, "", &id, sizeof(id)) != 0 ||
+        receive_response(sock_fd, buffer, sizeof(buffer), &data_size) != 0) {
+        fprintf(stderr, "Error: upload of %s failed\n", local_path);
+        return;
+    }
+    
+    printf("File uploaded successfully (%llu bytes over %d %s%s, %.1f MB/s)\n",
+           (unsigned long long)job.size, used, multiplexed ? "stream" : "connection", used == 1 ? "" : "s",
+           seconds > 0 ? job.size / seconds / (1024 * 1024) : 0.0);
+}
+
+// A chunk of a file being deduplicated
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    int send;        // Missing on the server and the first chunk with its hash
+} dedup_chunk_t;
+
+static const uint8_t *g_dedup_hashes;  // Hashes qsort() compares chunk indexes by
+
+static int compare_chunk_hashes(const void *a, const void *b) {
+    size_t i = *(const size_t *)a;
+    size_t j = *(const size_t *)b;
+    int res = memcmp(g_dedup_hashes + i * CHUNK_HASH_SIZE, g_dedup_hashes + j * CHUNK_HASH_SIZE, CHUNK_HASH_SIZE);
+    return res != 0 ? res : (i > j) - (i < j);
+}
+
+// Mark the chunks to send: those the server lacks, and of chunks that occur
+// more than once in the file only the first. Returns the bytes to send.
+static uint64_t pick_missing_chunks(dedup_chunk_t *chunks, const uint8_t *hashes,
+                                    const uint8_t *present, size_t count) {
+    size_t *order = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].send = !(present[i / 8] & (1u << (i % 8)));
+        if (order != NULL) {
+            order[i] = i;
+        }
+    }
+    if (order != NULL) {
+        g_dedup_hashes = hashes;
+        qsort(order, count, sizeof(size_t), compare_chunk_hashes);
+        for (size_t k = 1; k < count; k++) {
+            if (memcmp(hashes + order[k] * CHUNK_HASH_SIZE, hashes + order[k - 1] * CHUNK_HASH_SIZE,
+                       CHUNK_HASH_SIZE) == 0) {
+                chunks[order[k]].send = 0;
+            }
+        }
+        free(order);
+    }
+    for (size_t i = 0; i < count; i++) {
+        bytes += chunks[i].send ? chunks[i].length : 0;
+    }
+    return bytes;
+}
+
+// Send the marked chunks with CHUNK_STORE, keeping a few requests in flight.
+// Returns 0 once the server has stored all of them, -1 on failure.
+static int store_missing_chunks(int sock_fd, const uint8_t *data, const dedup_chunk_t *chunks,
+                                const uint8_t *hashes, size_t count) {
+    char buffer[BUFFER_SIZE];
+    uint64_t data_size;
+    size_t in_flight = 0;
+    
+    for (size_t i = 0; i <= count; i++) {
+        // Collect answers until there's room for the next request, at the end all of them
+        while (in_flight > 0 && (in_flight == DEDUP_PIPELINE || i == count)) {
+            if (receive_response(sock_fd, buffer, sizeof(buffer), &data_size) != 0) {
+                return -1;
+            }
+            in_flight--;
+        }
+        if (i == count || !chunks[i].send) {
+            continue;
+        }
+        
+        char header[REQUEST_HEADER_MAX];
+        size_t header_size = encode_request_header(g_protocol, header, CMD_CHUNK_STORE, 0,
+                                                   CHUNK_HASH_SIZE + chunks[i].length);
+        if (write_full(sock_fd, header, header_size) != 0 ||
+            write_full(sock_fd, hashes + i * CHUNK_HASH_SIZE, CHUNK_HASH_SIZE) != 0 ||
+            write_full(sock_fd, data + chunks[i].offset, chunks[i].length) != 0) {
+            perror("Error sending chunk");
+            return -1;
+        }
+        in_flight++;
+    }
+    return 0;
+}
+
+// Upload a file as content-defined chunks. The server is asked which chunks
+// its chunk store already holds, only the others are sent, and the server
+// then builds the file from its store.
+void client_dedup_file(int sock_fd, const char *path, const char *local_path) {
+    char buffer[BUFFER_SIZE];
+    uint64_t data_size;
+    struct stat st;
+    
+    if (strcmp(local_path, "-") == 0) {
+        fprintf(stderr, "Deduplicated uploads need a local file, sending it as a whole\n");
+        client_put_file(sock_fd, path, local_path);
+        return;
+    }
+    
+    printf("Putting file: %s -> %s\n", local_path, path);
+    
+    if (g_username[0] != '\0' && g_password[0] != '\0') {
+        client_authenticate(sock_fd, g_username, g_password);
+    }
+    
+    int fd = open(local_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Error opening local file");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: %s is not a regular file\n", local_path);
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Error reading local file");
+            close(fd);
+            return;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    
+    // Cut and hash the whole file first, the server needs the complete list
+    size_t capacity = size / CDC_MIN_SIZE + 1;
+    dedup_chunk_t *chunks = malloc(capacity * sizeof(*chunks));
+    uint8_t *hashes = malloc(capacity * CHUNK_HASH_SIZE);
+    uint8_t *present = NULL;
+    uint8_t *entries = NULL;
+    size_t count = 0;
+    if (chunks == NULL || hashes == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        goto done;
+    }
+    for (size_t offset = 0; offset < size; count++) {
+        size_t length = cdc_next_chunk(data + offset, size - offset);
+        chunks[count].offset = offset;
+        chunks[count].length = (uint32_t)length;
+        sha256(data + offset, length, hashes + count * CHUNK_HASH_SIZE);
+        offset += length;
+    }
+    if (count * CHUNK_ENTRY_SIZE > MAX_CHUNK_LIST) {
+        fprintf(stderr, "Error: %s has too many chunks for a deduplicated upload\n", local_path);
+        goto done;
+    }
+    
+    size_t present_size = (count + 7) / 8 > BUFFER_SIZE ? (count + 7) / 8 : BUFFER_SIZE;
+    present = calloc(present_size, 1);
+    if (present == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        goto done;
+    }
+    if (send_request(sock_fd, CMD_CHUNK_QUERY, "", hashes, count * CHUNK_HASH_SIZE) != 0 ||
+        receive_response(sock_fd, present, present_size, &data_size) != 0) {
+        goto done;
+    }
+    if (data_size != (count + 7) / 8) {
+        fprintf(stderr, "Invalid response to chunk query\n");
+        goto done;
+    }
+    
+    // The file is assembled from each chunk's hash and length, and the
+    // server answers with the size of what it built
+    entries = malloc(count > 0 ? count * CHUNK_ENTRY_SIZE : 1);
+    if (entries == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        goto done;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint32_t length = htonl(chunks[i].length);
+        memcpy(entries + i * CHUNK_ENTRY_SIZE, hashes + i * CHUNK_HASH_SIZE, CHUNK_HASH_SIZE);
+        memcpy(entries + i * CHUNK_ENTRY_SIZE + CHUNK_HASH_SIZE, &length, sizeof(length));
+    }
+    uint64_t sent = pick_missing_chunks(chunks, hashes, present, count);
+    if (store_missing_chunks(sock_fd, data, chunks, hashes, count) != 0 ||
+        send_request(sock_fd, CMD_CHUNK_ASSEMBLE, path, entries, count * CHUNK_ENTRY_SIZE) != 0 ||
+        receive_response(sock_fd, buffer, sizeof(buffer), &data_size) != 0) {
+        fprintf(stderr, "Error: upload of %s failed\n", local_path);
+        goto done;
+    }
+    uint64_t assembled;
+    memcpy(&assembled, buffer, sizeof(assembled));
+    if (data_size != sizeof(assembled) || be64toh(assembled) != size) {
+        fprintf(stderr, "Error: server assembled %s with the wrong size\n", path);
+        goto done;
+    }
+    
+    printf("File uploaded successfully (%llu bytes in %zu chunks, %llu sent)\n",
+           (unsigned long long)size, count, (unsigned long long)sent);
+    
+done:
+    free(entries);
+    free(present);
+    free(hashes);
+    free(chunks);
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+}
+
+// An instruction of a delta: a range of the server's file or of the local one
+typedef struct {
+    int copy;
+    uint64_t offset;
+    uint64_t length;
+} delta_op_t;
+
+typedef struct {
+    delta_op_t *ops;
+    size_t count;
+    size_t capacity;
+    uint64_t literal_bytes;
+} delta_plan_t;
+
+// Append an instruction, extending the previous one where it continues it.
+// Returns 0 on success, -1 if out of memory.
+static int add_delta_op(delta_plan_t *plan, int copy, uint64_t offset, uint64_t length) {
+    delta_op_t *last = plan->count > 0 ? &plan->ops[plan->count - 1] : NULL;
+    if (copy) {
+        if (last != NULL && last->copy && last->offset + last->length == offset) {
+            last->length += length;
+            return 0;
+        }
+    } else {
+        plan->literal_bytes += length;
+    }
+    
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity > 0 ? plan->capacity * 2 : 1024;
+        delta_op_t *ops = realloc(plan->ops, capacity * sizeof(*ops));
+        if (ops == NULL) {
+            return -1;
+        }
+        plan->ops = ops;
+        plan->capacity = capacity;
+    }
+    plan->ops[plan->count].copy = copy;
+    plan->ops[plan->count].offset = offset;
+    plan->ops[plan->count].length = length;
+    plan->count++;
+    return 0;
+}
+
+static int add_literal(delta_plan_t *plan, uint64_t start, uint64_t end) {
+    while (start < end) {
+        uint64_t length = end - start < DELTA_LITERAL_MAX ? end - start : DELTA_LITERAL_MAX;
+        if (add_delta_op(plan, 0, start, length) != 0) {
+            return -1;
+        }
+        start += length;
+    }
+    return 0;
+}
+
+// Check a window of the local file against one of the server's blocks
+static int block_matches(const uint8_t *signature, uint32_t weak, const uint8_t *data, size_t len,
+                         uint8_t strong[DELTA_STRONG_SIZE], int *have_strong) {
+    uint32_t block_weak;
+    memcpy(&block_weak, signature, sizeof(block_weak));
+    if (ntohl(block_weak) != weak) {
+        return 0;
+    }
+    if (!*have_strong) {
+        delta_strong_sum(data, len, strong);
+        *have_strong = 1;
+    }
+    return memcmp(strong, signature + sizeof(block_weak), DELTA_STRONG_SIZE) == 0;
+}
+
+// Work out the delta from the server's blocks to the local file. A window the
+// size of a block slides over the file one byte at a time, and wherever its
+// weak checksum and then its strong hash match a block, the block is reused.
+// Returns 0 on success, -1 if out of memory.
+static int plan_delta(delta_plan_t *plan, const uint8_t *data, uint64_t size,
+                      const uint8_t *signatures, uint64_t base_size, uint32_t block_size) {
+    uint64_t num_full = base_size / block_size;
+    uint8_t strong[DELTA_STRONG_SIZE];
+    
+    // Full blocks are found through their weak checksums, chained per table slot
+    size_t table_size = 1024;
+    while (table_size < 2 * num_full) {
+        table_size *= 2;
+    }
+    uint32_t *heads = calloc(table_size, sizeof(uint32_t));
+    uint32_t *next = malloc((num_full > 0 ? num_full : 1) * sizeof(uint32_t));
+    if (heads == NULL || next == NULL) {
+        free(heads);
+        free(next);
+        return -1;
+    }
+    for (uint64_t i = num_full; i-- > 0;) {
+        uint32_t weak;
+        memcpy(&weak, signatures + i * DELTA_SIGNATURE_SIZE, sizeof(weak));
+        size_t slot = ntohl(weak) & (table_size - 1);
+        next[i] = heads[slot];
+        heads[slot] = (uint32_t)i + 1;
+    }
+    
+    uint64_t pos = 0;
+    uint64_t literal = 0;  // Start of the local bytes not covered yet
+    int res = 0;
+    uint32_t weak = 0;
+    int have_weak = 0;
+    while (res == 0 && num_full > 0 && size - pos >= block_size) {
+        if (!have_weak) {
+            weak = delta_weak_sum(data + pos, block_size);
+            have_weak = 1;
+        }
+        int have_strong = 0;
+        uint32_t match = 0;
+        for (uint32_t k = heads[weak & (table_size - 1)]; k != 0 && match == 0; k = next[k - 1]) {
+            if (block_matches(signatures + (uint64_t)(k - 1) * DELTA_SIGNATURE_SIZE, weak, data + pos,
+                              block_size, strong, &have_strong)) {
+                match = k;
+            }
+        }
+        if (match != 0) {
+            res = add_literal(plan, literal, pos);
+            if (res == 0) {
+                res = add_delta_op(plan, 1, (uint64_t)(match - 1) * block_size, block_size);
+            }
+            pos += block_size;
+            literal = pos;
+            have_weak = 0;
+            continue;
+        }
+        if (size - pos > block_size) {
+            weak = delta_weak_roll(weak, data[pos], data[pos + block_size], block_size);
+        }
+        pos++;
+    }
+    free(heads);
+    free(next);
+    
+    // The server's last block may be short, it can only match the end of the file
+    uint64_t tail = base_size - num_full * block_size;
+    if (res == 0 && tail > 0 && size - literal >= tail) {
+        int have_strong = 0;
+        const uint8_t *end = data + size - tail;
+        if (block_matches(signatures + num_full * DELTA_SIGNATURE_SIZE, delta_weak_sum(end, tail),
+                          end, tail, strong, &have_strong)) {
+            res = add_literal(plan, literal, size - tail);
+            if (res == 0) {
+                res = add_delta_op(plan, 1, num_full * block_size, tail);
+            }
+            literal = size;
+        }
+    }
+    return res == 0 ? add_literal(plan, literal, size) : res;
+}
+
+// Send a planned delta. Instruction headers are gathered in a buffer,
+// literal data goes out straight from the mapped file.
+// Returns 0 on success, -1 on failure.
+static int send_delta(int sock_fd, const char *path, const delta_plan_t *plan, const uint8_t *data,
+                      const uint64_t prefix[3]) {
+    char buffer[BUFFER_SIZE];
+    size_t len = 0;
+    
+    uint64_t payload_size = DELTA_PREFIX;
+    for (size_t i = 0; i < plan->count; i++) {
+        payload_size += plan->ops[i].copy ? DELTA_COPY_SIZE : DELTA_LITERAL_HEADER + plan->ops[i].length;
+    }
+    if (send_request(sock_fd, CMD_DELTA, path, NULL, payload_size) != 0) {
+        return -1;
+    }
+    memcpy(buffer, prefix, DELTA_PREFIX);
+    len = DELTA_PREFIX;
+    
+    for (size_t i = 0; i < plan->count; i++) {
+        const delta_op_t *op = &plan->ops[i];
+        if (len + DELTA_COPY_SIZE > sizeof(buffer)) {
+            if (write_full(sock_fd, buffer, len) != 0) {
+                perror("Error sending delta");
+                return -1;
+            }
+            len = 0;
+        }
+        if (op->copy) {
+            uint64_t range[2] = { htobe64(op->offset), htobe64(op->length) };
+            buffer[len] = DELTA_COPY;
+            memcpy(buffer + len + 1, range, sizeof(range));
+            len += DELTA_COPY_SIZE;
+            continue;
+        }
+        uint32_t length = htonl((uint32_t)op->length);
+        buffer[len] = DELTA_LITERAL;
+        memcpy(buffer + len + 1, &length, sizeof(length));
+        len += DELTA_LITERAL_HEADER;
+        if (write_full(sock_fd, buffer, len) != 0 || write_full(sock_fd, data + op->offset, op->length) != 0) {
+            perror("Error sending delta");
+            return -1;
+        }
+        len = 0;
+    }
+    if (len > 0 && write_full(sock_fd, buffer, len) != 0) {
+        perror("Error sending delta");
+        return -1;
+    }
+    return 0;
+}
+
+// Update a file the server already has. The server sends signatures of its
+// blocks, and only the parts of the local file that match none of them are
+// sent. Without a copy on the server the whole file is uploaded instead.
+void client_sync_file(int sock_fd, const char *path, const char *local_path) {
+    char buffer[BUFFER_SIZE];
+    char header[RESPONSE_HEADER_MAX];
+    uint8_t status;
+    uint64_t data_size;
+    struct stat st;
+    
+    if (strcmp(local_path, "-") == 0) {
+        fprintf(stderr, "Delta updates need a local file, sending it as a whole\n");
+        client_put_file(sock_fd, path, local_path);
+        return;
+    }
+    
+    if (g_username[0] != '\0' && g_password[0] != '\0') {
+        client_authenticate(sock_fd, g_username, g_password);
+    }
+    
+    if (send_request(sock_fd, CMD_SIGNATURES, path, NULL, 0) != 0 ||
+        read_full(sock_fd, header, response_header_size(g_protocol)) != 0) {
+        return;
+    }
+    decode_response_header(g_protocol, header, &status, &data_size);
+    uint8_t *answer = malloc(data_size > 0 ? data_size : 1);
+    if (answer == NULL || read_full(sock_fd, answer, data_size) != 0) {
+        fprintf(stderr, "Error receiving signatures\n");
+        free(answer);
+        return;
+    }
+    if (status != RESP_OK) {
+        free(answer);
+        printf("No copy of %s on the server to update, sending the whole file\n", path);
+        client_put_file(sock_fd, path, local_path);
+        return;
+    }
+    
+    uint64_t base_size, base_mtime;
+    uint32_t block_size = 0;
+    if (data_size >= SIGNATURES_PREFIX) {
+        memcpy(&base_size, answer, sizeof(base_size));
+        memcpy(&base_mtime, answer + 8, sizeof(base_mtime));
+        memcpy(&block_size, answer + 16, sizeof(block_size));
+        base_size = be64toh(base_size);
+        block_size = ntohl(block_size);
+    }
+    if (block_size == 0 ||
+        data_size - SIGNATURES_PREFIX != (base_size + block_size - 1) / block_size * DELTA_SIGNATURE_SIZE) {
+        fprintf(stderr, "Invalid response to signature request\n");
+        free(answer);
+        return;
+    }
+    
+    printf("Updating file: %s -> %s\n", local_path, path);
+    int fd = open(local_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error opening local file %s\n", local_path);
+        if (fd >= 0) close(fd);
+        free(answer);
+        return;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    const uint8_t *data = NULL;
+    if (size > 0 && (data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror("Error reading local file");
+        close(fd);
+        free(answer);
+        return;
+    }
+    close(fd);
+    
+    // The prefix ties the delta to the version the signatures describe
+    delta_plan_t plan = { NULL, 0, 0, 0 };
+    uint64_t prefix[3] = { htobe64(base_size), base_mtime, htobe64(size) };
+    if (plan_delta(&plan, data, size, answer + SIGNATURES_PREFIX, base_size, block_size) != 0) {
+        fprintf(stderr, "Error: out of memory\n");
+    } else if (send_delta(sock_fd, path, &plan, data, prefix) == 0 &&
+               receive_response(sock_fd, buffer, sizeof(buffer), &data_size) == 0) {
+        printf("File updated successfully (%llu bytes, %llu sent)\n",
+               (unsigned long long)size, (unsigned long long)plan.literal_bytes);
+    }
+    
+    free(plan.ops);
+    free(answer);
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+}
+
+static void print_digest(const uint8_t digest[SHA256_DIGEST_SIZE], const char *name, uint64_t size) {
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        printf("%02x", digest[i]);
+    }
+    printf("  %s (%llu bytes)\n", name, (unsigned long long)size);
+}
+
+// Ask the server for a file's digest, and compare it with a local copy's if
+// there is one. Nothing but the digest has to cross the network.
+void client_hash_file(int sock_fd, const char *path, const char *local_path) {
+    uint8_t answer[HASH_ANSWER_SIZE];
+    uint8_t local_digest[SHA256_DIGEST_SIZE];
+    uint64_t data_size;
+    uint64_t size;
+    
+    if (g_username[0] != '\0' && g_password[0] != '\0') {
+        client_authenticate(sock_fd, g_username, g_password);
+    }
+    
+    if (send_request(sock_fd, CMD_HASH, path, NULL, 0) != 0 ||
+        receive_response(sock_fd, answer, sizeof(answer), &data_size) != 0) {
+        return;
+    }
+    if (data_size != HASH_ANSWER_SIZE) {
+        fprintf(stderr, "Invalid response to hash request\n");
+        return;
+    }
+    memcpy(&size, answer, sizeof(size));
+    print_digest(answer + 8, path, be64toh(size));
+    if (local_path == NULL) {
+        return;
+    }
+    
+    int fd = open(local_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error opening local file %s\n", local_path);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int err = file_hash(fd, (uint64_t)st.st_size, cpus > 0 ? (int)cpus : 1, local_digest);
+    close(fd);
+    if (err != 0) {
+        fprintf(stderr, "Error reading local file %s: %s\n", local_path, strerror(err));
+        return;
+    }
+    print_digest(local_digest, local_path, (uint64_t)st.st_size);
+    if (memcmp(local_digest, answer + 8, SHA256_DIGEST_SIZE) == 0) {
+        printf("Files match\n");
+    } else {
+        printf("Files differ\n");
+    }
+}
+
+void client_delete_file(int sock_fd, const char *path) {
+    char buffer[BUFFER_SIZE];
+    uint64_t data_size;
+    
+    printf("Deleting: %s\n", path);
+    
+        // Try to authenticate first if credentials are available
+    if (g_username[0] != '\0' && g_password[0] != '\0') {
+        client_authenticate(sock_fd, g_username, g_password);
+    }
+    
+    // Send DELETE request
+    if (send_request(sock_fd, CMD_DELETE, path, NULL, 0) != 0) {
+        return;
+    }
+    
+    // Receive response
+    int result = receive_response(sock_fd, buffer, BUFFER_SIZE, &data_size);
+    if (result == -2) {
+        // Authentication required, prompt for credentials if not already set
+        if (g_username[0] == '\0') {
+            printf("Username: ");
+            fgets(g_username, sizeof(g_username), stdin);
+            g_username[strcspn(g_username, "\n")] = 0; // Remove newline
+        } else {
+            printf("Using username: %s\n", g_username);
         }
         
         if (g_password[0] == '\0') {
@@ -475,7 +2265,7 @@ void client_delete_file(int sock_fd, const char *path) {
 
 void client_create_directory(int sock_fd, const char *path) {
     char buffer[BUFFER_SIZE];
-    size_t data_size;
+    uint64_t data_size;
     
     printf("Creating directory: %s\n", path);
     
@@ -545,18 +2335,119 @@ void print_usage(const char *program_name) {
     printf("  -p, --port PORT      Server port (default: %d)\n", DEFAULT_PORT);
     printf("  -u, --user USER      Username for authentication\n");
     printf("  -P, --password PASS  Password for authentication\n");
+    printf("  -c, --continue       Resume an interrupted download or upload\n");
+    printf("  -j, --parallel N     Transfer files over N connections at once\n");
+    printf("  -m, --multiplex      Run the -j transfers as streams of a single connection\n");
+    printf("  -z, --compress CODEC Compress single-connection transfers (lz4 or zstd)\n");
+    printf("  -d, --dedup          Upload only the parts of a file the server doesn't have\n");
+    printf("  -s, --sync           Update a file on the server by sending only what changed\n");
+    printf("\nList options:\n");
+    printf("  --match GLOB         List only names matching GLOB\n");
+    printf("  --type f|d           List only files or only directories\n");
+    printf("  --min-size N         List only entries of at least N bytes\n");
+    printf("  --max-size N         List only entries of at most N bytes\n");
+    printf("  --newer T            List only entries modified at or after T (seconds since the epoch)\n");
+    printf("  --older T            List only entries modified at or before T\n");
+    printf("  --sort [-]KEY        Sort by name, size or mtime, - for descending\n");
+    printf("  --top N              List only the first N entries (at most %d)\n", LIST_PAGE_MAX);
+    printf("  --names              List names only\n");
     printf("\nCommands:\n");
     printf("  login USERNAME PASSWORD    Authenticate with the server\n");
     printf("  logout                     Log out from the server\n");
     printf("  list PATH                  List directory contents\n");
-    printf("  get REMOTE_PATH LOCAL_PATH Download a file\n");
-    printf("  put REMOTE_PATH LOCAL_PATH Upload a file\n");
+    printf("  get REMOTE_PATH LOCAL_PATH [OFFSET [LENGTH]]\n");
+    printf("                             Download a file, or LENGTH bytes from OFFSET\n");
+    printf("  put REMOTE_PATH LOCAL_PATH Upload a file (LOCAL_PATH - reads standard input)\n");
+    printf("  hash REMOTE_PATH [LOCAL_PATH]\n");
+    printf("                             Show a file's digest, compare it with a local file\n");
     printf("  delete PATH                Delete a file or directory\n");
     printf("  mkdir PATH                 Create a directory\n");
 }
 
+// Take a list option into g_list_query. Returns the number of arguments
+// used, 0 if the option isn't one, -1 if its value is missing or bad.
+static int parse_list_option(const char *option, const char *value) {
+    dir_filter_t *filter = &g_list_query.filter;
+    char *end;
+    
+    if (strcmp(option, "--names") == 0) {
+        g_list_query.fields = 0;
+        g_list_queried = 1;
+        return 1;
+    }
+    if (strcmp(option, "--match") != 0 && strcmp(option, "--type") != 0 &&
+        strcmp(option, "--min-size") != 0 && strcmp(option, "--max-size") != 0 &&
+        strcmp(option, "--newer") != 0 && strcmp(option, "--older") != 0 &&
+        strcmp(option, "--sort") != 0 && strcmp(option, "--top") != 0) {
+        return 0;
+    }
+    if (value == NULL) {
+        fprintf(stderr, "Error: %s needs a value\n", option);
+        return -1;
+    }
+    
+    if (strcmp(option, "--match") == 0) {
+        if (strlen(value) > LIST_PATTERN_MAX) {
+            fprintf(stderr, "Error: pattern is longer than %d bytes\n", LIST_PATTERN_MAX);
+            return -1;
+        }
+        strcpy(g_list_query.pattern, value);
+        filter->pattern = g_list_query.pattern;
+    } else if (strcmp(option, "--type") == 0) {
+        if (strcmp(value, "f") == 0) {
+            filter->type = DIR_FILTER_FILES;
+        } else if (strcmp(value, "d") == 0) {
+            filter->type = DIR_FILTER_DIRECTORIES;
+        } else {
+            fprintf(stderr, "Error: --type is f or d\n");
+            return -1;
+        }
+    } else if (strcmp(option, "--sort") == 0) {
+        g_list_query.descending = value[0] == '-';
+        const char *key = value + g_list_query.descending;
+        if (strcmp(key, "name") == 0) {
+            g_list_query.sort = LIST_SORT_NAME;
+        } else if (strcmp(key, "size") == 0) {
+            g_list_query.sort = LIST_SORT_SIZE;
+        } else if (strcmp(key, "mtime") == 0) {
+            g_list_query.sort = LIST_SORT_MTIME;
+        } else {
+            fprintf(stderr, "Error: --sort is name, size or mtime\n");
+            return -1;
+        }
+    } else {
+        errno = 0;
+        long long number = strtoll(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || number < 0) {
+            fprintf(stderr, "Error: bad number for %s: %s\n", option, value);
+            return -1;
+        }
+        if (strcmp(option, "--min-size") == 0) {
+            filter->min_size = (uint64_t)number;
+        } else if (strcmp(option, "--max-size") == 0) {
+            filter->max_size = (uint64_t)number;
+        } else if (strcmp(option, "--newer") == 0) {
+            filter->min_mtime = (int64_t)number;
+        } else if (strcmp(option, "--older") == 0) {
+            filter->max_mtime = (int64_t)number;
+        } else {
+            if (number < 1 || number > LIST_PAGE_MAX) {
+                fprintf(stderr, "Error: --top is 1 to %d\n", LIST_PAGE_MAX);
+                return -1;
+            }
+            g_list_top = (uint32_t)number;
+            return 2;  // A page size, not part of the query
+        }
+    }
+    g_list_queried = 1;
+    return 2;
+}
+
 int main(int argc, char *argv[]) {
     int i;
+    int used;
+    
+    list_query_init(&g_list_query);
     
     // Parse options
     for (i = 1; i < argc; i++) {
@@ -580,6 +2471,35 @@ int main(int argc, char *argv[]) {
                 strncpy(g_password, argv[i + 1], sizeof(g_password) - 1);
                 i++;
             }
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--continue") == 0) {
+            g_continue = 1;
+        } else if (strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--compress") == 0) {
+            if (i + 1 < argc) {
+                g_codec = compress_codec_by_name(argv[i + 1]);
+                if (g_codec < 0 || !(compress_codecs() & (1u << g_codec))) {
+                    fprintf(stderr, "Error: compression %s is not available\n", argv[i + 1]);
+                    return 1;
+                }
+                i++;
+            }
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dedup") == 0) {
+            g_dedup = 1;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--sync") == 0) {
+            g_sync = 1;
+        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--multiplex") == 0) {
+            g_multiplex = 1;
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--parallel") == 0) {
+            if (i + 1 < argc) {
+                g_streams = atoi(argv[i + 1]);
+                if (g_streams < 1) g_streams = 1;
+                if (g_streams > MAX_STREAMS) g_streams = MAX_STREAMS;
+                i++;
+            }
+        } else if ((used = parse_list_option(argv[i], i + 1 < argc ? argv[i + 1] : NULL)) != 0) {
+            if (used < 0) {
+                return 1;
+            }
+            i += used - 1;
         } else {
             break;  // End of options
         }
@@ -619,16 +2539,36 @@ int main(int argc, char *argv[]) {
         }
     } else if (strcmp(command, "get") == 0) {
         if (i + 1 < argc) {
-            client_get_file(sock_fd, argv[i], argv[i + 1]);
+            uint64_t offset = i + 2 < argc ? strtoull(argv[i + 2], NULL, 10) : 0;
+            uint64_t length = i + 3 < argc ? strtoull(argv[i + 3], NULL, 10) : RANGE_TO_END;
+            if (g_streams > 1 && !g_continue && i + 2 >= argc) {
+                client_get_file_parallel(sock_fd, argv[i], argv[i + 1], g_streams);
+            } else {
+                client_get_file(sock_fd, argv[i], argv[i + 1], offset, length);
+            }
         } else {
             fprintf(stderr, "Error: get command requires REMOTE_PATH and LOCAL_PATH\n");
         }
     } else if (strcmp(command, "put") == 0) {
         if (i + 1 < argc) {
-            client_put_file(sock_fd, argv[i], argv[i + 1]);
+            if (g_sync) {
+                client_sync_file(sock_fd, argv[i], argv[i + 1]);
+            } else if (g_dedup) {
+                client_dedup_file(sock_fd, argv[i], argv[i + 1]);
+            } else if (g_streams > 1 || g_continue) {
+                client_upload_file(sock_fd, argv[i], argv[i + 1], g_streams);
+            } else {
+                client_put_file(sock_fd, argv[i], argv[i + 1]);
+            }
         } else {
             fprintf(stderr, "Error: put command requires REMOTE_PATH and LOCAL_PATH\n");
         }
+    } else if (strcmp(command, "hash") == 0) {
+        if (i < argc) {
+            client_hash_file(sock_fd, argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+        } else {
+            fprintf(stderr, "Error: hash command requires REMOTE_PATH\n");
+        }
     } else if (strcmp(command, "delete") == 0) {
         if (i < argc) {
             client_delete_file(sock_fd, argv[i]);
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include "../include/compress.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ENTROPY_SAMPLES 4096  // Bytes looked at to judge a block
+#define ENTROPY_MIN_SIZE 512  // Smaller blocks are simply tried
+
+uint32_t compress_codecs(void) {
+    uint32_t codecs = 0;
+#ifdef HAVE_LZ4
+    codecs |= 1u << COMPRESS_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    codecs |= 1u << COMPRESS_ZSTD;
+#endif
+    return codecs;
+}
+
+int compress_codec_by_name(const char *name) {
+    if (strcmp(name, "lz4") == 0) {
+        return COMPRESS_LZ4;
+    }
+    if (strcmp(name, "zstd") == 0) {
+        return COMPRESS_ZSTD;
+    }
+    return -1;
+}
+
+void compress_close(compress_stream_t *cs) {
+    if (cs == NULL) {
+        return;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(cs->zstd_cctx);
+    ZSTD_freeDCtx(cs->zstd_dctx);
+#endif
+    free(cs->block);
+    free(cs->raw);
+    free(cs);
+}
+
+compress_stream_t *compress_open(int codec) {
+    compress_stream_t *cs = calloc(1, sizeof(*cs));
+    if (cs == NULL) {
+        return NULL;
+    }
+    cs->codec = codec;
+    cs->block = malloc(COMPRESS_BLOCK_MAX);
+    cs->raw = malloc(COMPRESS_BLOCK_SIZE);
+    if (cs->block == NULL || cs->raw == NULL) {
+        compress_close(cs);
+        return NULL;
+    }
+    return cs;
+}
+
+// Estimate the order-0 entropy of a block from evenly spread samples.
+// Compressed, encrypted and media data comes close to 8 bits per byte.
+static double sample_entropy(const unsigned char *data, size_t len) {
+    uint32_t counts[256] = { 0 };
+    size_t step = len > ENTROPY_SAMPLES ? len / ENTROPY_SAMPLES : 1;
+    size_t samples = 0;
+    
+    for (size_t i = 0; i < len; i += step) {
+        counts[data[i]]++;
+        samples++;
+    }
+    
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] > 0) {
+            double p = (double)counts[i] / samples;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
+
+// Compress into at most capacity bytes. Returns the compressed size, 0 if
+// the data didn't fit, that is, didn't shrink.
+static size_t encode(compress_stream_t *cs, const char *data, size_t len, char *out, size_t capacity) {
+    switch (cs->codec) {
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4: {
+            int n = LZ4_compress_default(data, out, (int)len, (int)capacity);
+            return n > 0 ? (size_t)n : 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            if (cs->zstd_cctx == NULL && (cs->zstd_cctx = ZSTD_createCCtx()) == NULL) {
+                return 0;
+            }
+            size_t n = ZSTD_compressCCtx(cs->zstd_cctx, out, capacity, data, len, COMPRESS_ZSTD_LEVEL);
+            return ZSTD_isError(n) ? 0 : n;
+        }
+#endif
+        default:
+            (void)data;
+            (void)len;
+            (void)out;
+            (void)capacity;
+            return 0;
+    }
+}
+
+// Decompress a block body into exactly raw_len bytes. Returns 0 on success.
+static int decode(compress_stream_t *cs, int codec, const char *data, size_t len, char *out, size_t raw_len) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4:
+            return LZ4_decompress_safe(data, out, (int)len, (int)raw_len) == (int)raw_len ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            if (cs->zstd_dctx == NULL && (cs->zstd_dctx = ZSTD_createDCtx()) == NULL) {
+                return -1;
+            }
+            size_t n = ZSTD_decompressDCtx(cs->zstd_dctx, out, raw_len, data, len);
+            return !ZSTD_isError(n) && n == raw_len ? 0 : -1;
+        }
+#endif
+        default:
+            (void)cs;
+            (void)data;
+            (void)len;
+            (void)out;
+            (void)raw_len;
+            return -1;
+    }
+}
+
+size_t compress_block(compress_stream_t *cs, const char *data, size_t len, char *block) {
+    uint8_t codec = COMPRESS_NONE;
+    size_t stored = 0;
+    
+    // Data that looks random is not worth the attempt
+    if (cs->codec != COMPRESS_NONE && len > 0 &&
+        (len < ENTROPY_MIN_SIZE || sample_entropy((const unsigned char *)data, len) < COMPRESS_ENTROPY_LIMIT)) {
+        stored = encode(cs, data, len, block + COMPRESS_BLOCK_HEADER, len - 1);
+        codec = stored > 0 ? (uint8_t)cs->codec : COMPRESS_NONE;
+    }
+    if (codec == COMPRESS_NONE) {
+        memcpy(block + COMPRESS_BLOCK_HEADER, data, len);
+        stored = len;
+    }
+    
+    uint32_t net_raw = htonl((uint32_t)len);
+    uint32_t net_stored = htonl((uint32_t)stored);
+    block[0] = (char)codec;
+    memcpy(block + 1, &net_raw, sizeof(net_raw));
+    memcpy(block + 5, &net_stored, sizeof(net_stored));
+    
+    cs->raw_bytes += len;
+    cs->wire_bytes += COMPRESS_BLOCK_HEADER + stored;
+    return COMPRESS_BLOCK_HEADER + stored;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int compress_store(compress_stream_t *cs, int fd, const char *data, size_t len) {
+    while (len > 0) {
+        // Collect the header first, it tells how much of the block is still to come
+        if (cs->block_len < COMPRESS_BLOCK_HEADER) {
+            size_t take = COMPRESS_BLOCK_HEADER - cs->block_len < len ? COMPRESS_BLOCK_HEADER - cs->block_len : len;
+            memcpy(cs->block + cs->block_len, data, take);
+            cs->block_len += take;
+            data += take;
+            len -= take;
+            continue;
+        }
+        
+        uint32_t raw_len, stored;
+        memcpy(&raw_len, cs->block + 1, sizeof(raw_len));
+        memcpy(&stored, cs->block + 5, sizeof(stored));
+        raw_len = ntohl(raw_len);
+        stored = ntohl(stored);
+        if (raw_len == 0 || raw_len > COMPRESS_BLOCK_SIZE || stored == 0 || stored > COMPRESS_BLOCK_SIZE ||
+            (cs->block[0] == COMPRESS_NONE && stored != raw_len)) {
+            return EBADMSG;
+        }
+        
+        size_t want = COMPRESS_BLOCK_HEADER + stored;
+        size_t take = want - cs->block_len < len ? want - cs->block_len : len;
+        memcpy(cs->block + cs->block_len, data, take);
+        cs->block_len += take;
+        data += take;
+        len -= take;
+        if (cs->block_len < want) {
+            continue;
+        }
+        
+        const char *body = cs->block + COMPRESS_BLOCK_HEADER;
+        if (cs->block[0] != COMPRESS_NONE) {
+            // Codecs this build lacks fail to decode like corrupt data
+            if (decode(cs, (uint8_t)cs->block[0], body, stored, cs->raw, raw_len) != 0) {
+                return EBADMSG;
+            }
+            body = cs->raw;
+        }
+        int err = write_all(fd, body, raw_len);
+        if (err != 0) {
+            return err;
+        }
+        cs->raw_bytes += raw_len;
+        cs->wire_bytes += want;
+        cs->block_len = 0;
+    }
+    return 0;
+}
+
+int compress_finish(const compress_stream_t *cs) {
+    return cs->block_len != 0 ? EBADMSG : 0;
+}
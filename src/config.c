@@ -8,12 +8,35 @@
 #define LINE_BUFFER_SIZE 1024
 #define DEFAULT_PORT 8080
 #define DEFAULT_MAX_CONNECTIONS 100
+#define DEFAULT_WORKER_THREADS 4
+#define DEFAULT_QUEUE_DEPTH 1024
+#define DEFAULT_IO_ENGINE "epoll"
+#define DEFAULT_REACTOR_THREADS 1
+#define DEFAULT_STATS_INTERVAL 60
+#define DEFAULT_HASH_THREADS 4
+#define DEFAULT_META_CACHE_ENTRIES 4096
 #define DEFAULT_LOG_LEVEL 1  // INFO
 
 static server_config_t config;
 static int config_loaded = 0;
 static char config_file_path[MAX_PATH_LENGTH] = CONFIG_FILENAME;
 
+// Where the server keeps its own state unless told otherwise: not below the
+// working directory, which is the default root, but where the XDG base
+// directory spec puts it, $XDG_STATE_HOME or ~/.local/state
+static void default_state_dir(const char *name, char *out, size_t size) {
+    const char *state = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    
+    if (state != NULL && state[0] == '/') {
+        snprintf(out, size, "%s/cileserver/%s", state, name);
+    } else if (home != NULL && home[0] == '/') {
+        snprintf(out, size, "%s/.local/state/cileserver/%s", home, name);
+    } else {
+        snprintf(out, size, "%s", name);
+    }
+}
+
 // Initialize config with default values
 static void init_default_config(void) {
     char cwd[MAX_PATH_LENGTH];
@@ -25,10 +48,20 @@ static void init_default_config(void) {
     }
     
     config.max_connections = DEFAULT_MAX_CONNECTIONS;
+    config.worker_threads = DEFAULT_WORKER_THREADS;
+    config.queue_depth = DEFAULT_QUEUE_DEPTH;
+    strncpy(config.io_engine, DEFAULT_IO_ENGINE, sizeof(config.io_engine) - 1);
+    config.reactor_threads = DEFAULT_REACTOR_THREADS;
+    config.cpu_affinity = 1;
+    config.stats_interval = DEFAULT_STATS_INTERVAL;
     config.port = DEFAULT_PORT;
     config.log_level = DEFAULT_LOG_LEVEL;
     config.enable_auth = 0;
     strncpy(config.auth_file, "users.auth", sizeof(config.auth_file) - 1);
+    default_state_dir("uploads", config.upload_dir, sizeof(config.upload_dir));
+    default_state_dir("chunks", config.chunk_dir, sizeof(config.chunk_dir));
+    config.hash_threads = DEFAULT_HASH_THREADS;
+    config.meta_cache_entries = DEFAULT_META_CACHE_ENTRIES;
 }
 
 int set_config_path(const char *path) {
@@ -101,10 +134,20 @@ int save_config(void) {
     fprintf(file, "# CileServer Configuration File\n\n");
     fprintf(file, "root_directory=%s\n", config.root_directory);
     fprintf(file, "max_connections=%d\n", config.max_connections);
+    fprintf(file, "worker_threads=%d\n", config.worker_threads);
+    fprintf(file, "queue_depth=%d\n", config.queue_depth);
+    fprintf(file, "io_engine=%s\n", config.io_engine);
+    fprintf(file, "reactor_threads=%d\n", config.reactor_threads);
+    fprintf(file, "cpu_affinity=%d\n", config.cpu_affinity);
+    fprintf(file, "stats_interval=%d\n", config.stats_interval);
     fprintf(file, "port=%d\n", config.port);
     fprintf(file, "log_level=%d\n", config.log_level);
     fprintf(file, "enable_auth=%d\n", config.enable_auth);
     fprintf(file, "auth_file=%s\n", config.auth_file);
+    fprintf(file, "upload_dir=%s\n", config.upload_dir);
+    fprintf(file, "chunk_dir=%s\n", config.chunk_dir);
+    fprintf(file, "hash_threads=%d\n", config.hash_threads);
+    fprintf(file, "meta_cache_entries=%d\n", config.meta_cache_entries);
     
     fclose(file);
     log_info("Configuration saved to %s", config_file_path);
@@ -129,6 +172,18 @@ int set_config_value(const char *name, const char *value) {
         strncpy(config.root_directory, value, sizeof(config.root_directory) - 1);
     } else if (strcmp(name, "max_connections") == 0) {
         config.max_connections = atoi(value);
+    } else if (strcmp(name, "worker_threads") == 0) {
+        config.worker_threads = atoi(value);
+    } else if (strcmp(name, "queue_depth") == 0) {
+        config.queue_depth = atoi(value);
+    } else if (strcmp(name, "io_engine") == 0) {
+        strncpy(config.io_engine, value, sizeof(config.io_engine) - 1);
+    } else if (strcmp(name, "reactor_threads") == 0) {
+        config.reactor_threads = atoi(value);
+    } else if (strcmp(name, "cpu_affinity") == 0) {
+        config.cpu_affinity = atoi(value);
+    } else if (strcmp(name, "stats_interval") == 0) {
+        config.stats_interval = atoi(value);
     } else if (strcmp(name, "port") == 0) {
         config.port = atoi(value);
     } else if (strcmp(name, "log_level") == 0) {
@@ -138,6 +193,14 @@ int set_config_value(const char *name, const char *value) {
         config.enable_auth = atoi(value);
     } else if (strcmp(name, "auth_file") == 0) {
         strncpy(config.auth_file, value, sizeof(config.auth_file) - 1);
+    } else if (strcmp(name, "upload_dir") == 0) {
+        strncpy(config.upload_dir, value, sizeof(config.upload_dir) - 1);
+    } else if (strcmp(name, "chunk_dir") == 0) {
+        strncpy(config.chunk_dir, value, sizeof(config.chunk_dir) - 1);
+    } else if (strcmp(name, "hash_threads") == 0) {
+        config.hash_threads = atoi(value);
+    } else if (strcmp(name, "meta_cache_entries") == 0) {
+        config.meta_cache_entries = atoi(value);
     } else {
         log_warning("Unknown configuration parameter: %s", name);
         return -1;
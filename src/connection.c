@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/connection.h"
+#include "../include/mux.h"
+#include "../include/compress.h"
+#include "../include/delta.h"
+#include "../include/checksum.h"
+#include "../include/logger.h"
+
+#define OUTPUT_INITIAL_SIZE 1024
+#define OUTPUT_RETAIN_SIZE 65536
+#define OUTPUT_COPY_LIMIT 2048   // Payloads up to this size are copied next to their header
+
+void conn_open(connection_t *conn, int fd) {
+    conn->fd = fd;
+    conn->role = ROLE_GUEST;  // Every connection starts as guest
+    conn->file_fd = -1;
+    conn->pipe_rd = -1;
+    conn->pipe_wr = -1;
+    conn->pipe_len = 0;
+    conn->busy = 0;
+    conn->request_status = 0;
+    conn->request_count = 0;
+    conn->protocol_version = 1;  // Until the client negotiates another with CMD_HELLO
+    conn->mux = NULL;
+    conn->mux_stream = 0;
+    conn->checksums = 0;
+    conn->compact_lists = 0;
+    conn->ring_head = 0;
+    conn->ring_tail = 0;
+    conn->out_len = 0;
+    conn->out_pending = 0;
+    conn->out_nsegs = 0;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+    conn->file_chunked = 0;
+    conn->stream_done = NULL;
+    conn->codec = NULL;
+    conn->delta = NULL;
+    conn->checksum = NULL;
+    conn_reset_request(conn);
+}
+
+static void close_pipe(connection_t *conn) {
+    if (conn->pipe_rd >= 0) {
+        close(conn->pipe_rd);
+        close(conn->pipe_wr);
+        conn->pipe_rd = -1;
+        conn->pipe_wr = -1;
+    }
+    conn->pipe_len = 0;
+}
+
+static void clear_output(connection_t *conn) {
+    for (int i = 0; i < conn->out_nsegs; i++) {
+        free(conn->out_segs[i].data);
+    }
+    conn->out_nsegs = 0;
+    conn->out_pending = 0;
+    conn->out_len = 0;
+}
+
+void conn_close(connection_t *conn) {
+    // A payload cut short still lets its handler release what it holds,
+    // whichever engine noticed the connection go
+    if (conn->state == CONN_RECV_FILE && conn->stream_done != NULL) {
+        conn_stream_done_t done = conn->stream_done;
+        conn->stream_done = NULL;
+        done(conn, -1);
+    }
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    close_pipe(conn);
+    compress_close(conn->codec);
+    conn->codec = NULL;
+    delta_close(conn->delta);
+    conn->delta = NULL;
+    checksum_close(conn->checksum);
+    conn->checksum = NULL;
+    mux_disable(conn);
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    
+    free(conn->body);
+    conn->body = NULL;
+    conn->body_len = 0;
+    
+    // Keep ordinary response buffers for reuse, release unusually large ones
+    clear_output(conn);
+    if (conn->out_cap > OUTPUT_RETAIN_SIZE) {
+        free(conn->out_buf);
+        conn->out_buf = NULL;
+        conn->out_cap = 0;
+    }
+}
+
+void conn_reset_request(connection_t *conn) {
+    conn->state = CONN_READ_HEADER;
+    conn->in_len = 0;
+    free(conn->body);
+    conn->body = NULL;
+    conn->body_len = 0;
+    conn->command = 0;
+    conn->path_length = 0;
+    conn->data_length = 0;
+}
+
+size_t conn_input_len(const connection_t *conn) {
+    return conn->ring_tail - conn->ring_head;
+}
+
+void conn_input_peek(const connection_t *conn, size_t offset, void *dest, size_t len) {
+    size_t start = (conn->ring_head + offset) & (CONN_RING_SIZE - 1);
+    size_t first = CONN_RING_SIZE - start < len ? CONN_RING_SIZE - start : len;
+    
+    memcpy(dest, conn->in_ring + start, first);
+    memcpy((char *)dest + first, conn->in_ring, len - first);
+}
+
+void conn_input_consume(connection_t *conn, size_t len) {
+    conn->ring_head += len;
+    if (conn->ring_head == conn->ring_tail) {
+        // Empty again, restart at the front so the next read gets one contiguous buffer
+        conn->ring_head = 0;
+        conn->ring_tail = 0;
+    }
+}
+
+int conn_input_space(connection_t *conn, struct iovec iov[2]) {
+    size_t free_len = CONN_RING_SIZE - conn_input_len(conn);
+    if (free_len == 0) {
+        return 0;
+    }
+    
+    size_t start = conn->ring_tail & (CONN_RING_SIZE - 1);
+    size_t first = CONN_RING_SIZE - start < free_len ? CONN_RING_SIZE - start : free_len;
+    iov[0].iov_base = conn->in_ring + start;
+    iov[0].iov_len = first;
+    if (first == free_len) {
+        return 1;
+    }
+    iov[1].iov_base = conn->in_ring;
+    iov[1].iov_len = free_len - first;
+    return 2;
+}
+
+void conn_input_commit(connection_t *conn, size_t len) {
+    conn->ring_tail += len;
+}
+
+int conn_queue_output(connection_t *conn, const void *data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    
+    if (conn->out_len + size > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : OUTPUT_INITIAL_SIZE;
+        while (new_cap < conn->out_len + size) {
+            new_cap *= 2;
+        }
+        char *new_buf = realloc(conn->out_buf, new_cap);
+        if (new_buf == NULL) {
+            log_error("Failed to grow output buffer to %zu bytes", new_cap);
+            return -1;
+        }
+        conn->out_buf = new_buf;
+        conn->out_cap = new_cap;
+    }
+    
+    // Bytes that directly follow the last piece of out_buf extend it, so
+    // consecutive small responses leave in a single iovec
+    conn_output_seg_t *last = conn->out_nsegs > 0 ? &conn->out_segs[conn->out_nsegs - 1] : NULL;
+    if (last != NULL && last->data == NULL && last->offset + last->len == conn->out_len) {
+        last->len += size;
+    } else {
+        // conn_queue_output_buffer() always leaves a segment free for this
+        last = &conn->out_segs[conn->out_nsegs++];
+        last->data = NULL;
+        last->offset = conn->out_len;
+        last->len = size;
+    }
+    
+    memcpy(conn->out_buf + conn->out_len, data, size);
+    conn->out_len += size;
+    conn->out_pending += size;
+    return 0;
+}
+
+int conn_queue_output_buffer(connection_t *conn, void *data, size_t size) {
+    // Small payloads are cheaper to copy than to send as a separate piece
+    if (size <= OUTPUT_COPY_LIMIT || conn->out_nsegs >= CONN_OUTPUT_SEGMENTS - 1) {
+        int res = conn_queue_output(conn, data, size);
+        free(data);
+        return res;
+    }
+    
+    conn_output_seg_t *seg = &conn->out_segs[conn->out_nsegs++];
+    seg->data = data;
+    seg->offset = 0;
+    seg->len = size;
+    conn->out_pending += size;
+    return 0;
+}
+
+void conn_patch_output(connection_t *conn, size_t offset, const void *data, size_t size) {
+    memcpy(conn->out_buf + offset, data, size);
+}
+
+int conn_has_output(const connection_t *conn) {
+    return conn->out_pending > 0;
+}
+
+int conn_output_iov(const connection_t *conn, struct iovec *iov) {
+    for (int i = 0; i < conn->out_nsegs; i++) {
+        const conn_output_seg_t *seg = &conn->out_segs[i];
+        iov[i].iov_base = (seg->data != NULL ? seg->data : conn->out_buf) + seg->offset;
+        iov[i].iov_len = seg->len;
+    }
+    return conn->out_nsegs;
+}
+
+void conn_output_sent(connection_t *conn, size_t len) {
+    int done = 0;
+    
+    conn->out_pending -= len;
+    while (done < conn->out_nsegs && len >= conn->out_segs[done].len) {
+        len -= conn->out_segs[done].len;
+        free(conn->out_segs[done].data);
+        done++;
+    }
+    if (done < conn->out_nsegs) {
+        conn->out_segs[done].offset += len;
+        conn->out_segs[done].len -= len;
+    }
+    
+    conn->out_nsegs -= done;
+    memmove(conn->out_segs, conn->out_segs + done, conn->out_nsegs * sizeof(conn->out_segs[0]));
+    if (conn->out_nsegs == 0) {
+        conn->out_len = 0;
+    }
+}
+
+void conn_start_send_file(connection_t *conn, int file_fd, uint64_t offset, uint64_t length) {
+    if (conn->mux != NULL) {
+        mux_start_send(conn, file_fd, offset, length);
+        return;
+    }
+    
+    conn->state = CONN_SEND_FILE;
+    conn->file_fd = file_fd;
+    conn->file_offset = offset;
+    conn->file_remaining = length;
+    conn->stream_done = NULL;
+    conn->file_chunked = 0;
+    conn->file_copy = 0;
+}
+
+void conn_start_recv_file(connection_t *conn, int file_fd, uint64_t length, conn_stream_done_t done) {
+    if (conn->mux != NULL) {
+        mux_start_recv(conn, file_fd, length, done);
+        return;
+    }
+    
+    conn->state = CONN_RECV_FILE;
+    conn->file_fd = file_fd;
+    conn->file_offset = 0;
+    conn->file_chunked = length == CONN_LENGTH_CHUNKED;
+    conn->file_remaining = conn->file_chunked ? 0 : length;
+    conn->stream_done = done;
+    conn->file_copy = 0;
+    conn->file_error = 0;
+}
+
+void conn_end_stream(connection_t *conn) {
+    if (conn->file_fd >= 0) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    close_pipe(conn);
+    compress_close(conn->codec);
+    conn->codec = NULL;
+    delta_close(conn->delta);
+    conn->delta = NULL;
+    checksum_close(conn->checksum);
+    conn->checksum = NULL;
+    conn->file_offset = 0;
+    conn->file_remaining = 0;
+    conn->file_chunked = 0;
+    conn->stream_done = NULL;
+    conn_reset_request(conn);
+}
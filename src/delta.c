@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include "../include/delta.h"
+#include "../include/sha256.h"
+
+#define SIGNATURE_READ_BLOCKS 16        // Blocks read at once while computing signatures
+#define COPY_BUFFER_SIZE (256 * 1024)   // Copies from the old file go through a buffer this large
+
+uint32_t delta_block_size(uint64_t size) {
+    // Rounded up to a whole kilobyte
+    uint64_t block = ((uint64_t)sqrt((double)size) + 1023) & ~(uint64_t)1023;
+    if (block < DELTA_MIN_BLOCK) {
+        return DELTA_MIN_BLOCK;
+    }
+    return block > DELTA_MAX_BLOCK ? DELTA_MAX_BLOCK : (uint32_t)block;
+}
+
+// rsync's checksum: a plain sum of the bytes in the low 16 bits and a sum
+// weighted by distance from the end of the window in the high 16 bits, so
+// a byte can be taken out at one end and added at the other
+uint32_t delta_weak_sum(const uint8_t *data, size_t len) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+uint32_t delta_weak_roll(uint32_t sum, uint8_t out, uint8_t in, size_t len) {
+    uint32_t a = (sum & 0xffff) - out + in;
+    uint32_t b = (sum >> 16) - (uint32_t)len * out + a;
+    return (a & 0xffff) | (b << 16);
+}
+
+void delta_strong_sum(const uint8_t *data, size_t len, uint8_t out[DELTA_STRONG_SIZE]) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(data, len, digest);
+    memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+int delta_signatures(int fd, uint64_t size, uint32_t block_size, uint8_t *out) {
+    size_t buffer_size = (size_t)block_size * SIGNATURE_READ_BLOCKS;
+    uint8_t *buffer = malloc(buffer_size);
+    if (buffer == NULL) {
+        return ENOMEM;
+    }
+
+    uint64_t offset = 0;
+    while (offset < size) {
+        size_t want = size - offset < buffer_size ? (size_t)(size - offset) : buffer_size;
+        size_t have = 0;
+        while (have < want) {
+            ssize_t r = pread(fd, buffer + have, want - have, (off_t)(offset + have));
+            if (r <= 0) {
+                int err = r < 0 ? errno : EIO;  // File shrank while being read
+                if (err == EINTR) {
+                    continue;
+                }
+                free(buffer);
+                return err;
+            }
+            have += r;
+        }
+        for (size_t pos = 0; pos < have; pos += block_size) {
+            size_t len = have - pos < block_size ? have - pos : block_size;
+            uint32_t weak = htonl(delta_weak_sum(buffer + pos, len));
+            memcpy(out, &weak, sizeof(weak));
+            delta_strong_sum(buffer + pos, len, out + sizeof(weak));
+            out += DELTA_SIGNATURE_SIZE;
+        }
+        offset += have;
+    }
+    free(buffer);
+    return 0;
+}
+
+delta_apply_t *delta_open(int base_fd, uint64_t base_size, uint64_t size, int dir_fd, const char *temp,
+                          const char *target) {
+    delta_apply_t *d = calloc(1, sizeof(*d));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->base_fd = base_fd;
+    d->base_size = base_size;
+    d->size = size;
+    d->dir_fd = dir_fd;
+    d->temp = strdup(temp);
+    d->target = strdup(target);
+    if (d->temp == NULL || d->target == NULL) {
+        free(d->temp);
+        free(d->target);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+void delta_close(delta_apply_t *d) {
+    if (d == NULL) {
+        return;
+    }
+    if (!d->committed) {
+        unlinkat(d->dir_fd, d->temp, 0);
+    }
+    close(d->base_fd);
+    close(d->dir_fd);
+    free(d->buffer);
+    free(d->temp);
+    free(d->target);
+    free(d);
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// Append a range of the old file to the new one
+static int copy_range(delta_apply_t *d, int fd, uint64_t offset, uint64_t length) {
+    // copy_file_range() keeps the data in the kernel, or shares blocks where it can
+    loff_t in_off = (loff_t)offset;
+    while (length > 0) {
+        ssize_t n = copy_file_range(d->base_fd, &in_off, fd, NULL, length, 0);
+        if (n > 0) {
+            length -= n;
+            continue;
+        }
+        if (n == 0) {
+            return EIO;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL) {
+            return errno;
+        }
+        break;
+    }
+
+    // Fall back to a plain copy for whatever is left
+    while (length > 0) {
+        if (d->buffer == NULL && (d->buffer = malloc(COPY_BUFFER_SIZE)) == NULL) {
+            return ENOMEM;
+        }
+        size_t want = length < COPY_BUFFER_SIZE ? (size_t)length : COPY_BUFFER_SIZE;
+        ssize_t r = pread(d->base_fd, d->buffer, want, in_off);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return r < 0 ? errno : EIO;
+        }
+        int err = write_all(fd, d->buffer, r);
+        if (err != 0) {
+            return err;
+        }
+        in_off += r;
+        length -= r;
+    }
+    return 0;
+}
+
+int delta_store(delta_apply_t *d, int fd, const char *data, size_t len) {
+    while (len > 0) {
+        if (d->literal_left > 0) {
+            size_t take = d->literal_left < len ? d->literal_left : len;
+            int err = write_all(fd, data, take);
+            if (err != 0) {
+                return err;
+            }
+            d->written += take;
+            d->literal_left -= take;
+            data += take;
+            len -= take;
+            continue;
+        }
+
+        // The first byte of an instruction tells how long it is
+        uint8_t type = d->header_len > 0 ? d->header[0] : (uint8_t)data[0];
+        if (type != DELTA_COPY && type != DELTA_LITERAL) {
+            return EBADMSG;
+        }
+        size_t need = type == DELTA_COPY ? DELTA_COPY_SIZE : DELTA_LITERAL_HEADER;
+        size_t take = need - d->header_len < len ? need - d->header_len : len;
+        memcpy(d->header + d->header_len, data, take);
+        d->header_len += take;
+        data += take;
+        len -= take;
+        if (d->header_len < need) {
+            continue;
+        }
+        d->header_len = 0;
+
+        if (d->header[0] == DELTA_LITERAL) {
+            uint32_t length;
+            memcpy(&length, d->header + 1, sizeof(length));
+            length = ntohl(length);
+            if (length == 0 || length > d->size - d->written) {
+                return EBADMSG;
+            }
+            d->literal_left = length;
+            continue;
+        }
+
+        uint64_t range[2];
+        memcpy(range, d->header + 1, sizeof(range));
+        uint64_t offset = be64toh(range[0]);
+        uint64_t length = be64toh(range[1]);
+        if (length == 0 || length > d->base_size || offset > d->base_size - length ||
+            length > d->size - d->written) {
+            return EBADMSG;
+        }
+        int err = copy_range(d, fd, offset, length);
+        if (err != 0) {
+            return err;
+        }
+        d->written += length;
+    }
+    return 0;
+}
+
+int delta_commit(delta_apply_t *d) {
+    if (d->header_len != 0 || d->literal_left != 0 || d->written != d->size) {
+        return EBADMSG;
+    }
+    if (renameat(d->dir_fd, d->temp, d->dir_fd, d->target) != 0) {
+        return errno;
+    }
+    d->committed = 1;
+    return 0;
+}
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "../include/file_hash.h"
+
+// What the cached attribute holds, all big endian
+typedef struct {
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t inode;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+} hash_xattr_t;
+
+typedef struct {
+    int fd;
+    uint64_t size;
+    uint64_t num_leaves;
+    atomic_uint_fast64_t next_leaf;  // Leaves are handed out in order
+    atomic_int error;
+    uint8_t *digests;
+} hash_job_t;
+
+static int hash_leaf(hash_job_t *job, uint8_t *buffer, uint64_t leaf) {
+    static const uint8_t leaf_tag = 0;
+    uint64_t offset = leaf * FILE_HASH_LEAF_SIZE;
+    size_t want = job->size - offset < FILE_HASH_LEAF_SIZE ? (size_t)(job->size - offset) : FILE_HASH_LEAF_SIZE;
+    size_t have = 0;
+
+    while (have < want) {
+        ssize_t r = pread(job->fd, buffer + have, want - have, (off_t)(offset + have));
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return r < 0 ? errno : EIO;  // File shrank while being read
+        }
+        have += r;
+    }
+
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &leaf_tag, 1);
+    sha256_update(&ctx, buffer, have);
+    sha256_final(&ctx, job->digests + leaf * SHA256_DIGEST_SIZE);
+    return 0;
+}
+
+static void *hash_worker(void *arg) {
+    hash_job_t *job = arg;
+    uint8_t *buffer = malloc(FILE_HASH_LEAF_SIZE);
+    if (buffer == NULL) {
+        atomic_store(&job->error, ENOMEM);
+        return NULL;
+    }
+    while (atomic_load(&job->error) == 0) {
+        uint64_t leaf = atomic_fetch_add(&job->next_leaf, 1);
+        if (leaf >= job->num_leaves) {
+            break;
+        }
+        int err = hash_leaf(job, buffer, leaf);
+        if (err != 0) {
+            atomic_store(&job->error, err);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+int file_hash(int fd, uint64_t size, int threads, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    hash_job_t job;
+    job.fd = fd;
+    job.size = size;
+    job.num_leaves = (size + FILE_HASH_LEAF_SIZE - 1) / FILE_HASH_LEAF_SIZE;
+    atomic_init(&job.next_leaf, 0);
+    atomic_init(&job.error, 0);
+    job.digests = malloc(job.num_leaves > 0 ? job.num_leaves * SHA256_DIGEST_SIZE : 1);
+    if (job.digests == NULL) {
+        return ENOMEM;
+    }
+
+    // The calling thread is one of the workers
+    if ((uint64_t)threads > job.num_leaves) {
+        threads = job.num_leaves > 0 ? (int)job.num_leaves : 1;
+    }
+    pthread_t *helpers = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (helpers != NULL && started < threads - 1 &&
+           pthread_create(&helpers[started], NULL, hash_worker, &job) == 0) {
+        started++;
+    }
+    hash_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+
+    int err = atomic_load(&job.error);
+    if (err == 0) {
+        static const uint8_t root_tag = 1;
+        uint64_t net_size = htobe64(size);
+        sha256_ctx_t ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, &root_tag, 1);
+        sha256_update(&ctx, &net_size, sizeof(net_size));
+        sha256_update(&ctx, job.digests, job.num_leaves * SHA256_DIGEST_SIZE);
+        sha256_final(&ctx, digest);
+    }
+    free(job.digests);
+    return err;
+}
+
+static void xattr_key(const struct stat *st, hash_xattr_t *key) {
+    key->size = htobe64((uint64_t)st->st_size);
+    key->mtime_ns = htobe64((uint64_t)st->st_mtim.tv_sec * 1000000000ULL + (uint64_t)st->st_mtim.tv_nsec);
+    key->inode = htobe64((uint64_t)st->st_ino);
+}
+
+int file_hash_cached(int fd, int threads, uint64_t *size, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    struct stat st;
+    hash_xattr_t key;
+    hash_xattr_t cached;
+
+    if (fstat(fd, &st) != 0) {
+        return errno;
+    }
+    *size = (uint64_t)st.st_size;
+    xattr_key(&st, &key);
+    if (fgetxattr(fd, FILE_HASH_XATTR, &cached, sizeof(cached)) == sizeof(cached) &&
+        memcmp(&cached, &key, offsetof(hash_xattr_t, digest)) == 0) {
+        memcpy(digest, cached.digest, SHA256_DIGEST_SIZE);
+        return 0;
+    }
+
+    int err = file_hash(fd, *size, threads, key.digest);
+    if (err != 0) {
+        return err;
+    }
+    memcpy(digest, key.digest, SHA256_DIGEST_SIZE);
+
+    // A file written to while it was hashed may have a digest of neither
+    // version, so it is only cached if it looks the same as before. Setting
+    // the attribute changes the inode's ctime but not its mtime.
+    if (fstat(fd, &st) == 0) {
+        xattr_key(&st, &cached);
+        if (memcmp(&cached, &key, offsetof(hash_xattr_t, digest)) == 0) {
+            fsetxattr(fd, FILE_HASH_XATTR, &key, sizeof(key), 0);
+        }
+    }
+    return 0;
+}
@@ -1,90 +1,396 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <fnmatch.h>
 #include "../include/file_ops.h"
+#include "../include/meta_cache.h"
 #include "../include/config.h"
 #include "../include/logger.h"
 
-#define MAX_PATH_SIZE 2048
+#define MAX_WALK_DEPTH 128  // Directories held open while walking a path
+#define MAX_WALK_LINKS 40   // Symlinks followed in one path, as the kernel allows
 
-int get_full_path(const char *relative_path, char *out_path, size_t out_size) {
-    server_config_t *config = get_config();
-    char temp_path[MAX_PATH_SIZE];
-    
-    // Start with the root directory
-    strncpy(temp_path, config->root_directory, sizeof(temp_path) - 1);
-    temp_path[sizeof(temp_path) - 1] = '\0';
-    
-    // Skip leading slash in relative path if present
-    const char *rel = relative_path;
-    while (*rel == '/') {
-        rel++;
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+static int root_fd = -1;
+static int have_openat2;
+
+int normalize_path(const char *path, char *out, size_t out_size) {
+    size_t len = 0;
+
+    if (path == NULL || out_size == 0) {
+        errno = EINVAL;
+        return -1;
     }
-    
-    // Append the relative path
-    if (*rel != '\0') {
-        size_t len = strlen(temp_path);
-        if (len > 0 && temp_path[len - 1] != '/') {
-            strncat(temp_path, "/", sizeof(temp_path) - strlen(temp_path) - 1);
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        size_t n = strcspn(path, "/");
+        if (n == 2 && path[0] == '.' && path[1] == '.') {
+            errno = EINVAL;
+            return -1;
+        }
+        if (n > 0 && !(n == 1 && path[0] == '.')) {
+            if (len + (len > 0) + n >= out_size) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            if (len > 0) {
+                out[len++] = '/';
+            }
+            memcpy(out + len, path, n);
+            len += n;
         }
-        strncat(temp_path, rel, sizeof(temp_path) - strlen(temp_path) - 1);
+        path += n;
     }
-    
-    // Secure Path Resolution against Traversal
-    char resolved_path[PATH_MAX];
-    if (realpath(temp_path, resolved_path) == NULL) {
-        // If file doesn't exist yet (for write/mkdir), check its parent directory
-        char parent_path[MAX_PATH_SIZE];
-        strncpy(parent_path, temp_path, sizeof(parent_path) - 1);
-        parent_path[sizeof(parent_path) - 1] = '\0';
-        
-        char *last_slash = strrchr(parent_path, '/');
-        if (last_slash != NULL) {
-            *last_slash = '\0'; // split parent and filename
-            
-            if (realpath(parent_path, resolved_path) == NULL) {
-                return -1; // Parent directory also does not exist
+    out[len] = '\0';
+    return 0;
+}
+
+// Resolve a path one component at a time, for kernels without openat2().
+// Every directory on the way stays open and symlinks are expanded here, so
+// a ".." in a link's target goes back to a directory already reached and
+// can't climb above the root, whatever gets renamed meanwhile.
+static int walk_beneath(const char *path, int flags, mode_t mode, int strict) {
+    char rest[PATH_MAX];
+    char link[PATH_MAX];
+    int dirs[MAX_WALK_DEPTH];
+    int depth = 0;
+    int links = 0;
+    int fd = -1;
+    int err = 0;
+
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(rest)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(rest, path, path_len + 1);
+    dirs[0] = root_fd;
+
+    char *p = rest;
+    while (fd < 0 && err == 0) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            // Nothing left to look up, the path names a directory already open
+            fd = openat(dirs[depth], ".", flags | O_CLOEXEC, mode);
+            err = fd < 0 ? errno : 0;
+            break;
+        }
+        char *end = p + strcspn(p, "/");
+        char *next = end;
+        while (*next == '/') {
+            next++;
+        }
+        int last = *next == '\0';
+        size_t len = (size_t)(end - p);
+        *end = '\0';
+
+        if (len == 1 && p[0] == '.') {
+            p = next;
+            continue;
+        }
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            if (depth == 0) {
+                err = EXDEV;
+                break;
             }
-            
-            // Re-append the filename to the resolved parent path
-            strncat(resolved_path, "/", sizeof(resolved_path) - strlen(resolved_path) - 1);
-            strncat(resolved_path, last_slash + 1, sizeof(resolved_path) - strlen(resolved_path) - 1);
+            close(dirs[depth--]);
+            p = next;
+            continue;
+        }
+
+        int opened = last ? openat(dirs[depth], p, flags | O_NOFOLLOW | O_CLOEXEC, mode)
+                          : openat(dirs[depth], p, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+        if (opened >= 0 && last && (flags & O_PATH) && fstat(opened, &st) == 0 && S_ISLNK(st.st_mode)) {
+            close(opened);  // O_PATH opens a symlink itself instead of failing
+            opened = -1;
+            errno = ELOOP;
+        }
+        if (opened >= 0) {
+            if (last) {
+                fd = opened;
+            } else if (depth + 1 == MAX_WALK_DEPTH) {
+                close(opened);
+                err = ENAMETOOLONG;
+            } else {
+                dirs[++depth] = opened;
+                p = next;
+            }
+            continue;
+        }
+
+        // O_NOFOLLOW fails with ELOOP on a symlink, or ENOTDIR along with O_DIRECTORY
+        int open_err = errno;
+        ssize_t n = open_err == ELOOP || open_err == ENOTDIR ? readlinkat(dirs[depth], p, link, sizeof(link)) : -1;
+        if (n < 0) {
+            err = open_err;
+        } else if (strict || ++links > MAX_WALK_LINKS) {
+            err = ELOOP;
+        } else if (link[0] == '/') {
+            err = EXDEV;  // An absolute link leaves the root, as RESOLVE_BENEATH has it
         } else {
-            return -1;
+            // The link's target takes its place in what is left to resolve
+            size_t next_len = strlen(next);
+            if ((size_t)n + 1 + next_len >= sizeof(rest)) {
+                err = ENAMETOOLONG;
+                break;
+            }
+            memmove(rest + n + 1, next, next_len + 1);
+            memcpy(rest, link, (size_t)n);
+            rest[n] = '/';
+            p = rest;
         }
     }
-    
-    // Get absolute path of root directory
-    char resolved_root[PATH_MAX];
-    if (realpath(config->root_directory, resolved_root) == NULL) {
+
+    while (depth > 0) {
+        close(dirs[depth--]);
+    }
+    if (fd < 0) {
+        errno = err;
+    }
+    return fd;
+}
+
+static int resolve_beneath(const char *path, int flags, mode_t mode, int strict) {
+    char rel[MAX_PATH_SIZE];
+
+    if (root_fd < 0) {
+        errno = EBADF;
         return -1;
     }
-    
-    // Verify that resolved_path starts with resolved_root
-    size_t root_len = strlen(resolved_root);
-    if (strncmp(resolved_path, resolved_root, root_len) != 0) {
-        log_error("Path traversal attempt blocked: %s", relative_path);
-        return -1; // Outside root directory
+    if (normalize_path(path, rel, sizeof(rel)) != 0) {
+        return -1;
     }
-    
-    // If the path continues after root_len, it must be a separator or we are at exactly the root
-    if (resolved_path[root_len] != '\0' && resolved_path[root_len] != '/') {
-        log_error("Path traversal attempt blocked (boundary): %s", relative_path);
+    if (!have_openat2) {
+        return walk_beneath(rel, flags, mode, strict);
+    }
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = (uint64_t)(flags | O_CLOEXEC);
+    how.mode = (flags & (O_CREAT | O_TMPFILE)) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | (strict ? RESOLVE_NO_SYMLINKS : 0);
+
+    // EAGAIN means a rename raced with a ".." the kernel was resolving, worth another try
+    int fd;
+    int tries = 0;
+    do {
+        fd = (int)syscall(SYS_openat2, root_fd, rel[0] != '\0' ? rel : ".", &how, sizeof(how));
+    } while (fd < 0 && (errno == EAGAIN || errno == EINTR) && ++tries < 8);
+    return fd;
+}
+
+int open_beneath(const char *path, int flags, mode_t mode) {
+    return resolve_beneath(path, flags, mode, 0);
+}
+
+int open_beneath_strict(const char *path, int flags) {
+    return resolve_beneath(path, flags, 0, 1);
+}
+
+int open_parent_beneath(const char *path, char *name, size_t name_size) {
+    char rel[MAX_PATH_SIZE];
+
+    if (normalize_path(path, rel, sizeof(rel)) != 0) {
         return -1;
     }
-    
-    strncpy(out_path, resolved_path, out_size - 1);
-    out_path[out_size - 1] = '\0';
+    // The root directory itself can't be created, removed or replaced
+    if (rel[0] == '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    char *slash = strrchr(rel, '/');
+    const char *last = slash != NULL ? slash + 1 : rel;
+    if (strlen(last) >= name_size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(name, last);
+    if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        rel[0] = '\0';
+    }
+    return resolve_beneath(rel, O_PATH | O_DIRECTORY, 0, 0);
+}
+
+int stat_beneath(const char *path, struct stat *st, int *linked) {
+    int fd = open_beneath_strict(path, O_PATH);
+    if (fd < 0 && errno == ELOOP) {
+        *linked = 1;
+        fd = open_beneath(path, O_PATH, 0);
+    }
+    if (fd < 0) {
+        return errno;
+    }
+    int err = fstat(fd, st) == 0 ? 0 : errno;
+    close(fd);
+    return err;
+}
+
+// Read ahead to the next entry other than . and .., remembering where it
+// starts so a later reader can pick up from there
+static int advance_reader(dir_reader_t *reader) {
+    for (;;) {
+        long pos = telldir(reader->dir);
+        errno = 0;
+        struct dirent *entry = readdir(reader->dir);
+        if (entry == NULL) {
+            // After an error the cursor still points at the entry that failed
+            reader->pending = NULL;
+            if (errno != 0) {
+                reader->cursor = (uint64_t)pos;
+                return -1;
+            }
+            reader->cursor = 0;
+            reader->done = 1;
+            return 0;
+        }
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            reader->pending = entry;
+            reader->cursor = (uint64_t)pos;
+            return 0;
+        }
+    }
+}
+
+// Stat an entry relative to the open directory, so the kernel doesn't walk the
+// whole path again. A symlink is followed from the root directory instead, so
+// it can't show what lies outside.
+static int stat_entry(dir_reader_t *reader, const struct dirent *entry, struct stat *st) {
+    int err = 0;
+    if (entry->d_type == DT_UNKNOWN) {
+        err = fstatat(dirfd(reader->dir), entry->d_name, st, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : errno;
+    }
+    if (entry->d_type == DT_LNK || (entry->d_type == DT_UNKNOWN && err == 0 && S_ISLNK(st->st_mode))) {
+        char link[PATH_MAX];
+        int len = reader->path[0] == '\0'
+                      ? snprintf(link, sizeof(link), "%s", entry->d_name)
+                      : snprintf(link, sizeof(link), "%s/%s", reader->path, entry->d_name);
+        reader->linked = 1;
+        return len < (int)sizeof(link) ? stat_beneath(link, st, &reader->linked) : ENAMETOOLONG;
+    }
+    if (entry->d_type != DT_UNKNOWN) {
+        err = fstatat(dirfd(reader->dir), entry->d_name, st, 0) == 0 ? 0 : errno;
+    }
+    return err;
+}
+
+int dir_reader_open(dir_reader_t *reader, const char *path, uint64_t cursor) {
+    reader->dir = NULL;
+    reader->pending = NULL;
+    reader->cursor = 0;
+    reader->done = 0;
+    reader->linked = 0;
+    if (normalize_path(path, reader->path, sizeof(reader->path)) != 0) {
+        return -1;
+    }
+
+    int fd = open_beneath_strict(reader->path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 && errno == ELOOP) {
+        reader->linked = 1;
+        fd = open_beneath(reader->path, O_RDONLY | O_DIRECTORY, 0);
+    }
+    reader->dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (reader->dir == NULL) {
+        if (fd >= 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+        }
+        return -1;
+    }
+
+    // A cursor is a telldir() position, the filesystem keeps it valid across
+    // renames and removals of other entries
+    if (cursor != 0) {
+        seekdir(reader->dir, (long)cursor);
+    }
+    if (advance_reader(reader) != 0) {
+        int err = errno;
+        dir_reader_close(reader);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int match_metadata(const dir_filter_t *filter, const file_info_t *info) {
+    if ((filter->type == DIR_FILTER_FILES && info->is_directory) ||
+        (filter->type == DIR_FILTER_DIRECTORIES && !info->is_directory)) {
+        return 0;
+    }
+    return (uint64_t)info->size >= filter->min_size && (uint64_t)info->size <= filter->max_size &&
+           (int64_t)info->modified_time >= filter->min_mtime && (int64_t)info->modified_time <= filter->max_mtime;
+}
+
+int dir_filter_match(const dir_filter_t *filter, const file_info_t *info) {
+    if (filter->pattern != NULL && fnmatch(filter->pattern, info->name, 0) != 0) {
+        return 0;
+    }
+    return match_metadata(filter, info);
+}
+
+int dir_reader_read(dir_reader_t *reader, const dir_filter_t *filter, file_info_t *entries,
+                    int max_entries, int *num_entries) {
+    int n = 0;
+    while (n < max_entries && reader->pending != NULL) {
+        const struct dirent *entry = reader->pending;
+        
+        // The name is checked first, entries it rules out are never stat'ed
+        if (filter == NULL || filter->pattern == NULL || fnmatch(filter->pattern, entry->d_name, 0) == 0) {
+            struct stat st;
+            int err = 0;
+            int need_stat = filter == NULL || filter->need_stat || entry->d_type == DT_LNK ||
+                            (entry->d_type == DT_UNKNOWN && filter->need_type);
+            if (need_stat && (err = stat_entry(reader, entry, &st)) != 0) {
+                log_warning("Failed to get info for %s/%s: %s", reader->path, entry->d_name, strerror(err));
+            } else {
+                memset(entries[n].name, 0, sizeof(entries[n].name));
+                memcpy(entries[n].name, entry->d_name, strnlen(entry->d_name, sizeof(entries[n].name) - 1));
+                entries[n].size = need_stat && (filter == NULL || filter->need_stat) ? st.st_size : 0;
+                entries[n].is_directory = need_stat ? S_ISDIR(st.st_mode) != 0 : entry->d_type == DT_DIR;
+                entries[n].modified_time = need_stat && (filter == NULL || filter->need_stat) ? st.st_mtime : 0;
+                if (filter == NULL || match_metadata(filter, &entries[n])) {
+                    n++;
+                }
+            }
+        }
+        if (advance_reader(reader) != 0) {
+            *num_entries = n;
+            return -1;
+        }
+    }
+    *num_entries = n;
     return 0;
 }
 
+void dir_reader_close(dir_reader_t *reader) {
+    if (reader->dir != NULL) {
+        closedir(reader->dir);
+        reader->dir = NULL;
+    }
+    reader->pending = NULL;
+}
+
 int init_file_ops(void) {
     server_config_t *config = get_config();
     
@@ -101,6 +407,29 @@ int init_file_ops(void) {
         return -1;
     }
     
+    // Every path is resolved relative to this descriptor from now on
+    if (root_fd >= 0) {
+        close(root_fd);
+    }
+    root_fd = open(config->root_directory, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        log_error("Failed to open root directory %s: %s", config->root_directory, strerror(errno));
+        return -1;
+    }
+    
+    // Kernels before 5.6 don't have openat2(), and some sandboxes refuse it
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_PATH | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+    int fd = (int)syscall(SYS_openat2, root_fd, ".", &how, sizeof(how));
+    have_openat2 = fd >= 0;
+    if (fd >= 0) {
+        close(fd);
+    } else {
+        log_warning("openat2() unavailable (%s), resolving paths one component at a time", strerror(errno));
+    }
+    
     char resolved_root[PATH_MAX];
     if (realpath(config->root_directory, resolved_root) != NULL) {
         log_info("File operations initialized with absolute root directory: %s", resolved_root);
@@ -109,204 +438,261 @@ int init_file_ops(void) {
 }
 
 int cleanup_file_ops(void) {
-    // Nothing to clean up for now
+    if (root_fd >= 0) {
+        close(root_fd);
+        root_fd = -1;
+    }
     return 0;
 }
 
 int is_path_valid(const char *path) {
+    char rel[MAX_PATH_SIZE];
+
     if (path == NULL || *path == '\0') {
         return 0;
     }
-    // Deep path traversal is prevented in get_full_path via realpath logic.
-    return 1;
+    // A ".." component is refused rather than resolved
+    return normalize_path(path, rel, sizeof(rel)) == 0;
 }
 
-int read_file(const char *path, void *buffer, size_t size, size_t *bytes_read) {
-    if (!is_path_valid(path)) {
-        log_error("Invalid path: %s", path);
-        return -1;
+// Whether resolved path a is b or lies below it
+static int path_within(const char *a, const char *b) {
+    size_t len = strlen(b);
+    if (len == 1) {
+        return 1;  // Everything lies below /
     }
-    
-    char full_path[MAX_PATH_SIZE];
-    if (get_full_path(path, full_path, sizeof(full_path)) != 0) {
-        log_error("Failed to resolve path safely: %s", path);
+    return strncmp(a, b, len) == 0 && (a[len] == '\0' || a[len] == '/');
+}
+
+// Resolve a directory that may not exist yet: its deepest existing ancestor
+// through realpath(), then the missing components as they are
+static int resolve_missing(const char *dir, char *out) {
+    char path[PATH_MAX];
+    size_t len = strlen(dir);
+
+    if (len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
         return -1;
     }
-    
-    FILE *file = fopen(full_path, "rb");
-    if (file == NULL) {
-        log_error("Failed to open file %s for reading: %s", full_path, strerror(errno));
-        return -1;
+    memcpy(path, dir, len + 1);
+    while (realpath(path[0] != '\0' ? path : ".", out) == NULL) {
+        if (errno != ENOENT) {
+            return -1;
+        }
+        char *slash = strrchr(path, '/');
+        if (slash == NULL) {
+            path[0] = '\0';
+        } else {
+            slash[slash == path ? 1 : 0] = '\0';
+        }
     }
-    
-    *bytes_read = fread(buffer, 1, size, file);
-    if (*bytes_read == 0 && ferror(file)) {
-        log_error("Error reading file %s: %s", full_path, strerror(errno));
-        fclose(file);
+
+    // Nothing below the ancestor exists, so no link can lead elsewhere,
+    // but mkdir() would still follow a ".."
+    size_t out_len = strlen(out);
+    const char *rest = dir + strlen(path);
+    while (*rest != '\0') {
+        size_t n = strcspn(rest, "/");
+        if ((n == 1 && rest[0] == '.') || (n == 2 && rest[0] == '.' && rest[1] == '.')) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (n > 0) {
+            if (out_len + 1 + n >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            if (out_len > 1) {
+                out[out_len++] = '/';
+            }
+            memcpy(out + out_len, rest, n);
+            out_len += n;
+            out[out_len] = '\0';
+        }
+        rest += n + (rest[n] == '/');
+    }
+    return 0;
+}
+
+int is_outside_root(const char *dir) {
+    char root[PATH_MAX];
+    char resolved[PATH_MAX];
+
+    if (realpath(get_config()->root_directory, root) == NULL || resolve_missing(dir, resolved) != 0) {
         return -1;
     }
-    
-    fclose(file);
+    return !path_within(resolved, root) && !path_within(root, resolved);
+}
+
+int create_state_directory(const char *dir) {
+    char path[PATH_MAX];
+    int outside = is_outside_root(dir);
+
+    if (outside != 1) {
+        return outside == 0 ? EXDEV : errno;
+    }
+    // Checked before anything is created, so a refused directory leaves
+    // nothing behind in the served tree
+    size_t len = strlen(dir);
+    memcpy(path, dir, len + 1);
+    for (size_t i = 1; i <= len; i++) {
+        if (path[i] != '/' && path[i] != '\0') {
+            continue;
+        }
+        char c = path[i];
+        path[i] = '\0';
+        if (path[i - 1] != '/' && mkdir(path, 0700) != 0 && errno != EEXIST) {
+            return errno;
+        }
+        path[i] = c;
+    }
     return 0;
 }
 
-int write_file(const char *path, const void *buffer, size_t size) {
+int read_file(const char *path, void *buffer, size_t size, size_t *bytes_read) {
     if (!is_path_valid(path)) {
         log_error("Invalid path: %s", path);
         return -1;
     }
     
-    char full_path[MAX_PATH_SIZE];
-    if (get_full_path(path, full_path, sizeof(full_path)) != 0) {
-        log_error("Failed to resolve path safely for write: %s", path);
+    int fd = open_beneath(path, O_RDONLY, 0);
+    if (fd < 0) {
+        log_error("Failed to open file %s for reading: %s", path, strerror(errno));
         return -1;
     }
     
-    // Check if path is a directory
-    struct stat st;
-    if (stat(full_path, &st) == 0) {
-        if (S_ISDIR(st.st_mode)) {
-            log_error("Cannot write to %s: Is a directory", full_path);
+    *bytes_read = 0;
+    while (*bytes_read < size) {
+        ssize_t r = read(fd, (char *)buffer + *bytes_read, size - *bytes_read);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0) {
+            log_error("Error reading file %s: %s", path, strerror(errno));
+            close(fd);
             return -1;
         }
+        if (r == 0) {
+            break;
+        }
+        *bytes_read += (size_t)r;
     }
     
-    FILE *file = fopen(full_path, "wb");
-    if (file == NULL) {
-        log_error("Failed to open file %s for writing: %s", full_path, strerror(errno));
-        return -1;
-    }
-    
-    size_t bytes_written = fwrite(buffer, 1, size, file);
-    if (bytes_written != size) {
-        log_error("Error writing file %s: %s", full_path, strerror(errno));
-        fclose(file);
-        return -1;
-    }
-    
-    fclose(file);
-    log_info("File %s written successfully (%zu bytes)", path, size);
+    close(fd);
     return 0;
 }
 
-int delete_file(const char *path) {
+int write_file(const char *path, const void *buffer, size_t size) {
     if (!is_path_valid(path)) {
         log_error("Invalid path: %s", path);
         return -1;
     }
     
-    char full_path[MAX_PATH_SIZE];
-    if (get_full_path(path, full_path, sizeof(full_path)) != 0) {
-        return -1;
-    }
-    
-    struct stat st;
-    if (stat(full_path, &st) != 0) {
-        log_error("File %s does not exist", full_path);
+    // Opening a directory for writing fails with EISDIR
+    int fd = open_beneath(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        log_error("Failed to open file %s for writing: %s", path, strerror(errno));
         return -1;
     }
     
-    if (S_ISDIR(st.st_mode)) {
-        if (rmdir(full_path) != 0) {
-            log_error("Failed to delete directory %s: %s", full_path, strerror(errno));
-            return -1;
+    size_t bytes_written = 0;
+    while (bytes_written < size) {
+        ssize_t w = write(fd, (const char *)buffer + bytes_written, size - bytes_written);
+        if (w < 0 && errno == EINTR) {
+            continue;
         }
-    } else {
-        if (unlink(full_path) != 0) {
-            log_error("Failed to delete file %s: %s", full_path, strerror(errno));
+        if (w < 0) {
+            log_error("Error writing file %s: %s", path, strerror(errno));
+            close(fd);
             return -1;
         }
+        bytes_written += (size_t)w;
     }
     
-    log_info("Deleted %s", path);
+    close(fd);
+    log_info("File %s written successfully (%zu bytes)", path, size);
     return 0;
 }
 
-int list_directory(const char *path, file_info_t *entries, int max_entries, int *num_entries) {
+int delete_file(const char *path) {
+    char name[NAME_MAX + 1];
+    
     if (!is_path_valid(path)) {
         log_error("Invalid path: %s", path);
         return -1;
     }
     
-    char full_path[MAX_PATH_SIZE];
-    if (get_full_path(path, full_path, sizeof(full_path)) != 0) {
+    int dir_fd = open_parent_beneath(path, name, sizeof(name));
+    if (dir_fd < 0) {
+        log_error("Failed to delete %s: %s", path, strerror(errno));
         return -1;
     }
     
-    DIR *dir = opendir(full_path);
-    if (dir == NULL) {
-        log_error("Failed to open directory %s: %s", full_path, strerror(errno));
+    // Files are the common case, a directory answers EISDIR and is removed as one
+    int res = unlinkat(dir_fd, name, 0);
+    if (res != 0 && errno == EISDIR) {
+        res = unlinkat(dir_fd, name, AT_REMOVEDIR);
+    }
+    if (res != 0) {
+        log_error("Failed to delete %s: %s", path, strerror(errno));
+        close(dir_fd);
         return -1;
     }
     
-    struct dirent *entry;
-    int count = 0;
+    close(dir_fd);
+    log_info("Deleted %s", path);
+    return 0;
+}
+
+int list_directory(const char *path, file_info_t *entries, int max_entries, int *num_entries) {
+    char rel[MAX_PATH_SIZE];
     
-    while ((entry = readdir(dir)) != NULL && count < max_entries) {
-        // Skip . and ..
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        char entry_path[MAX_PATH_SIZE];
-        snprintf(entry_path, sizeof(entry_path), "%s/%s", full_path, entry->d_name);
-        
-        struct stat st;
-        if (stat(entry_path, &st) != 0) {
-            log_warning("Failed to get info for %s: %s", entry_path, strerror(errno));
-            continue;
-        }
-        
-        strncpy(entries[count].name, entry->d_name, sizeof(entries[count].name) - 1);
-        entries[count].name[sizeof(entries[count].name) - 1] = '\0';
-        entries[count].size = st.st_size;
-        entries[count].is_directory = S_ISDIR(st.st_mode) ? 1 : 0;
-        entries[count].modified_time = st.st_mtime;
-        
-        count++;
+    if (!is_path_valid(path) || normalize_path(path, rel, sizeof(rel)) != 0) {
+        log_error("Invalid path: %s", path);
+        return -1;
     }
     
-    closedir(dir);
-    *num_entries = count;
+    if (meta_cache_list(rel, entries, max_entries, num_entries) != 0) {
+        log_error("Failed to open directory %s: %s", path, strerror(errno));
+        return -1;
+    }
     
-    log_debug("Listed %d entries in directory %s", count, path);
+    log_debug("Listed %d entries in directory %s", *num_entries, path);
     return 0;
 }
 
 int create_directory(const char *path) {
+    char name[NAME_MAX + 1];
+    
     if (!is_path_valid(path)) {
         log_error("Invalid path: %s", path);
         return -1;
     }
     
-    char full_path[MAX_PATH_SIZE];
-    if (get_full_path(path, full_path, sizeof(full_path)) != 0) {
-        return -1;
-    }
-    
-    if (mkdir(full_path, 0755) != 0) {
-        log_error("Failed to create directory %s: %s", full_path, strerror(errno));
+    int dir_fd = open_parent_beneath(path, name, sizeof(name));
+    if (dir_fd < 0 || mkdirat(dir_fd, name, 0755) != 0) {
+        log_error("Failed to create directory %s: %s", path, strerror(errno));
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
         return -1;
     }
     
+    close(dir_fd);
     log_info("Created directory %s", path);
     return 0;
 }
 
 int get_file_info(const char *path, file_info_t *info) {
-    if (!is_path_valid(path)) {
-        log_error("Invalid path: %s", path);
-        return -1;
-    }
+    char rel[MAX_PATH_SIZE];
     
-    char full_path[MAX_PATH_SIZE];
-    if (get_full_path(path, full_path, sizeof(full_path)) != 0) {
+    if (!is_path_valid(path) || normalize_path(path, rel, sizeof(rel)) != 0) {
+        log_error("Invalid path: %s", path);
         return -1;
     }
     
-    struct stat st;
-    if (stat(full_path, &st) != 0) {
-        log_error("Failed to get info for %s: %s", full_path, strerror(errno));
+    if (meta_cache_stat(rel, info) != 0) {
+        log_error("Failed to get info for %s: %s", path, strerror(errno));
         return -1;
     }
     
@@ -319,9 +705,6 @@ int get_file_info(const char *path, file_info_t *info) {
     
     strncpy(info->name, filename, sizeof(info->name) - 1);
     info->name[sizeof(info->name) - 1] = '\0';
-    info->size = st.st_size;
-    info->is_directory = S_ISDIR(st.st_mode) ? 1 : 0;
-    info->modified_time = st.st_mtime;
     
     return 0;
 }
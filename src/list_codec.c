@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "../include/list_codec.h"
+
+void list_codec_reset(list_codec_t *codec, int fields, int keep_order) {
+    codec->name[0] = '\0';
+    codec->name_len = 0;
+    codec->mtime = 0;
+    codec->fields = fields;
+    codec->keep_order = keep_order;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+static int get_varint(const uint8_t *data, size_t len, size_t *pos, uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+        uint8_t b = data[(*pos)++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Small differences of either sign become small numbers: 0, -1, 1, -2, ...
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (value < 0 ? UINT64_MAX : 0);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(((const file_info_t *)a)->name, ((const file_info_t *)b)->name);
+}
+
+size_t list_encode_entries(list_codec_t *codec, file_info_t *entries, int num_entries, uint8_t *out) {
+    size_t n = 0;
+
+    if (!codec->keep_order) {
+        qsort(entries, (size_t)num_entries, sizeof(file_info_t), compare_names);
+    }
+    for (int i = 0; i < num_entries; i++) {
+        const file_info_t *e = &entries[i];
+        size_t len = strnlen(e->name, sizeof(e->name) - 1);
+        size_t shared = 0;
+        while (shared < len && shared < codec->name_len && e->name[shared] == codec->name[shared]) {
+            shared++;
+        }
+
+        out[n++] = e->is_directory && (codec->fields & LIST_FIELD_TYPE) ? LIST_RECORD_DIRECTORY : LIST_RECORD_FILE;
+        n += put_varint(out + n, shared);
+        n += put_varint(out + n, len - shared);
+        memcpy(out + n, e->name + shared, len - shared);
+        n += len - shared;
+        if (codec->fields & LIST_FIELD_SIZE) {
+            n += put_varint(out + n, e->size);
+        }
+        if (codec->fields & LIST_FIELD_MTIME) {
+            n += put_varint(out + n, zigzag((int64_t)((uint64_t)e->modified_time - (uint64_t)codec->mtime)));
+            codec->mtime = (int64_t)e->modified_time;
+        }
+
+        memcpy(codec->name + shared, e->name + shared, len - shared);
+        codec->name[len] = '\0';
+        codec->name_len = len;
+    }
+    return n;
+}
+
+size_t list_encode_trailer(uint64_t count, uint64_t cursor, uint8_t *out) {
+    uint64_t fields[2] = { htobe64(count), htobe64(cursor) };
+    out[0] = LIST_RECORD_TRAILER;
+    memcpy(out + 1, fields, sizeof(fields));
+    return LIST_TRAILER_RECORD_SIZE;
+}
+
+int list_decode_record(list_codec_t *codec, const uint8_t *data, size_t len, file_info_t *info,
+                       uint64_t trailer[2], size_t *used) {
+    if (len == 0) {
+        return -1;
+    }
+    if (data[0] == LIST_RECORD_TRAILER) {
+        if (len < LIST_TRAILER_RECORD_SIZE) {
+            return -1;
+        }
+        memcpy(trailer, data + 1, 2 * sizeof(uint64_t));
+        trailer[0] = be64toh(trailer[0]);
+        trailer[1] = be64toh(trailer[1]);
+        *used = LIST_TRAILER_RECORD_SIZE;
+        return LIST_RECORD_TRAILER;
+    }
+    if (data[0] != LIST_RECORD_FILE && data[0] != LIST_RECORD_DIRECTORY) {
+        return -1;
+    }
+
+    size_t pos = 1;
+    uint64_t shared, rest, size = 0, mtime = 0;
+    if (get_varint(data, len, &pos, &shared) != 0 || get_varint(data, len, &pos, &rest) != 0 ||
+        shared > codec->name_len || rest > sizeof(codec->name) - 1 - shared || rest > len - pos) {
+        return -1;
+    }
+    memcpy(codec->name + shared, data + pos, rest);
+    pos += rest;
+    if (((codec->fields & LIST_FIELD_SIZE) && get_varint(data, len, &pos, &size) != 0) ||
+        ((codec->fields & LIST_FIELD_MTIME) && get_varint(data, len, &pos, &mtime) != 0)) {
+        return -1;
+    }
+    codec->name_len = shared + rest;
+    codec->name[codec->name_len] = '\0';
+    codec->mtime = (int64_t)((uint64_t)codec->mtime + (uint64_t)unzigzag(mtime));
+
+    memset(info->name, 0, sizeof(info->name));
+    memcpy(info->name, codec->name, codec->name_len);
+    info->size = size;
+    info->is_directory = data[0] == LIST_RECORD_DIRECTORY;
+    info->modified_time = (codec->fields & LIST_FIELD_MTIME) ? (time_t)codec->mtime : 0;
+    *used = pos;
+    return data[0];
+}
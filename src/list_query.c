@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "../include/list_query.h"
+
+void list_query_init(list_query_t *query) {
+    query->filter.pattern = NULL;
+    query->filter.type = DIR_FILTER_ANY;
+    query->filter.min_size = 0;
+    query->filter.max_size = UINT64_MAX;
+    query->filter.min_mtime = INT64_MIN;
+    query->filter.max_mtime = INT64_MAX;
+    query->filter.need_stat = 1;
+    query->filter.need_type = 1;
+    query->fields = LIST_FIELDS_ALL;
+    query->sort = LIST_SORT_NONE;
+    query->descending = 0;
+    query->pattern[0] = '\0';
+}
+
+int list_query_parse(list_query_t *query, const char *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t ranges[4];
+
+    if (size < LIST_QUERY_SIZE || size != LIST_QUERY_SIZE + (size_t)p[3]) {
+        return -1;
+    }
+    list_query_init(query);
+    query->fields = p[0] & LIST_FIELDS_ALL;
+    query->filter.type = p[1];
+    query->sort = p[2] & ~LIST_SORT_DESCENDING;
+    query->descending = (p[2] & LIST_SORT_DESCENDING) != 0;
+    if (query->filter.type > DIR_FILTER_DIRECTORIES || query->sort > LIST_SORT_MTIME) {
+        return -1;
+    }
+
+    memcpy(ranges, data + 4, sizeof(ranges));
+    query->filter.min_size = be64toh(ranges[0]);
+    query->filter.max_size = be64toh(ranges[1]);
+    query->filter.min_mtime = (int64_t)be64toh(ranges[2]);
+    query->filter.max_mtime = (int64_t)be64toh(ranges[3]);
+
+    // The pattern is a C string, a NUL inside would cut it short
+    size_t pattern_len = p[3];
+    if (memchr(data + LIST_QUERY_SIZE, '\0', pattern_len) != NULL) {
+        return -1;
+    }
+    memcpy(query->pattern, data + LIST_QUERY_SIZE, pattern_len);
+    query->pattern[pattern_len] = '\0';
+    query->filter.pattern = pattern_len > 0 ? query->pattern : NULL;
+
+    // Entries are only stat'ed for what is asked for, filtered on or sorted by
+    query->filter.need_stat = (query->fields & (LIST_FIELD_SIZE | LIST_FIELD_MTIME)) ||
+                              query->filter.min_size > 0 || query->filter.max_size < UINT64_MAX ||
+                              query->filter.min_mtime > INT64_MIN || query->filter.max_mtime < INT64_MAX ||
+                              query->sort == LIST_SORT_SIZE || query->sort == LIST_SORT_MTIME;
+    query->filter.need_type = (query->fields & LIST_FIELD_TYPE) || query->filter.type != DIR_FILTER_ANY;
+    return 0;
+}
+
+size_t list_query_encode(const list_query_t *query, char *out) {
+    size_t pattern_len = query->filter.pattern != NULL ? strlen(query->filter.pattern) : 0;
+    uint64_t ranges[4] = { htobe64(query->filter.min_size), htobe64(query->filter.max_size),
+                           htobe64((uint64_t)query->filter.min_mtime), htobe64((uint64_t)query->filter.max_mtime) };
+
+    if (pattern_len > LIST_PATTERN_MAX) {
+        pattern_len = LIST_PATTERN_MAX;
+    }
+    out[0] = (char)query->fields;
+    out[1] = (char)query->filter.type;
+    out[2] = (char)(query->sort | (query->descending ? LIST_SORT_DESCENDING : 0));
+    out[3] = (char)pattern_len;
+    memcpy(out + 4, ranges, sizeof(ranges));
+    memcpy(out + LIST_QUERY_SIZE, query->filter.pattern, pattern_len);
+    return LIST_QUERY_SIZE + pattern_len;
+}
+
+// Order two entries by the sort key, names break ties so the order is total
+static int compare_entries(const void *a, const void *b, void *arg) {
+    const list_query_t *query = arg;
+    const file_info_t *x = a;
+    const file_info_t *y = b;
+    int c = 0;
+
+    if (query->sort == LIST_SORT_SIZE) {
+        c = (x->size > y->size) - (x->size < y->size);
+    } else if (query->sort == LIST_SORT_MTIME) {
+        c = (x->modified_time > y->modified_time) - (x->modified_time < y->modified_time);
+    }
+    if (c == 0) {
+        c = strcmp(x->name, y->name);
+    }
+    return query->descending ? -c : c;
+}
+
+void list_query_sort(const list_query_t *query, file_info_t *entries, int num_entries) {
+    qsort_r(entries, (size_t)num_entries, sizeof(file_info_t), compare_entries, (void *)query);
+}
+
+int list_top_init(list_top_t *top, const list_query_t *query, int capacity) {
+    top->query = query;
+    top->count = 0;
+    top->capacity = capacity;
+    top->entries = malloc((size_t)capacity * sizeof(file_info_t) + 2 * sizeof(uint64_t));
+    return top->entries != NULL ? 0 : -1;
+}
+
+static void swap_entries(file_info_t *a, file_info_t *b) {
+    file_info_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
+void list_top_push(list_top_t *top, const file_info_t *entry) {
+    file_info_t *heap = top->entries;
+    void *query = (void *)top->query;
+
+    if (top->count < top->capacity) {
+        // Sift up from the new leaf
+        int i = top->count++;
+        heap[i] = *entry;
+        while (i > 0 && compare_entries(&heap[(i - 1) / 2], &heap[i], query) < 0) {
+            swap_entries(&heap[(i - 1) / 2], &heap[i]);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    if (top->capacity == 0 || compare_entries(entry, &heap[0], query) >= 0) {
+        return;
+    }
+
+    // Replace the root, the last entry kept, and sift down
+    heap[0] = *entry;
+    for (int i = 0;;) {
+        int largest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < top->count && compare_entries(&heap[left], &heap[largest], query) > 0) {
+            largest = left;
+        }
+        if (right < top->count && compare_entries(&heap[right], &heap[largest], query) > 0) {
+            largest = right;
+        }
+        if (largest == i) {
+            break;
+        }
+        swap_entries(&heap[i], &heap[largest]);
+        i = largest;
+    }
+}
+
+void list_top_finish(list_top_t *top) {
+    list_query_sort(top->query, top->entries, top->count);
+}
@@ -12,7 +12,7 @@
 #include "../include/auth.h"
 
 #define DEFAULT_PORT 9090
-#define DEFAULT_BACKLOG 10
+#define DEFAULT_BACKLOG SOMAXCONN  // Let connection bursts queue in the kernel instead of dropping SYNs
 #define DEFAULT_CONFIG_PATH "config/cileserver.conf"
 #define DEFAULT_AUTH_FILE "config/users.auth"
 
@@ -123,16 +123,16 @@ int main(int argc, char *argv[]) {
         log_info("Authentication disabled");
     }
     
-    // Main server loop
+    // Main server loop, server_process() blocks until there is work or a signal arrives
     while (keep_running) {
-        server_process();
-        usleep(10000); // 10ms sleep to prevent CPU hogging
+        if (server_process() != 0) {
+            break;
+        }
     }
     
     // Cleanup
     shutdown_server();
     cleanup_logger();
     
-    log_info("Server shutdown complete");
     return 0;
 } 
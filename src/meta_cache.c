@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "../include/meta_cache.h"
+#include "../include/config.h"
+#include "../include/logger.h"
+
+#define WATCH_MASK (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_GONE (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)
+#define SUBDIR_GONE (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)  // Along with IN_ISDIR
+#define EVENT_BUFFER_SIZE 16384
+
+// An inotify watch on a directory. Every watch holds a reference to the one
+// on its parent, up to the root directory, so the renaming of any ancestor
+// of a cached path is seen. Paths are relative to the root directory, which
+// has the empty one.
+typedef struct meta_watch {
+    int wd;
+    int refs;                   // Entries, fills and subdirectory watches using it
+    int attached;               // Found by path and wd, cleared when the cache is flushed
+    uint64_t events;            // Events seen so far
+    struct meta_watch *parent;  // NULL for the root directory
+    struct meta_watch *next_wd;
+    struct meta_watch *next_path;
+    char path[];
+} meta_watch_t;
+
+typedef struct meta_entry {
+    struct meta_entry *next;    // Hash chain
+    struct meta_entry *newer;   // LRU list
+    struct meta_entry *older;
+    meta_watch_t *watch;        // Directory whose events invalidate the entry
+    int is_list;
+    int error;                  // errno of a path that doesn't exist, 0 for a stat result
+    uint64_t size;
+    int is_directory;
+    time_t modified_time;
+    file_info_t *list;          // Listing, and whether it holds all of the directory
+    int num_entries;
+    int complete;
+    char path[];
+} meta_entry_t;
+
+// A lookup that missed. The watch is held while the filesystem is read
+// without the lock, the result is only kept if no event came in meanwhile.
+typedef struct {
+    meta_watch_t *watch;
+    uint64_t events;
+    uint64_t flushes;
+} meta_fill_t;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int inotify_fd = -1;
+static char event_buffer[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+static size_t capacity;
+static size_t count;
+static size_t num_buckets;                   // Power of two
+static meta_entry_t **entry_buckets;
+static meta_watch_t **wd_buckets;
+static meta_watch_t **path_buckets;
+static meta_entry_t *newest;
+static meta_entry_t *oldest;
+static uint64_t flushes;                     // Times every entry was dropped
+static char root[PATH_MAX];                  // Absolute, inotify takes no directory descriptor
+static size_t root_len;
+
+static size_t hash_path(const char *path, int kind) {
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)kind;
+    for (; *path != '\0'; path++) {
+        h ^= (uint8_t)*path;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h & (num_buckets - 1);
+}
+
+static int join_path(char *out, size_t out_size, const char *dir, const char *name) {
+    int len = snprintf(out, out_size, dir[0] == '\0' ? "%s%s" : "%s/%s", dir, name);
+    return len < 0 || (size_t)len >= out_size ? -1 : 0;
+}
+
+// Length of the parent of a path, 0 for the root directory
+static size_t parent_length(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? (size_t)(slash - path) : 0;
+}
+
+// Caller holds cache_mutex, as for all functions up to the public ones
+
+static meta_watch_t *find_watch_wd(int wd) {
+    meta_watch_t *w = wd_buckets[(size_t)wd & (num_buckets - 1)];
+    while (w != NULL && w->wd != wd) {
+        w = w->next_wd;
+    }
+    return w;
+}
+
+static meta_watch_t *find_watch_path(const char *path) {
+    meta_watch_t *w = path_buckets[hash_path(path, 2)];
+    while (w != NULL && strcmp(w->path, path) != 0) {
+        w = w->next_path;
+    }
+    return w;
+}
+
+static void detach_watch(meta_watch_t *w) {
+    meta_watch_t **p = &wd_buckets[(size_t)w->wd & (num_buckets - 1)];
+    while (*p != w) {
+        p = &(*p)->next_wd;
+    }
+    *p = w->next_wd;
+    p = &path_buckets[hash_path(w->path, 2)];
+    while (*p != w) {
+        p = &(*p)->next_path;
+    }
+    *p = w->next_path;
+    w->attached = 0;
+}
+
+static void release_watch(meta_watch_t *w) {
+    while (w != NULL && --w->refs == 0) {
+        meta_watch_t *parent = w->parent;
+        if (w->attached) {
+            detach_watch(w);
+            inotify_rm_watch(inotify_fd, w->wd);
+        } else if (find_watch_wd(w->wd) == NULL) {
+            inotify_rm_watch(inotify_fd, w->wd);  // Unless the directory is watched again since
+        }
+        free(w);
+        w = parent;
+    }
+}
+
+// Watch one directory. The new watch takes over the caller's reference to parent.
+static meta_watch_t *add_watch(const char *path, meta_watch_t *parent) {
+    char full_path[PATH_MAX];
+    int n = snprintf(full_path, sizeof(full_path), path[0] != '\0' ? "%s/%s" : "%s%s", root, path);
+    if (n < 0 || (size_t)n >= sizeof(full_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int wd = inotify_add_watch(inotify_fd, full_path, WATCH_MASK);
+    if (wd < 0) {
+        return NULL;
+    }
+    if (find_watch_wd(wd) != NULL) {
+        // Watched under another path, the directory was renamed and the event is still on its way
+        errno = ESTALE;
+        return NULL;
+    }
+    size_t len = strlen(path);
+    meta_watch_t *w = calloc(1, sizeof(*w) + len + 1);
+    if (w == NULL) {
+        inotify_rm_watch(inotify_fd, wd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    w->wd = wd;
+    w->refs = 1;
+    w->attached = 1;
+    w->parent = parent;
+    memcpy(w->path, path, len + 1);
+    size_t wd_bucket = (size_t)wd & (num_buckets - 1);
+    size_t path_bucket = hash_path(path, 2);
+    w->next_wd = wd_buckets[wd_bucket];
+    wd_buckets[wd_bucket] = w;
+    w->next_path = path_buckets[path_bucket];
+    path_buckets[path_bucket] = w;
+    return w;
+}
+
+// Take a reference to the watch on a directory, watching it and any of its
+// ancestors that aren't yet. Returns NULL with errno set on failure.
+static meta_watch_t *acquire_watch(const char *dir) {
+    char path[PATH_MAX];
+    size_t dir_len = strlen(dir);
+    memcpy(path, dir, dir_len + 1);
+
+    // Climb to the nearest directory that is watched already
+    size_t len = dir_len;
+    meta_watch_t *w;
+    while ((w = find_watch_path(path)) == NULL && len > 0) {
+        len = parent_length(path);
+        path[len] = '\0';
+    }
+    if (w != NULL) {
+        w->refs++;
+    }
+
+    // Then watch each directory on the way back down
+    while (w == NULL || len < dir_len) {
+        if (w != NULL) {
+            const char *slash = strchr(len == 0 ? dir : dir + len + 1, '/');
+            len = slash != NULL ? (size_t)(slash - dir) : dir_len;
+            memcpy(path, dir, len);
+            path[len] = '\0';
+        }
+        meta_watch_t *child = add_watch(path, w);
+        if (child == NULL) {
+            int err = errno;
+            release_watch(w);
+            errno = err;
+            return NULL;
+        }
+        w = child;
+    }
+    return w;
+}
+
+static meta_entry_t **find_entry(const char *path, int is_list) {
+    meta_entry_t **p = &entry_buckets[hash_path(path, is_list)];
+    while (*p != NULL && ((*p)->is_list != is_list || strcmp((*p)->path, path) != 0)) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static void lru_unlink(meta_entry_t *e) {
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        newest = e->older;
+    }
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        oldest = e->newer;
+    }
+}
+
+static void lru_push(meta_entry_t *e) {
+    e->newer = NULL;
+    e->older = newest;
+    if (newest != NULL) {
+        newest->newer = e;
+    } else {
+        oldest = e;
+    }
+    newest = e;
+}
+
+static void free_entry(meta_entry_t *e) {
+    if (e != NULL) {
+        free(e->list);
+        free(e);
+    }
+}
+
+static void remove_entry(meta_entry_t *e) {
+    meta_entry_t **p = find_entry(e->path, e->is_list);
+    *p = e->next;
+    lru_unlink(e);
+    count--;
+    release_watch(e->watch);
+    free_entry(e);
+}
+
+static void invalidate(const char *path) {
+    for (int is_list = 0; is_list <= 1; is_list++) {
+        meta_entry_t *e = *find_entry(path, is_list);
+        if (e != NULL) {
+            remove_entry(e);
+        }
+    }
+}
+
+// Drop every entry. Watches still held by fills are detached, so later
+// lookups watch their directories anew, and the fills are dropped.
+static void flush_cache(void) {
+    while (oldest != NULL) {
+        remove_entry(oldest);
+    }
+    for (size_t i = 0; i < num_buckets; i++) {
+        for (meta_watch_t *w = wd_buckets[i]; w != NULL; w = w->next_wd) {
+            w->attached = 0;
+        }
+        wd_buckets[i] = NULL;
+        path_buckets[i] = NULL;
+    }
+    flushes++;
+}
+
+static void handle_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        flush_cache();
+        return;
+    }
+    meta_watch_t *w = find_watch_wd(ev->wd);
+    if (w == NULL) {
+        return;  // Removed since
+    }
+
+    // A directory that moved or went away takes whatever was cached below it
+    if ((ev->mask & WATCH_GONE) || (ev->len > 0 && (ev->mask & IN_ISDIR) && (ev->mask & SUBDIR_GONE))) {
+        flush_cache();
+        return;
+    }
+
+    // Anything happening in a directory changes its listing and maybe its mtime
+    char path[PATH_MAX];
+    w->events++;
+    invalidate(w->path);
+    if (ev->len > 0 && join_path(path, sizeof(path), w->path, ev->name) == 0) {
+        invalidate(path);
+    }
+}
+
+static void drain_events(void) {
+    for (;;) {
+        ssize_t r = read(inotify_fd, event_buffer, sizeof(event_buffer));
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return;  // Nothing pending
+        }
+        for (ssize_t pos = 0; pos < r; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)(event_buffer + pos);
+            handle_event(ev);
+            pos += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+static int start_fill(meta_fill_t *fill, const char *dir) {
+    fill->watch = acquire_watch(dir);
+    if (fill->watch == NULL) {
+        return -1;
+    }
+    fill->events = fill->watch->events;
+    fill->flushes = flushes;
+    return 0;
+}
+
+// Store what a fill read, unless something changed while it did. The
+// entry takes over the fill's watch reference.
+static void finish_fill(meta_fill_t *fill, meta_entry_t *e) {
+    drain_events();
+    if (e == NULL || fill->flushes != flushes || fill->watch->events != fill->events) {
+        release_watch(fill->watch);
+        free_entry(e);
+        return;
+    }
+
+    meta_entry_t *old = *find_entry(e->path, e->is_list);
+    if (old != NULL) {
+        remove_entry(old);  // Filled by another request meanwhile
+    }
+    if (count == capacity) {
+        remove_entry(oldest);
+    }
+    meta_entry_t **p = &entry_buckets[hash_path(e->path, e->is_list)];
+    e->watch = fill->watch;
+    e->next = *p;
+    *p = e;
+    lru_push(e);
+    count++;
+}
+
+static meta_entry_t *new_entry(const char *path, int is_list) {
+    size_t len = strlen(path);
+    meta_entry_t *e = calloc(1, sizeof(*e) + len + 1);
+    if (e != NULL) {
+        e->is_list = is_list;
+        memcpy(e->path, path, len + 1);
+    }
+    return e;
+}
+
+static int cacheable(const char *path) {
+    return inotify_fd >= 0 && root_len + 1 + strlen(path) < PATH_MAX;
+}
+
+// Read a directory's entries and their metadata, complete tells whether all
+// of them fit and linked whether any of them is a symlink
+static int read_directory(const char *path, file_info_t *entries, int max_entries, int *num_entries,
+                          int *complete, int *linked) {
+    dir_reader_t reader;
+    if (dir_reader_open(&reader, path, 0) != 0) {
+        return -1;
+    }
+    int res = dir_reader_read(&reader, NULL, entries, max_entries, num_entries);
+    int err = errno;
+    *complete = reader.done;
+    *linked = reader.linked;
+    dir_reader_close(&reader);
+    errno = err;
+    return res;
+}
+
+int meta_cache_init(void) {
+    server_config_t *config = get_config();
+
+    if (config->meta_cache_entries <= 0) {
+        log_info("Metadata cache disabled");
+        return 0;
+    }
+    if (realpath(config->root_directory, root) == NULL) {
+        log_warning("Metadata cache disabled, root directory unavailable: %s", strerror(errno));
+        return 0;
+    }
+    root_len = strlen(root);
+
+    capacity = (size_t)config->meta_cache_entries;
+    num_buckets = 64;
+    while (num_buckets < capacity) {
+        num_buckets <<= 1;
+    }
+    entry_buckets = calloc(num_buckets, sizeof(*entry_buckets));
+    wd_buckets = calloc(num_buckets, sizeof(*wd_buckets));
+    path_buckets = calloc(num_buckets, sizeof(*path_buckets));
+    if (entry_buckets == NULL || wd_buckets == NULL || path_buckets == NULL) {
+        meta_cache_cleanup();
+        return -1;
+    }
+
+    // Without inotify changes can't be seen, so nothing is cached
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        log_warning("Metadata cache disabled, inotify unavailable: %s", strerror(errno));
+        meta_cache_cleanup();
+        return 0;
+    }
+    log_info("Metadata cache holds up to %zu entries", capacity);
+    return 0;
+}
+
+void meta_cache_cleanup(void) {
+    pthread_mutex_lock(&cache_mutex);
+    if (inotify_fd >= 0) {
+        flush_cache();
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    free(entry_buckets);
+    free(wd_buckets);
+    free(path_buckets);
+    entry_buckets = NULL;
+    wd_buckets = NULL;
+    path_buckets = NULL;
+    count = 0;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+int meta_cache_stat(const char *path, file_info_t *info) {
+    struct stat st;
+    meta_fill_t fill;
+    int watched = 0;
+    int expect_dir = 0;
+    int linked = 0;
+
+    if (cacheable(path)) {
+        pthread_mutex_lock(&cache_mutex);
+        drain_events();
+        meta_entry_t *e = *find_entry(path, 0);
+        if (e != NULL) {
+            lru_unlink(e);
+            lru_push(e);
+            int err = e->error;
+            info->size = e->size;
+            info->is_directory = e->is_directory;
+            info->modified_time = e->modified_time;
+            pthread_mutex_unlock(&cache_mutex);
+            errno = err;
+            return err != 0 ? -1 : 0;
+        }
+
+        // A directory's entry depends on the directory's watch, anything
+        // else's on the parent's, where it would be created or removed
+        if (path[0] == '\0') {
+            watched = start_fill(&fill, path) == 0;
+            expect_dir = 1;
+        } else {
+            char parent[PATH_MAX];
+            size_t len = parent_length(path);
+            memcpy(parent, path, len);
+            parent[len] = '\0';
+            watched = start_fill(&fill, parent) == 0;
+            meta_watch_t *self = watched ? acquire_watch(path) : NULL;
+            if (self != NULL) {
+                release_watch(fill.watch);
+                fill.watch = self;
+                fill.events = self->events;
+                expect_dir = 1;
+            }
+        }
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+    int err = stat_beneath(path, &st, &linked);
+    if (watched) {
+        // The type must match the watch, a path that changed type meanwhile isn't kept
+        int keep = err == 0 ? (S_ISDIR(st.st_mode) != 0) == expect_dir
+                            : (err == ENOENT || err == ENOTDIR) && !expect_dir;
+        meta_entry_t *e = keep && !linked ? new_entry(path, 0) : NULL;
+        if (e != NULL) {
+            e->error = err;
+            e->size = err == 0 ? (uint64_t)st.st_size : 0;
+            e->is_directory = err == 0 && S_ISDIR(st.st_mode);
+            e->modified_time = err == 0 ? st.st_mtime : 0;
+        }
+        pthread_mutex_lock(&cache_mutex);
+        finish_fill(&fill, e);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    info->size = st.st_size;
+    info->is_directory = S_ISDIR(st.st_mode) ? 1 : 0;
+    info->modified_time = st.st_mtime;
+    return 0;
+}
+
+int meta_cache_list(const char *path, file_info_t *entries, int max_entries, int *num_entries) {
+    meta_fill_t fill;
+    int watched = 0;
+    int complete;
+    int linked = 0;
+
+    if (cacheable(path)) {
+        pthread_mutex_lock(&cache_mutex);
+        drain_events();
+        meta_entry_t *e = *find_entry(path, 1);
+        if (e != NULL && (e->complete || e->num_entries >= max_entries)) {
+            lru_unlink(e);
+            lru_push(e);
+            *num_entries = e->num_entries < max_entries ? e->num_entries : max_entries;
+            memcpy(entries, e->list, (size_t)*num_entries * sizeof(file_info_t));
+            pthread_mutex_unlock(&cache_mutex);
+            return 0;
+        }
+        watched = start_fill(&fill, path) == 0;
+        pthread_mutex_unlock(&cache_mutex);
+    }
+
+    int res = read_directory(path, entries, max_entries, num_entries, &complete, &linked);
+    int err = errno;
+    if (watched) {
+        meta_entry_t *e = NULL;
+        if (res == 0 && !linked && *num_entries <= META_CACHE_MAX_LIST && (e = new_entry(path, 1)) != NULL) {
+            e->list = malloc((size_t)*num_entries * sizeof(file_info_t) + 1);
+            if (e->list != NULL) {
+                memcpy(e->list, entries, (size_t)*num_entries * sizeof(file_info_t));
+                e->num_entries = *num_entries;
+                e->complete = complete;
+            } else {
+                free_entry(e);
+                e = NULL;
+            }
+        }
+        pthread_mutex_lock(&cache_mutex);
+        finish_fill(&fill, e);
+        pthread_mutex_unlock(&cache_mutex);
+    }
+    errno = err;
+    return res;
+}
@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "../include/mux.h"
+#include "../include/protocol.h"
+#include "../include/logger.h"
+
+int mux_enable(connection_t *conn) {
+    mux_state_t *mux = calloc(1, sizeof(mux_state_t));
+    if (mux == NULL) {
+        log_error("Failed to allocate stream state for client %d", conn->fd);
+        return -1;
+    }
+    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+        mux->streams[i].file_fd = -1;
+    }
+    conn->mux = mux;
+    return 0;
+}
+
+static mux_stream_t *find_stream(mux_state_t *mux, uint32_t id) {
+    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+        if (mux->streams[i].kind != MUX_STREAM_FREE && mux->streams[i].id == id) {
+            return &mux->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static mux_stream_t *claim_stream(connection_t *conn) {
+    mux_state_t *mux = conn->mux;
+    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+        mux_stream_t *s = &mux->streams[i];
+        if (s->kind == MUX_STREAM_FREE) {
+            memset(s, 0, sizeof(*s));
+            s->id = conn->mux_stream;
+            s->window = STREAM_INITIAL_WINDOW;
+            mux->num_streams++;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void drop_stream(mux_state_t *mux, mux_stream_t *s) {
+    if (s->file_fd >= 0) {
+        close(s->file_fd);
+    }
+    s->file_fd = -1;
+    s->kind = MUX_STREAM_FREE;
+    mux->num_streams--;
+}
+
+static int queue_frame(connection_t *conn, uint8_t type, uint32_t stream, const void *data, uint32_t length) {
+    char header[FRAME_HEADER_SIZE];
+    encode_frame_header(header, type, stream, length);
+    if (conn_queue_output(conn, header, sizeof(header)) != 0 || conn_queue_output(conn, data, length) != 0) {
+        log_error("Failed to queue frame for client %d", conn->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Hand a finished PUT payload to its handler, whose response belongs to the stream
+static int finish_recv(connection_t *conn, mux_stream_t *s, int status) {
+    conn_stream_done_t done = s->done;
+    conn->mux_stream = s->id;
+    conn->upload_id = s->upload_id;
+    conn->upload_offset = s->upload_offset;
+    drop_stream(conn->mux, s);
+    return done != NULL ? done(conn, status) : 0;
+}
+
+void mux_disable(connection_t *conn) {
+    mux_state_t *mux = conn->mux;
+    if (mux == NULL) {
+        return;
+    }
+    for (int i = 0; i < MUX_MAX_STREAMS; i++) {
+        mux_stream_t *s = &mux->streams[i];
+        if (s->kind == MUX_STREAM_RECV) {
+            finish_recv(conn, s, -1);
+        } else if (s->kind != MUX_STREAM_FREE) {
+            drop_stream(mux, s);
+        }
+    }
+    free(mux);
+    conn->mux = NULL;
+    conn->mux_stream = 0;
+}
+
+int mux_streams_full(const connection_t *conn) {
+    return conn->mux->num_streams >= MUX_MAX_STREAMS;
+}
+
+void mux_start_send(connection_t *conn, int file_fd, uint64_t offset, uint64_t length) {
+    mux_stream_t *s = length > 0 ? claim_stream(conn) : NULL;
+    if (s == NULL) {
+        // Nothing to send, or no slot (requests that open streams are refused before that happens)
+        close(file_fd);
+        if (length > 0) {
+            queue_frame(conn, FRAME_CANCEL, conn->mux_stream, NULL, 0);
+        }
+        return;
+    }
+    s->kind = MUX_STREAM_SEND;
+    s->file_fd = file_fd;
+    s->offset = offset;
+    s->remaining = length;
+}
+
+void mux_start_recv(connection_t *conn, int file_fd, uint64_t length, conn_stream_done_t done) {
+    int chunked = length == CONN_LENGTH_CHUNKED;
+    mux_stream_t *s = chunked || length > 0 ? claim_stream(conn) : NULL;
+    if (s == NULL) {
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        if (done != NULL) {
+            done(conn, chunked || length > 0 ? -1 : 0);
+        }
+        return;
+    }
+    s->kind = MUX_STREAM_RECV;
+    s->file_fd = file_fd;
+    s->chunked = chunked;
+    s->remaining = chunked ? 0 : length;
+    s->done = done;
+    s->upload_id = conn->upload_id;
+    s->upload_offset = conn->upload_offset;
+}
+
+// Write part of a DATA payload to the stream's file. After a write error the
+// rest of the payload is discarded and the error reported once it has arrived.
+static void store_data(connection_t *conn, mux_stream_t *s, const char *data, size_t len) {
+    size_t written = 0;
+    while (s->file_fd >= 0 && written < len) {
+        ssize_t w = write(s->file_fd, data + written, len - written);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Failed to write file for client %d: %s", conn->fd, strerror(errno));
+            s->error = errno;
+            close(s->file_fd);
+            s->file_fd = -1;
+            return;
+        }
+        written += w;
+    }
+}
+
+// Consume as much of the current DATA payload as has arrived.
+// Returns 0 once the frame is complete, 1 if more input is needed.
+static int read_data(connection_t *conn) {
+    mux_state_t *mux = conn->mux;
+    mux_stream_t *s = find_stream(mux, mux->in_stream);
+    if (s != NULL && s->kind != MUX_STREAM_RECV) {
+        s = NULL;  // DATA for a stream that doesn't take any is dropped
+    }
+    
+    while (mux->in_left > 0 && conn_input_len(conn) > 0) {
+        size_t len = conn_input_len(conn);
+        if (len > mux->in_left) {
+            len = mux->in_left;
+        }
+        if (len > sizeof(conn->in_buf)) {
+            len = sizeof(conn->in_buf);
+        }
+        conn_input_peek(conn, 0, conn->in_buf, len);
+        conn_input_consume(conn, len);
+        if (s != NULL) {
+            store_data(conn, s, conn->in_buf, len);
+        }
+        mux->in_left -= len;
+    }
+    return mux->in_left > 0 ? 1 : 0;
+}
+
+// Start reading a DATA frame. Returns 0 on success, -1 if it breaks flow control.
+static int begin_data(connection_t *conn, uint32_t stream, uint32_t length) {
+    mux_state_t *mux = conn->mux;
+    mux_stream_t *s = find_stream(mux, stream);
+    
+    mux->in_stream = stream;
+    mux->in_length = length;
+    mux->in_left = length;
+    if (s == NULL || s->kind != MUX_STREAM_RECV) {
+        return 0;  // Cancelled or refused stream, the payload is skipped
+    }
+    if (length > s->window || (!s->chunked && length > s->remaining)) {
+        log_error("Client %d overran stream %u", conn->fd, stream);
+        return -1;
+    }
+    s->window -= length;
+    if (!s->chunked) {
+        s->remaining -= length;
+    }
+    return 0;
+}
+
+// After a whole DATA frame: finish the stream, or let the client send as much again
+static int end_data(connection_t *conn, uint32_t length) {
+    mux_state_t *mux = conn->mux;
+    mux_stream_t *s = find_stream(mux, mux->in_stream);
+    if (s == NULL || s->kind != MUX_STREAM_RECV) {
+        return 0;
+    }
+    
+    if (s->chunked ? length == 0 : s->remaining == 0) {
+        return finish_recv(conn, s, s->error) != 0 ? -1 : 0;
+    }
+    
+    uint32_t increment = htonl(length);
+    s->window += length;
+    return length > 0 ? queue_frame(conn, FRAME_WINDOW, s->id, &increment, sizeof(increment)) : 0;
+}
+
+int mux_read_frames(connection_t *conn, uint32_t *request_length) {
+    mux_state_t *mux = conn->mux;
+    
+    for (;;) {
+        // Finish a DATA payload cut short by the end of the input
+        if (mux->in_left > 0) {
+            if (read_data(conn) != 0) {
+                return 0;
+            }
+            if (end_data(conn, mux->in_length) != 0) {
+                return -1;
+            }
+        }
+    
+        size_t avail = conn_input_len(conn);
+        if (avail < FRAME_HEADER_SIZE) {
+            return 0;
+        }
+        char header[FRAME_HEADER_SIZE];
+        uint8_t type;
+        uint32_t stream;
+        uint32_t length;
+        conn_input_peek(conn, 0, header, sizeof(header));
+        decode_frame_header(header, &type, &stream, &length);
+    
+        switch (type) {
+            case FRAME_REQUEST: {
+                // Stream ids may be reused, but not while the stream is still open
+                if (stream == 0 || find_stream(mux, stream) != NULL) {
+                    log_error("Client %d opened stream %u twice", conn->fd, stream);
+                    return -1;
+                }
+                size_t want = length < CONN_BUFFER_SIZE ? length : CONN_BUFFER_SIZE;
+                if (avail < FRAME_HEADER_SIZE + want) {
+                    return 0;
+                }
+                conn_input_consume(conn, FRAME_HEADER_SIZE);
+                conn->mux_stream = stream;
+                *request_length = length;
+                return 1;
+            }
+    
+            case FRAME_DATA: {
+                if (length > FRAME_MAX_DATA) {
+                    log_error("DATA frame of %u bytes from client %d", length, conn->fd);
+                    return -1;
+                }
+                conn_input_consume(conn, FRAME_HEADER_SIZE);
+                if (begin_data(conn, stream, length) != 0) {
+                    return -1;
+                }
+                if (read_data(conn) != 0) {
+                    return 0;
+                }
+                if (end_data(conn, length) != 0) {
+                    return -1;
+                }
+                break;
+            }
+    
+            case FRAME_WINDOW: {
+                uint32_t increment;
+                if (length != WINDOW_UPDATE_SIZE) {
+                    log_error("Malformed WINDOW frame from client %d", conn->fd);
+                    return -1;
+                }
+                if (avail < FRAME_HEADER_SIZE + WINDOW_UPDATE_SIZE) {
+                    return 0;
+                }
+                conn_input_peek(conn, FRAME_HEADER_SIZE, &increment, sizeof(increment));
+                conn_input_consume(conn, FRAME_HEADER_SIZE + WINDOW_UPDATE_SIZE);
+                mux_stream_t *s = find_stream(mux, stream);
+                if (s != NULL && s->kind == MUX_STREAM_SEND) {
+                    s->window += ntohl(increment);
+                }
+                break;
+            }
+    
+            case FRAME_CANCEL: {
+                if (length != 0) {
+                    log_error("Malformed CANCEL frame from client %d", conn->fd);
+                    return -1;
+                }
+                conn_input_consume(conn, FRAME_HEADER_SIZE);
+                mux_stream_t *s = find_stream(mux, stream);
+                if (s != NULL && s->kind == MUX_STREAM_RECV) {
+                    log_debug("Client %d cancelled upload stream %u", conn->fd, stream);
+                    finish_recv(conn, s, -1);
+                } else if (s != NULL) {
+                    log_debug("Client %d cancelled download stream %u", conn->fd, stream);
+                    drop_stream(mux, s);
+                }
+                break;
+            }
+    
+            default:
+                log_error("Unknown frame type %d from client %d", type, conn->fd);
+                return -1;
+        }
+    }
+}
+
+// Read the next DATA payload of a GET stream into a frame buffer.
+// Returns the frame, or NULL if the file can't be read any more.
+static char *read_frame(connection_t *conn, mux_stream_t *s, size_t len) {
+    char *frame = malloc(FRAME_HEADER_SIZE + len);
+    if (frame == NULL) {
+        log_error("Failed to allocate %zu byte frame", len);
+        return NULL;
+    }
+    
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread(s->file_fd, frame + FRAME_HEADER_SIZE + done, len - done, s->offset + done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            if (r == 0) {
+                log_error("File truncated while streaming to client %d", conn->fd);
+            } else {
+                log_error("Failed to read file for client %d: %s", conn->fd, strerror(errno));
+            }
+            free(frame);
+            return NULL;
+        }
+        done += r;
+    }
+    encode_frame_header(frame, FRAME_DATA, s->id, (uint32_t)len);
+    return frame;
+}
+
+int mux_fill_output(connection_t *conn) {
+    mux_state_t *mux = conn->mux;
+    int queued = 0;
+    
+    // One frame per stream and round, so every transfer moves at the same pace
+    for (int n = 0; n < MUX_MAX_STREAMS && queued < MUX_ROUND_FRAMES; n++) {
+        mux_stream_t *s = &mux->streams[mux->next_send];
+        mux->next_send = (mux->next_send + 1) % MUX_MAX_STREAMS;
+        if (s->kind != MUX_STREAM_SEND || s->window == 0) {
+            continue;
+        }
+    
+        size_t len = s->remaining < FRAME_MAX_DATA ? s->remaining : FRAME_MAX_DATA;
+        if (len > s->window) {
+            len = s->window;
+        }
+        char *frame = read_frame(conn, s, len);
+        if (frame == NULL) {
+            // The response header is out already, the client learns of the failure by the cancel
+            uint32_t id = s->id;
+            drop_stream(mux, s);
+            if (queue_frame(conn, FRAME_CANCEL, id, NULL, 0) != 0) {
+                return -1;
+            }
+            queued++;
+            continue;
+        }
+        if (conn_queue_output_buffer(conn, frame, FRAME_HEADER_SIZE + len) != 0) {
+            return -1;
+        }
+    
+        s->offset += len;
+        s->remaining -= len;
+        s->window -= len;
+        if (s->remaining == 0) {
+            drop_stream(mux, s);
+        }
+        queued++;
+    }
+    return queued > 0;
+}
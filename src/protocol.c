@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,30 +6,30 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/random.h>
 #include "../include/protocol.h"
 #include "../include/file_ops.h"
 #include "../include/logger.h"
 #include "../include/auth.h"
 #include "../include/config.h"
+#include "../include/upload.h"
+#include "../include/mux.h"
+#include "../include/compress.h"
+#include "../include/chunk_store.h"
+#include "../include/delta.h"
+#include "../include/file_hash.h"
+#include "../include/checksum.h"
+#include "../include/list_codec.h"
+#include "../include/list_query.h"
 
-#define BUFFER_SIZE 4096
 #define MAX_PATH_LENGTH 1024
-#define MAX_ENTRIES 100
 #define MAX_USERNAME_LENGTH 64
 #define MAX_PASSWORD_LENGTH 64
-
-// Protocol message header
-typedef struct {
-    uint8_t command;
-    uint16_t path_length;
-    uint32_t data_length;
-} __attribute__((packed)) message_header_t;
-
-// Response header
-typedef struct {
-    uint8_t status;
-    uint32_t data_length;
-} __attribute__((packed)) response_header_t;
+#define BATCH_GET_LIMIT 65536                  // Largest file a batched GET returns
+#define BATCH_RESPONSE_LIMIT (16 * 1024 * 1024) // Entries past this much output fail instead of running
 
 // Auth message structure
 typedef struct {
@@ -37,22 +38,159 @@ typedef struct {
 } __attribute__((packed)) auth_message_t;
 
 // Function prototypes for handlers with streaming support
-int handle_put_streaming(int client_fd, const char *path, const char *initial_data, size_t initial_len, uint32_t total_len, user_role_t user_role);
-int handle_get_streaming(int client_fd, const char *path, user_role_t user_role);
+int handle_put_streaming(connection_t *conn, const char *path, const char *initial_data, size_t initial_len, uint64_t total_len, int compressed, int checked, user_role_t user_role);
+int handle_get_streaming(connection_t *conn, const char *path, uint64_t offset, uint64_t length, int codec, int checked, user_role_t user_role);
 
-int process_request(int client_fd, const char *buffer, size_t size, user_role_t *user_role) {
-    if (size < sizeof(message_header_t)) {
+int command_streams_payload(int command) {
+    return command == CMD_PUT || command == CMD_PUT_COMPRESSED || command == CMD_UPLOAD_WRITE ||
+           command == CMD_DELTA;
+}
+
+size_t command_payload_limit(int command) {
+    switch (command) {
+        case CMD_BATCH:
+            return MAX_BATCH_SIZE;
+        case CMD_CHUNK_QUERY:
+        case CMD_CHUNK_ASSEMBLE:
+            return MAX_CHUNK_LIST;
+        case CMD_CHUNK_STORE:
+            return CHUNK_HASH_SIZE + MAX_CHUNK_DATA;
+        default:
+            return 0;
+    }
+}
+
+size_t command_payload_prefix(int command) {
+    switch (command) {
+        case CMD_UPLOAD_WRITE:
+            return UPLOAD_WRITE_PREFIX;
+        case CMD_DELTA:
+            return DELTA_PREFIX;
+        default:
+            return 0;
+    }
+}
+
+// Headers are the command/status byte, then for requests the 16-bit path
+// length, then the data length: 32 bits in version 1, 64 bits from version 2.
+// Everything is in network byte order.
+size_t request_header_size(int version) {
+    return version >= PROTOCOL_V2 ? 11 : 7;
+}
+
+size_t response_header_size(int version) {
+    return version >= PROTOCOL_V2 ? 9 : 5;
+}
+
+static size_t encode_length(int version, char *buf, uint64_t length) {
+    if (version >= PROTOCOL_V2) {
+        uint64_t net = htobe64(length);
+        memcpy(buf, &net, sizeof(net));
+        return sizeof(net);
+    }
+    if (length > UINT32_MAX) {
+        return 0;
+    }
+    uint32_t net = htonl((uint32_t)length);
+    memcpy(buf, &net, sizeof(net));
+    return sizeof(net);
+}
+
+static uint64_t decode_length(int version, const char *buf) {
+    if (version >= PROTOCOL_V2) {
+        uint64_t net;
+        memcpy(&net, buf, sizeof(net));
+        return be64toh(net);
+    }
+    uint32_t net;
+    memcpy(&net, buf, sizeof(net));
+    return ntohl(net);
+}
+
+size_t encode_request_header(int version, char *buf, uint8_t command, uint16_t path_length, uint64_t data_length) {
+    uint16_t net_path_length = htons(path_length);
+    buf[0] = (char)command;
+    memcpy(buf + 1, &net_path_length, sizeof(net_path_length));
+    if (data_length == LENGTH_CHUNKED && version < PROTOCOL_V2) {
+        return 0;
+    }
+    return encode_length(version, buf + 3, data_length) ? request_header_size(version) : 0;
+}
+
+void decode_request_header(int version, const char *buf, uint8_t *command, uint16_t *path_length, uint64_t *data_length) {
+    uint16_t net_path_length;
+    memcpy(&net_path_length, buf + 1, sizeof(net_path_length));
+    *command = (uint8_t)buf[0];
+    *path_length = ntohs(net_path_length);
+    *data_length = decode_length(version, buf + 3);
+}
+
+size_t encode_response_header(int version, char *buf, uint8_t status, uint64_t data_length) {
+    buf[0] = (char)status;
+    return encode_length(version, buf + 1, data_length) ? response_header_size(version) : 0;
+}
+
+void decode_response_header(int version, const char *buf, uint8_t *status, uint64_t *data_length) {
+    *status = (uint8_t)buf[0];
+    *data_length = decode_length(version, buf + 1);
+}
+
+// Version 3 frame headers: type, then stream id and payload length as 32 bits each
+size_t encode_frame_header(char *buf, uint8_t type, uint32_t stream, uint32_t length) {
+    uint32_t net_stream = htonl(stream);
+    uint32_t net_length = htonl(length);
+    buf[0] = (char)type;
+    memcpy(buf + 1, &net_stream, sizeof(net_stream));
+    memcpy(buf + 5, &net_length, sizeof(net_length));
+    return FRAME_HEADER_SIZE;
+}
+
+void decode_frame_header(const char *buf, uint8_t *type, uint32_t *stream, uint32_t *length) {
+    uint32_t net_stream;
+    uint32_t net_length;
+    memcpy(&net_stream, buf + 1, sizeof(net_stream));
+    memcpy(&net_length, buf + 5, sizeof(net_length));
+    *type = (uint8_t)buf[0];
+    *stream = ntohl(net_stream);
+    *length = ntohl(net_length);
+}
+
+// Response header, on a multiplexed connection preceded by the header of the
+// RESPONSE frame that carries it along with frame_data bytes of the response data.
+// Returns the size of both, 0 if the lengths can't be expressed.
+static size_t encode_response_start(connection_t *conn, char *buf, int status,
+                                    uint64_t data_length, uint64_t frame_data) {
+    size_t frame_size = 0;
+    if (conn->mux_stream != 0) {
+        uint64_t frame_length = response_header_size(conn->protocol_version) + frame_data;
+        if (frame_length > UINT32_MAX) {
+            return 0;
+        }
+        frame_size = encode_frame_header(buf, FRAME_RESPONSE, conn->mux_stream, (uint32_t)frame_length);
+    }
+    size_t header_size = encode_response_header(conn->protocol_version, buf + frame_size, status, data_length);
+    return header_size > 0 ? frame_size + header_size : 0;
+}
+
+// Payload still to come after the part that arrived with the request
+static uint64_t payload_remaining(uint64_t total_len, size_t initial_len) {
+    return total_len == LENGTH_CHUNKED ? LENGTH_CHUNKED : total_len - initial_len;
+}
+
+int process_request(connection_t *conn, const char *buffer, size_t size) {
+    size_t header_size = request_header_size(conn->protocol_version);
+    if (size < header_size) {
         log_error("Request too small to contain header");
         return -1;
     }
     
-    const message_header_t *header = (const message_header_t *)buffer;
-    uint8_t command = header->command;
-    uint16_t path_length = ntohs(header->path_length);
-    uint32_t data_length = ntohl(header->data_length);
+    uint8_t command;
+    uint16_t path_length;
+    uint64_t data_length;
+    decode_request_header(conn->protocol_version, buffer, &command, &path_length, &data_length);
     
     // Validate that we at least have the path in this initial buffer
-    if (size < sizeof(message_header_t) + path_length) {
+    if (size < header_size + path_length) {
         log_error("Incomplete request message (path missing)");
         return -1;
     }
@@ -64,11 +202,11 @@ int process_request(int client_fd, const char *buffer, size_t size, user_role_t
         return -1;
     }
     
-    memcpy(path, buffer + sizeof(message_header_t), path_length);
+    memcpy(path, buffer + header_size, path_length);
     path[path_length] = '\0';
     
     // Calculate how much actual data is in the initial buffer
-    size_t header_and_path_len = sizeof(message_header_t) + path_length;
+    size_t header_and_path_len = header_size + path_length;
     size_t initial_data_len = size - header_and_path_len;
     const char *initial_data = buffer + header_and_path_len;
     
@@ -76,14 +214,30 @@ int process_request(int client_fd, const char *buffer, size_t size, user_role_t
         initial_data_len = data_length;
     }
     
-    log_debug("Received command %d for path %s (data_length=%u, initial_read=%zu)", 
-              command, path, data_length, initial_data_len);
+    // Payloads too large for the request buffer arrive in a buffer of their own
+    if (conn->body != NULL) {
+        initial_data = conn->body;
+        initial_data_len = conn->body_len;
+    }
+    
+    log_debug("Received command %d for path %s (data_length=%llu, initial_read=%zu)", 
+              command, path, (unsigned long long)data_length, initial_data_len);
+    
+    // Every transfer on a multiplexed connection takes a stream slot until it ends
+    if (conn->mux != NULL && (command == CMD_GET || command == CMD_GET_COMPRESSED || command_streams_payload(command)) &&
+        mux_streams_full(conn)) {
+        return send_response(conn, RESP_ERROR, "Too many streams", 16);
+    }
     
     // Check if authentication is required
     server_config_t *config = get_config();
-    if (config->enable_auth && command != CMD_AUTH && *user_role == ROLE_GUEST) {
+    if (config->enable_auth && command != CMD_AUTH && command != CMD_HELLO && conn->role == ROLE_GUEST) {
         log_warning("Authentication required for command %d", command);
-        return send_response(client_fd, RESP_AUTH_REQUIRED, "Authentication required", 23);
+        if (command_streams_payload(command)) {
+            // Skip the payload the client is still sending
+            conn_start_recv_file(conn, -1, payload_remaining(data_length, initial_data_len), NULL);
+        }
+        return send_response(conn, RESP_AUTH_REQUIRED, "Authentication required", 23);
     }
     
     // Process command
@@ -91,71 +245,132 @@ int process_request(int client_fd, const char *buffer, size_t size, user_role_t
         case CMD_AUTH:
             if (initial_data_len >= sizeof(auth_message_t)) {
                 const auth_message_t *auth_data = (const auth_message_t *)initial_data;
-                return handle_auth_command(client_fd, auth_data->username, auth_data->password, user_role);
+                return handle_auth_command(conn, auth_data->username, auth_data->password, &conn->role);
             } else {
                 log_error("Invalid authentication data");
-                return send_response(client_fd, RESP_ERROR, "Invalid authentication data", 27);
+                return send_response(conn, RESP_ERROR, "Invalid authentication data", 27);
             }
         
         case CMD_LOGOUT:
-            return handle_logout_command(client_fd, user_role);
+            return handle_logout_command(conn, &conn->role);
             
         case CMD_LIST:
-            return handle_list_command(client_fd, path, *user_role);
+            // Pages go out as chunks where the connection has them
+            return handle_list_command(conn, path, initial_data, initial_data_len,
+                                       conn->protocol_version >= PROTOCOL_V2 && conn->mux == NULL, conn->role);
         
-        case CMD_GET:
-            return handle_get_streaming(client_fd, path, *user_role);
+        case CMD_GET: {
+            // An optional payload selects a byte range, without one the whole file is sent
+            uint64_t range[2] = { 0, htobe64(RANGE_TO_END) };
+            if (initial_data_len != 0 && initial_data_len != GET_RANGE_SIZE) {
+                return send_response(conn, RESP_ERROR, "Invalid range", 13);
+            }
+            memcpy(range, initial_data, initial_data_len);
+            return handle_get_streaming(conn, path, be64toh(range[0]), be64toh(range[1]), COMPRESS_NONE,
+                                        conn->checksums, conn->role);
+        }
+        
+        case CMD_GET_COMPRESSED: {
+            // The codec asked for, then the same optional range as for GET
+            uint64_t range[2] = { 0, htobe64(RANGE_TO_END) };
+            if (initial_data_len != GET_CODEC_SIZE && initial_data_len != GET_CODEC_SIZE + GET_RANGE_SIZE) {
+                return send_response(conn, RESP_ERROR, "Invalid range", 13);
+            }
+            memcpy(range, initial_data + GET_CODEC_SIZE, initial_data_len - GET_CODEC_SIZE);
+            return handle_get_streaming(conn, path, be64toh(range[0]), be64toh(range[1]),
+                                        (uint8_t)initial_data[0], 0, conn->role);
+        }
         
         case CMD_PUT:
-            return handle_put_streaming(client_fd, path, initial_data, initial_data_len, data_length, *user_role);
+            return handle_put_streaming(conn, path, initial_data, initial_data_len, data_length, 0,
+                                        conn->checksums, conn->role);
+        
+        case CMD_PUT_COMPRESSED:
+            return handle_put_streaming(conn, path, initial_data, initial_data_len, data_length, 1, 0, conn->role);
         
         case CMD_DELETE:
-            return handle_delete_command(client_fd, path, *user_role);
+            return handle_delete_command(conn, path, conn->role);
         
         case CMD_MKDIR:
-            return handle_mkdir_command(client_fd, path, *user_role);
+            return handle_mkdir_command(conn, path, conn->role);
         
         case CMD_INFO:
-            return handle_info_command(client_fd, path, *user_role);
+            return handle_info_command(conn, path, conn->role);
+        
+        case CMD_BATCH:
+            return handle_batch_command(conn, initial_data, initial_data_len, conn->role);
+        
+        case CMD_HELLO:
+            return handle_hello_command(conn, initial_data, initial_data_len);
+        
+        case CMD_UPLOAD_WRITE:
+            return handle_upload_write(conn, initial_data, initial_data_len, data_length, conn->role);
+        
+        case CMD_UPLOAD_BEGIN:
+        case CMD_UPLOAD_COMMIT:
+        case CMD_UPLOAD_ABORT:
+        case CMD_UPLOAD_STATUS:
+            return handle_upload_command(conn, command, path, initial_data, initial_data_len, conn->role);
+        
+        case CMD_CHUNK_QUERY:
+        case CMD_CHUNK_STORE:
+        case CMD_CHUNK_ASSEMBLE:
+            return handle_chunk_command(conn, command, path, initial_data, initial_data_len, conn->role);
+        
+        case CMD_SIGNATURES:
+            return handle_signatures_command(conn, path, conn->role);
+        
+        case CMD_DELTA:
+            return handle_delta_streaming(conn, path, initial_data, initial_data_len, data_length, conn->role);
+        
+        case CMD_HASH:
+            return handle_hash_command(conn, path, conn->role);
         
         default:
             log_error("Unknown command: %d", command);
-            return send_response(client_fd, RESP_ERROR, "Unknown command", 15);
+            return send_response(conn, RESP_ERROR, "Unknown command", 15);
     }
 }
 
-int send_response(int client_fd, int status, const void *data, size_t data_size) {
-    response_header_t header;
-    header.status = status;
-    header.data_length = htonl(data_size);
+int send_response(connection_t *conn, int status, const void *data, size_t data_size) {
+    char header[FRAME_HEADER_SIZE + RESPONSE_HEADER_MAX];
+    size_t header_size = encode_response_start(conn, header, status, data_size, data_size);
     
-    // Send header
-    if (write(client_fd, &header, sizeof(header)) != sizeof(header)) {
-        log_error("Failed to send response header");
+    // Queue header and data together so they leave in a single write
+    if (header_size == 0 || conn_queue_output(conn, header, header_size) != 0) {
+        log_error("Failed to queue response header");
         return -1;
     }
     
-    // Send data if present
     if (data != NULL && data_size > 0) {
-        size_t written = 0;
-        while (written < data_size) {
-            ssize_t res = write(client_fd, (const char *)data + written, data_size - written);
-            if (res < 0) {
-                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(1000);
-                    continue;
-                }
-                log_error("Failed to send response data");
-                return -1;
-            }
-            written += res;
+        if (conn_queue_output(conn, data, data_size) != 0) {
+            log_error("Failed to queue response data");
+            return -1;
         }
     }
     
     return 0;
 }
 
-int handle_auth_command(int client_fd, const char *username, const char *password, user_role_t *user_role) {
+int send_response_buffer(connection_t *conn, int status, void *data, size_t data_size) {
+    char header[FRAME_HEADER_SIZE + RESPONSE_HEADER_MAX];
+    size_t header_size = encode_response_start(conn, header, status, data_size, data_size);
+    
+    // The payload is queued by reference right behind its header
+    if (header_size == 0 || conn_queue_output(conn, header, header_size) != 0) {
+        log_error("Failed to queue response header");
+        free(data);
+        return -1;
+    }
+    if (conn_queue_output_buffer(conn, data, data_size) != 0) {
+        log_error("Failed to queue response data");
+        return -1;
+    }
+    
+    return 0;
+}
+
+int handle_auth_command(connection_t *conn, const char *username, const char *password, user_role_t *user_role) {
     int result;
     
     log_info("Authentication attempt for user %s", username);
@@ -164,154 +379,1038 @@ int handle_auth_command(int client_fd, const char *username, const char *passwor
     if (result == 0) {
         char response[64];
         snprintf(response, sizeof(response), "Authenticated as %s (role %d)", username, *user_role);
-        return send_response(client_fd, RESP_OK, response, strlen(response));
+        return send_response(conn, RESP_OK, response, strlen(response));
     } else {
-        return send_response(client_fd, RESP_ERROR, "Authentication failed", 21);
+        return send_response(conn, RESP_ERROR, "Authentication failed", 21);
     }
 }
 
-int handle_logout_command(int client_fd, user_role_t *user_role) {
+int handle_logout_command(connection_t *conn, user_role_t *user_role) {
     *user_role = ROLE_GUEST;
     log_info("User logged out, role set to guest");
-    return send_response(client_fd, RESP_OK, "Logged out", 10);
+    return send_response(conn, RESP_OK, "Logged out", 10);
 }
 
-int handle_list_command(int client_fd, const char *path, user_role_t user_role) {
-    file_info_t entries[MAX_ENTRIES];
-    int num_entries;
+static int queue_list_chunk(connection_t *conn, const void *data, size_t size) {
+    uint32_t prefix = htonl((uint32_t)size);
+    if (conn_queue_output(conn, &prefix, sizeof(prefix)) != 0) {
+        return -1;
+    }
+    return size > 0 ? conn_queue_output(conn, data, size) : 0;
+}
+
+// Send entries in one piece, as file_info_t or as compact records, whichever
+// the connection agreed on. A paged answer ends with its trailer. The entries
+// must have room for a trailer after them and are freed.
+static int send_list_entries(connection_t *conn, file_info_t *entries, int num_entries, int paged, uint64_t cursor,
+                             const list_query_t *query) {
+    size_t size = (size_t)num_entries * sizeof(file_info_t);
+    if (!conn->compact_lists) {
+        if (paged) {
+            uint64_t trailer[2] = { htobe64((uint64_t)num_entries), htobe64(cursor) };
+            memcpy((char *)entries + size, trailer, sizeof(trailer));
+            size += LIST_TRAILER_SIZE;
+        }
+        return send_response_buffer(conn, RESP_OK, entries, size);
+    }
     
-    if (!check_permission(user_role, CMD_LIST)) {
-        return send_response(client_fd, RESP_ERROR, "Permission denied", 17);
+    uint8_t *records = malloc((size_t)num_entries * LIST_RECORD_MAX + LIST_TRAILER_RECORD_SIZE);
+    if (records == NULL) {
+        free(entries);
+        return send_response(conn, RESP_ERROR, "Out of memory", 13);
+    }
+    list_codec_t codec;
+    list_codec_reset(&codec, query->fields, query->sort != LIST_SORT_NONE);
+    size = list_encode_entries(&codec, entries, num_entries, records);
+    if (paged) {
+        size += list_encode_trailer((uint64_t)num_entries, cursor, records + size);
+    }
+    free(entries);
+    return send_response_buffer(conn, RESP_OK, records, size);
+}
+
+// Send a page as chunks, each queued as soon as its entries are read, so the
+// page never has to be held whole. The trailer comes in a chunk of its own.
+// The status is out before the directory is read to the end, so an error
+// midway ends the page early, with the cursor where reading stopped.
+static int send_list_chunks(connection_t *conn, dir_reader_t *reader, uint32_t page_size, const list_query_t *query) {
+    file_info_t *chunk = malloc(LIST_CHUNK_ENTRIES * sizeof(file_info_t));
+    uint8_t *records = conn->compact_lists ? malloc(LIST_CHUNK_ENTRIES * LIST_RECORD_MAX) : NULL;
+    if (chunk == NULL || (conn->compact_lists && records == NULL)) {
+        free(chunk);
+        free(records);
+        return send_response(conn, RESP_ERROR, "Out of memory", 13);
+    }
+    char header[FRAME_HEADER_SIZE + RESPONSE_HEADER_MAX];
+    size_t header_size = encode_response_start(conn, header, RESP_OK, LENGTH_CHUNKED, 0);
+    if (conn_queue_output(conn, header, header_size) != 0) {
+        free(chunk);
+        free(records);
+        return -1;
     }
     
-    if (list_directory(path, entries, MAX_ENTRIES, &num_entries) != 0) {
-        return send_response(client_fd, RESP_ERROR, "Failed to list directory", 24);
+    // Compact records are relative to the one before, across chunks too
+    list_codec_t codec;
+    list_codec_reset(&codec, query->fields, 0);
+
+    uint64_t count = 0;
+    while (count < page_size && !reader->done) {
+        int want = page_size - count < LIST_CHUNK_ENTRIES ? (int)(page_size - count) : LIST_CHUNK_ENTRIES;
+        int n = 0;
+        int res = dir_reader_read(reader, &query->filter, chunk, want, &n);
+        int err = 0;
+        if (n > 0 && records != NULL) {
+            err = queue_list_chunk(conn, records, list_encode_entries(&codec, chunk, n, records));
+        } else if (n > 0) {
+            err = queue_list_chunk(conn, chunk, (size_t)n * sizeof(file_info_t));
+        }
+        if (err != 0) {
+            free(chunk);
+            free(records);
+            return -1;
+        }
+        count += (uint64_t)n;
+        if (res != 0) {
+            log_error("Failed to read directory %s: %s", reader->path, strerror(errno));
+            break;
+        }
     }
+    free(chunk);
     
-    size_t response_size = num_entries * sizeof(file_info_t);
-    return send_response(client_fd, RESP_OK, entries, response_size);
+    uint64_t trailer[2] = { htobe64(count), htobe64(reader->cursor) };
+    int err = records != NULL
+                  ? queue_list_chunk(conn, records, list_encode_trailer(count, reader->cursor, records))
+                  : queue_list_chunk(conn, trailer, sizeof(trailer));
+    free(records);
+    if (err != 0 || queue_list_chunk(conn, NULL, 0) != 0) {
+        return -1;
+    }
+    return 0;
 }
 
-int handle_get_streaming(int client_fd, const char *path, user_role_t user_role) {
-    if (!check_permission(user_role, CMD_GET)) {
-        return send_response(client_fd, RESP_ERROR, "Permission denied", 17);
+// Send a page in one piece, for connections that can't take chunks
+static int send_list_page(connection_t *conn, dir_reader_t *reader, uint32_t page_size, const list_query_t *query) {
+    char *page = malloc((size_t)page_size * sizeof(file_info_t) + LIST_TRAILER_SIZE);
+    int n = 0;
+    if (page == NULL) {
+        return send_response(conn, RESP_ERROR, "Out of memory", 13);
     }
+    if (dir_reader_read(reader, &query->filter, (file_info_t *)page, (int)page_size, &n) != 0) {
+        log_error("Failed to read directory %s: %s", reader->path, strerror(errno));
+        free(page);
+        return send_response(conn, RESP_ERROR, "Failed to list directory", 24);
+    }
+    return send_list_entries(conn, (file_info_t *)page, n, 1, reader->cursor, query);
+}
 
-    file_info_t info;
-    if (get_file_info(path, &info) != 0 || info.is_directory) {
-        return send_response(client_fd, RESP_ERROR, "Failed to read file", 19);
+// Send the first page size entries of the whole directory in the query's
+// order. The directory is read a chunk at a time into a heap of that many
+// entries, so only they are ever held.
+static int send_list_top(connection_t *conn, dir_reader_t *reader, uint32_t page_size, const list_query_t *query) {
+    file_info_t *chunk = malloc(LIST_CHUNK_ENTRIES * sizeof(file_info_t));
+    list_top_t top;
+    if (chunk == NULL || list_top_init(&top, query, (int)page_size) != 0) {
+        free(chunk);
+        return send_response(conn, RESP_ERROR, "Out of memory", 13);
     }
     
-    // We send RESP_OK with data_length = file size
-    response_header_t header;
-    header.status = RESP_OK;
-    header.data_length = htonl((uint32_t)info.size);
-    if (write(client_fd, &header, sizeof(header)) != sizeof(header)) {
-        return -1;
+    while (!reader->done) {
+        int n = 0;
+        if (dir_reader_read(reader, &query->filter, chunk, LIST_CHUNK_ENTRIES, &n) != 0) {
+            log_error("Failed to read directory %s: %s", reader->path, strerror(errno));
+            free(chunk);
+            free(top.entries);
+            return send_response(conn, RESP_ERROR, "Failed to list directory", 24);
+        }
+        for (int i = 0; i < n; i++) {
+            list_top_push(&top, &chunk[i]);
+        }
     }
+    free(chunk);
+    list_top_finish(&top);
+    return send_list_entries(conn, top.entries, top.count, 1, 0, query);
+}
+
+// List up to want entries of a directory through the metadata cache, into a
+// buffer with room for the trailer. Small directories, the common case, are
+// tried in two chunks' worth of room first: a whole page is big enough that
+// allocating and freeing it for every answer costs more than the listing.
+static file_info_t *list_first_page(const char *path, size_t want, int *num_entries) {
+    size_t room = want < 2 * LIST_CHUNK_ENTRIES ? want : 2 * LIST_CHUNK_ENTRIES;
+    for (;;) {
+        file_info_t *entries = malloc(room * sizeof(file_info_t) + LIST_TRAILER_SIZE);
+        if (entries == NULL || list_directory(path, entries, (int)room, num_entries) != 0) {
+            free(entries);
+            return NULL;
+        }
+        if ((size_t)*num_entries < room || room == want) {
+            return entries;
+        }
+        free(entries);
+        room = want;
+    }
+}
+
+int handle_list_command(connection_t *conn, const char *path, const char *data, size_t size,
+                        int chunked, user_role_t user_role) {
+    int num_entries;
+    list_query_t query;
     
-    char resolved_path[1024];
-    if (get_full_path(path, resolved_path, sizeof(resolved_path)) != 0) return -1;
+    if (!check_permission(user_role, CMD_LIST)) {
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    list_query_init(&query);
+    if ((size != 0 && size < LIST_PAGE_SIZE) ||
+        (size > LIST_PAGE_SIZE && list_query_parse(&query, data + LIST_PAGE_SIZE, size - LIST_PAGE_SIZE) != 0)) {
+        return send_response(conn, RESP_ERROR, "Invalid list request", 20);
+    }
     
-    FILE *f = fopen(resolved_path, "rb");
-    if (!f) return -1;
+    // A page size of 0, or one too large, means as many entries as fit in an answer
+    int paged = size >= LIST_PAGE_SIZE;
+    int sorted = query.sort != LIST_SORT_NONE;
+    uint64_t cursor = 0;
+    uint32_t page_size = LIST_PAGE_MAX;
+    if (paged) {
+        memcpy(&cursor, data, sizeof(cursor));
+        memcpy(&page_size, data + sizeof(cursor), sizeof(page_size));
+        cursor = be64toh(cursor);
+        page_size = ntohl(page_size);
+        if (page_size == 0 || page_size > LIST_PAGE_MAX) {
+            page_size = LIST_PAGE_MAX;
+        }
+    }
+    // A sorted answer is a single page, there's nothing to resume
+    if (sorted && cursor != 0) {
+        return send_response(conn, RESP_ERROR, "Invalid list request", 20);
+    }
     
-    char stream_buf[BUFFER_SIZE];
-    size_t sent = 0;
-    while (sent < info.size) {
-        size_t count = fread(stream_buf, 1, sizeof(stream_buf), f);
-        if (count == 0) break;
-        size_t written = 0;
-        while (written < count) {
-            ssize_t w = write(client_fd, stream_buf + written, count - written);
-            if (w < 0) {
-                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                    usleep(1000);
+    // A first page holding the whole directory comes from the metadata cache,
+    // one entry more than asked for tells whether it does. The query is then
+    // answered from the cached entries.
+    if (cursor == 0) {
+        file_info_t *entries = list_first_page(path, (size_t)page_size + (paged ? 1 : 0), &num_entries);
+        if (entries == NULL) {
+            return send_response(conn, RESP_ERROR, "Failed to list directory", 24);
+        }
+        if (!paged || (uint32_t)num_entries <= page_size) {
+            int n = 0;
+            for (int i = 0; i < num_entries; i++) {
+                if (!dir_filter_match(&query.filter, &entries[i])) {
                     continue;
                 }
-                fclose(f);
-                return -1;
+                if (n != i) {
+                    entries[n] = entries[i];
+                }
+                n++;
+            }
+            if (sorted) {
+                list_query_sort(&query, entries, n);
             }
-            written += w;
+            return send_list_entries(conn, entries, n, paged, 0, &query);
         }
-        sent += count;
+        free(entries);
+    }
+    
+    // Larger directories are read a page at a time, from where the last page
+    // ended, or all the way through for the first entries in sorted order
+    dir_reader_t *reader = malloc(sizeof(*reader));
+    if (reader == NULL) {
+        return send_response(conn, RESP_ERROR, "Out of memory", 13);
+    }
+    if (!is_path_valid(path) || dir_reader_open(reader, path, cursor) != 0) {
+        log_error("Failed to open directory %s: %s", path, strerror(errno));
+        free(reader);
+        return send_response(conn, RESP_ERROR, "Failed to list directory", 24);
     }
-    fclose(f);
+    int res;
+    if (sorted) {
+        res = send_list_top(conn, reader, page_size, &query);
+    } else if (chunked) {
+        res = send_list_chunks(conn, reader, page_size, &query);
+    } else {
+        res = send_list_page(conn, reader, page_size, &query);
+    }
+    dir_reader_close(reader);
+    free(reader);
+    return res;
+}
+
+// Check whether a GET body can be sent compressed with a codec. The size of a
+// compressed body isn't known up front, so it needs the chunks of version 2.
+// Multiplexed streams carry their own framing and are always sent plain.
+static int can_compress(const connection_t *conn, int codec) {
+    return codec != COMPRESS_NONE && codec < 32 && (compress_codecs() & (1u << codec)) &&
+           conn->protocol_version >= PROTOCOL_V2 && conn->mux == NULL;
+}
+
+int handle_get_streaming(connection_t *conn, const char *path, uint64_t offset, uint64_t length, int codec, int checked, user_role_t user_role) {
+    if (!check_permission(user_role, CMD_GET)) {
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+
+    // The size comes from the descriptor that is sent, not from a second lookup of the path
+    struct stat st;
+    int fd = open_beneath(path, O_RDONLY, 0);
+    if (fd < 0) {
+        log_error("Failed to open %s for reading: %s", path, strerror(errno));
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+        close(fd);
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    
+    // Ranges reaching past the end are cut short, only the start must lie within the file
+    uint64_t size = (uint64_t)st.st_size;
+    if (offset > size) {
+        close(fd);
+        return send_response(conn, RESP_ERROR, "Invalid range", 13);
+    }
+    if (length > size - offset) {
+        length = size - offset;
+    }
+    
+    // A codec the server can't use gets the plain body, the client tells the two apart by the length
+    compress_stream_t *cs = can_compress(conn, codec) ? compress_open(codec) : NULL;
+    checksum_stream_t *ck = NULL;
+    if (checked && (ck = checksum_open()) == NULL) {
+        close(fd);
+        return send_response(conn, RESP_ERROR, "Out of memory", 13);
+    }
+    
+    // We send RESP_OK with data_length = range length, the body follows once the header is out
+    // (on a multiplexed connection as DATA frames of the stream, compressed as chunks, and
+    // with the CRC32C trailer counted in if the connection agreed on one).
+    // Version 1 lengths are 32 bits, larger files need a client that negotiated version 2.
+    char header[FRAME_HEADER_SIZE + RESPONSE_HEADER_MAX];
+    uint64_t data_length = cs != NULL ? LENGTH_CHUNKED : length + (ck != NULL ? CHECKSUM_SIZE : 0);
+    size_t header_size = encode_response_start(conn, header, RESP_OK, data_length, 0);
+    if (header_size == 0) {
+        checksum_close(ck);
+        close(fd);
+        return send_response(conn, RESP_ERROR, "File too large for protocol version 1", 37);
+    }
+    if (conn_queue_output(conn, header, header_size) != 0) {
+        compress_close(cs);
+        checksum_close(ck);
+        close(fd);
+        return -1;
+    }
+    
+    conn_start_send_file(conn, fd, offset, length);
+    conn->codec = cs;
+    conn->checksum = ck;
     return 0;
 }
 
-int handle_put_streaming(int client_fd, const char *path, const char *initial_data, size_t initial_len, uint32_t total_len, user_role_t user_role) {
+static int send_write_error(connection_t *conn, int err) {
+    char message[128];
+    int len = snprintf(message, sizeof(message), "Failed to write file: %s", strerror(err));
+    return send_response(conn, RESP_ERROR, message, len);
+}
+
+// Called by the server once the streamed PUT payload is on disk
+static int finish_put_streaming(connection_t *conn, int status) {
+    if (status < 0) {
+        return -1; // disconnected early
+    }
+    if (status == 0 && conn->codec != NULL) {
+        status = compress_finish(conn->codec);  // Payload ended inside a block
+    }
+    if (status > 0) {
+        return send_write_error(conn, status);
+    }
+    if (conn->checksum != NULL && checksum_verify(conn->checksum) != 0) {
+        return send_response(conn, RESP_ERROR, "Checksum mismatch", 17);
+    }
+    return send_response(conn, RESP_OK, "File written successfully", 25);
+}
+
+int handle_put_streaming(connection_t *conn, const char *path, const char *initial_data, size_t initial_len, uint64_t total_len, int compressed, int checked, user_role_t user_role) {
+    uint64_t remaining = payload_remaining(total_len, initial_len);
+    
     if (!check_permission(user_role, CMD_PUT)) {
-        return send_response(client_fd, RESP_ERROR, "Permission denied", 17);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    
+    // Compressed payloads always come in chunks, and not on multiplexed streams
+    if (compressed && (total_len != LENGTH_CHUNKED || conn->mux != NULL)) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Compression not available", 25);
     }
+    // A checked payload ends with its CRC32C, which is part of the length
+    if (checked && total_len != LENGTH_CHUNKED && total_len < CHECKSUM_SIZE) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Checksum mismatch", 17);
+    }
+    uint64_t file_size = checked && total_len != LENGTH_CHUNKED ? total_len - CHECKSUM_SIZE : total_len;
     
-    char full_path[1024];
-    if (get_full_path(path, full_path, sizeof(full_path)) != 0) {
-        return send_response(client_fd, RESP_ERROR, "Invalid path", 12);
+    int fd = open_beneath(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        int err = errno;
+        log_error("Failed to open %s for writing: %s", path, strerror(err));
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        // A path that leads nowhere, or out of the root directory, isn't a write error
+        if (err == ENOENT || err == ENOTDIR || err == EXDEV || err == EINVAL) {
+            return send_response(conn, RESP_ERROR, "Invalid path", 12);
+        }
+        return send_response(conn, RESP_ERROR, "Failed to write file", 20);
     }
     
-    FILE *f = fopen(full_path, "wb");
-    if (!f) {
-        return send_response(client_fd, RESP_ERROR, "Failed to write file", 20);
+    // Reserve the space up front, so the file is laid out in few extents and a
+    // full disk is reported before the client sends the payload
+    // (not possible for a chunked payload, its size isn't known)
+    if (file_size > 0 && file_size != LENGTH_CHUNKED &&
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, file_size) != 0 &&
+        (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+        int err = errno;
+        log_error("Failed to reserve %llu bytes for %s: %s",
+                  (unsigned long long)file_size, path, strerror(err));
+        close(fd);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_write_error(conn, err);
+    }
+    
+    // The trailer is held back from the file and checked once the payload is complete
+    checksum_stream_t *ck = NULL;
+    if (checked) {
+        int err = (ck = checksum_open()) == NULL ? ENOMEM : checksum_store(ck, fd, initial_data, initial_len);
+        if (err == 0 && remaining == 0) {
+            err = checksum_verify(ck) != 0 ? EBADMSG : 0;
+        }
+        if (err != 0 || remaining == 0) {
+            checksum_close(ck);
+            close(fd);
+            conn_start_recv_file(conn, -1, remaining, NULL);
+            if (err == EBADMSG) {
+                return send_response(conn, RESP_ERROR, "Checksum mismatch", 17);
+            }
+            return err != 0 ? send_write_error(conn, err) : send_response(conn, RESP_OK, "File written successfully", 25);
+        }
+        initial_len = 0;
     }
     
     // Write initial data
-    if (initial_len > 0) {
-        fwrite(initial_data, 1, initial_len, f);
-    }
-    
-    // Read the rest from socket
-    uint32_t remaining = total_len - initial_len;
-    char stream_buf[BUFFER_SIZE];
-    while (remaining > 0) {
-        size_t to_read = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
-        ssize_t r = read(client_fd, stream_buf, to_read);
-        if (r < 0) {
-            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(1000); // Back off
+    size_t written = 0;
+    while (written < initial_len) {
+        ssize_t w = write(fd, initial_data + written, initial_len - written);
+        if (w < 0) {
+            if (errno == EINTR) {
                 continue;
             }
-            fclose(f);
-            return -1;
-        } else if (r == 0) {
-            // connection closed prematurely
-            break;
+            int err = errno;
+            log_error("Failed to write %s: %s", path, strerror(err));
+            close(fd);
+            conn_start_recv_file(conn, -1, remaining, NULL);
+            return send_write_error(conn, err);
         }
-        fwrite(stream_buf, 1, r, f);
-        remaining -= r;
+        written += w;
     }
-    fclose(f);
     
     if (remaining == 0) {
-        return send_response(client_fd, RESP_OK, "File written successfully", 25);
-    } else {
+        close(fd);
+        return send_response(conn, RESP_OK, "File written successfully", 25);
+    }
+    
+    compress_stream_t *cs = NULL;
+    if (compressed && (cs = compress_open(COMPRESS_NONE)) == NULL) {
+        close(fd);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_write_error(conn, ENOMEM);
+    }
+    
+    // The server streams the rest from the socket as it arrives
+    conn_start_recv_file(conn, fd, remaining, finish_put_streaming);
+    conn->codec = cs;
+    conn->checksum = ck;
+    return 0;
+}
+
+static uint64_t mtime_ns(const struct stat *st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + (uint64_t)st->st_mtim.tv_nsec;
+}
+
+int handle_signatures_command(connection_t *conn, const char *path, user_role_t user_role) {
+    struct stat st;
+    
+    if (!check_permission(user_role, CMD_GET)) {
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    int fd = open_beneath(path, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    
+    // Size and modification time let the delta be checked against the same version
+    uint64_t size = (uint64_t)st.st_size;
+    uint32_t block_size = delta_block_size(size);
+    uint64_t num_blocks = (size + block_size - 1) / block_size;
+    size_t answer_size = SIGNATURES_PREFIX + num_blocks * DELTA_SIGNATURE_SIZE;
+    char *answer = malloc(answer_size);
+    if (answer == NULL) {
+        close(fd);
+        return send_response(conn, RESP_ERROR, "Out of memory", 13);
+    }
+    uint64_t net_size = htobe64(size);
+    uint64_t net_mtime = htobe64(mtime_ns(&st));
+    uint32_t net_block = htonl(block_size);
+    memcpy(answer, &net_size, sizeof(net_size));
+    memcpy(answer + 8, &net_mtime, sizeof(net_mtime));
+    memcpy(answer + 16, &net_block, sizeof(net_block));
+    int err = delta_signatures(fd, size, block_size, (uint8_t *)answer + SIGNATURES_PREFIX);
+    close(fd);
+    if (err != 0) {
+        log_error("Failed to compute signatures of %s: %s", path, strerror(err));
+        free(answer);
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    return send_response_buffer(conn, RESP_OK, answer, answer_size);
+}
+
+int handle_hash_command(connection_t *conn, const char *path, user_role_t user_role) {
+    char answer[HASH_ANSWER_SIZE];
+    struct stat st;
+    uint64_t size;
+    
+    if (!check_permission(user_role, CMD_GET)) {
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    int fd = open_beneath(path, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    
+    // hash_threads = 0 means one thread per available CPU
+    int threads = get_config()->hash_threads;
+    if (threads <= 0) {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    int err = file_hash_cached(fd, threads > 0 ? threads : 1, &size, (uint8_t *)answer + 8);
+    close(fd);
+    if (err != 0) {
+        log_error("Failed to hash %s: %s", path, strerror(err));
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    uint64_t net_size = htobe64(size);
+    memcpy(answer, &net_size, sizeof(net_size));
+    return send_response(conn, RESP_OK, answer, sizeof(answer));
+}
+
+// Called by the server once the whole delta has been applied
+static int finish_delta(connection_t *conn, int status) {
+    if (status < 0) {
         return -1; // disconnected early
     }
+    if (status == 0) {
+        status = delta_commit(conn->delta);
+    }
+    if (status > 0) {
+        return send_write_error(conn, status);
+    }
+    return send_response(conn, RESP_OK, "File updated", 12);
+}
+
+int handle_delta_streaming(connection_t *conn, const char *path, const char *initial_data, size_t initial_len,
+                           uint64_t total_len, user_role_t user_role) {
+    uint64_t remaining = payload_remaining(total_len, initial_len);
+    struct stat st;
+    
+    if (!check_permission(user_role, CMD_PUT)) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    if (total_len == LENGTH_CHUNKED || total_len < DELTA_PREFIX) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Invalid delta", 13);
+    }
+    // Multiplexed streams are not decoded, like compressed payloads
+    if (conn->mux != NULL) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Delta not available", 19);
+    }
+    
+    uint64_t prefix[3];
+    memcpy(prefix, initial_data, sizeof(prefix));
+    uint64_t base_size = be64toh(prefix[0]);
+    uint64_t base_mtime = be64toh(prefix[1]);
+    uint64_t size = be64toh(prefix[2]);
+    
+    char name[NAME_MAX + 1];
+    char temp[NAME_MAX + 1];
+    int dir_fd = open_parent_beneath(path, name, sizeof(name));
+    if (dir_fd < 0) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Invalid path", 12);
+    }
+    
+    // The delta only makes sense against the version its signatures came from
+    int base_fd = open_beneath(path, O_RDONLY, 0);
+    if (base_fd < 0 || fstat(base_fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size != base_size || mtime_ns(&st) != base_mtime) {
+        if (base_fd >= 0) close(base_fd);
+        close(dir_fd);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "File changed", 12);
+    }
+    
+    // The new version is built next to the old one and keeps its permissions
+    uint64_t nonce = 0;
+    int len = getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce) ? -1 :
+              snprintf(temp, sizeof(temp), ".%s.delta-%016llx", name, (unsigned long long)nonce);
+    if (len < 0 || (size_t)len >= sizeof(temp)) {
+        close(base_fd);
+        close(dir_fd);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Invalid path", 12);
+    }
+    int fd = openat(dir_fd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if (fd < 0) {
+        log_error("Failed to open %s for writing: %s", path, strerror(errno));
+        close(base_fd);
+        close(dir_fd);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Failed to write file", 20);
+    }
+    delta_apply_t *d = delta_open(base_fd, base_size, size, dir_fd, temp, name);
+    if (d == NULL) {
+        close(base_fd);
+        close(fd);
+        unlinkat(dir_fd, temp, 0);
+        close(dir_fd);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_write_error(conn, ENOMEM);
+    }
+    
+    int err = 0;
+    if (size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0 &&
+        (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+        err = errno;
+    }
+    if (err == 0) {
+        err = delta_store(d, fd, initial_data + DELTA_PREFIX, initial_len - DELTA_PREFIX);
+    }
+    if (err == 0 && remaining == 0) {
+        err = delta_commit(d);
+    }
+    if (err != 0 || remaining == 0) {
+        close(fd);
+        delta_close(d);
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return err != 0 ? send_write_error(conn, err) : send_response(conn, RESP_OK, "File updated", 12);
+    }
+    
+    // The rest of the instructions are applied as they arrive
+    conn_start_recv_file(conn, fd, remaining, finish_delta);
+    conn->delta = d;
+    return 0;
+}
+
+static int send_upload_error(connection_t *conn, uint8_t command, int err) {
+    switch (err) {
+        case ENOENT:
+            return send_response(conn, RESP_ERROR, "Unknown upload session", 22);
+        case EINVAL:
+            return command == CMD_UPLOAD_WRITE ? send_response(conn, RESP_ERROR, "Invalid upload chunk", 20)
+                                               : send_response(conn, RESP_ERROR, "Invalid upload", 14);
+        case EAGAIN:
+            return command == CMD_UPLOAD_BEGIN ? send_response(conn, RESP_ERROR, "Too many uploads", 16)
+                                               : send_response(conn, RESP_ERROR, "Upload incomplete", 17);
+        case EBUSY:
+            return send_response(conn, RESP_ERROR, "Upload busy", 11);
+        default:
+            return send_write_error(conn, err);
+    }
+}
+
+static int finish_upload_write(connection_t *conn, int status) {
+    int err = upload_chunk_done(conn->upload_id, conn->upload_offset, status == 0);
+    if (status < 0) {
+        return -1; // disconnected early
+    }
+    if (status > 0 || err != 0) {
+        return send_write_error(conn, status > 0 ? status : err);
+    }
+    return send_response(conn, RESP_OK, "Chunk written", 13);
+}
+
+int handle_upload_write(connection_t *conn, const char *initial_data, size_t initial_len,
+                        uint64_t total_len, user_role_t user_role) {
+    uint64_t remaining = payload_remaining(total_len, initial_len);
+    
+    if (total_len == LENGTH_CHUNKED || total_len < UPLOAD_WRITE_PREFIX) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_upload_error(conn, CMD_UPLOAD_WRITE, EINVAL);
+    }
+    if (!check_permission(user_role, CMD_PUT)) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    
+    uint64_t prefix[2];
+    memcpy(prefix, initial_data, sizeof(prefix));
+    uint64_t id = be64toh(prefix[0]);
+    uint64_t offset = be64toh(prefix[1]);
+    const char *data = initial_data + UPLOAD_WRITE_PREFIX;
+    size_t data_len = initial_len - UPLOAD_WRITE_PREFIX;
+    
+    int fd;
+    int err = upload_open_chunk(id, offset, total_len - UPLOAD_WRITE_PREFIX, &fd);
+    if (err != 0) {
+        conn_start_recv_file(conn, -1, remaining, NULL);
+        return send_upload_error(conn, CMD_UPLOAD_WRITE, err);
+    }
+    
+    size_t written = 0;
+    while (written < data_len) {
+        ssize_t w = write(fd, data + written, data_len - written);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = errno;
+            close(fd);
+            upload_chunk_done(id, offset, 0);
+            conn_start_recv_file(conn, -1, remaining, NULL);
+            return send_write_error(conn, err);
+        }
+        written += w;
+    }
+    
+    if (remaining == 0) {
+        close(fd);
+        err = upload_chunk_done(id, offset, 1);
+        if (err != 0) {
+            return send_write_error(conn, err);
+        }
+        return send_response(conn, RESP_OK, "Chunk written", 13);
+    }
+    
+    // The rest lands at the descriptor's position, right after what was written here
+    conn->upload_id = id;
+    conn->upload_offset = offset;
+    conn_start_recv_file(conn, fd, remaining, finish_upload_write);
+    return 0;
+}
+
+int handle_upload_command(connection_t *conn, uint8_t command, const char *path,
+                          const char *data, size_t size, user_role_t user_role) {
+    if (!check_permission(user_role, CMD_PUT)) {
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    
+    if (command == CMD_UPLOAD_BEGIN) {
+        uint64_t params[2];
+        uint64_t id;
+        if (size != UPLOAD_BEGIN_SIZE) {
+            return send_upload_error(conn, command, EINVAL);
+        }
+        memcpy(params, data, sizeof(params));
+        int err = upload_begin(path, be64toh(params[0]), be64toh(params[1]), &id);
+        if (err != 0) {
+            return send_upload_error(conn, command, err);
+        }
+        id = htobe64(id);
+        return send_response(conn, RESP_OK, &id, sizeof(id));
+    }
+    
+    uint64_t id = 0;
+    if (command == CMD_UPLOAD_STATUS && (size == 0 || size == UPLOAD_ID_SIZE)) {
+        // Without a session id the session is looked up by its target path
+        uint64_t info[3];
+        uint64_t *extents;
+        size_t num_extents;
+        memcpy(&id, data, size);
+        int err = upload_status(be64toh(id), path, info, &extents, &num_extents);
+        if (err != 0) {
+            return send_upload_error(conn, command, err);
+        }
+        
+        // Session id, file size, chunk size, then an offset and length per missing extent
+        size_t count = 3 + 2 * num_extents;
+        uint64_t *answer = malloc(count * sizeof(uint64_t));
+        if (answer == NULL) {
+            free(extents);
+            return send_response(conn, RESP_ERROR, "Out of memory", 13);
+        }
+        for (size_t i = 0; i < count; i++) {
+            answer[i] = htobe64(i < 3 ? info[i] : extents[i - 3]);
+        }
+        free(extents);
+        return send_response_buffer(conn, RESP_OK, answer, count * sizeof(uint64_t));
+    }
+    if (size != UPLOAD_ID_SIZE) {
+        return send_upload_error(conn, command, EINVAL);
+    }
+    memcpy(&id, data, sizeof(id));
+    int err = command == CMD_UPLOAD_COMMIT ? upload_commit(be64toh(id)) : upload_abort(be64toh(id));
+    if (err != 0) {
+        return send_upload_error(conn, command, err);
+    }
+    return command == CMD_UPLOAD_COMMIT ? send_response(conn, RESP_OK, "Upload committed", 16)
+                                        : send_response(conn, RESP_OK, "Upload aborted", 14);
+}
+
+static int send_chunk_error(connection_t *conn, int err) {
+    switch (err) {
+        case EINVAL:
+            return send_response(conn, RESP_ERROR, "Invalid chunk list", 18);
+        case EBADMSG:
+            return send_response(conn, RESP_ERROR, "Chunk hash mismatch", 19);
+        case EAGAIN:
+            return send_response(conn, RESP_ERROR, "Missing chunks", 14);
+        default:
+            return send_write_error(conn, err);
+    }
+}
+
+int handle_chunk_command(connection_t *conn, uint8_t command, const char *path,
+                         const char *data, size_t size, user_role_t user_role) {
+    if (!check_permission(user_role, CMD_PUT)) {
+        return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    }
+    
+    if (command == CMD_CHUNK_STORE) {
+        // The chunk's hash, then its data
+        if (size <= CHUNK_HASH_SIZE || size > CHUNK_HASH_SIZE + MAX_CHUNK_DATA) {
+            return send_chunk_error(conn, EINVAL);
+        }
+        int err = chunk_store_put((const uint8_t *)data, data + CHUNK_HASH_SIZE, size - CHUNK_HASH_SIZE);
+        if (err != 0) {
+            return send_chunk_error(conn, err);
+        }
+        return send_response(conn, RESP_OK, "Chunk stored", 12);
+    }
+    
+    size_t entry_size = command == CMD_CHUNK_QUERY ? CHUNK_HASH_SIZE : CHUNK_ENTRY_SIZE;
+    if (size % entry_size != 0) {
+        return send_chunk_error(conn, EINVAL);
+    }
+    size_t count = size / entry_size;
+    
+    if (command == CMD_CHUNK_QUERY) {
+        // One bit per hash, set for the chunks the store holds
+        uint8_t *present = calloc(count / 8 + 1, 1);
+        if (present == NULL) {
+            return send_response(conn, RESP_ERROR, "Out of memory", 13);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (chunk_store_has((const uint8_t *)data + i * CHUNK_HASH_SIZE)) {
+                present[i / 8] |= 1u << (i % 8);
+            }
+        }
+        return send_response_buffer(conn, RESP_OK, present, (count + 7) / 8);
+    }
+    
+    // The answer is the size of the file built, for the client to check
+    uint64_t file_size;
+    int err = chunk_store_assemble(path, (const uint8_t *)data, count, &file_size);
+    if (err != 0) {
+        return send_chunk_error(conn, err);
+    }
+    file_size = htobe64(file_size);
+    return send_response(conn, RESP_OK, &file_size, sizeof(file_size));
 }
 
 // Stubs for remaining since handle_put_command was redefined over old one
-int handle_put_command(int client_fd, const char *path, const void *data, size_t data_size, user_role_t user_role) {
-    return handle_put_streaming(client_fd, path, data, data_size, data_size, user_role);
+int handle_put_command(connection_t *conn, const char *path, const void *data, size_t data_size, user_role_t user_role) {
+    return handle_put_streaming(conn, path, data, data_size, data_size, 0, 0, user_role);
 }
-int handle_get_command(int client_fd, const char *path, user_role_t user_role) {
-    return handle_get_streaming(client_fd, path, user_role);
+int handle_get_command(connection_t *conn, const char *path, user_role_t user_role) {
+    return handle_get_streaming(conn, path, 0, RANGE_TO_END, COMPRESS_NONE, 0, user_role);
 }
 
-int handle_delete_command(int client_fd, const char *path, user_role_t user_role) {
-    if (!check_permission(user_role, CMD_DELETE)) return send_response(client_fd, RESP_ERROR, "Permission denied", 17);
-    if (delete_file(path) != 0) return send_response(client_fd, RESP_ERROR, "Failed to delete file", 21);
-    return send_response(client_fd, RESP_OK, "File deleted successfully", 25);
+int handle_delete_command(connection_t *conn, const char *path, user_role_t user_role) {
+    if (!check_permission(user_role, CMD_DELETE)) return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    if (delete_file(path) != 0) return send_response(conn, RESP_ERROR, "Failed to delete file", 21);
+    return send_response(conn, RESP_OK, "File deleted successfully", 25);
 }
 
-int handle_mkdir_command(int client_fd, const char *path, user_role_t user_role) {
-    if (!check_permission(user_role, CMD_MKDIR)) return send_response(client_fd, RESP_ERROR, "Permission denied", 17);
-    if (create_directory(path) != 0) return send_response(client_fd, RESP_ERROR, "Failed to create dir", 20);
-    return send_response(client_fd, RESP_OK, "Directory created successfully", 30);
+int handle_mkdir_command(connection_t *conn, const char *path, user_role_t user_role) {
+    if (!check_permission(user_role, CMD_MKDIR)) return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    if (create_directory(path) != 0) return send_response(conn, RESP_ERROR, "Failed to create dir", 20);
+    return send_response(conn, RESP_OK, "Directory created successfully", 30);
 }
 
-int handle_info_command(int client_fd, const char *path, user_role_t user_role) {
+int handle_info_command(connection_t *conn, const char *path, user_role_t user_role) {
+    file_info_t info;
+    if (!check_permission(user_role, CMD_INFO)) return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    if (get_file_info(path, &info) != 0) return send_response(conn, RESP_ERROR, "Failed to get file info", 23);
+    if (conn->compact_lists) {
+        uint8_t record[LIST_RECORD_MAX];
+        list_codec_t codec;
+        list_codec_reset(&codec, LIST_FIELDS_ALL, 1);
+        return send_response(conn, RESP_OK, record, list_encode_entries(&codec, &info, 1, record));
+    }
+    return send_response(conn, RESP_OK, &info, sizeof(info));
+}
+
+// A batched GET returns the whole file in its result frame, so only small files qualify
+static int handle_batch_get(connection_t *conn, const char *path, user_role_t user_role) {
+    if (!check_permission(user_role, CMD_GET)) return send_response(conn, RESP_ERROR, "Permission denied", 17);
+    
     file_info_t info;
-    if (!check_permission(user_role, CMD_INFO)) return send_response(client_fd, RESP_ERROR, "Permission denied", 17);
-    if (get_file_info(path, &info) != 0) return send_response(client_fd, RESP_ERROR, "Failed to get file info", 23);
-    return send_response(client_fd, RESP_OK, &info, sizeof(info));
+    if (get_file_info(path, &info) != 0 || info.is_directory) {
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    if (info.size > BATCH_GET_LIMIT) {
+        return send_response(conn, RESP_ERROR, "File too large for batch", 24);
+    }
+    
+    size_t bytes_read = 0;
+    char *data = malloc(info.size > 0 ? info.size : 1);
+    if (data == NULL || read_file(path, data, info.size, &bytes_read) != 0) {
+        free(data);
+        return send_response(conn, RESP_ERROR, "Failed to read file", 19);
+    }
+    return send_response_buffer(conn, RESP_OK, data, bytes_read);
+}
+
+static int handle_batch_entry(connection_t *conn, uint8_t command, const char *path,
+                              const char *data, size_t data_size, user_role_t user_role) {
+    switch (command) {
+        case CMD_LIST:
+            return handle_list_command(conn, path, data, data_size, 0, user_role);
+        
+        case CMD_GET:
+            if (data_size != 0) return send_response(conn, RESP_ERROR, "Range not allowed in batch", 26);
+            return handle_batch_get(conn, path, user_role);
+        
+        case CMD_PUT:
+            if (!check_permission(user_role, CMD_PUT)) return send_response(conn, RESP_ERROR, "Permission denied", 17);
+            if (write_file(path, data, data_size) != 0) return send_response(conn, RESP_ERROR, "Failed to write file", 20);
+            return send_response(conn, RESP_OK, "File written successfully", 25);
+        
+        case CMD_DELETE:
+            return handle_delete_command(conn, path, user_role);
+        
+        case CMD_MKDIR:
+            return handle_mkdir_command(conn, path, user_role);
+        
+        case CMD_INFO:
+            return handle_info_command(conn, path, user_role);
+        
+        default:
+            return send_response(conn, RESP_ERROR, "Command not allowed in batch", 28);
+    }
+}
+
+int handle_batch_command(connection_t *conn, const char *data, size_t size, user_role_t user_role) {
+    int version = conn->protocol_version;
+    size_t header_size = request_header_size(version);
+    uint8_t command;
+    uint16_t path_length;
+    uint64_t data_length;
+    uint32_t count = 0;
+    
+    // Check every entry's framing before anything runs
+    for (size_t pos = 0; pos < size; count++) {
+        if (size - pos < header_size) {
+            return send_response(conn, RESP_ERROR, "Malformed batch", 15);
+        }
+        decode_request_header(version, data + pos, &command, &path_length, &data_length);
+        size_t left = size - pos - header_size;
+        if (path_length >= MAX_PATH_LENGTH || path_length > left || data_length > left - path_length) {
+            return send_response(conn, RESP_ERROR, "Malformed batch", 15);
+        }
+        pos += header_size + path_length + data_length;
+    }
+    
+    log_debug("Running batch of %u requests", count);
+    
+    // The results are queued behind a header whose length is filled in at the end.
+    // Entries answer inside the batch response, never in frames of their own.
+    size_t header_offset = conn->out_len;
+    size_t pending_before = conn->out_pending;
+    char response[FRAME_HEADER_SIZE + RESPONSE_HEADER_MAX];
+    size_t response_size = encode_response_start(conn, response, RESP_OK, 0, 0);
+    uint32_t net_count = htonl(count);
+    if (conn_queue_output(conn, response, response_size) != 0 ||
+        conn_queue_output(conn, &net_count, sizeof(net_count)) != 0) {
+        log_error("Failed to queue batch response");
+        return -1;
+    }
+    uint32_t stream = conn->mux_stream;
+    conn->mux_stream = 0;
+    
+    for (size_t pos = 0; pos < size;) {
+        char path[MAX_PATH_LENGTH];
+        decode_request_header(version, data + pos, &command, &path_length, &data_length);
+        memcpy(path, data + pos + header_size, path_length);
+        path[path_length] = '\0';
+        const char *entry_data = data + pos + header_size + path_length;
+        pos += header_size + path_length + data_length;
+        
+        int res;
+        if (conn->out_pending - pending_before > BATCH_RESPONSE_LIMIT) {
+            res = send_response(conn, RESP_ERROR, "Batch response too large", 24);
+        } else {
+            res = handle_batch_entry(conn, command, path, entry_data, data_length, user_role);
+        }
+        if (res != 0) {
+            return -1;
+        }
+    }
+    conn->mux_stream = stream;
+    
+    // The result is bounded well below 4GB, so it fits either header
+    uint64_t result_size = conn->out_pending - pending_before - response_size;
+    encode_response_start(conn, response, RESP_OK, result_size, result_size);
+    conn_patch_output(conn, header_offset, response, response_size);
+    return 0;
+}
+
+int handle_hello_command(connection_t *conn, const char *data, size_t size) {
+    uint32_t requested;
+    
+    if (size < sizeof(requested)) {
+        return send_response(conn, RESP_ERROR, "Invalid protocol version", 24);
+    }
+    memcpy(&requested, data, sizeof(requested));
+    requested = ntohl(requested);
+    if (requested < PROTOCOL_V1) {
+        return send_response(conn, RESP_ERROR, "Invalid protocol version", 24);
+    }
+    // Streams can't be taken back once they exist
+    if (conn->mux != NULL) {
+        return send_response(conn, RESP_ERROR, "Connection is multiplexed", 25);
+    }
+    
+    uint32_t agreed = requested < PROTOCOL_VERSION ? requested : PROTOCOL_VERSION;
+    if (agreed >= PROTOCOL_V3 && mux_enable(conn) != 0) {
+        agreed = PROTOCOL_V2;
+    }
+    uint32_t answer[3] = { htonl(agreed), 0, 0 };
+    size_t answer_size = sizeof(answer[0]);
+    log_debug("Client %d speaks protocol version %u", conn->fd, agreed);
+    
+    // Clients that list their codecs learn which of them the server has too
+    if (size >= sizeof(requested) + HELLO_CODECS_SIZE) {
+        uint32_t codecs;
+        memcpy(&codecs, data + sizeof(requested), sizeof(codecs));
+        answer[1] = htonl(ntohl(codecs) & compress_codecs());
+        answer_size += HELLO_CODECS_SIZE;
+    }
+    
+    // Checksum trailers are only added to streams that aren't multiplexed
+    conn->checksums = 0;
+    conn->compact_lists = 0;
+    if (size >= sizeof(requested) + HELLO_CODECS_SIZE + HELLO_FEATURES_SIZE) {
+        uint32_t features;
+        memcpy(&features, data + sizeof(requested) + HELLO_CODECS_SIZE, sizeof(features));
+        features = ntohl(features);
+        conn->checksums = conn->mux == NULL && (features & HELLO_FEATURE_CRC32C);
+        conn->compact_lists = (features & HELLO_FEATURE_COMPACT_LIST) != 0;
+        answer[2] = htonl((conn->checksums ? HELLO_FEATURE_CRC32C : 0) |
+                          (features & (HELLO_FEATURE_LIST_PAGES | HELLO_FEATURE_COMPACT_LIST |
+                                       HELLO_FEATURE_LIST_QUERY)));
+        answer_size += HELLO_FEATURES_SIZE;
+    }
+    
+    // The answer still uses the old framing, everything after it the new one
+    int res = send_response(conn, RESP_OK, answer, answer_size);
+    conn->protocol_version = (int)agreed;
+    return res;
 }
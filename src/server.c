@@ -1,262 +1,2118 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "../include/server.h"
+#include "../include/connection.h"
+#include "../include/thread_pool.h"
+#include "../include/uring.h"
 #include "../include/logger.h"
 #include "../include/file_ops.h"
+#include "../include/upload.h"
+#include "../include/chunk_store.h"
+#include "../include/delta.h"
+#include "../include/checksum.h"
+#include "../include/meta_cache.h"
+#include "../include/mux.h"
+#include "../include/compress.h"
 #include "../include/protocol.h"
 #include "../include/config.h"
 #include "../include/auth.h"
 
-#define MAX_CLIENTS 100
-#define BUFFER_SIZE 4096
+#define MAX_EVENTS 256
+#define LOOP_TIMEOUT_MS 500      // Upper bound on how long server_process() blocks
+#define STREAM_CHUNK_SIZE 65536
+#define STREAM_CHUNKS_PER_EVENT 16 // Keeps one large transfer from starving other clients
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#define URING_MAX_ENTRIES 4096
+#define URING_FIXED_BUFFERS 64   // Registered stream buffers, further streams use heap buffers
+#define PIPELINE_OUTPUT_LIMIT (256 * 1024) // Pending response bytes that end a worker's run of pipelined requests
 
-static int server_fd = -1;
+// epoll/io_uring user data for the two non-client descriptors, clients use conn_id()
+#define LISTENER_ID UINT64_MAX
+#define NOTIFY_ID (UINT64_MAX - 1)
+
+// io_uring engine, used instead of epoll when io_engine = io_uring
+typedef enum {
+    URING_OP_NONE,
+    URING_OP_RECV_INPUT,  // Request bytes (or a chunk length) into the input ring
+    URING_OP_RECV,        // A large request payload, or a PUT chunk in CONN_RECV_FILE
+    URING_OP_SEND,        // Queued response output, as one sendmsg()
+    URING_OP_FILE_READ,   // GET chunk from the file
+    URING_OP_FILE_SEND,   // GET chunk to the socket
+    URING_OP_FILE_WRITE   // PUT chunk to the file
+} uring_op_t;
+
+typedef struct {
+    uring_op_t op;        // Operation in flight, a connection has at most one
+    int closing;          // Close requested while an operation was in flight
+    char *buf;            // Stream chunk buffer, only held while streaming
+    int buf_index;        // Registered buffer index, -1 for a heap buffer
+    size_t chunk_len;
+    size_t chunk_pos;
+    int polled;           // Multiplexed: input was checked since the last round of stream data
+    struct iovec iov[CONN_OUTPUT_SEGMENTS]; // Input ring space or pending output of the operation in flight
+    struct msghdr msg;
+} uring_conn_t;
+
+// Per-shard counters, only touched by the shard's own reactor thread
+typedef struct {
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t raw_bytes;        // File bytes of compressed transfers
+    uint64_t compressed_bytes; // The same transfers as sent or received
+} shard_stats_t;
+
+// One reactor: its own listener, event loop, connection table and buffers.
+// Shard 0 runs on the main thread inside server_process(), the rest on
+// their own threads.
+typedef struct {
+    int index;
+    int cpu;                   // CPU the reactor is pinned to, -1 if unpinned
+    pthread_t thread;
+    int thread_started;
+    int init_status;
+    
+    int listen_fd;
+    int epoll_fd;
+    int num_clients;
+    
+    // Connection table, max_connections split evenly across shards
+    connection_t *conn_table;
+    uint32_t *free_slots;      // Stack of unused slot indices
+    int num_free;
+    int table_size;
+    
+    // Workers hand finished connections back through this list and wake the loop via notify_fd
+    int notify_fd;
+    pthread_mutex_t done_mutex;
+    uint64_t *done_ids;
+    uint64_t *done_swap;
+    int num_done;
+    
+    // Requests waiting for room in the worker queue, oldest first
+    uint64_t *deferred_ids;
+    int deferred_head;
+    int num_deferred;
+    
+    // io_uring engine state
+    int use_uring;
+    uring_t ring;
+    uring_conn_t *uring_conns; // Indexed by connection slot
+    char *fixed_pool;
+    int *free_buffers;
+    int num_free_buffers;
+    int accept_multishot;
+    
+    shard_stats_t stats;
+    time_t last_stats;
+} shard_t;
+
+static shard_t *shards = NULL;
+static int num_shards = 0;
+static atomic_int shards_running;
 static struct sockaddr_in server_addr;
-static pthread_t client_threads[MAX_CLIENTS];
-static int client_fds[MAX_CLIENTS];
-static user_role_t client_roles[MAX_CLIENTS];  // Added: Track role for each client
-static int num_clients = 0;
-static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int listen_backlog = 0;
 
-static void *client_handler(void *arg);
+// Shard threads report back once their setup has finished
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static int shards_ready = 0;
 
-int init_server(int port, int backlog) {
-    server_config_t *config = get_config();
+static void accept_connections(shard_t *sh);
+static void handle_connection_event(connection_t *conn, uint32_t events);
+static void close_connection(connection_t *conn);
+static void release_slot(connection_t *conn);
+static void free_conn_table(shard_t *sh);
+static void complete_requests(shard_t *sh);
+static void dispatch_deferred(shard_t *sh);
+static int uring_engine_init(shard_t *sh);
+static void uring_engine_shutdown(shard_t *sh);
+static int uring_process(shard_t *sh);
+static int uring_drive(connection_t *conn);
+static void uring_release_buffer(shard_t *sh, uring_conn_t *uc);
+
+static shard_t *shard_of(const connection_t *conn) {
+    return &shards[conn->shard];
+}
+
+static uint64_t conn_id(const connection_t *conn) {
+    return ((uint64_t)conn->generation << 32) | conn->slot;
+}
+
+// Map an id back to its connection, NULL if the slot has been closed or reused since
+static connection_t *lookup_conn(shard_t *sh, uint64_t id) {
+    uint32_t slot = (uint32_t)id;
+    if (slot >= (uint32_t)sh->table_size) {
+        return NULL;
+    }
+    connection_t *conn = &sh->conn_table[slot];
+    if (conn->fd < 0 || conn->generation != (uint32_t)(id >> 32)) {
+        return NULL;
+    }
+    return conn;
+}
+
+static int init_conn_table(shard_t *sh, int size) {
+    sh->table_size = size > 0 ? size : 1;
+    sh->conn_table = calloc(sh->table_size, sizeof(connection_t));
+    sh->free_slots = calloc(sh->table_size, sizeof(uint32_t));
+    sh->done_ids = calloc(sh->table_size, sizeof(uint64_t));
+    sh->done_swap = calloc(sh->table_size, sizeof(uint64_t));
+    sh->deferred_ids = calloc(sh->table_size, sizeof(uint64_t));
+    if (sh->conn_table == NULL || sh->free_slots == NULL || sh->done_ids == NULL ||
+        sh->done_swap == NULL || sh->deferred_ids == NULL) {
+        log_error("Failed to allocate connection table for %d connections", sh->table_size);
+        free_conn_table(sh);
+        return -1;
+    }
+    
+    // Hand out low slots first so a lightly loaded server touches little memory
+    for (int i = 0; i < sh->table_size; i++) {
+        sh->conn_table[i].slot = i;
+        sh->conn_table[i].shard = sh->index;
+        sh->conn_table[i].fd = -1;
+        sh->conn_table[i].file_fd = -1;
+        sh->conn_table[i].pipe_rd = -1;
+        sh->conn_table[i].pipe_wr = -1;
+        sh->free_slots[i] = sh->table_size - 1 - i;
+    }
+    sh->num_free = sh->table_size;
+    return 0;
+}
+
+static void free_conn_table(shard_t *sh) {
+    if (sh->conn_table != NULL) {
+        for (int i = 0; i < sh->table_size; i++) {
+            free(sh->conn_table[i].out_buf);
+        }
+    }
+    free(sh->conn_table);
+    free(sh->free_slots);
+    free(sh->done_ids);
+    free(sh->done_swap);
+    free(sh->deferred_ids);
+    sh->conn_table = NULL;
+    sh->free_slots = NULL;
+    sh->done_ids = NULL;
+    sh->done_swap = NULL;
+    sh->deferred_ids = NULL;
+    sh->table_size = 0;
+    sh->num_free = 0;
+    sh->num_done = 0;
+    sh->num_deferred = 0;
+}
+
+// Create the epoll instance and register the listening socket and worker channel
+static int epoll_engine_init(shard_t *sh) {
+    sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sh->epoll_fd < 0) {
+        log_error("Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTENER_ID;
+    if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->listen_fd, &ev) < 0) {
+        log_error("Failed to register listening socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.u64 = NOTIFY_ID;
+    if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->notify_fd, &ev) < 0) {
+        log_error("Failed to register worker notification channel: %s", strerror(errno));
+        return -1;
+    }
     
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
+    return 0;
+}
+
+// Open this shard's listening socket. With several shards every one binds
+// the same port and SO_REUSEPORT lets the kernel spread connections across them.
+static int open_listener(shard_t *sh) {
+    sh->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sh->listen_fd < 0) {
         log_error("Failed to create socket: %s", strerror(errno));
         return -1;
     }
     
     // Set socket options
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(sh->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         log_error("Failed to set socket options: %s", strerror(errno));
-        close(server_fd);
         return -1;
     }
-    
-    // Prepare server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-    
-    log_info("Attempting to bind to port %d", port);
+    if (num_shards > 1 && setsockopt(sh->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_error("Failed to enable SO_REUSEPORT: %s", strerror(errno));
+        return -1;
+    }
     
     // Bind socket to address
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(sh->listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         log_error("Failed to bind socket: %s (errno=%d)", strerror(errno), errno);
-        close(server_fd);
         return -1;
     }
     
     // Listen for connections
-    if (listen(server_fd, backlog) < 0) {
+    if (listen(sh->listen_fd, listen_backlog) < 0) {
         log_error("Failed to listen on socket: %s", strerror(errno));
-        close(server_fd);
         return -1;
     }
     
-    // Set non-blocking mode
-    int flags = fcntl(server_fd, F_GETFL, 0);
-    if (flags < 0) {
-        log_error("Failed to get socket flags: %s", strerror(errno));
-        close(server_fd);
+    return 0;
+}
+
+// Set up everything a shard owns. Runs on the shard's own (pinned) thread so
+// its connection table and buffers are first touched from that CPU.
+static int init_shard(shard_t *sh) {
+    server_config_t *config = get_config();
+    
+    if (sh->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(sh->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            log_warning("Failed to pin shard %d to CPU %d: %s", sh->index, sh->cpu, strerror(err));
+            sh->cpu = -1;
+        }
+    }
+    
+    if (open_listener(sh) != 0) {
         return -1;
     }
     
-    if (fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
-        log_error("Failed to set non-blocking mode: %s", strerror(errno));
-        close(server_fd);
+    // Workers signal finished requests through an eventfd
+    sh->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sh->notify_fd < 0) {
+        log_error("Failed to create worker notification channel: %s", strerror(errno));
         return -1;
     }
     
-    // Initialize authentication if enabled
-    if (config->enable_auth) {
-        if (init_auth(config->auth_file) != 0) {
-            log_error("Failed to initialize authentication system");
-            close(server_fd);
-            return -1;
+    if (init_conn_table(sh, (config->max_connections + num_shards - 1) / num_shards) != 0) {
+        return -1;
+    }
+    
+    // Pick the I/O engine, io_uring falls back to epoll on kernels without it
+    if (strcmp(config->io_engine, "io_uring") == 0) {
+        sh->use_uring = uring_engine_init(sh) == 0;
+        if (!sh->use_uring) {
+            log_warning("Falling back to the epoll I/O engine");
         }
-        log_info("Authentication system initialized with file: %s", config->auth_file);
+    } else if (strcmp(config->io_engine, "epoll") != 0 && sh->index == 0) {
+        log_warning("Unknown io_engine '%s', using epoll", config->io_engine);
     }
     
-    // Initialize client tracking
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        client_fds[i] = -1;
-        client_roles[i] = ROLE_GUEST;  // Default role is guest
+    if (!sh->use_uring && epoll_engine_init(sh) != 0) {
+        return -1;
     }
     
-    log_info("Server initialized on port %d", port);
+    sh->last_stats = time(NULL);
     return 0;
 }
 
-int server_process(void) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    
-    // Accept new connections
-    int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-    if (client_fd < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            log_error("Failed to accept connection: %s", strerror(errno));
+static void log_shard_stats(shard_t *sh) {
+    log_info("Shard %d (cpu %d): %d active, %llu accepted, %llu rejected, %llu requests, "
+             "%llu bytes in, %llu bytes out, %llu raw bytes compressed to %llu",
+             sh->index, sh->cpu, sh->num_clients,
+             (unsigned long long)sh->stats.accepted, (unsigned long long)sh->stats.rejected,
+             (unsigned long long)sh->stats.requests, (unsigned long long)sh->stats.bytes_in,
+             (unsigned long long)sh->stats.bytes_out, (unsigned long long)sh->stats.raw_bytes,
+             (unsigned long long)sh->stats.compressed_bytes);
+}
+
+// Run one pass of a shard's event loop
+static int shard_process(shard_t *sh) {
+    int res;
+    
+    if (sh->use_uring) {
+        res = uring_process(sh);
+    } else {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(sh->epoll_fd, events, MAX_EVENTS, LOOP_TIMEOUT_MS);
+        if (n < 0 && errno != EINTR) {
+            log_error("Failed to wait for events: %s", strerror(errno));
             return -1;
         }
-    } else {
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
-        log_info("New connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
         
-        // Add client to tracking
-        pthread_mutex_lock(&clients_mutex);
-        if (num_clients < MAX_CLIENTS) {
-            for (int i = 0; i < MAX_CLIENTS; i++) {
-                if (client_fds[i] == -1) {
-                    client_fds[i] = client_fd;
-                    client_roles[i] = ROLE_GUEST;  // Initialize as guest
-                    
-                    // Create thread to handle client
-                    if (pthread_create(&client_threads[i], NULL, client_handler, (void *)(intptr_t)i) != 0) {
-                        log_error("Failed to create client thread: %s", strerror(errno));
-                        close(client_fd);
-                        client_fds[i] = -1;
-                    } else {
-                        num_clients++;
-                        log_info("Client %d connected, total clients: %d", i, num_clients);
-                    }
-                    break;
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+            if (id == LISTENER_ID) {
+                accept_connections(sh);
+            } else if (id == NOTIFY_ID) {
+                complete_requests(sh);
+            } else {
+                // Stale events for a slot closed earlier in this batch are dropped here
+                connection_t *conn = lookup_conn(sh, id);
+                if (conn != NULL) {
+                    handle_connection_event(conn, events[i].events);
                 }
             }
-        } else {
-            log_error("Maximum number of clients reached, connection rejected");
-            close(client_fd);
         }
-        pthread_mutex_unlock(&clients_mutex);
+        
+        if (sh->num_deferred > 0) {
+            dispatch_deferred(sh);
+        }
+        res = 0;
     }
     
-    return 0;
+    int interval = get_config()->stats_interval;
+    if (interval > 0) {
+        time_t now = time(NULL);
+        if (now - sh->last_stats >= interval) {
+            log_shard_stats(sh);
+            sh->last_stats = now;
+        }
+    }
+    
+    return res;
 }
 
-int shutdown_server(void) {
-    if (server_fd >= 0) {
-        // Close server socket
-        close(server_fd);
-        server_fd = -1;
-        
-        // Wait for client threads to finish
-        pthread_mutex_lock(&clients_mutex);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (client_fds[i] >= 0) {
-                close(client_fds[i]);
-                client_fds[i] = -1;
-                pthread_join(client_threads[i], NULL);
-            }
+static void *shard_main(void *arg) {
+    shard_t *sh = arg;
+    
+    sh->init_status = init_shard(sh);
+    
+    pthread_mutex_lock(&ready_mutex);
+    shards_ready++;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_mutex);
+    
+    if (sh->init_status != 0) {
+        return NULL;
+    }
+    
+    while (atomic_load(&shards_running)) {
+        if (shard_process(sh) != 0) {
+            log_error("Shard %d event loop failed, its connections are no longer served", sh->index);
+            break;
         }
-        num_clients = 0;
-        pthread_mutex_unlock(&clients_mutex);
-        
-        log_info("Server shutdown complete");
     }
     
-    return 0;
+    return NULL;
 }
 
-int handle_client(int client_fd, int client_index) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = 0;
+// Spread shards over the CPUs this process may run on
+static void assign_cpus(int pin) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int num_cpus = 0;
     
-    // Read header (7 bytes: 1 cmd + 2 path_len + 4 data_len)
-    while (bytes_read < 7) {
-        ssize_t r = read(client_fd, buffer + bytes_read, 7 - bytes_read);
-        if (r <= 0) {
-            if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
-                usleep(1000);
-                continue;
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[num_cpus++] = cpu;
             }
+        }
+    }
+    
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].cpu = num_cpus > 0 ? cpus[i % num_cpus] : -1;
+    }
+}
+
+static int count_cpus(void) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        return CPU_COUNT(&allowed);
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+int init_server(int port, int backlog) {
+    server_config_t *config = get_config();
+    
+    // Prepare server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    listen_backlog = backlog;
+    
+    // reactor_threads = 0 means one reactor per available CPU
+    num_shards = config->reactor_threads > 0 ? config->reactor_threads : count_cpus();
+    shards = calloc(num_shards, sizeof(shard_t));
+    if (shards == NULL) {
+        log_error("Failed to allocate %d reactor shards", num_shards);
+        return -1;
+    }
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].index = i;
+        shards[i].listen_fd = -1;
+        shards[i].epoll_fd = -1;
+        shards[i].notify_fd = -1;
+        pthread_mutex_init(&shards[i].done_mutex, NULL);
+    }
+    // A single reactor keeps running wherever the scheduler puts the main thread
+    assign_cpus(num_shards > 1 && config->cpu_affinity);
+    
+    log_info("Attempting to bind to port %d", port);
+    
+    if (thread_pool_init(config->worker_threads, config->queue_depth) != 0) {
+        shutdown_server();
+        return -1;
+    }
+    
+    // Initialize authentication if enabled
+    if (config->enable_auth) {
+        if (init_auth(config->auth_file) != 0) {
+            log_error("Failed to initialize authentication system");
+            shutdown_server();
             return -1;
         }
-        bytes_read += r;
+        log_info("Authentication system initialized with file: %s", config->auth_file);
     }
     
-    // Extract path_length (bytes 1 and 2 in network byte order)
-    uint16_t path_length;
-    memcpy(&path_length, buffer + 1, 2);
-    path_length = ntohs(path_length);
+    if (init_file_ops() != 0) {
+        log_error("Failed to open the root directory");
+        shutdown_server();
+        return -1;
+    }
     
-    if (7 + path_length > BUFFER_SIZE) {
-        log_error("Path size exceeds maximum buffer");
+    if (upload_init() != 0) {
+        log_error("Failed to initialize upload sessions");
+        shutdown_server();
         return -1;
     }
     
-    while (bytes_read < 7 + path_length) {
-        ssize_t r = read(client_fd, buffer + bytes_read, (7 + path_length) - bytes_read);
-        if (r <= 0) {
-            if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
-                usleep(1000);
-                continue;
-            }
+    if (chunk_store_init() != 0) {
+        log_error("Failed to initialize the chunk store");
+        shutdown_server();
+        return -1;
+    }
+    
+    if (meta_cache_init() != 0) {
+        log_error("Failed to initialize the metadata cache");
+        shutdown_server();
+        return -1;
+    }
+    
+    // Shard threads leave signal handling to the main thread
+    sigset_t block, old;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    
+    atomic_store(&shards_running, 1);
+    shards_ready = 0;
+    int started = 0;
+    for (int i = 1; i < num_shards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0) {
+            log_error("Failed to create reactor thread for shard %d", i);
+            shards[i].init_status = -1;
+            break;
+        }
+        shards[i].thread_started = 1;
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    // Shard 0 belongs to the main thread
+    shards[0].init_status = init_shard(&shards[0]);
+    
+    pthread_mutex_lock(&ready_mutex);
+    while (shards_ready < started) {
+        pthread_cond_wait(&ready_cond, &ready_mutex);
+    }
+    pthread_mutex_unlock(&ready_mutex);
+    
+    for (int i = 0; i < num_shards; i++) {
+        if (shards[i].init_status != 0) {
+            log_error("Failed to initialize reactor shard %d", i);
+            shutdown_server();
             return -1;
         }
-        bytes_read += r;
     }
     
-    // Extract data_length
-    uint32_t data_length;
-    memcpy(&data_length, buffer + 3, 4);
-    data_length = ntohl(data_length);
+    log_info("Server initialized on port %d (%s engine, %d shard%s, %d connections per shard, %d workers)",
+             port, shards[0].use_uring ? "io_uring" : "epoll", num_shards, num_shards > 1 ? "s" : "",
+             shards[0].table_size, thread_pool_size());
+    return 0;
+}
+
+int server_process(void) {
+    return shard_process(&shards[0]);
+}
+
+// Release everything a shard owns. Its reactor thread must have stopped.
+static void shutdown_shard(shard_t *sh) {
+    if (sh->listen_fd >= 0) {
+        close(sh->listen_fd);
+        sh->listen_fd = -1;
+    }
+    
+    // Drop all client connections
+    if (sh->use_uring) {
+        uring_engine_shutdown(sh);
+    }
+    for (int i = 0; i < sh->table_size; i++) {
+        if (sh->conn_table[i].fd >= 0) {
+            sh->conn_table[i].busy = 0;
+            close_connection(&sh->conn_table[i]);
+        }
+    }
+    if (sh->conn_table != NULL) {
+        log_shard_stats(sh);
+    }
+    free_conn_table(sh);
     
-    // Try to read as much of the payload as possible into the remaining buffer space
-    size_t remaining_buffer = BUFFER_SIZE - (7 + path_length);
-    size_t to_read_payload = data_length < remaining_buffer ? data_length : remaining_buffer;
+    if (sh->notify_fd >= 0) {
+        close(sh->notify_fd);
+        sh->notify_fd = -1;
+    }
+    if (sh->epoll_fd >= 0) {
+        close(sh->epoll_fd);
+        sh->epoll_fd = -1;
+    }
+    pthread_mutex_destroy(&sh->done_mutex);
+}
+
+int shutdown_server(void) {
+    if (shards != NULL) {
+        // Stop the reactor threads, each notices within one loop timeout
+        atomic_store(&shards_running, 0);
+        for (int i = 1; i < num_shards; i++) {
+            if (shards[i].thread_started) {
+                pthread_join(shards[i].thread, NULL);
+            }
+        }
+        
+        // Stop accepting before waiting for the workers
+        for (int i = 0; i < num_shards; i++) {
+            if (shards[i].listen_fd >= 0) {
+                close(shards[i].listen_fd);
+                shards[i].listen_fd = -1;
+            }
+        }
+        
+        // Let running requests finish before their connections go away
+        thread_pool_shutdown();
+        
+        for (int i = 0; i < num_shards; i++) {
+            shutdown_shard(&shards[i]);
+        }
+        upload_cleanup();
+        meta_cache_cleanup();
+        cleanup_file_ops();
+        free(shards);
+        shards = NULL;
+        num_shards = 0;
+        
+        log_info("Server shutdown complete");
+    }
     
-    while (bytes_read < (ssize_t)(7 + path_length + to_read_payload)) {
-        ssize_t r = read(client_fd, buffer + bytes_read, (7 + path_length + to_read_payload) - bytes_read);
-        if (r <= 0) {
-            if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
-                usleep(1000);
+    return 0;
+}
+
+// Accept every pending connection until the backlog is drained
+static void accept_connections(shard_t *sh) {
+    for (;;) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        
+        int client_fd = accept4(sh->listen_fd, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
                 continue;
             }
-            return -1;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+        
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        log_info("New connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
+        
+        if (sh->num_free == 0) {
+            log_error("Maximum number of clients reached, connection rejected");
+            sh->stats.rejected++;
+            close(client_fd);
+            continue;
+        }
+        
+        connection_t *conn = &sh->conn_table[sh->free_slots[--sh->num_free]];
+        conn->generation++;
+        conn_open(conn, client_fd);
+        
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.u64 = conn_id(conn);
+        if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            log_error("Failed to register client socket: %s", strerror(errno));
+            conn_close(conn);
+            sh->free_slots[sh->num_free++] = conn->slot;
+            continue;
         }
-        bytes_read += r;
+        
+        sh->num_clients++;
+        sh->stats.accepted++;
+        log_info("Client %d connected, total clients: %d", client_fd, sh->num_clients);
     }
+}
+
+static void close_connection(connection_t *conn) {
+    shard_t *sh = shard_of(conn);
+    sh->num_clients--;
+    log_info("Client %d disconnected, total clients: %d", conn->fd, sh->num_clients);
     
-    // Process request based on protocol
-    return process_request(client_fd, buffer, bytes_read, &client_roles[client_index]);
+    if (sh->use_uring && sh->uring_conns[conn->slot].op != URING_OP_NONE) {
+        // The slot's buffers stay in use until the kernel completes the operation,
+        // shutting the socket down makes a pending recv or send finish promptly
+        sh->uring_conns[conn->slot].closing = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    if (!sh->use_uring && sh->epoll_fd >= 0) {
+        epoll_ctl(sh->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    release_slot(conn);
+}
+
+static void release_slot(connection_t *conn) {
+    shard_t *sh = shard_of(conn);
+    if (sh->uring_conns != NULL) {
+        uring_release_buffer(sh, &sh->uring_conns[conn->slot]);
+        sh->uring_conns[conn->slot].closing = 0;
+    }
+    conn_close(conn);
+    sh->free_slots[sh->num_free++] = conn->slot;
 }
 
-static void *client_handler(void *arg) {
-    int index = (intptr_t)arg;
-    int client_fd = client_fds[index];
+static int parse_request(connection_t *conn);
+
+// Worker side: run the buffered requests and hand the connection back to the event loop
+static void run_request(void *arg) {
+    connection_t *conn = arg;
+    shard_t *sh = shard_of(conn);
     
-    // Handle client until disconnection
-    while (client_fd >= 0) {
-        if (handle_client(client_fd, index) != 0) {
+    // Pipelined requests already in the input ring run back to back, so their
+    // responses queue up in order. A streamed transfer or a large backlog of
+    // output hands the connection back before the next request starts.
+    conn->request_count = 0;
+    for (;;) {
+        // Handlers may switch the connection into a streaming state
+        conn->state = CONN_READ_HEADER;
+        conn->request_status = process_request(conn, conn->in_buf, conn->in_len);
+        conn->request_count++;
+        
+        if (conn->request_status != 0 || conn->state != CONN_READ_HEADER ||
+            conn->out_pending >= PIPELINE_OUTPUT_LIMIT) {
             break;
         }
+        conn_reset_request(conn);
+        if (parse_request(conn) != 1) {
+            break;  // Malformed input is rejected once the event loop parses it again,
+                    // a large payload is read by the event loop before it runs
+        }
+    }
+    
+    pthread_mutex_lock(&sh->done_mutex);
+    sh->done_ids[sh->num_done++] = conn_id(conn);
+    pthread_mutex_unlock(&sh->done_mutex);
+    
+    uint64_t one = 1;
+    if (write(sh->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_error("Failed to notify event loop: %s", strerror(errno));
+    }
+}
+
+// Queue a complete request for the workers. While a worker owns the
+// connection the event loop leaves it alone and its socket is not armed.
+static void dispatch_request(connection_t *conn) {
+    shard_t *sh = shard_of(conn);
+    conn->busy = 1;
+    if (sh->num_deferred > 0 || thread_pool_submit(run_request, conn) != 0) {
+        // Queue is full: park the request and stop reading from this client until it runs
+        sh->deferred_ids[(sh->deferred_head + sh->num_deferred) % sh->table_size] = conn_id(conn);
+        sh->num_deferred++;
+        log_debug("Worker queue full, deferring request from client %d", conn->fd);
+    }
+}
+
+static void dispatch_deferred(shard_t *sh) {
+    while (sh->num_deferred > 0) {
+        connection_t *conn = lookup_conn(sh, sh->deferred_ids[sh->deferred_head]);
+        if (conn != NULL && thread_pool_submit(run_request, conn) != 0) {
+            return;
+        }
+        sh->deferred_head = (sh->deferred_head + 1) % sh->table_size;
+        sh->num_deferred--;
+    }
+}
+
+// Cut the next complete request out of the input ring into in_buf.
+// Returns 1 when a request is ready, 0 if more data is needed, -1 on error.
+static int parse_request(connection_t *conn) {
+    // A multiplexed connection's other frames are handled on the way to the next request
+    uint32_t frame_length = 0;
+    if (conn->mux != NULL) {
+        int res = mux_read_frames(conn, &frame_length);
+        if (res <= 0) {
+            return res;
+        }
+    }
+    
+    size_t avail = conn_input_len(conn);
+    size_t header_size = request_header_size(conn->protocol_version);
+    if (conn->mux != NULL && frame_length < header_size) {
+        log_error("Request frame too small to contain header");
+        return -1;
+    }
+    if (avail < header_size) {
+        return 0;
     }
     
-    // Clean up client resources
-    pthread_mutex_lock(&clients_mutex);
-    if (client_fds[index] >= 0) {
-        close(client_fds[index]);
-        client_fds[index] = -1;
-        client_roles[index] = ROLE_GUEST;  // Reset role
-        num_clients--;
-        log_info("Client %d disconnected, total clients: %d", index, num_clients);
+    char header[REQUEST_HEADER_MAX];
+    conn_input_peek(conn, 0, header, header_size);
+    decode_request_header(conn->protocol_version, header, &conn->command,
+                          &conn->path_length, &conn->data_length);
+    
+    if (conn->path_length >= MAX_PATH_LENGTH) {
+        log_error("Path size exceeds maximum buffer");
+        return -1;
     }
-    pthread_mutex_unlock(&clients_mutex);
     
-    return NULL;
-} 
+    size_t need = header_size + conn->path_length;
+    size_t take = need;
+    int large = 0;
+    if (conn->mux != NULL) {
+        // A request frame holds the whole request, except for a streamed
+        // payload, which may start in the frame and continues in DATA frames
+        size_t initial = frame_length >= need ? frame_length - need : 0;
+        int fits;
+        if (frame_length < need) {
+            fits = 0;
+        } else if (command_streams_payload(conn->command)) {
+            size_t prefix = command_payload_prefix(conn->command);
+            fits = frame_length <= CONN_BUFFER_SIZE && initial <= conn->data_length &&
+                   initial >= (prefix < conn->data_length ? prefix : conn->data_length);
+            need = take = frame_length;
+        } else {
+            fits = initial == conn->data_length;
+            large = conn->data_length > CONN_BUFFER_SIZE - need;
+            if (large && conn->data_length > command_payload_limit(conn->command)) {
+                log_error("Request payload of %llu bytes exceeds maximum buffer",
+                          (unsigned long long)conn->data_length);
+                return -1;
+            }
+            if (!large) {
+                need = take = frame_length;
+            }
+        }
+        if (!fits) {
+            log_error("Request does not match its frame");
+            return -1;
+        }
+    } else if (command_streams_payload(conn->command)) {
+        // Streamed payloads are handed to the request handler, along with
+        // whatever part of the payload has already arrived. A chunked
+        // payload starts with a chunk length, which the event loop reads.
+        // Some handlers need the first few payload bytes to get started.
+        if (conn->data_length != CONN_LENGTH_CHUNKED) {
+            size_t prefix = command_payload_prefix(conn->command);
+            need += prefix < conn->data_length ? prefix : conn->data_length;
+            take = need;
+        }
+        size_t extra = avail > need && conn->data_length != CONN_LENGTH_CHUNKED ? avail - need : 0;
+        if (extra > conn->data_length) {
+            extra = conn->data_length;
+        }
+        if (extra > CONN_BUFFER_SIZE - need) {
+            extra = CONN_BUFFER_SIZE - need;
+        }
+        take += extra;
+    } else if (conn->data_length > 0) {
+        // Everything else is buffered whole, in in_buf if it fits
+        large = conn->data_length > CONN_BUFFER_SIZE - need;
+        if (large && conn->data_length > command_payload_limit(conn->command)) {
+            log_error("Request payload of %llu bytes exceeds maximum buffer",
+                      (unsigned long long)conn->data_length);
+            return -1;
+        }
+        if (!large) {
+            need += conn->data_length;
+            take = need;
+        }
+    }
+    if (avail < need) {
+        return 0;
+    }
+    
+    conn_input_peek(conn, 0, conn->in_buf, take);
+    conn_input_consume(conn, take);
+    conn->in_len = take;
+    if (!large) {
+        return 1;
+    }
+    
+    // A large payload gets a buffer of its own, whatever has arrived is moved there now
+    conn->body = malloc(conn->data_length);
+    if (conn->body == NULL) {
+        log_error("Failed to allocate %llu bytes for a request payload",
+                  (unsigned long long)conn->data_length);
+        return -1;
+    }
+    conn->body_len = conn_input_len(conn) < conn->data_length ? conn_input_len(conn) : conn->data_length;
+    conn_input_peek(conn, 0, conn->body, conn->body_len);
+    conn_input_consume(conn, conn->body_len);
+    if (conn->body_len == conn->data_length) {
+        return 1;
+    }
+    conn->state = CONN_READ_BODY;
+    return 0;
+}
+
+// Read the rest of a large request payload straight into its buffer.
+// Returns 1 when the payload is complete, 0 if more data is needed, -1 on error or EOF.
+static int read_body(connection_t *conn) {
+    while (conn->body_len < conn->data_length) {
+        ssize_t r = read(conn->fd, conn->body + conn->body_len, conn->data_length - conn->body_len);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;  // Client closed the connection
+        }
+        conn->body_len += r;
+        shard_of(conn)->stats.bytes_in += r;
+    }
+    
+    conn->state = CONN_READ_HEADER;
+    return 1;
+}
+
+// Read as much as is available into the input ring.
+// Returns 1 if data was read, 0 if the socket is empty, -1 on error or EOF.
+static int fill_input(connection_t *conn) {
+    // The ring is larger than any request, so a full ring always parses
+    struct iovec iov[2];
+    int iov_count = conn_input_space(conn, iov);
+    if (iov_count == 0) {
+        return -1;
+    }
+    
+    for (;;) {
+        ssize_t r = readv(conn->fd, iov, iov_count);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;  // Client closed the connection
+        }
+        conn_input_commit(conn, r);
+        shard_of(conn)->stats.bytes_in += r;
+        return 1;
+    }
+}
+
+// Read as much input as is available and cut out the next request.
+// Returns 1 when a complete request is buffered, 0 if more data is needed, -1 on error or EOF.
+static int read_request(connection_t *conn) {
+    for (;;) {
+        int res = parse_request(conn);
+        if (res != 0) {
+            return res;
+        }
+        if (conn->state == CONN_READ_BODY) {
+            return read_body(conn);
+        }
+        
+        res = fill_input(conn);
+        if (res <= 0) {
+            return res;
+        }
+    }
+}
+
+// Start the next chunk of a chunked PUT payload from a length prefix in the
+// input ring. An empty chunk ends the payload.
+static void take_chunk_header(connection_t *conn) {
+    uint32_t length;
+    conn_input_peek(conn, 0, &length, sizeof(length));
+    conn_input_consume(conn, sizeof(length));
+    conn->file_remaining = ntohl(length);
+    if (conn->file_remaining == 0) {
+        conn->file_chunked = 0;
+    }
+}
+
+// Read the length prefix of the next chunk. Any chunk data read along with
+// it stays in the input ring and is stored before the socket is read again.
+// Returns 0 once the length is known, 1 if more data is needed, -1 on error.
+static int read_chunk_header(connection_t *conn) {
+    while (conn_input_len(conn) < CHUNK_HEADER_SIZE) {
+        int res = fill_input(conn);
+        if (res <= 0) {
+            return res < 0 ? -1 : 1;
+        }
+    }
+    take_chunk_header(conn);
+    return 0;
+}
+
+// Send as much queued output as the socket accepts.
+// Returns 0 when everything was sent, 1 if the socket is full, -1 on error.
+static int flush_output(connection_t *conn) {
+    // A GET header is held back so it leaves in the same segment as the start of the body
+    int flags = MSG_NOSIGNAL;
+    if (conn->state == CONN_SEND_FILE && conn->file_remaining > 0) {
+        flags |= MSG_MORE;
+    }
+    
+    // Every queued response goes out in one vectored send, however many pieces it has
+    while (conn_has_output(conn)) {
+        struct iovec iov[CONN_OUTPUT_SEGMENTS];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = conn_output_iov(conn, iov);
+        
+        ssize_t w = sendmsg(conn->fd, &msg, flags);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            log_error("Failed to send response: %s", strerror(errno));
+            return -1;
+        }
+        conn_output_sent(conn, w);
+        shard_of(conn)->stats.bytes_out += w;
+    }
+    
+    return 0;
+}
+
+// Copy the next part of a GET body through a buffer, for files sendfile() can't handle
+// and for bodies with a checksum trailer, which is computed over the bytes sent.
+// Returns 0 when the body is complete, 1 if the socket is full, -1 on error.
+static int copy_file_chunks(connection_t *conn) {
+    char chunk[STREAM_CHUNK_SIZE];
+    
+    for (int i = 0; i < STREAM_CHUNKS_PER_EVENT && conn->file_remaining > 0; i++) {
+        size_t to_read = conn->file_remaining < sizeof(chunk) ? conn->file_remaining : sizeof(chunk);
+        ssize_t r = pread(conn->file_fd, chunk, to_read, conn->file_offset);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("Failed to read file for client %d: %s", conn->fd, strerror(errno));
+            return -1;
+        }
+        if (r == 0) {
+            // File shrank after the header went out, the response can't be completed
+            log_error("File truncated while streaming to client %d", conn->fd);
+            return -1;
+        }
+        
+        ssize_t w = send(conn->fd, chunk, r, (uint64_t)r < conn->file_remaining ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        
+        // Only the written part counts, the rest is read again on the next pass
+        if (conn->checksum != NULL) {
+            conn->checksum->crc = crc32c(conn->checksum->crc, chunk, w);
+        }
+        conn->file_offset += w;
+        shard_of(conn)->stats.bytes_out += w;
+        conn->file_remaining -= w;
+        if (w < r) {
+            return 1;
+        }
+    }
+    
+    return conn->file_remaining > 0 ? 1 : 0;
+}
+
+// Stream the next part of a GET body. sendfile() moves the data from the page
+// cache to the socket without copying it through user space.
+// Returns 0 when the body is complete, 1 if the socket is full, -1 on error.
+static int send_file_chunks(connection_t *conn) {
+    if (conn->file_copy || conn->checksum != NULL) {
+        return copy_file_chunks(conn);
+    }
+    
+    size_t budget = (size_t)STREAM_CHUNK_SIZE * STREAM_CHUNKS_PER_EVENT;
+    while (conn->file_remaining > 0 && budget > 0) {
+        size_t count = conn->file_remaining < budget ? conn->file_remaining : budget;
+        off_t offset = conn->file_offset;
+        ssize_t w = sendfile(conn->fd, conn->file_fd, &offset, count);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                log_debug("sendfile not supported for client %d, copying instead", conn->fd);
+                conn->file_copy = 1;
+                return copy_file_chunks(conn);
+            }
+            log_error("Failed to send file to client %d: %s", conn->fd, strerror(errno));
+            return -1;
+        }
+        if (w == 0) {
+            // File shrank after the header went out, the response can't be completed
+            log_error("File truncated while streaming to client %d", conn->fd);
+            return -1;
+        }
+        
+        conn->file_offset += w;
+        shard_of(conn)->stats.bytes_out += w;
+        conn->file_remaining -= w;
+        budget -= w;
+    }
+    
+    return conn->file_remaining > 0 ? 1 : 0;
+}
+
+// Read the next block of a compressed GET body and queue it as a chunk, or
+// the empty chunk that ends the body once the range is done. The file is
+// read with pread() on both engines, compression needs the data in memory anyway.
+// Returns 1 if a chunk was queued, 0 once the body is complete, -1 on error.
+static int queue_compressed_chunk(connection_t *conn) {
+    compress_stream_t *cs = conn->codec;
+    uint32_t chunk_length = 0;
+    
+    if (cs->finished) {
+        return 0;
+    }
+    if (conn->file_remaining > 0) {
+        size_t len = conn->file_remaining < COMPRESS_BLOCK_SIZE ? conn->file_remaining : COMPRESS_BLOCK_SIZE;
+        size_t done = 0;
+        while (done < len) {
+            ssize_t r = pread(conn->file_fd, cs->raw + done, len - done, conn->file_offset + done);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                // A file that shrank after the header went out can't complete the response either
+                log_error("Failed to read file for client %d: %s", conn->fd, r < 0 ? strerror(errno) : "truncated");
+                return -1;
+            }
+            done += r;
+        }
+        chunk_length = (uint32_t)compress_block(cs, cs->raw, len, cs->block);
+        conn->file_offset += len;
+        conn->file_remaining -= len;
+    } else {
+        cs->finished = 1;
+    }
+    
+    uint32_t net_length = htonl(chunk_length);
+    if (conn_queue_output(conn, &net_length, sizeof(net_length)) != 0 ||
+        (chunk_length > 0 && conn_queue_output(conn, cs->block, chunk_length) != 0)) {
+        return -1;
+    }
+    return 1;
+}
+
+// Stream the next part of a compressed GET body through the output queue.
+// Returns 0 when the body is complete, 1 if the socket is full, -1 on error.
+static int send_compressed_chunks(connection_t *conn) {
+    for (int i = 0; i < STREAM_CHUNKS_PER_EVENT; i++) {
+        int res = queue_compressed_chunk(conn);
+        if (res <= 0) {
+            return res;
+        }
+        res = flush_output(conn);
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 1;
+}
+
+// Return to request framing once a stream is done, counting what compression saved
+static void end_stream(connection_t *conn) {
+    if (conn->codec != NULL) {
+        shard_t *sh = shard_of(conn);
+        sh->stats.raw_bytes += conn->codec->raw_bytes;
+        sh->stats.compressed_bytes += conn->codec->wire_bytes;
+    }
+    conn_end_stream(conn);
+}
+
+// Queue the CRC32C trailer once a checked GET body has been sent
+static int queue_checksum_trailer(connection_t *conn) {
+    uint8_t trailer[CHECKSUM_SIZE];
+    checksum_trailer(conn->checksum->crc, trailer);
+    return conn_queue_output(conn, trailer, sizeof(trailer));
+}
+
+// Stop storing a PUT payload after a write error. The rest of the payload is
+// still read and discarded so the client gets an error response in sync.
+static void fail_file_stream(connection_t *conn, int err) {
+    log_error("Failed to write file for client %d: %s", conn->fd, strerror(err));
+    close(conn->file_fd);
+    conn->file_fd = -1;
+    conn->file_error = err;
+}
+
+// Write a buffer to the file being received, short writes are retried.
+// Compressed payloads are decoded, deltas applied and checksums updated on the way.
+static void store_chunk(connection_t *conn, const char *data, size_t len) {
+    size_t written = 0;
+    
+    if ((conn->codec != NULL || conn->delta != NULL || conn->checksum != NULL) && conn->file_fd >= 0) {
+        int err = conn->codec != NULL ? compress_store(conn->codec, conn->file_fd, data, len)
+                : conn->delta != NULL ? delta_store(conn->delta, conn->file_fd, data, len)
+                                      : checksum_store(conn->checksum, conn->file_fd, data, len);
+        if (err != 0) {
+            fail_file_stream(conn, err);
+        }
+        return;
+    }
+    
+    // A file_fd of -1 means the payload is being discarded
+    while (conn->file_fd >= 0 && written < len) {
+        ssize_t w = write(conn->file_fd, data + written, len - written);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail_file_stream(conn, errno);
+            return;
+        }
+        written += w;
+    }
+}
+
+// Store the part of a PUT payload that was read into the input ring along
+// with the request. It precedes anything still waiting on the socket.
+static void store_buffered_payload(connection_t *conn) {
+    while (conn->file_remaining > 0 && conn_input_len(conn) > 0) {
+        size_t len = conn_input_len(conn);
+        if (len > conn->file_remaining) {
+            len = conn->file_remaining;
+        }
+        if (len > sizeof(conn->in_buf)) {
+            len = sizeof(conn->in_buf);
+        }
+        
+        conn_input_peek(conn, 0, conn->in_buf, len);
+        conn_input_consume(conn, len);
+        store_chunk(conn, conn->in_buf, len);
+        conn->file_offset += len;
+        conn->file_remaining -= len;
+    }
+}
+
+// Move whatever the splice pipe holds into the file through a buffer
+static void drain_pipe(connection_t *conn) {
+    char chunk[STREAM_CHUNK_SIZE];
+    
+    while (conn->pipe_len > 0) {
+        size_t to_read = conn->pipe_len < sizeof(chunk) ? conn->pipe_len : sizeof(chunk);
+        ssize_t r = read(conn->pipe_rd, chunk, to_read);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        store_chunk(conn, chunk, r);
+        conn->pipe_len -= r;
+    }
+    conn->pipe_len = 0;
+}
+
+// Store the next part of a streamed PUT payload by reading it through a buffer.
+// Returns 0 when the payload is complete, 1 if more data is needed, -1 on error.
+static int copy_recv_chunks(connection_t *conn) {
+    char chunk[STREAM_CHUNK_SIZE];
+    
+    for (int i = 0; i < STREAM_CHUNKS_PER_EVENT && conn->file_remaining > 0; i++) {
+        size_t to_read = conn->file_remaining < sizeof(chunk) ? conn->file_remaining : sizeof(chunk);
+        ssize_t r = read(conn->fd, chunk, to_read);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;  // Connection closed prematurely
+        }
+        
+        store_chunk(conn, chunk, r);
+        conn->file_offset += r;
+        shard_of(conn)->stats.bytes_in += r;
+        conn->file_remaining -= r;
+    }
+    
+    return conn->file_remaining > 0 ? 1 : 0;
+}
+
+static int open_splice_pipe(connection_t *conn) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        log_warning("Failed to create splice pipe: %s", strerror(errno));
+        return -1;
+    }
+    
+    // A bigger pipe means fewer splice calls per megabyte, the default is only 64KB.
+    // Unprivileged processes are capped by /proc/sys/fs/pipe-max-size, so failure is fine.
+    fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    
+    conn->pipe_rd = fds[0];
+    conn->pipe_wr = fds[1];
+    conn->pipe_len = 0;
+    return 0;
+}
+
+// Store the next part of a streamed PUT payload. splice() moves the data
+// socket -> pipe -> file inside the kernel, so it never passes through user space.
+// Returns 0 when the payload is complete, 1 if more data is needed, -1 on error.
+static int recv_file_chunks(connection_t *conn) {
+    store_buffered_payload(conn);
+    if (conn->file_remaining == 0) {
+        return 0;
+    }
+    if (conn->file_fd < 0 || conn->file_copy || conn->codec != NULL || conn->delta != NULL || conn->checksum != NULL) {
+        return copy_recv_chunks(conn);  // Compressed payloads, deltas and checksums are handled in user space
+    }
+    if (conn->pipe_rd < 0 && open_splice_pipe(conn) != 0) {
+        conn->file_copy = 1;
+        return copy_recv_chunks(conn);
+    }
+    
+    size_t budget = (size_t)STREAM_CHUNK_SIZE * STREAM_CHUNKS_PER_EVENT;
+    for (;;) {
+        // Empty the pipe into the file before pulling more from the socket
+        while (conn->pipe_len > 0) {
+            ssize_t w = splice(conn->pipe_rd, NULL, conn->file_fd, NULL, conn->pipe_len, SPLICE_F_MOVE);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL) {
+                    // The file system can't splice, finish this payload through a buffer
+                    log_debug("splice not supported for client %d, copying instead", conn->fd);
+                    conn->file_copy = 1;
+                } else {
+                    fail_file_stream(conn, errno);
+                }
+                drain_pipe(conn);
+                return copy_recv_chunks(conn);
+            }
+            conn->pipe_len -= w;
+        }
+        
+        if (conn->file_remaining == 0) {
+            return 0;
+        }
+        if (budget == 0) {
+            return 1;
+        }
+        
+        size_t want = conn->file_remaining < budget ? conn->file_remaining : budget;
+        ssize_t r = splice(conn->fd, NULL, conn->pipe_wr, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;  // Connection closed prematurely
+        }
+        
+        conn->pipe_len = r;
+        conn->file_offset += r;
+        shard_of(conn)->stats.bytes_in += r;
+        conn->file_remaining -= r;
+        budget -= (size_t)r < budget ? (size_t)r : budget;
+    }
+}
+
+// Re-arm the socket for whatever the connection is waiting for.
+// Connections owned by a worker stay disarmed until they are handed back.
+static int update_interest(connection_t *conn) {
+    shard_t *sh = shard_of(conn);
+    if (conn->busy) {
+        return 0;
+    }
+    
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.u64 = conn_id(conn);
+    
+    if (conn->mux != NULL) {
+        // Frames are read even while output is stuck, they may open room for it
+        ev.events = conn_has_output(conn) ? EPOLLIN | EPOLLOUT | EPOLLONESHOT : EPOLLIN | EPOLLONESHOT;
+    } else if (conn_has_output(conn) || conn->state == CONN_SEND_FILE) {
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+    } else {
+        ev.events = EPOLLIN | EPOLLONESHOT;
+    }
+    
+    if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        log_error("Failed to update client %d events: %s", conn->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Multiplexed connections take turns: queued output goes out, arrived frames
+// are handled, and the streams with room in their windows queue the next
+// round of DATA frames. Requests are still handed to the workers one at a time.
+static int drive_mux_connection(connection_t *conn) {
+    for (;;) {
+        int res = flush_output(conn);
+        if (res < 0) {
+            return -1;
+        }
+        int blocked = res > 0;
+        
+        res = conn->state == CONN_READ_BODY ? read_body(conn) : read_request(conn);
+        if (res < 0) {
+            return -1;
+        }
+        if (res > 0) {
+            dispatch_request(conn);
+            return 0;
+        }
+        
+        // Everything that arrived has been handled, on to the streams
+        if (blocked) {
+            return 0;
+        }
+        res = mux_fill_output(conn);
+        if (res <= 0) {
+            return res;
+        }
+    }
+}
+
+// Advance the connection's state machine as far as the socket allows
+static int drive_connection(connection_t *conn) {
+    if (conn->mux != NULL) {
+        return drive_mux_connection(conn);
+    }
+    
+    for (;;) {
+        // Responses always go out before the next request is read
+        int res = flush_output(conn);
+        if (res != 0) {
+            return res < 0 ? -1 : 0;
+        }
+        
+        switch (conn->state) {
+            case CONN_SEND_FILE:
+                res = conn->codec != NULL ? send_compressed_chunks(conn) : send_file_chunks(conn);
+                if (res != 0) {
+                    return res < 0 ? -1 : 0;
+                }
+                if (conn->checksum != NULL && queue_checksum_trailer(conn) != 0) {
+                    return -1;
+                }
+                end_stream(conn);
+                break;
+            
+            case CONN_RECV_FILE: {
+                if (conn->file_chunked && conn->file_remaining == 0) {
+                    res = read_chunk_header(conn);
+                } else {
+                    res = recv_file_chunks(conn);
+                }
+                if (res < 0) {
+                    return -1;  // conn_close() tells the handler
+                }
+                if (res > 0) {
+                    return 0;
+                }
+                if (conn->file_chunked || conn->file_remaining > 0) {
+                    break;  // On to the next chunk
+                }
+                conn_stream_done_t done = conn->stream_done;
+                int status = done != NULL ? done(conn, conn->file_error) : 0;
+                end_stream(conn);
+                if (status != 0) {
+                    return -1;
+                }
+                break;
+            }
+            
+            case CONN_READ_BODY:
+                res = read_body(conn);
+                if (res <= 0) {
+                    return res;
+                }
+                dispatch_request(conn);
+                return 0;
+            
+            default:
+                res = read_request(conn);
+                if (res <= 0) {
+                    return res;
+                }
+                dispatch_request(conn);
+                return 0;
+        }
+    }
+}
+
+static void handle_connection_event(connection_t *conn, uint32_t events) {
+    if ((events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN)) {
+        close_connection(conn);
+        return;
+    }
+    
+    if (drive_connection(conn) != 0 || update_interest(conn) != 0) {
+        close_connection(conn);
+    }
+}
+
+// Pick up connections whose requests the workers have finished
+static void complete_requests(shard_t *sh) {
+    uint64_t count;
+    if (read(sh->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_error("Failed to read worker notifications: %s", strerror(errno));
+    }
+    
+    pthread_mutex_lock(&sh->done_mutex);
+    uint64_t *ids = sh->done_ids;
+    int n = sh->num_done;
+    sh->done_ids = sh->done_swap;
+    sh->done_swap = ids;
+    sh->num_done = 0;
+    pthread_mutex_unlock(&sh->done_mutex);
+    
+    for (int i = 0; i < n; i++) {
+        connection_t *conn = lookup_conn(sh, ids[i]);
+        if (conn == NULL) {
+            continue;
+        }
+        
+        conn->busy = 0;
+        sh->stats.requests += conn->request_count;
+        if (conn->request_status != 0) {
+            close_connection(conn);
+            continue;
+        }
+        if (conn->state == CONN_READ_HEADER) {
+            conn_reset_request(conn);
+        }
+        if (!sh->use_uring) {
+            handle_connection_event(conn, 0);
+        } else if (uring_drive(conn) != 0) {
+            close_connection(conn);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// io_uring engine
+//
+// Every connection has at most one operation in flight. When it completes,
+// uring_drive() looks at the connection state and queues the next one, so
+// the same state machine and request handlers serve both engines. New
+// submissions are batched and handed to the kernel once per loop iteration.
+// ---------------------------------------------------------------------------
+
+static int uring_queue(connection_t *conn, uring_op_t op, uint8_t opcode, int fd,
+                       void *buf, size_t len, uint64_t offset) {
+    shard_t *sh = shard_of(conn);
+    struct io_uring_sqe *sqe = uring_get_sqe(&sh->ring);
+    if (sqe == NULL) {
+        log_error("io_uring submission queue full, dropping client %d", conn->fd);
+        return -1;
+    }
+    
+    uring_conn_t *uc = &sh->uring_conns[conn->slot];
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+    sqe->user_data = conn_id(conn);
+    if (opcode == IORING_OP_SEND || opcode == IORING_OP_SENDMSG) {
+        // Hold back data that more of the GET body will follow, as the epoll engine does
+        int more = conn->state == CONN_SEND_FILE &&
+                   (op == URING_OP_SEND ? conn->file_remaining > 0 : len < conn->file_remaining);
+        sqe->msg_flags = more ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+    } else if (opcode == IORING_OP_RECVMSG) {
+        sqe->msg_flags = MSG_DONTWAIT;  // Only used to look for input without waiting for it
+    } else if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+        sqe->buf_index = (uint16_t)uc->buf_index;
+    }
+    uc->op = op;
+    return 0;
+}
+
+// File I/O goes through the registered buffer when the stream holds one
+static int uring_queue_file(connection_t *conn, uring_op_t op, int write_op,
+                            void *buf, size_t len, uint64_t offset) {
+    shard_t *sh = shard_of(conn);
+    int fixed = sh->uring_conns[conn->slot].buf_index >= 0;
+    uint8_t opcode;
+    if (write_op) {
+        opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    } else {
+        opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    }
+    return uring_queue(conn, op, opcode, conn->file_fd, buf, len, offset);
+}
+
+static int uring_acquire_buffer(shard_t *sh, uring_conn_t *uc) {
+    if (uc->buf != NULL) {
+        return 0;
+    }
+    
+    if (sh->num_free_buffers > 0) {
+        uc->buf_index = sh->free_buffers[--sh->num_free_buffers];
+        uc->buf = sh->fixed_pool + (size_t)uc->buf_index * STREAM_CHUNK_SIZE;
+    } else {
+        uc->buf = malloc(STREAM_CHUNK_SIZE);
+        uc->buf_index = -1;
+        if (uc->buf == NULL) {
+            log_error("Failed to allocate stream buffer");
+            return -1;
+        }
+    }
+    uc->chunk_len = 0;
+    uc->chunk_pos = 0;
+    return 0;
+}
+
+static void uring_release_buffer(shard_t *sh, uring_conn_t *uc) {
+    if (uc->buf != NULL) {
+        if (uc->buf_index >= 0) {
+            sh->free_buffers[sh->num_free_buffers++] = uc->buf_index;
+        } else {
+            free(uc->buf);
+        }
+    }
+    uc->buf = NULL;
+    uc->buf_index = -1;
+    uc->chunk_len = 0;
+    uc->chunk_pos = 0;
+}
+
+// Hand received PUT payload in the stream buffer on to the file. Plain payloads
+// are written by the next operation, compressed ones, deltas and checked ones are stored right away.
+static void uring_store(connection_t *conn, uring_conn_t *uc, size_t len) {
+    if (conn->codec != NULL || conn->delta != NULL || conn->checksum != NULL) {
+        store_chunk(conn, uc->buf, len);
+    } else if (conn->file_fd >= 0) {
+        uc->chunk_len = len;  // A file_fd of -1 means the payload is being discarded
+        uc->chunk_pos = 0;
+    }
+}
+
+// Fill all free input ring space, so pipelined requests arrive in one completion
+static int uring_queue_input(connection_t *conn) {
+    uring_conn_t *uc = &shard_of(conn)->uring_conns[conn->slot];
+    int iov_count = conn_input_space(conn, uc->iov);
+    if (iov_count == 0) {
+        return -1;
+    }
+    return uring_queue(conn, URING_OP_RECV_INPUT, IORING_OP_READV, conn->fd, uc->iov, iov_count, 0);
+}
+
+// Multiplexed connections alternate like on epoll, but with one operation
+// in flight: arrived frames are handled, output is sent, and before each
+// round of stream data the socket is checked for new frames without waiting.
+static int uring_drive_mux(connection_t *conn) {
+    shard_t *sh = shard_of(conn);
+    uring_conn_t *uc = &sh->uring_conns[conn->slot];
+    
+    for (;;) {
+        if (conn->state == CONN_READ_BODY) {
+            if (conn->body_len < conn->data_length) {
+                return uring_queue(conn, URING_OP_RECV, IORING_OP_RECV, conn->fd,
+                                   conn->body + conn->body_len, conn->data_length - conn->body_len, 0);
+            }
+            conn->state = CONN_READ_HEADER;
+            dispatch_request(conn);
+            return 0;
+        }
+        
+        int res = parse_request(conn);
+        if (res < 0) {
+            return -1;
+        }
+        if (res > 0) {
+            dispatch_request(conn);
+            return 0;
+        }
+        if (conn->state == CONN_READ_BODY) {
+            continue;
+        }
+        
+        if (conn_has_output(conn)) {
+            memset(&uc->msg, 0, sizeof(uc->msg));
+            uc->msg.msg_iov = uc->iov;
+            uc->msg.msg_iovlen = conn_output_iov(conn, uc->iov);
+            return uring_queue(conn, URING_OP_SEND, IORING_OP_SENDMSG, conn->fd, &uc->msg, 1, 0);
+        }
+        if (!uc->polled) {
+            uc->polled = 1;
+            memset(&uc->msg, 0, sizeof(uc->msg));
+            uc->msg.msg_iov = uc->iov;
+            uc->msg.msg_iovlen = conn_input_space(conn, uc->iov);
+            if (uc->msg.msg_iovlen == 0) {
+                return -1;
+            }
+            return uring_queue(conn, URING_OP_RECV_INPUT, IORING_OP_RECVMSG, conn->fd, &uc->msg, 1, 0);
+        }
+        
+        uc->polled = 0;
+        res = mux_fill_output(conn);
+        if (res < 0) {
+            return -1;
+        }
+        if (res == 0) {
+            return uring_queue_input(conn);  // Idle until the client sends something
+        }
+    }
+}
+
+// Queue the next operation for a connection that has none in flight.
+// Returns 0 on success, -1 if the connection should be closed.
+static int uring_drive(connection_t *conn) {
+    shard_t *sh = shard_of(conn);
+    uring_conn_t *uc = &sh->uring_conns[conn->slot];
+    
+    if (conn->mux != NULL) {
+        return uring_drive_mux(conn);
+    }
+    
+    for (;;) {
+        // Responses always go out before the next request is read
+        if (conn_has_output(conn)) {
+            memset(&uc->msg, 0, sizeof(uc->msg));
+            uc->msg.msg_iov = uc->iov;
+            uc->msg.msg_iovlen = conn_output_iov(conn, uc->iov);
+            return uring_queue(conn, URING_OP_SEND, IORING_OP_SENDMSG, conn->fd, &uc->msg, 1, 0);
+        }
+        
+        switch (conn->state) {
+            case CONN_SEND_FILE: {
+                if (conn->codec != NULL) {
+                    // Compressed blocks leave through the output queue
+                    int res = queue_compressed_chunk(conn);
+                    if (res < 0) {
+                        return -1;
+                    }
+                    if (res == 0) {
+                        end_stream(conn);
+                    }
+                    break;
+                }
+                if (uc->chunk_pos < uc->chunk_len) {
+                    return uring_queue(conn, URING_OP_FILE_SEND, IORING_OP_SEND, conn->fd,
+                                       uc->buf + uc->chunk_pos, uc->chunk_len - uc->chunk_pos, 0);
+                }
+                if (conn->file_remaining == 0) {
+                    uring_release_buffer(sh, uc);
+                    if (conn->checksum != NULL && queue_checksum_trailer(conn) != 0) {
+                        return -1;
+                    }
+                    end_stream(conn);
+                    break;
+                }
+                if (uring_acquire_buffer(sh, uc) != 0) {
+                    return -1;
+                }
+                size_t len = conn->file_remaining < STREAM_CHUNK_SIZE ? conn->file_remaining : STREAM_CHUNK_SIZE;
+                return uring_queue_file(conn, URING_OP_FILE_READ, 0, uc->buf, len, conn->file_offset);
+            }
+            
+            case CONN_RECV_FILE: {
+                if (uc->chunk_pos < uc->chunk_len) {
+                    // Offset -1 continues at the file position, after any data the handler wrote itself
+                    return uring_queue_file(conn, URING_OP_FILE_WRITE, 1, uc->buf + uc->chunk_pos,
+                                            uc->chunk_len - uc->chunk_pos, (uint64_t)-1);
+                }
+                if (conn->file_chunked && conn->file_remaining == 0) {
+                    // The next chunk length comes through the input ring
+                    if (conn_input_len(conn) < CHUNK_HEADER_SIZE) {
+                        return uring_queue_input(conn);
+                    }
+                    take_chunk_header(conn);
+                    break;
+                }
+                if (conn->file_remaining == 0) {
+                    conn_stream_done_t done = conn->stream_done;
+                    int status = done != NULL ? done(conn, conn->file_error) : 0;
+                    uring_release_buffer(sh, uc);
+                    end_stream(conn);
+                    if (status != 0) {
+                        return -1;
+                    }
+                    break;
+                }
+                if (uring_acquire_buffer(sh, uc) != 0) {
+                    return -1;
+                }
+                size_t len = conn->file_remaining < STREAM_CHUNK_SIZE ? conn->file_remaining : STREAM_CHUNK_SIZE;
+                if (conn_input_len(conn) > 0) {
+                    // Payload read along with the request is written before more is received
+                    if (len > conn_input_len(conn)) {
+                        len = conn_input_len(conn);
+                    }
+                    conn_input_peek(conn, 0, uc->buf, len);
+                    conn_input_consume(conn, len);
+                    conn->file_offset += len;
+                    conn->file_remaining -= len;
+                    uring_store(conn, uc, len);
+                    break;
+                }
+                return uring_queue(conn, URING_OP_RECV, IORING_OP_RECV, conn->fd, uc->buf, len, 0);
+            }
+            
+            case CONN_READ_BODY:
+                if (conn->body_len < conn->data_length) {
+                    return uring_queue(conn, URING_OP_RECV, IORING_OP_RECV, conn->fd,
+                                       conn->body + conn->body_len, conn->data_length - conn->body_len, 0);
+                }
+                conn->state = CONN_READ_HEADER;
+                dispatch_request(conn);
+                return 0;
+            
+            default: {
+                int res = parse_request(conn);
+                if (res < 0) {
+                    return -1;
+                }
+                if (res == 0 && conn->state == CONN_READ_BODY) {
+                    break;
+                }
+                if (res == 0) {
+                    return uring_queue_input(conn);
+                }
+                dispatch_request(conn);
+                return 0;
+            }
+        }
+    }
+}
+
+// Apply a finished operation to the connection and queue the next one
+static void uring_complete(connection_t *conn, int res) {
+    shard_t *sh = shard_of(conn);
+    uring_conn_t *uc = &sh->uring_conns[conn->slot];
+    uring_op_t op = uc->op;
+    uc->op = URING_OP_NONE;
+    
+    if (uc->closing) {
+        release_slot(conn);
+        return;
+    }
+    
+    if (res == -EINTR || res == -EAGAIN) {
+        res = 0;  // Nothing transferred, the same operation is queued again below
+    } else if (op == URING_OP_FILE_WRITE && res <= 0) {
+        // Keep the connection, discard the rest of the payload and report the error
+        fail_file_stream(conn, res < 0 ? -res : EIO);
+        uc->chunk_len = 0;
+        uc->chunk_pos = 0;
+        res = 0;
+    } else if (res <= 0) {
+        if (op == URING_OP_FILE_READ && res == 0) {
+            // File shrank after the header went out, the response can't be completed
+            log_error("File truncated while streaming to client %d", conn->fd);
+        } else if (op == URING_OP_FILE_READ) {
+            log_error("Failed to read file for client %d: %s", conn->fd, strerror(-res));
+        }
+        close_connection(conn);
+        return;
+    }
+    
+    if (op == URING_OP_RECV || op == URING_OP_RECV_INPUT) {
+        sh->stats.bytes_in += res;
+    } else if (op == URING_OP_SEND || op == URING_OP_FILE_SEND) {
+        sh->stats.bytes_out += res;
+    }
+    
+    switch (op) {
+        case URING_OP_RECV_INPUT:
+            conn_input_commit(conn, res);
+            break;
+        
+        case URING_OP_RECV:
+            if (conn->state == CONN_READ_BODY) {
+                conn->body_len += res;
+                break;
+            }
+            conn->file_offset += res;
+            conn->file_remaining -= res;
+            uring_store(conn, uc, res);
+            break;
+        
+        case URING_OP_SEND:
+            conn_output_sent(conn, res);
+            break;
+        
+        case URING_OP_FILE_READ:
+            if (conn->checksum != NULL) {
+                conn->checksum->crc = crc32c(conn->checksum->crc, uc->buf, res);
+            }
+            conn->file_offset += res;
+            uc->chunk_len = res;
+            uc->chunk_pos = 0;
+            break;
+        
+        case URING_OP_FILE_SEND:
+            conn->file_remaining -= res;
+            uc->chunk_pos += res;
+            break;
+        
+        case URING_OP_FILE_WRITE:
+            uc->chunk_pos += res;
+            break;
+        
+        default:
+            break;
+    }
+    
+    if (uring_drive(conn) != 0) {
+        close_connection(conn);
+    }
+}
+
+static int uring_arm_accept(shard_t *sh) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&sh->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    
+    // One multishot accept keeps producing connections until it is cancelled
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sh->listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = sh->accept_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = LISTENER_ID;
+    return 0;
+}
+
+static int uring_arm_notify(shard_t *sh) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&sh->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sh->notify_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = NOTIFY_ID;
+    return 0;
+}
+
+static void uring_accepted(shard_t *sh, int res, uint32_t flags) {
+    if (res >= 0) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        if (getpeername(res, (struct sockaddr *)&client_addr, &client_len) == 0) {
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+            log_info("New connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
+        }
+        
+        if (sh->num_free == 0) {
+            log_error("Maximum number of clients reached, connection rejected");
+            sh->stats.rejected++;
+            close(res);
+        } else {
+            connection_t *conn = &sh->conn_table[sh->free_slots[--sh->num_free]];
+            conn->generation++;
+            conn_open(conn, res);
+            memset(&sh->uring_conns[conn->slot], 0, sizeof(uring_conn_t));
+            sh->uring_conns[conn->slot].buf_index = -1;
+            sh->num_clients++;
+            sh->stats.accepted++;
+            log_info("Client %d connected, total clients: %d", res, sh->num_clients);
+            
+            if (uring_drive(conn) != 0) {
+                close_connection(conn);
+            }
+        }
+    } else if (res == -EINVAL && sh->accept_multishot) {
+        log_warning("Multishot accept not supported, accepting one connection at a time");
+        sh->accept_multishot = 0;
+    } else if (res != -EINTR && res != -ECANCELED) {
+        log_error("Failed to accept connection: %s", strerror(-res));
+    }
+    
+    // Multishot accept stays armed for as long as the kernel reports more to come
+    if (!(flags & IORING_CQE_F_MORE) && uring_arm_accept(sh) != 0) {
+        log_error("Failed to re-arm accept");
+    }
+}
+
+static int uring_process(shard_t *sh) {
+    if (uring_submit_and_wait(&sh->ring, LOOP_TIMEOUT_MS) != 0) {
+        return -1;
+    }
+    
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&sh->ring)) != NULL) {
+        uint64_t id = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        uring_cqe_seen(&sh->ring);
+        
+        if (id == LISTENER_ID) {
+            uring_accepted(sh, res, flags);
+        } else if (id == NOTIFY_ID) {
+            complete_requests(sh);
+            if (uring_arm_notify(sh) != 0) {
+                log_error("Failed to re-arm worker notifications");
+                return -1;
+            }
+        } else {
+            connection_t *conn = lookup_conn(sh, id);
+            if (conn != NULL) {
+                uring_complete(conn, res);
+            }
+        }
+    }
+    
+    if (sh->num_deferred > 0) {
+        dispatch_deferred(sh);
+    }
+    
+    return 0;
+}
+
+static int uring_engine_init(shard_t *sh) {
+    unsigned entries = 64;
+    while (entries < (unsigned)sh->table_size + 2 && entries < URING_MAX_ENTRIES) {
+        entries *= 2;
+    }
+    if (uring_init(&sh->ring, entries) != 0) {
+        return -1;
+    }
+    
+    sh->uring_conns = calloc(sh->table_size, sizeof(uring_conn_t));
+    int num_fixed = sh->table_size < URING_FIXED_BUFFERS ? sh->table_size : URING_FIXED_BUFFERS;
+    sh->free_buffers = calloc(num_fixed, sizeof(int));
+    if (sh->uring_conns == NULL || sh->free_buffers == NULL) {
+        log_error("Failed to allocate io_uring connection state");
+        uring_engine_shutdown(sh);
+        return -1;
+    }
+    
+    // Registered buffers spare the kernel from mapping pages on every file read and write.
+    // This can fail under a low RLIMIT_MEMLOCK, streams then fall back to heap buffers.
+    struct iovec iovs[URING_FIXED_BUFFERS];
+    sh->fixed_pool = aligned_alloc(4096, (size_t)num_fixed * STREAM_CHUNK_SIZE);
+    if (sh->fixed_pool != NULL) {
+        for (int i = 0; i < num_fixed; i++) {
+            iovs[i].iov_base = sh->fixed_pool + (size_t)i * STREAM_CHUNK_SIZE;
+            iovs[i].iov_len = STREAM_CHUNK_SIZE;
+        }
+        if (uring_register_buffers(&sh->ring, iovs, num_fixed) == 0) {
+            for (int i = 0; i < num_fixed; i++) {
+                sh->free_buffers[i] = num_fixed - 1 - i;
+            }
+            sh->num_free_buffers = num_fixed;
+        }
+    }
+    
+    // io_uring waits for readiness itself, blocking sockets avoid early -EAGAIN completions
+    int flags = fcntl(sh->listen_fd, F_GETFL);
+    if (flags >= 0) {
+        fcntl(sh->listen_fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    
+    sh->accept_multishot = 1;
+    if (uring_arm_accept(sh) != 0 || uring_arm_notify(sh) != 0) {
+        log_error("Failed to queue initial io_uring operations");
+        if (flags >= 0) {
+            fcntl(sh->listen_fd, F_SETFL, flags);
+        }
+        uring_engine_shutdown(sh);
+        return -1;
+    }
+    
+    log_info("Using io_uring I/O engine (%u entries, %d registered buffers)",
+             sh->ring.sq_entries, sh->num_free_buffers);
+    return 0;
+}
+
+// Tear down the ring. Open connections are left for close_connection().
+static void uring_engine_shutdown(shard_t *sh) {
+    for (int i = 0; i < sh->table_size && sh->uring_conns != NULL; i++) {
+        if (sh->conn_table[i].fd >= 0) {
+            shutdown(sh->conn_table[i].fd, SHUT_RDWR);
+        }
+    }
+    
+    // Closing the ring cancels whatever is still in flight
+    uring_exit(&sh->ring);
+    
+    for (int i = 0; i < sh->table_size && sh->uring_conns != NULL; i++) {
+        uring_release_buffer(sh, &sh->uring_conns[i]);
+        if (sh->uring_conns[i].closing) {
+            conn_close(&sh->conn_table[i]);
+            sh->free_slots[sh->num_free++] = i;
+        }
+        sh->uring_conns[i].op = URING_OP_NONE;
+        sh->uring_conns[i].closing = 0;
+    }
+    
+    free(sh->uring_conns);
+    free(sh->free_buffers);
+    free(sh->fixed_pool);
+    sh->uring_conns = NULL;
+    sh->free_buffers = NULL;
+    sh->fixed_pool = NULL;
+    sh->num_free_buffers = 0;
+    sh->use_uring = 0;
+}
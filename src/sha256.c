@@ -0,0 +1,210 @@
+#include <string.h>
+#include <pthread.h>
+#include "../include/sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#endif
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// Run the compression function over whole 64-byte blocks
+static void sha256_blocks_generic(uint32_t state[8], const uint8_t *data, size_t num_blocks) {
+    uint32_t w[64];
+
+    for (; num_blocks > 0; num_blocks--, data += SHA256_BLOCK_SIZE) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                          round_constants[i] + w[i];
+            uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef HAVE_SHA_NI
+// Four rounds with the SHA extensions: each sha256rnds2 does two, on the
+// state split into ABEF and CDGH halves
+#define SHA_NI_ROUNDS(group, msg) do { \
+        __m128i wk = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i *)&round_constants[4 * (group)])); \
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk); \
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0e)); \
+    } while (0)
+
+// Next four message words from the previous sixteen, m0 oldest
+#define SHA_NI_SCHEDULE(m0, m1, m2, m3) \
+    m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_sha_ni(uint32_t state[8], const uint8_t *data, size_t num_blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // Reorder the state words from ABCD EFGH to ABEF CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    for (; num_blocks > 0; num_blocks--, data += SHA256_BLOCK_SIZE) {
+        __m128i abef_save = abef;
+        __m128i cdgh_save = cdgh;
+        __m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), byte_swap);
+        __m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), byte_swap);
+        __m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), byte_swap);
+        __m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), byte_swap);
+
+        SHA_NI_ROUNDS(0, m0);
+        SHA_NI_ROUNDS(1, m1);
+        SHA_NI_ROUNDS(2, m2);
+        SHA_NI_ROUNDS(3, m3);
+        for (int group = 4; group < 16; group += 4) {
+            SHA_NI_SCHEDULE(m0, m1, m2, m3);
+            SHA_NI_ROUNDS(group, m0);
+            SHA_NI_SCHEDULE(m1, m2, m3, m0);
+            SHA_NI_ROUNDS(group + 1, m1);
+            SHA_NI_SCHEDULE(m2, m3, m0, m1);
+            SHA_NI_ROUNDS(group + 2, m2);
+            SHA_NI_SCHEDULE(m3, m0, m1, m2);
+            SHA_NI_ROUNDS(group + 3, m3);
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+static void (*blocks_impl)(uint32_t state[8], const uint8_t *data, size_t num_blocks) = sha256_blocks_generic;
+static pthread_once_t blocks_once = PTHREAD_ONCE_INIT;
+
+// Use the CPU's SHA instructions where it has them
+static void select_blocks(void) {
+#ifdef HAVE_SHA_NI
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3) &&
+        __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+        blocks_impl = sha256_blocks_sha_ni;
+    }
+#endif
+}
+
+static void sha256_blocks(uint32_t state[8], const uint8_t *data, size_t num_blocks) {
+    pthread_once(&blocks_once, select_blocks);
+    blocks_impl(state, data, num_blocks);
+}
+
+void sha256_init(sha256_ctx_t *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->buffer_len = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    ctx->length += len;
+
+    // Top up a partial block first, then hash whole blocks straight from the input
+    if (ctx->buffer_len > 0) {
+        size_t take = SHA256_BLOCK_SIZE - ctx->buffer_len < len ? SHA256_BLOCK_SIZE - ctx->buffer_len : len;
+        memcpy(ctx->buffer + ctx->buffer_len, p, take);
+        ctx->buffer_len += take;
+        p += take;
+        len -= take;
+        if (ctx->buffer_len < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->buffer, 1);
+        ctx->buffer_len = 0;
+    }
+    if (len >= SHA256_BLOCK_SIZE) {
+        sha256_blocks(ctx->state, p, len / SHA256_BLOCK_SIZE);
+        p += len - len % SHA256_BLOCK_SIZE;
+        len %= SHA256_BLOCK_SIZE;
+    }
+    memcpy(ctx->buffer, p, len);
+    ctx->buffer_len = len;
+}
+
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->length * 8;
+
+    // A single 1 bit, zeros up to 8 bytes short of a block, then the length in bits
+    ctx->buffer[ctx->buffer_len++] = 0x80;
+    if (ctx->buffer_len > SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->buffer + ctx->buffer_len, 0, SHA256_BLOCK_SIZE - ctx->buffer_len);
+        sha256_blocks(ctx->state, ctx->buffer, 1);
+        ctx->buffer_len = 0;
+    }
+    memset(ctx->buffer + ctx->buffer_len, 0, SHA256_BLOCK_SIZE - 8 - ctx->buffer_len);
+    store_be32(ctx->buffer + SHA256_BLOCK_SIZE - 8, (uint32_t)(bits >> 32));
+    store_be32(ctx->buffer + SHA256_BLOCK_SIZE - 4, (uint32_t)bits);
+    sha256_blocks(ctx->state, ctx->buffer, 1);
+
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "../include/thread_pool.h"
+#include "../include/logger.h"
+
+// Bounded lock-free MPMC queue (Vyukov). Each cell's sequence number tells
+// producers and consumers whose turn it is, so no lock is ever taken.
+typedef struct {
+    atomic_size_t sequence;
+    thread_pool_task_t task;
+    void *arg;
+} pool_cell_t;
+
+static pool_cell_t *cells = NULL;
+static size_t cell_mask = 0;
+static _Alignas(64) atomic_size_t enqueue_pos;
+static _Alignas(64) atomic_size_t dequeue_pos;
+
+static sem_t pending;            // Counts published tasks, idle workers sleep on it
+static pthread_t *workers = NULL;
+static int num_workers = 0;
+static atomic_int running;
+
+static int queue_push(thread_pool_task_t task, void *arg) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        pool_cell_t *cell = &cells[pos & cell_mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->task = task;
+                cell->arg = arg;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // Full
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static int queue_pop(thread_pool_task_t *task, void **arg) {
+    size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        pool_cell_t *cell = &cells[pos & cell_mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *task = cell->task;
+                *arg = cell->arg;
+                atomic_store_explicit(&cell->sequence, pos + cell_mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // Empty, or the producer of this cell has not published yet
+        } else {
+            pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        if (sem_wait(&pending) != 0) {
+            continue;  // EINTR
+        }
+        if (!atomic_load(&running)) {
+            break;
+        }
+
+        // The semaphore guarantees a task is published, but an earlier slot
+        // may still be in the middle of being filled by another producer
+        thread_pool_task_t task;
+        void *task_arg;
+        while (queue_pop(&task, &task_arg) != 0) {
+            sched_yield();
+        }
+        task(task_arg);
+    }
+
+    return NULL;
+}
+
+int thread_pool_init(int worker_count, int queue_depth) {
+    if (worker_count < 1 || queue_depth < 1) {
+        log_error("Invalid thread pool size: %d workers, queue depth %d", worker_count, queue_depth);
+        return -1;
+    }
+
+    size_t capacity = 2;
+    while (capacity < (size_t)queue_depth) {
+        capacity *= 2;
+    }
+
+    cells = calloc(capacity, sizeof(pool_cell_t));
+    workers = calloc(worker_count, sizeof(pthread_t));
+    if (cells == NULL || workers == NULL) {
+        log_error("Failed to allocate thread pool");
+        free(cells);
+        free(workers);
+        cells = NULL;
+        workers = NULL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&cells[i].sequence, i);
+    }
+    cell_mask = capacity - 1;
+    atomic_init(&enqueue_pos, 0);
+    atomic_init(&dequeue_pos, 0);
+    atomic_init(&running, 1);
+    sem_init(&pending, 0, 0);
+
+    for (num_workers = 0; num_workers < worker_count; num_workers++) {
+        if (pthread_create(&workers[num_workers], NULL, worker_main, NULL) != 0) {
+            log_error("Failed to create worker thread: %s", strerror(errno));
+            thread_pool_shutdown();
+            return -1;
+        }
+    }
+
+    log_info("Thread pool started with %d workers, queue depth %zu", num_workers, capacity);
+    return 0;
+}
+
+int thread_pool_submit(thread_pool_task_t task, void *arg) {
+    if (cells == NULL || !atomic_load(&running)) {
+        return -1;
+    }
+    if (queue_push(task, arg) != 0) {
+        return -1;
+    }
+    sem_post(&pending);
+    return 0;
+}
+
+int thread_pool_size(void) {
+    return num_workers;
+}
+
+void thread_pool_shutdown(void) {
+    if (workers == NULL) {
+        return;
+    }
+
+    atomic_store(&running, 0);
+    for (int i = 0; i < num_workers; i++) {
+        sem_post(&pending);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    sem_destroy(&pending);
+    free(workers);
+    free(cells);
+    workers = NULL;
+    cells = NULL;
+    num_workers = 0;
+}
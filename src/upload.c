@@ -0,0 +1,606 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include "../include/upload.h"
+#include "../include/file_ops.h"
+#include "../include/config.h"
+#include "../include/logger.h"
+
+#define UPLOAD_PATH_SIZE 2048
+#define STATE_MAGIC "CILEUP02"
+#define STATE_SUFFIX ".state"
+
+// State file layout: this header, then the chunk map. Only the server that
+// wrote it reads it back, so fields are in host byte order.
+typedef struct {
+    char magic[8];
+    uint64_t id;
+    uint64_t size;
+    uint64_t chunk_size;
+    char target[UPLOAD_PATH_SIZE];  // Normalized path below the root directory
+    char temp[UPLOAD_PATH_SIZE];    // Name of the file being built, next to the target
+} upload_state_t;
+
+typedef struct {
+    uint64_t id;                    // 0 marks a free slot
+    char target[UPLOAD_PATH_SIZE];
+    char temp[NAME_MAX + 1];
+    char name[NAME_MAX + 1];        // Last component of target
+    int dir_fd;                     // Directory holding the target and the file being built
+    uint64_t size;
+    uint64_t chunk_size;
+    uint64_t num_chunks;
+    uint64_t chunks_done;
+    uint8_t *chunk_map;             // One bit per chunk that has been stored
+    int state_fd;                   // State file, the chunk map follows its header
+    int writers;                    // Chunks being written right now
+    time_t last_used;
+} upload_session_t;
+
+static upload_session_t sessions[MAX_UPLOAD_SESSIONS];
+static pthread_mutex_t upload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Caller holds upload_mutex
+static upload_session_t *find_session(uint64_t id) {
+    if (id == 0) {
+        return NULL;
+    }
+    for (int i = 0; i < MAX_UPLOAD_SESSIONS; i++) {
+        if (sessions[i].id == id) {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+static size_t chunk_map_size(uint64_t num_chunks) {
+    return num_chunks / 8 + 1;
+}
+
+static int state_path(uint64_t id, char *out, size_t out_size) {
+    int len = snprintf(out, out_size, "%s/%016llx%s", get_config()->upload_dir,
+                       (unsigned long long)id, STATE_SUFFIX);
+    return len < 0 || (size_t)len >= out_size ? -1 : 0;
+}
+
+// Caller holds upload_mutex
+static void release_session(upload_session_t *session) {
+    if (session->state_fd >= 0) {
+        close(session->state_fd);
+    }
+    if (session->dir_fd >= 0) {
+        close(session->dir_fd);
+    }
+    free(session->chunk_map);
+    memset(session, 0, sizeof(*session));
+}
+
+// Caller holds upload_mutex
+static void discard_session(upload_session_t *session) {
+    char state[UPLOAD_PATH_SIZE];
+    if (unlinkat(session->dir_fd, session->temp, 0) != 0 && errno != ENOENT) {
+        log_warning("Failed to remove upload file %s: %s", session->temp, strerror(errno));
+    }
+    if (state_path(session->id, state, sizeof(state)) == 0) {
+        unlink(state);
+    }
+    release_session(session);
+}
+
+// Restore one session from its state file. The file names the session, and
+// the session's file must be the one upload_begin() would have made for it.
+static void load_session(const char *state, uint64_t id, upload_session_t *session) {
+    upload_state_t header;
+    struct stat st;
+
+    int fd = open(state, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        log_warning("Failed to open upload state %s: %s", state, strerror(errno));
+        return;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.id == 0 || header.id != id || header.chunk_size == 0 || header.size / header.chunk_size >= MAX_UPLOAD_CHUNKS ||
+        memchr(header.target, '\0', sizeof(header.target)) == NULL ||
+        memchr(header.temp, '\0', NAME_MAX + 1) == NULL || strchr(header.temp, '/') != NULL) {
+        log_warning("Ignoring invalid upload state %s", state);
+        close(fd);
+        return;
+    }
+    char name[NAME_MAX + 1];
+    char temp[NAME_MAX + 1];
+    int dir_fd = open_parent_beneath(header.target, name, sizeof(name));
+    int len = dir_fd >= 0 ? snprintf(temp, sizeof(temp), ".%s.upload-%016llx", name, (unsigned long long)id) : -1;
+    if (dir_fd >= 0 && (len < 0 || (size_t)len >= sizeof(temp) || strcmp(temp, header.temp) != 0)) {
+        log_warning("Ignoring invalid upload state %s", state);
+        close(dir_fd);
+        close(fd);
+        return;
+    }
+    if (dir_fd < 0 || fstatat(dir_fd, header.temp, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISREG(st.st_mode) || (uint64_t)st.st_size != header.size) {
+        log_warning("Upload file for %s is gone, dropping its state", header.target);
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        close(fd);
+        unlink(state);
+        return;
+    }
+
+    uint64_t num_chunks = (header.size + header.chunk_size - 1) / header.chunk_size;
+    size_t map_size = chunk_map_size(num_chunks);
+    uint8_t *chunk_map = malloc(map_size);
+    if (chunk_map == NULL || pread(fd, chunk_map, map_size, sizeof(header)) != (ssize_t)map_size) {
+        log_warning("Ignoring invalid upload state %s", state);
+        free(chunk_map);
+        close(dir_fd);
+        close(fd);
+        return;
+    }
+
+    session->id = header.id;
+    strcpy(session->target, header.target);
+    strcpy(session->temp, header.temp);
+    strcpy(session->name, name);
+    session->dir_fd = dir_fd;
+    session->size = header.size;
+    session->chunk_size = header.chunk_size;
+    session->num_chunks = num_chunks;
+    session->chunks_done = 0;
+    for (uint64_t chunk = 0; chunk < num_chunks; chunk++) {
+        session->chunks_done += (chunk_map[chunk / 8] >> (chunk % 8)) & 1;
+    }
+    session->chunk_map = chunk_map;
+    session->state_fd = fd;
+    session->writers = 0;
+    session->last_used = fstat(fd, &st) == 0 ? st.st_mtime : time(NULL);
+    log_info("Resumable upload of %s: %llu of %llu chunks stored", session->target,
+             (unsigned long long)session->chunks_done, (unsigned long long)num_chunks);
+}
+
+int upload_init(void) {
+    const char *dir = get_config()->upload_dir;
+
+    // Clients that could write state files there could point sessions at any file
+    int err = create_state_directory(dir);
+    if (err == EXDEV) {
+        log_error("Upload directory %s must lie outside root_directory and not contain it", dir);
+        return -1;
+    }
+    if (err != 0) {
+        log_error("Failed to create upload directory %s: %s", dir, strerror(err));
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        log_error("Failed to open upload directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&upload_mutex);
+    int loaded = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && loaded < MAX_UPLOAD_SESSIONS) {
+        // State files are named by their session id, as state_path() makes them
+        size_t len = strlen(entry->d_name);
+        size_t suffix_len = strlen(STATE_SUFFIX);
+        if (len != 16 + suffix_len || strcmp(entry->d_name + 16, STATE_SUFFIX) != 0 ||
+            strspn(entry->d_name, "0123456789abcdef") != 16) {
+            continue;
+        }
+        uint64_t id = strtoull(entry->d_name, NULL, 16);
+        char state[UPLOAD_PATH_SIZE];
+        if (snprintf(state, sizeof(state), "%s/%s", dir, entry->d_name) >= (int)sizeof(state)) {
+            continue;
+        }
+        load_session(state, id, &sessions[loaded]);
+        if (sessions[loaded].id != 0) {
+            loaded++;
+        }
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    closedir(d);
+    return 0;
+}
+
+// Flush a directory's entries. Returns 0 on success, -1 with errno set.
+static int sync_directory(int dir_fd, const char *path) {
+    int fd = openat(dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int res = fsync(fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return res;
+}
+
+// Write a new state file, on disk along with its directory entry before it
+// is used. Returns its descriptor, or -1 with errno set.
+static int create_state(const char *state, const upload_state_t *header, const uint8_t *chunk_map, size_t map_size) {
+    int fd = open(state, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    errno = 0;
+    if (pwrite(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+        pwrite(fd, chunk_map, map_size, sizeof(*header)) != (ssize_t)map_size ||
+        fsync(fd) != 0 || sync_directory(AT_FDCWD, get_config()->upload_dir) != 0) {
+        int err = errno != 0 ? errno : EIO;
+        close(fd);
+        unlink(state);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Caller holds upload_mutex
+static upload_session_t *claim_slot(time_t now) {
+    upload_session_t *free_slot = NULL;
+
+    for (int i = 0; i < MAX_UPLOAD_SESSIONS; i++) {
+        upload_session_t *session = &sessions[i];
+        if (session->id != 0 && session->writers == 0 &&
+            now - session->last_used > UPLOAD_IDLE_TIMEOUT) {
+            log_info("Discarding abandoned upload of %s", session->target);
+            discard_session(session);
+        }
+        if (session->id == 0 && free_slot == NULL) {
+            free_slot = session;
+        }
+    }
+    return free_slot;
+}
+
+int upload_begin(const char *path, uint64_t size, uint64_t chunk_size, uint64_t *id) {
+    char target[UPLOAD_PATH_SIZE];
+    char name[NAME_MAX + 1];
+    char temp[NAME_MAX + 1];
+    struct stat st;
+
+    if (chunk_size == 0 || size / chunk_size >= MAX_UPLOAD_CHUNKS) {
+        return EINVAL;
+    }
+    if (normalize_path(path, target, sizeof(target)) != 0) {
+        return EINVAL;
+    }
+    int dir_fd = open_parent_beneath(target, name, sizeof(name));
+    if (dir_fd < 0) {
+        return EINVAL;
+    }
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+        close(dir_fd);
+        return EISDIR;
+    }
+
+    uint64_t new_id = 0;
+    while (new_id == 0) {
+        if (getrandom(&new_id, sizeof(new_id), 0) != sizeof(new_id)) {
+            int err = errno;
+            close(dir_fd);
+            return err;
+        }
+    }
+
+    // The file is built next to its target, so publishing it is a rename within one directory
+    int len = snprintf(temp, sizeof(temp), ".%s.upload-%016llx", name, (unsigned long long)new_id);
+    if (len < 0 || (size_t)len >= sizeof(temp)) {
+        close(dir_fd);
+        return ENAMETOOLONG;
+    }
+
+    int fd = openat(dir_fd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        int err = errno;
+        log_error("Failed to create upload file for %s: %s", target, strerror(err));
+        close(dir_fd);
+        return err;
+    }
+
+    // Chunks are written in place, so the whole file is laid out up front
+    int err = 0;
+    if (size > 0 && fallocate(fd, 0, 0, size) != 0) {
+        err = errno;
+        if (err != ENOSPC && err != EDQUOT && err != EFBIG) {
+            err = ftruncate(fd, size) == 0 ? 0 : errno;
+        }
+    }
+    close(fd);
+    if (err != 0) {
+        log_error("Failed to reserve %llu bytes for %s: %s",
+                  (unsigned long long)size, target, strerror(err));
+        unlinkat(dir_fd, temp, 0);
+        close(dir_fd);
+        return err;
+    }
+
+    uint64_t num_chunks = (size + chunk_size - 1) / chunk_size;
+    uint8_t *chunk_map = calloc(chunk_map_size(num_chunks), 1);
+    if (chunk_map == NULL) {
+        unlinkat(dir_fd, temp, 0);
+        close(dir_fd);
+        return ENOMEM;
+    }
+
+    // The state file is complete before the session exists, a restart finds either both or neither
+    char state[UPLOAD_PATH_SIZE];
+    upload_state_t *header = calloc(1, sizeof(*header));
+    if (header == NULL || state_path(new_id, state, sizeof(state)) != 0) {
+        free(header);
+        free(chunk_map);
+        unlinkat(dir_fd, temp, 0);
+        close(dir_fd);
+        return header == NULL ? ENOMEM : ENAMETOOLONG;
+    }
+    memcpy(header->magic, STATE_MAGIC, sizeof(header->magic));
+    header->id = new_id;
+    header->size = size;
+    header->chunk_size = chunk_size;
+    strcpy(header->target, target);
+    strcpy(header->temp, temp);
+    int state_fd = create_state(state, header, chunk_map, chunk_map_size(num_chunks));
+    free(header);
+    if (state_fd < 0) {
+        err = errno;
+        log_error("Failed to write upload state %s: %s", state, strerror(err));
+        free(chunk_map);
+        unlinkat(dir_fd, temp, 0);
+        close(dir_fd);
+        return err;
+    }
+
+    pthread_mutex_lock(&upload_mutex);
+    time_t now = time(NULL);
+    upload_session_t *session = claim_slot(now);
+    if (session == NULL) {
+        pthread_mutex_unlock(&upload_mutex);
+        free(chunk_map);
+        close(state_fd);
+        unlink(state);
+        unlinkat(dir_fd, temp, 0);
+        close(dir_fd);
+        return EAGAIN;
+    }
+    session->id = new_id;
+    strcpy(session->target, target);
+    strcpy(session->temp, temp);
+    strcpy(session->name, name);
+    session->dir_fd = dir_fd;
+    session->size = size;
+    session->chunk_size = chunk_size;
+    session->num_chunks = num_chunks;
+    session->chunks_done = 0;
+    session->chunk_map = chunk_map;
+    session->state_fd = state_fd;
+    session->writers = 0;
+    session->last_used = now;
+    pthread_mutex_unlock(&upload_mutex);
+
+    log_info("Upload of %s started: %llu bytes in %llu chunks", target,
+             (unsigned long long)size, (unsigned long long)num_chunks);
+    *id = new_id;
+    return 0;
+}
+
+int upload_open_chunk(uint64_t id, uint64_t offset, uint64_t length, int *fd) {
+    pthread_mutex_lock(&upload_mutex);
+    upload_session_t *session = find_session(id);
+    if (session == NULL) {
+        pthread_mutex_unlock(&upload_mutex);
+        return ENOENT;
+    }
+    uint64_t expected = 0;
+    if (offset < session->size && offset % session->chunk_size == 0) {
+        expected = session->size - offset < session->chunk_size ? session->size - offset : session->chunk_size;
+    }
+    if (expected == 0 || length != expected) {
+        pthread_mutex_unlock(&upload_mutex);
+        return EINVAL;
+    }
+    session->writers++;
+    session->last_used = time(NULL);
+
+    // Each chunk gets a descriptor of its own, so concurrent chunks don't share a file position.
+    // The directory's descriptor goes away with the session, so it is only used under the lock.
+    int err = 0;
+    *fd = openat(session->dir_fd, session->temp, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (*fd < 0) {
+        err = errno;
+        log_error("Failed to open upload file for %s: %s", session->target, strerror(err));
+    }
+    pthread_mutex_unlock(&upload_mutex);
+
+    if (err == 0 && lseek(*fd, (off_t)offset, SEEK_SET) < 0) {
+        err = errno;
+        close(*fd);
+        *fd = -1;
+    }
+    if (err != 0) {
+        upload_chunk_done(id, offset, 0);
+    }
+    return err;
+}
+
+// Flush a session's file. The data written through any descriptor of it
+// goes, so a chunk's own descriptor isn't needed. Returns 0 or an errno value.
+static int sync_upload_file(uint64_t id) {
+    pthread_mutex_lock(&upload_mutex);
+    upload_session_t *session = find_session(id);
+    int fd = session != NULL ? openat(session->dir_fd, session->temp, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+    int err = session == NULL ? ENOENT : fd < 0 ? errno : 0;
+    pthread_mutex_unlock(&upload_mutex);
+
+    if (fd >= 0) {
+        err = fdatasync(fd) == 0 ? 0 : errno;
+        close(fd);
+    }
+    return err;
+}
+
+int upload_chunk_done(uint64_t id, uint64_t offset, int complete) {
+    // The chunk's bit must never reach the state file before its data reaches
+    // the disk, or a crash could leave a resumed upload skipping lost data
+    int err = complete ? sync_upload_file(id) : 0;
+    if (err != 0) {
+        log_warning("Failed to flush upload chunk: %s", strerror(err));
+        complete = 0;
+    }
+
+    pthread_mutex_lock(&upload_mutex);
+    upload_session_t *session = find_session(id);
+    if (session != NULL) {
+        uint64_t chunk = offset / session->chunk_size;
+        session->writers--;
+        session->last_used = time(NULL);
+        if (complete && !(session->chunk_map[chunk / 8] & (1u << (chunk % 8)))) {
+            session->chunk_map[chunk / 8] |= 1u << (chunk % 8);
+            session->chunks_done++;
+            
+            // Only the byte holding this chunk's bit changes on disk
+            if (pwrite(session->state_fd, &session->chunk_map[chunk / 8], 1,
+                       sizeof(upload_state_t) + chunk / 8) != 1) {
+                log_warning("Failed to record chunk of %s: %s", session->target, strerror(errno));
+            }
+        }
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    return err;
+}
+
+int upload_commit(uint64_t id) {
+    pthread_mutex_lock(&upload_mutex);
+    upload_session_t *session = find_session(id);
+    if (session == NULL) {
+        pthread_mutex_unlock(&upload_mutex);
+        return ENOENT;
+    }
+    if (session->writers > 0) {
+        pthread_mutex_unlock(&upload_mutex);
+        return EBUSY;
+    }
+    if (session->chunks_done < session->num_chunks) {
+        pthread_mutex_unlock(&upload_mutex);
+        return EAGAIN;
+    }
+    // The file is on disk before its name is, and the new name before the session is gone
+    int fd = openat(session->dir_fd, session->temp, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0 ||
+        renameat(session->dir_fd, session->temp, session->dir_fd, session->name) != 0) {
+        int err = errno;
+        log_error("Failed to publish upload %s as %s: %s", session->temp, session->target, strerror(err));
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_unlock(&upload_mutex);
+        return err;
+    }
+    close(fd);
+    if (sync_directory(session->dir_fd, ".") != 0) {
+        log_warning("Failed to flush directory of %s: %s", session->target, strerror(errno));
+    }
+
+    log_info("Upload of %s committed", session->target);
+    char state[UPLOAD_PATH_SIZE];
+    if (state_path(session->id, state, sizeof(state)) == 0) {
+        unlink(state);
+    }
+    release_session(session);
+    pthread_mutex_unlock(&upload_mutex);
+    return 0;
+}
+
+int upload_abort(uint64_t id) {
+    pthread_mutex_lock(&upload_mutex);
+    upload_session_t *session = find_session(id);
+    if (session == NULL) {
+        pthread_mutex_unlock(&upload_mutex);
+        return ENOENT;
+    }
+    // Chunks still being written finish into the unlinked file
+    log_info("Upload of %s aborted", session->target);
+    discard_session(session);
+    pthread_mutex_unlock(&upload_mutex);
+    return 0;
+}
+
+int upload_status(uint64_t id, const char *path, uint64_t info[3], uint64_t **extents, size_t *num_extents) {
+    char target[UPLOAD_PATH_SIZE];
+    
+    if (id == 0 && normalize_path(path, target, sizeof(target)) != 0) {
+        return ENOENT;
+    }
+
+    pthread_mutex_lock(&upload_mutex);
+    upload_session_t *session = NULL;
+    if (id != 0) {
+        session = find_session(id);
+    } else {
+        for (int i = 0; i < MAX_UPLOAD_SESSIONS && session == NULL; i++) {
+            if (sessions[i].id != 0 && strcmp(sessions[i].target, target) == 0) {
+                session = &sessions[i];
+            }
+        }
+    }
+    if (session == NULL) {
+        pthread_mutex_unlock(&upload_mutex);
+        return ENOENT;
+    }
+    info[0] = session->id;
+    info[1] = session->size;
+    info[2] = session->chunk_size;
+    session->last_used = time(NULL);
+
+    // Neighbouring missing chunks are reported as one extent
+    size_t count = 0;
+    uint64_t *list = NULL;
+    uint64_t missing = session->num_chunks - session->chunks_done;
+    if (missing > 0) {
+        list = malloc(missing * 2 * sizeof(uint64_t));
+        if (list == NULL) {
+            pthread_mutex_unlock(&upload_mutex);
+            return ENOMEM;
+        }
+    }
+    for (uint64_t chunk = 0; chunk < session->num_chunks && missing > 0; chunk++) {
+        if (session->chunk_map[chunk / 8] & (1u << (chunk % 8))) {
+            continue;
+        }
+        uint64_t offset = chunk * session->chunk_size;
+        uint64_t length = session->size - offset < session->chunk_size ? session->size - offset : session->chunk_size;
+        if (count > 0 && list[2 * count - 2] + list[2 * count - 1] == offset) {
+            list[2 * count - 1] += length;
+        } else {
+            list[2 * count] = offset;
+            list[2 * count + 1] = length;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&upload_mutex);
+
+    *extents = list;
+    *num_extents = count;
+    return 0;
+}
+
+void upload_cleanup(void) {
+    pthread_mutex_lock(&upload_mutex);
+    for (int i = 0; i < MAX_UPLOAD_SESSIONS; i++) {
+        if (sessions[i].id != 0) {
+            release_session(&sessions[i]);
+        }
+    }
+    pthread_mutex_unlock(&upload_mutex);
+}
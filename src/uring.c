@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "../include/uring.h"
+#include "../include/logger.h"
+
+// liburing is not required, the three system calls are used directly
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, const void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = -1;
+    
+    int fd = sys_io_uring_setup(entries, &params);
+    if (fd < 0) {
+        log_warning("io_uring is not available: %s", strerror(errno));
+        return -1;
+    }
+    ring->fd = fd;
+    ring->features = params.features;
+    
+    // Timed waits and a shared SQ/CQ mapping keep the rest of this file simple
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        log_warning("io_uring lacks required features (have 0x%x)", params.features);
+        uring_exit(ring);
+        return -1;
+    }
+    
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        log_error("Failed to map io_uring rings: %s", strerror(errno));
+        ring->ring_ptr = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+    
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        log_error("Failed to map io_uring submission entries: %s", strerror(errno));
+        ring->sqes = NULL;
+        uring_exit(ring);
+        return -1;
+    }
+    
+    char *base = ring->ring_ptr;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    
+    // Submission slots map 1:1 onto entries, so the index array never changes
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    
+    return 0;
+}
+
+void uring_exit(uring_t *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->ring_ptr != NULL) {
+        munmap(ring->ring_ptr, ring->ring_size);
+        ring->ring_ptr = NULL;
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+// Make locally queued entries visible to the kernel.
+// Returns the number of entries not yet consumed by io_uring_enter.
+static unsigned publish_sqes(uring_t *ring) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int enter(uring_t *ring, unsigned min_complete, int timeout_ms) {
+    unsigned to_submit = publish_sqes(ring);
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+    
+    int ret = flags ? sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, &arg, sizeof(arg))
+                    : sys_io_uring_enter(ring->fd, to_submit, 0, 0, NULL, 0);
+    if (ret >= 0 || errno == ETIME || errno == EINTR) {
+        return 0;
+    }
+    if (errno == EAGAIN || errno == EBUSY) {
+        // Completion queue backed up, the caller drains it and submits again next time
+        return 0;
+    }
+    log_error("io_uring_enter failed: %s", strerror(errno));
+    return -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        if (enter(ring, 0, 0) != 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, int timeout_ms) {
+    // Don't sleep if completions are already waiting
+    unsigned min_complete = uring_peek_cqe(ring) == NULL && timeout_ms > 0 ? 1 : 0;
+    return enter(ring, min_complete, timeout_ms);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(uring_t *ring, const struct iovec *iovs, unsigned count) {
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, count) < 0) {
+        log_warning("Failed to register io_uring buffers: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -1,13 +1,49 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include "../include/file_ops.h"
 #include "../include/logger.h"
 #include "../include/config.h"
 
 #define TEST_BUFFER_SIZE 1024
 
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+// Set to make openat2() look missing, as on kernels before 5.6, so paths
+// are resolved by the fallback walk
+static int hide_openat2 = 0;
+
+long syscall(long number, ...) {
+    static long (*real_syscall)(long, ...);
+    long args[6];
+    va_list ap;
+    
+    va_start(ap, number);
+    for (int i = 0; i < 6; i++) {
+        args[i] = va_arg(ap, long);
+    }
+    va_end(ap);
+    if (number == SYS_openat2 && hide_openat2) {
+        errno = ENOSYS;
+        return -1;
+    }
+    if (real_syscall == NULL) {
+        *(void **)&real_syscall = dlsym(RTLD_NEXT, "syscall");
+    }
+    return real_syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
 void test_file_write_read() {
     printf("Testing file write and read...\n");
     
@@ -94,8 +130,134 @@ void test_path_validation() {
     printf("Path validation test passed!\n");
 }
 
+void test_normalize_path() {
+    printf("Testing path normalization...\n");
+    
+    char out[64];
+    assert(normalize_path("a//b/./c/", out, sizeof(out)) == 0);
+    assert(strcmp(out, "a/b/c") == 0);
+    assert(normalize_path("/", out, sizeof(out)) == 0);
+    assert(strcmp(out, "") == 0);
+    assert(normalize_path("./a/.", out, sizeof(out)) == 0);
+    assert(strcmp(out, "a") == 0);
+    assert(normalize_path("..a/b..", out, sizeof(out)) == 0);
+    assert(strcmp(out, "..a/b..") == 0);
+    
+    errno = 0;
+    assert(normalize_path("a/../b", out, sizeof(out)) == -1 && errno == EINVAL);
+    errno = 0;
+    assert(normalize_path("/..", out, sizeof(out)) == -1 && errno == EINVAL);
+    errno = 0;
+    assert(normalize_path("abcdefgh", out, 8) == -1 && errno == ENAMETOOLONG);
+    
+    printf("Path normalization test passed!\n");
+}
+
+// Expect a path to be refused with an errno value
+static void assert_refused(const char *path, int err) {
+    errno = 0;
+    int fd = open_beneath(path, O_RDONLY, 0);
+    assert(fd < 0);
+    assert(errno == err);
+}
+
+void test_path_resolution(const char *how) {
+    printf("Testing path resolution with %s...\n", how);
+    
+    // Below the root: a file, a link to it, a link that leaves its
+    // directory but comes back, an absolute link and one that climbs out
+    assert(mkdir("beneath", 0755) == 0);
+    assert(mkdir("beneath/d", 0755) == 0);
+    assert(write_file("beneath/d/f", "inside", 6) == 0);
+    assert(symlink("d/f", "beneath/in") == 0);
+    assert(symlink("../d/f", "beneath/d/up") == 0);
+    assert(symlink("..", "beneath/d/parent") == 0);
+    assert(symlink("/etc", "beneath/abs") == 0);
+    assert(symlink("../../etc", "beneath/esc") == 0);
+    
+    char buffer[16];
+    int fd = open_beneath("beneath/in", O_RDONLY, 0);
+    assert(fd >= 0);
+    assert(read(fd, buffer, sizeof(buffer)) == 6 && memcmp(buffer, "inside", 6) == 0);
+    close(fd);
+    fd = open_beneath("/beneath/d/up", O_RDONLY, 0);
+    assert(fd >= 0);
+    close(fd);
+    fd = open_beneath("beneath/d/parent/d/parent/in", O_RDONLY, 0);
+    assert(fd >= 0);
+    close(fd);
+    
+    // Links that leave the root, or a path that tries to, never resolve
+    assert_refused("beneath/abs", EXDEV);
+    assert_refused("beneath/abs/passwd", EXDEV);
+    assert_refused("beneath/esc/passwd", EXDEV);
+    assert_refused("beneath/d/parent/esc", EXDEV);
+    assert_refused("beneath/../../etc/passwd", EINVAL);
+    assert_refused("beneath/missing", ENOENT);
+    
+    // The strict form refuses every link, the parent of a path comes without it
+    errno = 0;
+    assert(open_beneath_strict("beneath/in", O_RDONLY) < 0 && errno == ELOOP);
+    fd = open_beneath_strict("beneath/d/f", O_RDONLY);
+    assert(fd >= 0);
+    close(fd);
+    char name[64];
+    fd = open_parent_beneath("beneath/d/f", name, sizeof(name));
+    assert(fd >= 0 && strcmp(name, "f") == 0);
+    struct stat st;
+    assert(fstatat(fd, name, &st, 0) == 0 && st.st_size == 6);
+    close(fd);
+    
+    int linked = 0;
+    assert(stat_beneath("beneath/d/f", &st, &linked) == 0 && linked == 0);
+    assert(stat_beneath("beneath/in", &st, &linked) == 0 && linked == 1 && st.st_size == 6);
+    assert(stat_beneath("beneath/esc", &st, &linked) == EXDEV);
+    
+    // Clean up
+    const char *links[] = { "beneath/in", "beneath/d/up", "beneath/d/parent", "beneath/abs", "beneath/esc" };
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        assert(unlink(links[i]) == 0);
+    }
+    assert(delete_file("beneath/d/f") == 0);
+    assert(delete_file("beneath/d") == 0);
+    assert(delete_file("beneath") == 0);
+    
+    printf("Path resolution test with %s passed!\n", how);
+}
+
+void test_state_directory() {
+    printf("Testing state directories outside the root...\n");
+    
+    // Inside the root, or containing it: refused before anything is created
+    struct stat st;
+    assert(is_outside_root("state/uploads") == 0);
+    assert(create_state_directory("state/uploads") == EXDEV);
+    assert(stat("state", &st) != 0 && errno == ENOENT);
+    assert(create_state_directory("/") == EXDEV);
+    assert(create_state_directory("state/../../x") == EINVAL);
+    
+    // Elsewhere: created with its parents, for the server only
+    char base[] = "/tmp/cileserver-test-XXXXXX";
+    char dir[64];
+    assert(mkdtemp(base) != NULL);
+    snprintf(dir, sizeof(dir), "%s/a//b/", base);
+    assert(is_outside_root(dir) == 1);
+    assert(create_state_directory(dir) == 0);
+    assert(create_state_directory(dir) == 0);
+    assert(stat(dir, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 0777) == 0700);
+    
+    // Clean up
+    assert(rmdir(dir) == 0);
+    snprintf(dir, sizeof(dir), "%s/a", base);
+    assert(rmdir(dir) == 0);
+    assert(rmdir(base) == 0);
+    
+    printf("State directory test passed!\n");
+}
+
 int main() {
-    // Initialize
+    // Initialize; the logger writes below logs/
+    mkdir("logs", 0755);
     init_logger();
     load_config();
     init_file_ops();
@@ -104,6 +266,14 @@ int main() {
     test_file_write_read();
     test_directory_operations();
     test_path_validation();
+    test_normalize_path();
+    test_state_directory();
+    test_path_resolution("openat2()");
+    
+    // Again, resolving paths one component at a time
+    hide_openat2 = 1;
+    init_file_ops();
+    test_path_resolution("the fallback walk");
     
     // Clean up
     cleanup_file_ops();
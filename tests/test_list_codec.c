@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../include/list_codec.h"
+
+#define TEST_ENTRIES 6
+
+// Out of name order, with shared prefixes, a directory, and mtimes that go
+// back as well as forward, before the epoch included
+static const file_info_t test_entries[TEST_ENTRIES] = {
+    { "photos/2023/b.jpg", 2048, 0, 1700000000 },
+    { "photos/2023/a.jpg", 1024, 0, 1700000500 },
+    { "photos", 0, 1, 1600000000 },
+    { "readme", 5, 0, -86400 },
+    { "photos/2023", 0, 1, 1700000000 },
+    { "a", (size_t)1 << 40, 0, 0 }
+};
+
+// Encode the test entries and decode them back, one record at a time
+static void round_trip(int fields, int keep_order) {
+    file_info_t entries[TEST_ENTRIES];
+    uint8_t buffer[TEST_ENTRIES * LIST_RECORD_MAX];
+    list_codec_t codec;
+    
+    memcpy(entries, test_entries, sizeof(entries));
+    list_codec_reset(&codec, fields, keep_order);
+    size_t len = list_encode_entries(&codec, entries, TEST_ENTRIES, buffer);
+    assert(len > 0 && len <= sizeof(buffer));
+    
+    // Kept in the order given, or sorted by name
+    for (int i = 0; i < TEST_ENTRIES; i++) {
+        if (keep_order) {
+            assert(strcmp(entries[i].name, test_entries[i].name) == 0);
+        } else if (i > 0) {
+            assert(strcmp(entries[i - 1].name, entries[i].name) < 0);
+        }
+    }
+    
+    list_codec_reset(&codec, fields, keep_order);
+    size_t pos = 0;
+    for (int i = 0; i < TEST_ENTRIES; i++) {
+        file_info_t info;
+        uint64_t trailer[2];
+        size_t used = 0;
+        list_codec_t before = codec;
+    
+        int type = list_decode_record(&codec, buffer + pos, len - pos, &info, trailer, &used);
+        int directory = entries[i].is_directory && (fields & LIST_FIELD_TYPE);
+        assert(type == (directory ? LIST_RECORD_DIRECTORY : LIST_RECORD_FILE));
+        assert(strcmp(info.name, entries[i].name) == 0);
+        assert(info.is_directory == directory);
+        assert(info.size == ((fields & LIST_FIELD_SIZE) ? entries[i].size : 0));
+        assert(info.modified_time == ((fields & LIST_FIELD_MTIME) ? entries[i].modified_time : 0));
+    
+        // The same record cut short anywhere is refused
+        for (size_t cut = 0; cut < used; cut++) {
+            list_codec_t copy = before;
+            size_t ignored;
+            assert(list_decode_record(&copy, buffer + pos, cut, &info, trailer, &ignored) == -1);
+        }
+        pos += used;
+    }
+    assert(pos == len);
+}
+
+void test_round_trip() {
+    printf("Testing list codec round trip...\n");
+    
+    for (int fields = 0; fields <= LIST_FIELDS_ALL; fields++) {
+        round_trip(fields, 0);
+        round_trip(fields, 1);
+    }
+    
+    printf("List codec round trip test passed!\n");
+}
+
+void test_shared_prefix() {
+    printf("Testing shared name prefixes...\n");
+    
+    file_info_t entries[2] = {
+        { "photos/2023/a.jpg", 0, 0, 0 },
+        { "photos/2023/b.jpg", 0, 0, 0 }
+    };
+    uint8_t buffer[2 * LIST_RECORD_MAX];
+    list_codec_t codec;
+    
+    // Only what differs from the previous name is sent: type, shared, rest
+    list_codec_reset(&codec, 0, 1);
+    size_t len = list_encode_entries(&codec, entries, 2, buffer);
+    size_t first = 3 + strlen(entries[0].name);
+    assert(len == first + 3 + strlen("b.jpg"));
+    assert(buffer[first] == LIST_RECORD_FILE);
+    assert(buffer[first + 1] == strlen("photos/2023/"));
+    assert(buffer[first + 2] == strlen("b.jpg"));
+    assert(memcmp(buffer + first + 3, "b.jpg", 5) == 0);
+    
+    // The state carries over between batches of the same answer
+    file_info_t next = { "photos/2024", 0, 0, 0 };
+    len = list_encode_entries(&codec, &next, 1, buffer);
+    assert(len == 3 + 1 && buffer[1] == strlen("photos/202") && buffer[2] == 1 && buffer[3] == '4');
+    
+    printf("Shared name prefix test passed!\n");
+}
+
+void test_trailer() {
+    printf("Testing paged list trailer...\n");
+    
+    file_info_t entries[TEST_ENTRIES];
+    uint8_t buffer[TEST_ENTRIES * LIST_RECORD_MAX + LIST_TRAILER_RECORD_SIZE];
+    list_codec_t codec;
+    
+    memcpy(entries, test_entries, sizeof(entries));
+    list_codec_reset(&codec, LIST_FIELDS_ALL, 0);
+    size_t len = list_encode_entries(&codec, entries, TEST_ENTRIES, buffer);
+    assert(list_encode_trailer(TEST_ENTRIES, 0x0123456789abcdefULL, buffer + len) == LIST_TRAILER_RECORD_SIZE);
+    len += LIST_TRAILER_RECORD_SIZE;
+    
+    list_codec_reset(&codec, LIST_FIELDS_ALL, 0);
+    size_t pos = 0;
+    int records = 0;
+    for (;;) {
+        file_info_t info;
+        uint64_t trailer[2];
+        size_t used;
+        int type = list_decode_record(&codec, buffer + pos, len - pos, &info, trailer, &used);
+        assert(type >= 0);
+        pos += used;
+        if (type == LIST_RECORD_TRAILER) {
+            assert(trailer[0] == TEST_ENTRIES && trailer[1] == 0x0123456789abcdefULL);
+            break;
+        }
+        records++;
+    }
+    assert(records == TEST_ENTRIES && pos == len);
+    
+    // A trailer cut short is refused
+    file_info_t info;
+    uint64_t trailer[2];
+    size_t used;
+    assert(list_decode_record(&codec, buffer + len - LIST_TRAILER_RECORD_SIZE, LIST_TRAILER_RECORD_SIZE - 1,
+                              &info, trailer, &used) == -1);
+    
+    printf("Paged list trailer test passed!\n");
+}
+
+void test_malformed_records() {
+    printf("Testing malformed records...\n");
+    
+    list_codec_t codec;
+    file_info_t info;
+    uint64_t trailer[2];
+    size_t used;
+    
+    list_codec_reset(&codec, LIST_FIELDS_ALL, 0);
+    
+    // Nothing at all, and an unknown type byte
+    const uint8_t unknown[] = { 0x02, 0, 1, 'a', 0, 0 };
+    assert(list_decode_record(&codec, unknown, 0, &info, trailer, &used) == -1);
+    assert(list_decode_record(&codec, unknown, sizeof(unknown), &info, trailer, &used) == -1);
+    
+    // More bytes shared than the previous name has
+    const uint8_t shared[] = { LIST_RECORD_FILE, 3, 1, 'a', 0, 0 };
+    assert(list_decode_record(&codec, shared, sizeof(shared), &info, trailer, &used) == -1);
+    
+    // The rest of the name running past the data, or past a name's length
+    const uint8_t overrun[] = { LIST_RECORD_FILE, 0, 5, 'a', 'b', 0, 0 };
+    assert(list_decode_record(&codec, overrun, sizeof(overrun), &info, trailer, &used) == -1);
+    uint8_t long_name[4 + 300 + 2] = { LIST_RECORD_FILE, 0, 0xac, 0x02 };  // 300
+    memset(long_name + 4, 'x', 300);
+    assert(list_decode_record(&codec, long_name, sizeof(long_name), &info, trailer, &used) == -1);
+    
+    // A varint that never ends, or ends past 64 bits
+    uint8_t endless[16];
+    memset(endless, 0x80, sizeof(endless));
+    endless[0] = LIST_RECORD_FILE;
+    assert(list_decode_record(&codec, endless, sizeof(endless), &info, trailer, &used) == -1);
+    
+    // None of it moved the state: a good record still decodes from scratch
+    const uint8_t good[] = { LIST_RECORD_DIRECTORY, 0, 2, 'o', 'k', 7, 4 };
+    assert(list_decode_record(&codec, good, sizeof(good), &info, trailer, &used) == LIST_RECORD_DIRECTORY);
+    assert(used == sizeof(good) && strcmp(info.name, "ok") == 0 && info.is_directory);
+    assert(info.size == 7 && info.modified_time == 2);
+    
+    printf("Malformed record test passed!\n");
+}
+
+int main() {
+    test_round_trip();
+    test_shared_prefix();
+    test_trailer();
+    test_malformed_records();
+    
+    printf("All tests passed!\n");
+    return 0;
+}
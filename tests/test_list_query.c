@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "../include/list_query.h"
+
+#define TEST_ENTRIES 500
+
+// Build an encoded query around a pattern of pattern_len bytes
+static size_t make_query(char *out, int fields, int type, int sort, const char *pattern, size_t pattern_len) {
+    list_query_t query;
+    
+    list_query_init(&query);
+    query.fields = fields;
+    query.filter.type = type;
+    size_t len = list_query_encode(&query, out);
+    out[2] = (char)sort;
+    out[3] = (char)pattern_len;
+    memcpy(out + len, pattern, pattern_len);
+    return len + pattern_len;
+}
+
+void test_query_round_trip() {
+    printf("Testing list query encoding...\n");
+    
+    char buffer[LIST_QUERY_SIZE + LIST_PATTERN_MAX];
+    list_query_t query, parsed;
+    
+    list_query_init(&query);
+    query.fields = LIST_FIELD_SIZE;
+    query.filter.type = DIR_FILTER_FILES;
+    query.filter.pattern = "*.jpg";
+    query.filter.min_size = 10;
+    query.filter.max_size = 1 << 20;
+    query.filter.min_mtime = -86400;
+    query.filter.max_mtime = 1700000000;
+    query.sort = LIST_SORT_MTIME;
+    query.descending = 1;
+    size_t len = list_query_encode(&query, buffer);
+    assert(len == LIST_QUERY_SIZE + 5);
+    
+    assert(list_query_parse(&parsed, buffer, len) == 0);
+    assert(parsed.fields == LIST_FIELD_SIZE && parsed.filter.type == DIR_FILTER_FILES);
+    assert(parsed.sort == LIST_SORT_MTIME && parsed.descending == 1);
+    assert(parsed.filter.pattern == parsed.pattern && strcmp(parsed.pattern, "*.jpg") == 0);
+    assert(parsed.filter.min_size == 10 && parsed.filter.max_size == 1 << 20);
+    assert(parsed.filter.min_mtime == -86400 && parsed.filter.max_mtime == 1700000000);
+    assert(parsed.filter.need_stat == 1 && parsed.filter.need_type == 1);
+    
+    // Unknown field bits are dropped, the longest pattern fits
+    char pattern[LIST_PATTERN_MAX];
+    memset(pattern, '?', sizeof(pattern));
+    len = make_query(buffer, 0xff, DIR_FILTER_ANY, LIST_SORT_NAME, pattern, sizeof(pattern));
+    assert(list_query_parse(&parsed, buffer, len) == 0);
+    assert(parsed.fields == LIST_FIELDS_ALL && strlen(parsed.pattern) == LIST_PATTERN_MAX);
+    
+    // Entries are only stat'ed, or their type looked up, when needed
+    len = make_query(buffer, 0, DIR_FILTER_ANY, LIST_SORT_NAME, "", 0);
+    assert(list_query_parse(&parsed, buffer, len) == 0);
+    assert(parsed.filter.pattern == NULL && parsed.filter.need_stat == 0 && parsed.filter.need_type == 0);
+    len = make_query(buffer, 0, DIR_FILTER_DIRECTORIES, LIST_SORT_SIZE | LIST_SORT_DESCENDING, "", 0);
+    assert(list_query_parse(&parsed, buffer, len) == 0);
+    assert(parsed.filter.need_stat == 1 && parsed.filter.need_type == 1);
+    assert(parsed.sort == LIST_SORT_SIZE && parsed.descending == 1);
+    
+    printf("List query encoding test passed!\n");
+}
+
+void test_query_malformed() {
+    printf("Testing malformed list queries...\n");
+    
+    char buffer[LIST_QUERY_SIZE + LIST_PATTERN_MAX];
+    list_query_t parsed;
+    
+    // Shorter than the fixed part
+    size_t len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_ANY, LIST_SORT_NONE, "", 0);
+    assert(list_query_parse(&parsed, buffer, 0) == -1);
+    assert(list_query_parse(&parsed, buffer, len - 1) == -1);
+    
+    // A pattern length that doesn't match what follows
+    len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_ANY, LIST_SORT_NONE, "abc", 3);
+    assert(list_query_parse(&parsed, buffer, len) == 0);
+    assert(list_query_parse(&parsed, buffer, len - 1) == -1);
+    assert(list_query_parse(&parsed, buffer, len + 1) == -1);
+    buffer[3] = (char)0xff;
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    
+    // A NUL inside the pattern
+    len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_ANY, LIST_SORT_NONE, "a\0*", 3);
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_ANY, LIST_SORT_NONE, "ab\0", 3);
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    
+    // Types and sort keys out of range, in either direction
+    len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_DIRECTORIES + 1, LIST_SORT_NONE, "", 0);
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    len = make_query(buffer, LIST_FIELDS_ALL, 0xff, LIST_SORT_NONE, "", 0);
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_ANY, LIST_SORT_MTIME + 1, "", 0);
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_ANY, (LIST_SORT_MTIME + 1) | LIST_SORT_DESCENDING, "", 0);
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    len = make_query(buffer, LIST_FIELDS_ALL, DIR_FILTER_ANY, 0x7f, "", 0);
+    assert(list_query_parse(&parsed, buffer, len) == -1);
+    
+    printf("Malformed list query test passed!\n");
+}
+
+// Check that the first entries kept match the start of a full sort
+static void check_top(const list_query_t *query, const file_info_t *entries, int capacity) {
+    file_info_t sorted[TEST_ENTRIES];
+    list_top_t top;
+    
+    memcpy(sorted, entries, sizeof(sorted));
+    list_query_sort(query, sorted, TEST_ENTRIES);
+    
+    assert(list_top_init(&top, query, capacity) == 0);
+    for (int i = 0; i < TEST_ENTRIES; i++) {
+        list_top_push(&top, &entries[i]);
+    }
+    list_top_finish(&top);
+    
+    int expected = capacity < TEST_ENTRIES ? capacity : TEST_ENTRIES;
+    assert(top.count == expected);
+    for (int i = 0; i < expected; i++) {
+        assert(strcmp(top.entries[i].name, sorted[i].name) == 0);
+        assert(top.entries[i].size == sorted[i].size);
+        assert(top.entries[i].modified_time == sorted[i].modified_time);
+    }
+    free(top.entries);
+}
+
+void test_top_entries() {
+    printf("Testing first entries of a sorted listing...\n");
+    
+    // Few distinct sizes and mtimes, so names often decide
+    file_info_t entries[TEST_ENTRIES];
+    srand(1);
+    for (int i = 0; i < TEST_ENTRIES; i++) {
+        snprintf(entries[i].name, sizeof(entries[i].name), "file-%d-%d", rand() % 100, i);
+        entries[i].size = (size_t)(rand() % 20);
+        entries[i].is_directory = 0;
+        entries[i].modified_time = (time_t)(rand() % 10) - 5;
+    }
+    
+    const int keys[] = { LIST_SORT_NAME, LIST_SORT_SIZE, LIST_SORT_MTIME };
+    const int capacities[] = { 0, 1, 7, 100, TEST_ENTRIES, TEST_ENTRIES + 10 };
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+        for (int descending = 0; descending <= 1; descending++) {
+            list_query_t query;
+            list_query_init(&query);
+            query.sort = keys[k];
+            query.descending = descending;
+            for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+                check_top(&query, entries, capacities[c]);
+            }
+        }
+    }
+    
+    printf("First entries of a sorted listing test passed!\n");
+}
+
+int main() {
+    test_query_round_trip();
+    test_query_malformed();
+    test_top_entries();
+    
+    printf("All tests passed!\n");
+    return 0;
+}